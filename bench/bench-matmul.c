@@ -0,0 +1,147 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+// Standalone mul_mat throughput benchmark, same kernel sweep as ::ggml::bench_matmul
+//
+// usage: bench-matmul [-t F32,F16,Q4_0,Q4_K,Q8_0] [-s MxNxK,...] [-n 1,2,4,...] [-i iterations]
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define MAX_ITEMS 64
+
+static int parse_type(const char *name, enum ggml_type *type) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char *type_name = ggml_type_name((enum ggml_type) i);
+        if (type_name != NULL && ggml_blck_size((enum ggml_type) i) > 0 && strcasecmp(type_name, name) == 0) {
+            *type = (enum ggml_type) i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-t types] [-s MxNxK,...] [-n nthreads,...] [-i iterations]\n", argv0);
+    fprintf(stderr, "  -t  comma separated weight types (default: F32,F16,Q4_0,Q4_K,Q8_0)\n");
+    fprintf(stderr, "  -s  comma separated shapes (default: 4096x1x4096,4096x32x4096)\n");
+    fprintf(stderr, "  -n  comma separated thread counts (default: 1 and number of cpus)\n");
+    fprintf(stderr, "  -i  timed iterations per configuration (default: 10)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Tcl_FindExecutable(argv[0]);
+    ggml_time_init();
+
+    char types_arg[256] = "F32,F16,Q4_0,Q4_K,Q8_0";
+    char shapes_arg[1024] = "4096x1x4096,4096x32x4096";
+    char nthreads_arg[256] = "";
+    int iterations = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:n:i:h")) != -1) {
+        switch (opt) {
+            case 't':
+                snprintf(types_arg, sizeof(types_arg), "%s", optarg);
+                break;
+            case 's':
+                snprintf(shapes_arg, sizeof(shapes_arg), "%s", optarg);
+                break;
+            case 'n':
+                snprintf(nthreads_arg, sizeof(nthreads_arg), "%s", optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    enum ggml_type types[MAX_ITEMS];
+    int n_types = 0;
+    for (char *tok = strtok(types_arg, ","); tok && n_types < MAX_ITEMS; tok = strtok(NULL, ",")) {
+        if (!parse_type(tok, &types[n_types])) {
+            fprintf(stderr, "unknown type: %s\n", tok);
+            return 1;
+        }
+        n_types++;
+    }
+
+    int64_t shapes[MAX_ITEMS][3];
+    int n_shapes = 0;
+    for (char *tok = strtok(shapes_arg, ","); tok && n_shapes < MAX_ITEMS; tok = strtok(NULL, ",")) {
+        long long m, n, k;
+        if (sscanf(tok, "%lldx%lldx%lld", &m, &n, &k) != 3) {
+            fprintf(stderr, "invalid shape: %s (expected MxNxK)\n", tok);
+            return 1;
+        }
+        shapes[n_shapes][0] = m;
+        shapes[n_shapes][1] = n;
+        shapes[n_shapes][2] = k;
+        n_shapes++;
+    }
+
+    int nthreads_list[MAX_ITEMS];
+    int n_nthreads = 0;
+    if (nthreads_arg[0] != '\0') {
+        for (char *tok = strtok(nthreads_arg, ","); tok && n_nthreads < MAX_ITEMS; tok = strtok(NULL, ",")) {
+            nthreads_list[n_nthreads] = atoi(tok);
+            if (nthreads_list[n_nthreads] <= 0) {
+                fprintf(stderr, "invalid thread count: %s\n", tok);
+                return 1;
+            }
+            n_nthreads++;
+        }
+    } else {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads_list[n_nthreads++] = 1;
+        if (ncpus > 1) {
+            nthreads_list[n_nthreads++] = (int) ncpus;
+        }
+    }
+
+    printf("%-6s %7s %7s %7s %4s %12s %12s %10s %10s\n",
+           "type", "M", "N", "K", "thr", "avg_us", "min_us", "GFLOP/s", "GB/s");
+
+    int rc = 0;
+    for (int t = 0; t < n_types; t++) {
+        for (int s = 0; s < n_shapes; s++) {
+            for (int j = 0; j < n_nthreads; j++) {
+                ml_bench_matmul_params_t params = {
+                        .type = types[t],
+                        .m = shapes[s][0],
+                        .n = shapes[s][1],
+                        .k = shapes[s][2],
+                        .nthreads = nthreads_list[j],
+                        .iterations = iterations,
+                };
+                ml_bench_matmul_result_t result;
+                const char *errmsg = NULL;
+                if (TCL_OK != ml_BenchMatMul(&params, &result, &errmsg)) {
+                    fprintf(stderr, "%s M=%lld N=%lld K=%lld: %s\n", ggml_type_name(params.type),
+                            (long long) params.m, (long long) params.n, (long long) params.k, errmsg);
+                    rc = 1;
+                    continue;
+                }
+                printf("%-6s %7lld %7lld %7lld %4d %12.1f %12.1f %10.2f %10.2f\n",
+                       ggml_type_name(params.type),
+                       (long long) params.m, (long long) params.n, (long long) params.k, params.nthreads,
+                       result.avg_us, result.min_us, result.gflops, result.gbps);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return rc;
+}
@@ -0,0 +1,37 @@
+package require ggml
+
+if { [llength $argv] < 2 } {
+    puts "Usage: $argv0 <model.gguf> <text> ?text ...?"
+    exit 1
+}
+
+set filename [lindex $argv 0]
+set texts [lrange $argv 1 end]
+
+set ctx [::ggml::load_context_from_file $filename]
+set tokenizer [::ggml::tokenizer_create $ctx]
+set embedder [::ggml::embedder_create $ctx -n_ctx 256 -n_seq 8 -pooling mean -cache_size 1024]
+
+set out_ctx [::ggml::create_context [expr { 64 * 1024 * 1024 }]]
+set embeddings [::ggml::embed $embedder $out_ctx $texts -tokenizer $tokenizer]
+set n_embd [dict get [::ggml::embedder_info $embedder] n_embd]
+
+# rows are L2 normalized, so the dot product is the cosine similarity
+for { set i 0 } { $i < [llength $texts] } { incr i } {
+    for { set j [expr { $i + 1 }] } { $j < [llength $texts] } { incr j } {
+        set dot 0.0
+        for { set d 0 } { $d < $n_embd } { incr d } {
+            set dot [expr { $dot + [::ggml::get_f32_1d $embeddings [expr { $i * $n_embd + $d }]] * [::ggml::get_f32_1d $embeddings [expr { $j * $n_embd + $d }]] }]
+        }
+        puts "similarity($i,$j) = $dot"
+    }
+}
+
+# repeated texts come from the cache
+::ggml::embed $embedder $out_ctx $texts -tokenizer $tokenizer
+puts info=[::ggml::embedder_info $embedder]
+
+::ggml::embedder_destroy $embedder
+::ggml::destroy_context $out_ctx
+::ggml::tokenizer_destroy $tokenizer
+::ggml::destroy_context $ctx
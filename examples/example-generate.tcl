@@ -0,0 +1,36 @@
+package require ggml
+
+if { [llength $argv] < 2 } {
+    puts "Usage: $argv0 <model.gguf> <prompt>"
+    exit 1
+}
+
+set filename [lindex $argv 0]
+set prompt [lindex $argv 1]
+
+set ctx [::ggml::load_context_from_file $filename]
+set tokenizer [::ggml::tokenizer_create $ctx]
+set llama [::ggml::llama_create $ctx -n_ctx 512 -nthreads 4]
+
+proc on_generate {event data} {
+    if { $event eq {token} } {
+        puts -nonewline [dict get $data text]
+        flush stdout
+        return
+    }
+    puts ""
+    puts done=$data
+    set ::finished 1
+}
+
+set tokens [::ggml::tokenize $tokenizer $prompt]
+set gen [::ggml::generate $llama $tokens -callback on_generate -tokenizer $tokenizer -max_tokens 64 -temperature 0.7]
+
+# stop after 30 seconds whatever happens
+after 30000 [list catch [list ::ggml::generate_cancel $gen]]
+
+vwait ::finished
+
+::ggml::llama_destroy $llama
+::ggml::tokenizer_destroy $tokenizer
+::ggml::destroy_context $ctx
@@ -29,13 +29,13 @@ proc check_gradient {op_name ctx0 x f n_dims nargs eps max_error_abs max_error_r
 
             ::ggml::set_f32_1d [lindex $x $i] $k $xp
 
-            ::ggml::graph_compute $gf $n_threads
+            ::ggml::graph_compute_incremental $gf $n_threads
 
             set f0 [::ggml::get_f32_1d $f 0]
 
             ::ggml::set_f32_1d [lindex $x $i] $k $xm
 
-            ::ggml::graph_compute $gf $n_threads
+            ::ggml::graph_compute_incremental $gf $n_threads
 
             set f1 [::ggml::get_f32_1d $f 0]
             set g0 [expr { ($f0 - $f1)/(2.0 * $eps) }]
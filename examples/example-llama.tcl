@@ -0,0 +1,27 @@
+package require ggml
+
+if { [llength $argv] < 2 } {
+    puts "Usage: $argv0 <model.gguf> <prompt>"
+    exit 1
+}
+
+set filename [lindex $argv 0]
+set prompt [lindex $argv 1]
+
+set ctx [::ggml::load_context_from_file $filename]
+set tokenizer [::ggml::tokenizer_create $ctx]
+set llama [::ggml::llama_create $ctx -n_ctx 512 -nthreads 4]
+puts info=[::ggml::llama_info $llama]
+
+set tokens [::ggml::tokenize $tokenizer $prompt]
+puts tokens=$tokens
+
+set logits [::ggml::llama_eval $llama $tokens]
+
+set best [::ggml::sample $logits -temperature 0]
+puts next_token=$best
+puts next_text=[::ggml::detokenize $tokenizer [list $best]]
+
+::ggml::llama_destroy $llama
+::ggml::tokenizer_destroy $tokenizer
+::ggml::destroy_context $ctx
@@ -0,0 +1,33 @@
+package require ggml
+
+# builds f(x) = a*x^2 + b in the given context and returns the graph
+proc build_graph {ctx} {
+    set x [::ggml::new_tensor_1d $ctx F32 1024]
+    set a [::ggml::new_tensor_2d $ctx F32 1024 1024]
+    set b [::ggml::new_tensor_1d $ctx F32 1024]
+    set x2 [::ggml::mul $ctx $x $x]
+    set f [::ggml::add $ctx [::ggml::mul_mat $ctx $a $x2] $b]
+    set gf [::ggml::new_graph $ctx]
+    ::ggml::build_forward_expand $gf $f
+    return [list $gf $x $a $b $f]
+}
+
+set nthreads 4
+
+# measure: only tensor and graph objects are allocated
+set measure_ctx [::ggml::create_context [expr { 1024*1024 }] -no_alloc true]
+lassign [build_graph $measure_ctx] gf
+set estimate [::ggml::graph_estimate_mem $gf $nthreads]
+puts "estimate: $estimate"
+::ggml::destroy_context $measure_ctx
+
+# allocate exactly what the graph needs
+set ctx [::ggml::create_context [dict get $estimate mem_size]]
+lassign [build_graph $ctx] gf x a b f
+::ggml::set_f32 $x 2.0
+::ggml::set_f32 $a 3.0
+::ggml::set_f32 $b 4.0
+::ggml::graph_compute $gf $nthreads
+puts "f\[0\] = [::ggml::get_f32_1d $f 0]"
+puts "used_mem=[::ggml::used_mem $ctx] mem_size=[::ggml::get_mem_size $ctx]"
+::ggml::destroy_context $ctx
@@ -0,0 +1,41 @@
+package require ggml
+
+if { [llength $argv] < 2 } {
+    puts "Usage: $argv0 <model.gguf> <prompt> ?prompt ...?"
+    exit 1
+}
+
+set filename [lindex $argv 0]
+set prompts [lrange $argv 1 end]
+
+set ctx [::ggml::load_context_from_file $filename]
+set tokenizer [::ggml::tokenizer_create $ctx]
+set sched [::ggml::scheduler_create $ctx -n_ctx 512 -n_seq 4 -nthreads 4]
+
+proc on_generate {index event data} {
+    if { $event eq {token} } {
+        append ::output($index) [dict get $data text]
+        return
+    }
+    puts "$index: $::output($index)"
+    puts "$index: done=$data"
+    incr ::remaining -1
+}
+
+set remaining [llength $prompts]
+set index 0
+foreach prompt $prompts {
+    set output($index) ""
+    ::ggml::scheduler_submit $sched [::ggml::tokenize $tokenizer $prompt] \
+        -callback [list on_generate $index] -tokenizer $tokenizer -max_tokens 32
+    incr index
+}
+
+while { $remaining > 0 } {
+    vwait ::remaining
+}
+puts info=[::ggml::scheduler_info $sched]
+
+::ggml::scheduler_destroy $sched
+::ggml::tokenizer_destroy $tokenizer
+::ggml::destroy_context $ctx
@@ -0,0 +1,340 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "tensor.h"
+#include "bench.h"
+
+static const char *default_types[] = {"F32", "F16", "Q4_0", "Q4_K", "Q8_0", NULL};
+
+static const int64_t default_shapes[][3] = {
+        {1024,  1,   1024},
+        {4096,  1,   4096},
+        {11008, 1,   4096},
+        {4096,  32,  4096},
+        {4096,  256, 4096},
+};
+
+static void ml_FillRandom(float *data, int64_t n, uint32_t seed) {
+    uint32_t state = seed;
+    for (int64_t i = 0; i < n; i++) {
+        state = state * 1664525u + 1013904223u;
+        data[i] = ((float) (state >> 8) / (float) (1u << 24)) * 2.0f - 1.0f;
+    }
+}
+
+// Converts "n" random floats into the tensor's storage type.
+static int ml_FillTensor(struct ggml_tensor *tensor, uint32_t seed) {
+    int64_t n = ggml_nelements(tensor);
+    float *values = (float *) Tcl_Alloc(n * sizeof(float));
+    ml_FillRandom(values, n, seed);
+
+    int rc = 1;
+    switch (tensor->type) {
+        case GGML_TYPE_F32:
+            memcpy(tensor->data, values, n * sizeof(float));
+            break;
+        case GGML_TYPE_F16:
+            ggml_fp32_to_fp16_row(values, (ggml_fp16_t *) tensor->data, n);
+            break;
+        default:
+            if (ggml_is_quantized(tensor->type)) {
+                int64_t hist[16] = {0};
+                ggml_quantize_chunk(tensor->type, values, tensor->data, 0, n, hist);
+            } else {
+                rc = 0;
+            }
+    }
+
+    Tcl_Free((char *) values);
+    return rc;
+}
+
+int ml_BenchMatMul(const ml_bench_matmul_params_t *params, ml_bench_matmul_result_t *result, const char **errmsg) {
+    const int64_t m = params->m, n = params->n, k = params->k;
+
+    if (m <= 0 || n <= 0 || k <= 0) {
+        *errmsg = "shape dimensions must be > 0";
+        return TCL_ERROR;
+    }
+    if (k % ggml_blck_size(params->type) != 0) {
+        *errmsg = "K must be a multiple of the block size of the weight type";
+        return TCL_ERROR;
+    }
+
+    size_t weight_bytes = ggml_row_size(params->type, k) * m;
+    size_t mem_size = weight_bytes
+                      + (size_t) (k * n + m * n) * sizeof(float)
+                      + 3 * ggml_tensor_overhead()
+                      + ggml_graph_overhead()
+                      + 1024 * 1024;
+
+    char *mem_buffer = Tcl_AttemptAlloc(mem_size);
+    if (!mem_buffer) {
+        *errmsg = "could not allocate benchmark buffer";
+        return TCL_ERROR;
+    }
+
+    struct ggml_init_params init_params = {
+            .mem_size   = mem_size,
+            .mem_buffer = mem_buffer,
+            .no_alloc   = 0,
+    };
+    struct ggml_context *ggml_ctx = ggml_init(init_params);
+    if (!ggml_ctx) {
+        Tcl_Free(mem_buffer);
+        *errmsg = "could not create ggml context";
+        return TCL_ERROR;
+    }
+
+    struct ggml_tensor *a = ggml_new_tensor_2d(ggml_ctx, params->type, k, m);
+    struct ggml_tensor *b = ggml_new_tensor_2d(ggml_ctx, GGML_TYPE_F32, k, n);
+    if (!ml_FillTensor(a, 1234) || !ml_FillTensor(b, 5678)) {
+        ggml_free(ggml_ctx);
+        Tcl_Free(mem_buffer);
+        *errmsg = "unsupported weight type";
+        return TCL_ERROR;
+    }
+
+    struct ggml_tensor *c = ggml_mul_mat(ggml_ctx, a, b);
+    struct ggml_cgraph *gf = ggml_new_graph(ggml_ctx);
+    ggml_build_forward_expand(gf, c);
+
+    // plan once and reuse the work buffer, so that only the kernel is timed
+    struct ggml_cplan cplan = ggml_graph_plan(gf, params->nthreads);
+    uint8_t *work_data = NULL;
+    if (cplan.work_size > 0) {
+        work_data = (uint8_t *) Tcl_AttemptAlloc(cplan.work_size);
+        if (!work_data) {
+            ggml_free(ggml_ctx);
+            Tcl_Free(mem_buffer);
+            *errmsg = "could not allocate work buffer";
+            return TCL_ERROR;
+        }
+        cplan.work_data = work_data;
+    }
+
+    // warm up caches and the thread pool
+    ggml_graph_compute(gf, &cplan);
+
+    int iterations = params->iterations > 0 ? params->iterations : 1;
+    int64_t total_us = 0;
+    int64_t min_us = INT64_MAX;
+    for (int i = 0; i < iterations; i++) {
+        int64_t t0 = ggml_time_us();
+        ggml_graph_compute(gf, &cplan);
+        int64_t elapsed = ggml_time_us() - t0;
+        total_us += elapsed;
+        if (elapsed < min_us) {
+            min_us = elapsed;
+        }
+    }
+
+    double avg_us = (double) total_us / iterations;
+    if (avg_us <= 0) {
+        avg_us = 1;
+    }
+    double flops = 2.0 * (double) m * (double) n * (double) k;
+    double bytes = (double) (ggml_nbytes(a) + ggml_nbytes(b) + ggml_nbytes(c));
+
+    result->avg_us = avg_us;
+    result->min_us = (double) min_us;
+    result->gflops = flops / (avg_us * 1e3);
+    result->gbps = bytes / (avg_us * 1e3);
+    result->weight_bytes = weight_bytes;
+
+    if (work_data) {
+        Tcl_Free((char *) work_data);
+    }
+    ggml_free(ggml_ctx);
+    Tcl_Free(mem_buffer);
+    return TCL_OK;
+}
+
+static int ml_GetShapeFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, int64_t shape[3]) {
+    Tcl_Obj **elems;
+    int n_elems;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objPtr, &n_elems, &elems) || n_elems != 3) {
+        SetResult("shape must be a list of {M N K}");
+        return TCL_ERROR;
+    }
+    for (int i = 0; i < 3; i++) {
+        Tcl_WideInt value;
+        if (TCL_OK != Tcl_GetWideIntFromObj(interp, elems[i], &value) || value <= 0) {
+            SetResult("shape dimensions must be integers > 0");
+            return TCL_ERROR;
+        }
+        shape[i] = value;
+    }
+    return TCL_OK;
+}
+
+static Tcl_Obj *ml_NewBenchResultObj(const ml_bench_matmul_params_t *params, const ml_bench_matmul_result_t *result) {
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("type", -1), Tcl_NewStringObj(ggml_type_name(params->type), -1));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("m", -1), Tcl_NewWideIntObj(params->m));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("n", -1), Tcl_NewWideIntObj(params->n));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("k", -1), Tcl_NewWideIntObj(params->k));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("nthreads", -1), Tcl_NewIntObj(params->nthreads));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("weight_bytes", -1), Tcl_NewWideIntObj((Tcl_WideInt) result->weight_bytes));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("avg_us", -1), Tcl_NewDoubleObj(result->avg_us));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("min_us", -1), Tcl_NewDoubleObj(result->min_us));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("gflops", -1), Tcl_NewDoubleObj(result->gflops));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("gbps", -1), Tcl_NewDoubleObj(result->gbps));
+    return dict_ptr;
+}
+
+int ml_BenchMatMulCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "BenchMatMulCmd\n"));
+
+    static const char *options[] = {"-types", "-shapes", "-nthreads", "-iterations", NULL};
+    enum options {
+        OPT_TYPES, OPT_SHAPES, OPT_NTHREADS, OPT_ITERATIONS
+    };
+
+    if (objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-types type_list? ?-shapes shape_list? ?-nthreads nthreads_list? ?-iterations n?");
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *types_ptr = NULL;
+    Tcl_Obj *shapes_ptr = NULL;
+    Tcl_Obj *nthreads_ptr = NULL;
+    int iterations = 10;
+
+    for (int i = 1; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_TYPES:
+                types_ptr = objv[i + 1];
+                break;
+            case OPT_SHAPES:
+                shapes_ptr = objv[i + 1];
+                break;
+            case OPT_NTHREADS:
+                nthreads_ptr = objv[i + 1];
+                break;
+            case OPT_ITERATIONS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &iterations) || iterations <= 0) {
+                    SetResult("iterations is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    // types
+    int n_types = 0;
+    enum ggml_type types[GGML_TYPE_COUNT];
+    if (types_ptr) {
+        Tcl_Obj **elems;
+        int n_elems;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, types_ptr, &n_elems, &elems) || n_elems == 0 || n_elems > GGML_TYPE_COUNT) {
+            SetResult("types is not a valid list of ggml types");
+            return TCL_ERROR;
+        }
+        for (int i = 0; i < n_elems; i++) {
+            if (TCL_OK != ml_GetTypeFromObj(interp, elems[i], &types[n_types++])) {
+                return TCL_ERROR;
+            }
+        }
+    } else {
+        for (int i = 0; default_types[i] != NULL; i++) {
+            Tcl_Obj *type_name_ptr = Tcl_NewStringObj(default_types[i], -1);
+            Tcl_IncrRefCount(type_name_ptr);
+            ml_GetTypeFromObj(interp, type_name_ptr, &types[n_types++]);
+            Tcl_DecrRefCount(type_name_ptr);
+        }
+    }
+
+    // shapes
+    int n_shapes;
+    int64_t (*shapes)[3];
+    if (shapes_ptr) {
+        Tcl_Obj **elems;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, shapes_ptr, &n_shapes, &elems) || n_shapes == 0) {
+            SetResult("shapes is not a non-empty list");
+            return TCL_ERROR;
+        }
+        shapes = (int64_t (*)[3]) Tcl_Alloc(n_shapes * sizeof(*shapes));
+        for (int i = 0; i < n_shapes; i++) {
+            if (TCL_OK != ml_GetShapeFromObj(interp, elems[i], shapes[i])) {
+                Tcl_Free((char *) shapes);
+                return TCL_ERROR;
+            }
+        }
+    } else {
+        n_shapes = sizeof(default_shapes) / sizeof(default_shapes[0]);
+        shapes = (int64_t (*)[3]) Tcl_Alloc(sizeof(default_shapes));
+        memcpy(shapes, default_shapes, sizeof(default_shapes));
+    }
+
+    // thread counts, defaults to powers of two up to the number of online cpus
+    int n_nthreads = 0;
+    int nthreads_list[64];
+    if (nthreads_ptr) {
+        Tcl_Obj **elems;
+        int n_elems;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, nthreads_ptr, &n_elems, &elems) || n_elems == 0 || n_elems > 64) {
+            Tcl_Free((char *) shapes);
+            SetResult("nthreads is not a valid list of thread counts");
+            return TCL_ERROR;
+        }
+        for (int i = 0; i < n_elems; i++) {
+            if (TCL_OK != Tcl_GetIntFromObj(interp, elems[i], &nthreads_list[n_nthreads]) || nthreads_list[n_nthreads] <= 0) {
+                Tcl_Free((char *) shapes);
+                SetResult("nthreads element is not an integer > 0");
+                return TCL_ERROR;
+            }
+            n_nthreads++;
+        }
+    } else {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int nt = 1; nt < ncpus && n_nthreads < 63; nt *= 2) {
+            nthreads_list[n_nthreads++] = nt;
+        }
+        nthreads_list[n_nthreads++] = ncpus > 0 ? (int) ncpus : 1;
+    }
+
+    Tcl_Obj *list_ptr = Tcl_NewListObj(0, NULL);
+    for (int t = 0; t < n_types; t++) {
+        for (int s = 0; s < n_shapes; s++) {
+            for (int j = 0; j < n_nthreads; j++) {
+                ml_bench_matmul_params_t params = {
+                        .type = types[t],
+                        .m = shapes[s][0],
+                        .n = shapes[s][1],
+                        .k = shapes[s][2],
+                        .nthreads = nthreads_list[j],
+                        .iterations = iterations,
+                };
+                ml_bench_matmul_result_t result;
+                const char *errmsg = NULL;
+                if (TCL_OK != ml_BenchMatMul(&params, &result, &errmsg)) {
+                    Tcl_DecrRefCount(list_ptr);
+                    Tcl_Free((char *) shapes);
+                    char msg[256];
+                    snprintf(msg, sizeof(msg), "%s: %s M=%lld N=%lld K=%lld", errmsg, ggml_type_name(params.type),
+                             (long long) params.m, (long long) params.n, (long long) params.k);
+                    SetResult(msg);
+                    return TCL_ERROR;
+                }
+                Tcl_ListObjAppendElement(interp, list_ptr, ml_NewBenchResultObj(&params, &result));
+            }
+        }
+    }
+
+    Tcl_Free((char *) shapes);
+    Tcl_SetObjResult(interp, list_ptr);
+    return TCL_OK;
+}
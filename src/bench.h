@@ -0,0 +1,33 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef GGML_TCL_BENCH_H
+#define GGML_TCL_BENCH_H
+
+#include "common.h"
+
+typedef struct ml_bench_matmul_params_s {
+    enum ggml_type type;    // type of the weight matrix (src0)
+    int64_t m;              // rows of the weight matrix
+    int64_t n;              // columns of the activations (batch size)
+    int64_t k;              // shared (reduction) dimension
+    int nthreads;
+    int iterations;
+} ml_bench_matmul_params_t;
+
+typedef struct ml_bench_matmul_result_s {
+    double avg_us;
+    double min_us;
+    double gflops;          // 2*M*N*K / avg time
+    double gbps;            // bytes of src0, src1 and dst / avg time
+    size_t weight_bytes;
+} ml_bench_matmul_result_t;
+
+int ml_BenchMatMul(const ml_bench_matmul_params_t *params, ml_bench_matmul_result_t *result, const char **errmsg);
+
+GGML_TCL_CMD(ml_BenchMatMulCmd);
+
+#endif //GGML_TCL_BENCH_H
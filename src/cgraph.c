@@ -7,6 +7,7 @@
 #include <tcl.h>
 #include <ggml.h>
 #include "cgraph.h"
+#include "context.h"
 
 int ml_InsertGraphToList(ml_context_t *ctx, ml_cgraph_t *internal) {
     if (ctx->first_graph_ptr == NULL) {
@@ -20,6 +21,50 @@ int ml_InsertGraphToList(ml_context_t *ctx, ml_cgraph_t *internal) {
     return TCL_OK;
 }
 
+ml_cgraph_t *ml_CreateCGraphHandle(ml_context_t *ctx, struct ggml_cgraph *cgraph) {
+    ml_cgraph_t *cgraph_ptr = (ml_cgraph_t *) Tcl_Alloc(sizeof(ml_cgraph_t));
+    cgraph_ptr->ggml_cgraph = cgraph;
+    cgraph_ptr->ctx = ctx;
+    cgraph_ptr->prev = NULL;
+    cgraph_ptr->next = NULL;
+    cgraph_ptr->computed = 0;
+    cgraph_ptr->computed_version = 0;
+    CMD_CGRAPH_NAME(cgraph_ptr->handle, cgraph_ptr);
+    ml_RegisterCGraph(cgraph_ptr->handle, cgraph_ptr);
+    ml_InsertGraphToList(ctx, cgraph_ptr);
+    return cgraph_ptr;
+}
+
+// Ops that only reinterpret the data of their source, every other op with a view_src writes into it.
+int ml_IsViewOp(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE ||
+           op == GGML_OP_TRANSPOSE;
+}
+
+size_t ml_GraphMarkWritten(struct ggml_tensor **nodes, int n_nodes) {
+    struct ggml_tensor **written = (struct ggml_tensor **) Tcl_Alloc(sizeof(struct ggml_tensor *) * (n_nodes > 0 ? n_nodes : 1));
+    int n_written = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        if (!ml_IsViewOp(nodes[i]->op)) {
+            written[n_written++] = nodes[i];
+        }
+    }
+    size_t version = ml_ContextMarkModified(written, n_written);
+    Tcl_Free((char *) written);
+    return version;
+}
+
+// Evaluates every node and remembers which writes the results reflect, see graph_compute_incremental.
+static int ml_GraphComputeAll(ml_cgraph_t *cgraph_ptr, int nthreads) {
+    struct ggml_cgraph *cgraph = cgraph_ptr->ggml_cgraph;
+    if (TCL_OK != ml_ContextGraphCompute(cgraph_ptr->ctx, cgraph, nthreads)) {
+        return TCL_ERROR;
+    }
+    cgraph_ptr->computed = 1;
+    cgraph_ptr->computed_version = ml_GraphMarkWritten(cgraph->nodes, cgraph->n_nodes);
+    return TCL_OK;
+}
+
 int ml_NewGraphCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     DBG(fprintf(stderr, "NewGraphCmd\n"));
     CheckArgs(2, 2, 1, "context_handle");
@@ -31,14 +76,13 @@ int ml_NewGraphCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         return TCL_ERROR;
     }
 
-    ml_cgraph_t *cgraph_ptr = (ml_cgraph_t *) Tcl_Alloc(sizeof(ml_cgraph_t));
-    cgraph_ptr->ggml_cgraph = ggml_new_graph(ctx->ggml_ctx);
-    cgraph_ptr->ctx = ctx;
-    cgraph_ptr->prev = NULL;
-    cgraph_ptr->next = NULL;
-    CMD_CGRAPH_NAME(cgraph_ptr->handle, cgraph_ptr);
-    ml_RegisterCGraph(cgraph_ptr->handle, cgraph_ptr);
-    ml_InsertGraphToList(ctx, cgraph_ptr);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_ContextReserveMeta(ctx, ggml_graph_overhead(), &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ml_cgraph_t *cgraph_ptr = ml_CreateCGraphHandle(ctx, ggml_new_graph(ctx->ggml_ctx));
 
     SetResult(cgraph_ptr->handle);
     return TCL_OK;
@@ -69,14 +113,13 @@ int ml_NewGraphCustomCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tc
         }
     }
 
-    ml_cgraph_t *cgraph_ptr = (ml_cgraph_t *) Tcl_Alloc(sizeof(ml_cgraph_t));
-    cgraph_ptr->ggml_cgraph = ggml_new_graph_custom(ctx->ggml_ctx, size, grads);
-    cgraph_ptr->ctx = ctx;
-    cgraph_ptr->prev = NULL;
-    cgraph_ptr->next = NULL;
-    CMD_CGRAPH_NAME(cgraph_ptr->handle, cgraph_ptr);
-    ml_RegisterCGraph(cgraph_ptr->handle, cgraph_ptr);
-    ml_InsertGraphToList(ctx, cgraph_ptr);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_ContextReserveMeta(ctx, ggml_graph_overhead_custom(size, grads), &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ml_cgraph_t *cgraph_ptr = ml_CreateCGraphHandle(ctx, ggml_new_graph_custom(ctx->ggml_ctx, size, grads));
 
     SetResult(cgraph_ptr->handle);
     return TCL_OK;
@@ -99,7 +142,174 @@ int ml_GraphComputeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_
         return TCL_ERROR;
     }
 
-    ggml_graph_compute_with_ctx(cgraph_ptr->ctx->ggml_ctx, cgraph_ptr->ggml_cgraph, nthreads);
+    if (cgraph_ptr->ctx->no_alloc) {
+        SetResult("cannot compute a graph of a no_alloc context, use graph_estimate_mem instead");
+        return TCL_ERROR;
+    }
+
+    return ml_GraphComputeAll(cgraph_ptr, nthreads);
+}
+
+static int ml_IsDirty(Tcl_HashTable *dirty_ht, struct ggml_tensor *tensor) {
+    return Tcl_FindHashEntry(dirty_ht, (const char *) tensor) != NULL ||
+           (tensor->view_src != NULL && Tcl_FindHashEntry(dirty_ht, (const char *) tensor->view_src) != NULL);
+}
+
+int ml_GraphComputeIncrementalCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GraphComputeIncrementalCmd\n"));
+    CheckArgs(3, 3, 1, "cgraph_handle nthreads");
+
+    const char *cgraph_handle = Tcl_GetString(objv[1]);
+    ml_cgraph_t *cgraph_ptr = ml_GetInternalFromCGraph(cgraph_handle);
+    if (!cgraph_ptr) {
+        SetResult("cgraph handle not found");
+        return TCL_ERROR;
+    }
+
+    int nthreads;
+    if (Tcl_GetIntFromObj(interp, objv[2], &nthreads) != TCL_OK || nthreads <= 0) {
+        SetResult("nthreads is not a positive integer");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = cgraph_ptr->ctx;
+    if (ctx->no_alloc) {
+        SetResult("cannot compute a graph of a no_alloc context, use graph_estimate_mem instead");
+        return TCL_ERROR;
+    }
+
+    struct ggml_cgraph *cgraph = cgraph_ptr->ggml_cgraph;
+    if (!cgraph_ptr->computed) {
+        if (TCL_OK != ml_GraphComputeAll(cgraph_ptr, nthreads)) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(cgraph->n_nodes));
+        return TCL_OK;
+    }
+
+    // writes made while the graph is scanned are after this version, so the next call still sees them
+    size_t version = ml_ContextModifiedVersion();
+
+    // the nodes are in topological order, so one pass over them collects everything downstream of a written tensor
+    Tcl_HashTable dirty_ht;
+    Tcl_InitHashTable(&dirty_ht, TCL_ONE_WORD_KEYS);
+    int newEntry;
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        struct ggml_tensor *leaf = cgraph->leafs[i];
+        if (ml_ContextModifiedSince(leaf, cgraph_ptr->computed_version) ||
+            (leaf->view_src != NULL && ml_ContextModifiedSince(leaf->view_src, cgraph_ptr->computed_version))) {
+            Tcl_CreateHashEntry(&dirty_ht, (const char *) leaf, &newEntry);
+        }
+    }
+
+    struct ggml_tensor **nodes = (struct ggml_tensor **) Tcl_Alloc(sizeof(struct ggml_tensor *) * (cgraph->n_nodes > 0 ? cgraph->n_nodes : 1));
+    int n_nodes = 0;
+    int full = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor *node = cgraph->nodes[i];
+        int dirty = ml_ContextModifiedSince(node, cgraph_ptr->computed_version) ||
+                    (node->view_src != NULL && ml_IsDirty(&dirty_ht, node->view_src));
+        for (int j = 0; j < GGML_MAX_SRC && !dirty; j++) {
+            dirty = node->src[j] != NULL && ml_IsDirty(&dirty_ht, node->src[j]);
+        }
+        if (!dirty) {
+            continue;
+        }
+        Tcl_CreateHashEntry(&dirty_ht, (const char *) node, &newEntry);
+        nodes[n_nodes++] = node;
+
+        // an in-place op accumulates into the data of its source, which is only valid to redo after
+        // the source itself was recomputed (copies overwrite it and can always be redone)
+        if (node->view_src != NULL && !ml_IsViewOp(node->op) && node->op != GGML_OP_CPY &&
+            node->view_src->op != GGML_OP_NONE && !ml_IsDirty(&dirty_ht, node->view_src)) {
+            full = 1;
+        }
+    }
+    Tcl_DeleteHashTable(&dirty_ht);
+
+    int rc = TCL_OK;
+    if (full) {
+        n_nodes = cgraph->n_nodes;
+        rc = ml_GraphComputeAll(cgraph_ptr, nthreads);
+    } else if (n_nodes > 0) {
+        struct ggml_cgraph subgraph = *cgraph;
+        subgraph.nodes = nodes;
+        subgraph.n_nodes = n_nodes;
+        rc = ml_ContextGraphCompute(ctx, &subgraph, nthreads);
+        if (rc == TCL_OK) {
+            cgraph_ptr->computed_version = ml_GraphMarkWritten(nodes, n_nodes);
+        }
+    } else {
+        cgraph_ptr->computed_version = version;
+    }
+    Tcl_Free((char *) nodes);
+
+    if (rc != TCL_OK) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(n_nodes));
+    return TCL_OK;
+}
+
+int ml_GraphEstimateMemCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GraphEstimateMemCmd\n"));
+    CheckArgs(3, 3, 1, "cgraph_handle nthreads");
+
+    const char *cgraph_handle = Tcl_GetString(objv[1]);
+    ml_cgraph_t *cgraph_ptr = ml_GetInternalFromCGraph(cgraph_handle);
+    if (!cgraph_ptr) {
+        SetResult("cgraph handle not found");
+        return TCL_ERROR;
+    }
+
+    int nthreads;
+    if (Tcl_GetIntFromObj(interp, objv[2], &nthreads) != TCL_OK || nthreads <= 0) {
+        SetResult("nthreads is not a positive integer");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = cgraph_ptr->ctx;
+
+    // walk every tensor of the context, not just the graph's, since all of them need space in the arena
+    size_t n_tensors = 0;
+    size_t tensor_data_bytes = 0;
+    size_t objects_mem = 0;
+    ml_chunk_t *chunk = ctx->first_meta_chunk_ptr;
+    struct ggml_context *ggml_ctx = chunk != NULL ? chunk->ggml_ctx : ctx->ggml_ctx;
+    while (ggml_ctx != NULL) {
+        for (struct ggml_tensor *t = ggml_get_first_tensor(ggml_ctx); t != NULL; t = ggml_get_next_tensor(ggml_ctx, t)) {
+            n_tensors++;
+            if (t->view_src == NULL) {
+                tensor_data_bytes += GGML_PAD(ggml_nbytes(t), GGML_MEM_ALIGN);
+            }
+        }
+        objects_mem += ggml_used_mem(ggml_ctx);
+        chunk = chunk != NULL ? chunk->next : NULL;
+        ggml_ctx = chunk != NULL ? chunk->ggml_ctx : NULL;
+    }
+    if (ctx->chunk_size == 0 && !ctx->no_alloc) {
+        // a fixed arena that allocates keeps the data next to the objects
+        objects_mem = objects_mem > tensor_data_bytes ? objects_mem - tensor_data_bytes : 0;
+    }
+
+    size_t object_overhead = n_tensors * ggml_tensor_overhead();
+    size_t graph_size = objects_mem > object_overhead ? objects_mem - object_overhead : 0;
+
+    // graph_compute allocates the work buffer as a tensor in the same context
+    struct ggml_cplan cplan = ggml_graph_plan(cgraph_ptr->ggml_cgraph, nthreads);
+    size_t work_size = cplan.work_size;
+    size_t work_tensor_size = work_size > 0 ? GGML_PAD(work_size, GGML_MEM_ALIGN) + ggml_tensor_overhead() : 0;
+
+    size_t mem_size = objects_mem + tensor_data_bytes + work_tensor_size;
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_tensors", -1), Tcl_NewWideIntObj((Tcl_WideInt) n_tensors));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("tensor_data_bytes", -1), Tcl_NewWideIntObj((Tcl_WideInt) tensor_data_bytes));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("object_overhead", -1), Tcl_NewWideIntObj((Tcl_WideInt) object_overhead));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("graph_size", -1), Tcl_NewWideIntObj((Tcl_WideInt) graph_size));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("work_size", -1), Tcl_NewWideIntObj((Tcl_WideInt) work_size));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("mem_size", -1), Tcl_NewWideIntObj((Tcl_WideInt) mem_size));
+    Tcl_SetObjResult(interp, dict_ptr);
     return TCL_OK;
 }
 
@@ -114,7 +324,19 @@ int ml_GraphResetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
         return TCL_ERROR;
     }
 
-    ggml_graph_reset(cgraph_ptr->ggml_cgraph);
+    struct ggml_cgraph *cgraph = cgraph_ptr->ggml_cgraph;
+    ggml_graph_reset(cgraph);
+    if (cgraph->grads != NULL) {
+        struct ggml_tensor **grads = (struct ggml_tensor **) Tcl_Alloc(sizeof(struct ggml_tensor *) * (cgraph->n_nodes > 0 ? cgraph->n_nodes : 1));
+        int n_grads = 0;
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            if (cgraph->grads[i] != NULL) {
+                grads[n_grads++] = cgraph->grads[i];
+            }
+        }
+        ml_ContextMarkModified(grads, n_grads);
+        Tcl_Free((char *) grads);
+    }
     return TCL_OK;
 }
 
@@ -167,6 +389,7 @@ int ml_BuildForwardExpandCmd(ClientData clientData, Tcl_Interp *interp, int objc
     }
 
     ggml_build_forward_expand(cgraph_ptr->ggml_cgraph, tensor_ptr->ggml_tensor);
+    cgraph_ptr->computed = 0;
     return TCL_OK;
 
 }
@@ -202,11 +425,22 @@ int ml_BuildBackwardExpandCmd(ClientData clientData, Tcl_Interp *interp, int obj
         return TCL_ERROR;
     }
 
+    // the gradients and their ops must fit into one meta chunk, where ml_ContextAllocTensors finds them
+    struct ggml_cgraph *gf = forward_cgraph_ptr->ggml_cgraph;
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_ContextReserveMeta(ctx, 3 * (size_t) gf->n_nodes * ggml_tensor_overhead()
+                                             + ggml_graph_overhead_custom(gf->size, true), &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
     ggml_build_backward_expand(
             ctx->ggml_ctx,
             forward_cgraph_ptr->ggml_cgraph,
             backward_cgraph_ptr->ggml_cgraph,
             keep_gradient_graph);
+    ml_ContextAllocTensors(ctx);
+    backward_cgraph_ptr->computed = 0;
 
     return TCL_OK;
 }
@@ -230,5 +464,6 @@ int ml_GraphCpyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
     }
 
     ggml_graph_cpy(src_graph_ptr->ggml_cgraph, dst_graph_ptr->ggml_cgraph);
+    dst_graph_ptr->computed = 0;
     return TCL_OK;
 }
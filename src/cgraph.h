@@ -9,9 +9,16 @@
 
 #include "common.h"
 
+ml_cgraph_t *ml_CreateCGraphHandle(ml_context_t *ctx, struct ggml_cgraph *cgraph);
+int ml_IsViewOp(enum ggml_op op);
+// Records the writes of computing the nodes, returns their version.
+size_t ml_GraphMarkWritten(struct ggml_tensor **nodes, int n_nodes);
+
 GGML_TCL_CMD(ml_NewGraphCmd);
 GGML_TCL_CMD(ml_NewGraphCustomCmd);
 GGML_TCL_CMD(ml_GraphComputeCmd);
+GGML_TCL_CMD(ml_GraphComputeIncrementalCmd);
+GGML_TCL_CMD(ml_GraphEstimateMemCmd);
 GGML_TCL_CMD(ml_GraphResetCmd);
 GGML_TCL_CMD(ml_GraphDumpDotCmd);
 GGML_TCL_CMD(ml_BuildForwardExpandCmd);
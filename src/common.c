@@ -148,6 +148,28 @@ ml_GetInternalFromCGraph(const char *name) {
     return internal;
 }
 
+// Unregisters and frees a whole list of cgraph wrappers under a single lock, returns 0 if any was not registered
+int
+ml_UnregisterCGraphList(ml_cgraph_t *cgraph_ptr) {
+    int all_found = 1;
+
+    Tcl_MutexLock(&ml_CGraphToInternal_HT_Mutex);
+    while (cgraph_ptr != NULL) {
+        ml_cgraph_t *next_cgraph_ptr = cgraph_ptr->next;
+        Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&ml_CGraphToInternal_HT, cgraph_ptr->handle);
+        if (entryPtr != NULL) {
+            Tcl_DeleteHashEntry(entryPtr);
+        } else {
+            all_found = 0;
+        }
+        Tcl_Free((char *) cgraph_ptr);
+        cgraph_ptr = next_cgraph_ptr;
+    }
+    Tcl_MutexUnlock(&ml_CGraphToInternal_HT_Mutex);
+
+    return all_found;
+}
+
 /*static*/ int
 ml_RegisterTensor(const char *name, ml_tensor_t *internal) {
 
@@ -183,6 +205,28 @@ ml_UnregisterTensor(const char *name) {
     return entryPtr != NULL;
 }
 
+// Unregisters and frees a whole list of tensor wrappers under a single lock, returns 0 if any was not registered
+int
+ml_UnregisterTensorList(ml_tensor_t *tensor_ptr) {
+    int all_found = 1;
+
+    Tcl_MutexLock(&ml_TensorToInternal_HT_Mutex);
+    while (tensor_ptr != NULL) {
+        ml_tensor_t *next_tensor_ptr = tensor_ptr->next;
+        Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&ml_TensorToInternal_HT, tensor_ptr->handle);
+        if (entryPtr != NULL) {
+            Tcl_DeleteHashEntry(entryPtr);
+        } else {
+            all_found = 0;
+        }
+        Tcl_Free((char *) tensor_ptr);
+        tensor_ptr = next_tensor_ptr;
+    }
+    Tcl_MutexUnlock(&ml_TensorToInternal_HT_Mutex);
+
+    return all_found;
+}
+
 /*static*/ ml_tensor_t *
 ml_GetInternalFromTensor(const char *name) {
     ml_tensor_t *internal = NULL;
@@ -197,3 +241,43 @@ ml_GetInternalFromTensor(const char *name) {
 
     return internal;
 }
+
+typedef struct {
+    ml_worker_proc_t *proc;
+    void *worker;
+} ml_worker_start_t;
+
+static Tcl_ThreadCreateType ml_WorkerThread(ClientData clientData) {
+    ml_worker_start_t *start = (ml_worker_start_t *) clientData;
+    start->proc(start->worker);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+// Runs proc on n_workers workers laid out stride bytes apart, the calling thread runs the first worker
+// and any worker whose thread could not be started, returns once every worker is done
+void ml_RunWorkers(ml_worker_proc_t *proc, void *workers, size_t stride, int n_workers) {
+    ml_worker_start_t *starts = (ml_worker_start_t *) Tcl_Alloc(sizeof(ml_worker_start_t) * n_workers);
+    Tcl_ThreadId *threads = (Tcl_ThreadId *) Tcl_Alloc(sizeof(Tcl_ThreadId) * n_workers);
+    int *started = (int *) Tcl_Alloc(sizeof(int) * n_workers);
+    for (int t = 1; t < n_workers; t++) {
+        starts[t].proc = proc;
+        starts[t].worker = (char *) workers + stride * t;
+        started[t] = TCL_OK == Tcl_CreateThread(&threads[t], ml_WorkerThread, &starts[t],
+                                                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE);
+        if (!started[t]) {
+            proc(starts[t].worker);
+        }
+    }
+    if (n_workers > 0) {
+        proc(workers);
+    }
+    for (int t = 1; t < n_workers; t++) {
+        if (started[t]) {
+            int result;
+            Tcl_JoinThread(threads[t], &result);
+        }
+    }
+    Tcl_Free((char *) started);
+    Tcl_Free((char *) threads);
+    Tcl_Free((char *) starts);
+}
@@ -42,17 +42,50 @@ typedef struct ml_cgraph_s {
     struct ggml_cgraph *ggml_cgraph;
     struct ml_cgraph_s *next;
     struct ml_cgraph_s *prev;
+    int computed;                       // set once graph_compute has evaluated every node of the graph
+    size_t computed_version;            // version of the last write the results reflect, see ml_ContextMarkModified
     char handle[30];
 } ml_cgraph_t;
 
+typedef struct ml_chunk_s {
+    char *mem_buffer;
+    size_t mem_size;
+    size_t offset;                      // bump pointer of data chunks
+    struct ggml_context *ggml_ctx;      // set for meta chunks only
+    struct ggml_tensor *last_tensor;    // last tensor of a meta chunk that got its data assigned
+    struct ml_chunk_s *next;
+} ml_chunk_t;
+
+// A buffer owned by a context that tensors of a no_alloc context point into, e.g. a mapped file.
+typedef struct ml_buffer_s {
+    char *data;
+    size_t mapped_size;                 // as returned by ml_AllocBuffer or ml_MapFile
+    struct ml_buffer_s *next;
+} ml_buffer_t;
+
 struct ml_context_s {
     char *mem_buffer;
+    size_t mapped_size;                 // length of the mapping when mem_buffer was mmap'd, 0 for Tcl_Alloc
+    int numa_node;                      // node the buffer is bound to and compute threads are pinned to, -1 if none
     struct ggml_context *ggml_ctx;
     struct gguf_context *gguf_ctx;
+    int no_alloc;
+    // growable contexts keep tensor and graph objects in a chain of no_alloc meta chunks
+    // and place tensor data in a chain of data chunks, both grow on demand
+    size_t chunk_size;
+    ml_chunk_t *first_meta_chunk_ptr;
+    ml_chunk_t *last_meta_chunk_ptr;
+    ml_chunk_t *first_data_chunk_ptr;
+    ml_chunk_t *last_data_chunk_ptr;
+    char *work_buffer;
+    size_t work_size;
     ml_cgraph_t *first_graph_ptr;
     ml_cgraph_t *last_graph_ptr;
     ml_tensor_t *first_tensor_ptr;
     ml_tensor_t *last_tensor_ptr;
+    ml_buffer_t *first_buffer_ptr;      // released with the context
+    struct ml_context_s *next_pooled_ptr;  // link in the context pool while checked in
+    int refcount;                       // native objects (e.g. llama engines) that use the context
     char handle[30];
 };
 
@@ -69,8 +102,13 @@ ml_context_t *ml_GetInternalFromContext(const char *name);
 int ml_RegisterCGraph(const char *name, ml_cgraph_t *internal);
 int ml_UnregisterCGraph(const char *name);
 ml_cgraph_t *ml_GetInternalFromCGraph(const char *name);
+int ml_UnregisterCGraphList(ml_cgraph_t *cgraph_ptr);
 int ml_RegisterTensor(const char *name, ml_tensor_t *internal);
 int ml_UnregisterTensor(const char *name);
 ml_tensor_t *ml_GetInternalFromTensor(const char *name);
+int ml_UnregisterTensorList(ml_tensor_t *tensor_ptr);
+
+typedef void (ml_worker_proc_t)(void *worker);
+void ml_RunWorkers(ml_worker_proc_t *proc, void *workers, size_t stride, int n_workers);
 
 #endif //GGML_TCL_COMMON_H
@@ -5,38 +5,361 @@
  */
 #include <tcl.h>
 #include <ggml.h>
+#include <string.h>
 #include "common.h"
 #include "context.h"
+#include "membuf.h"
+
+// room kept free in the current meta chunk after every op, a single op creates only a handful of objects
+#define ML_META_CHUNK_SIZE (1024 * 1024)
+#define ML_META_HEADROOM (64 * ggml_tensor_overhead())
+// every meta chunk takes one of ggml's GGML_MAX_CONTEXTS slots, so chunks double in size and their number is capped,
+// 8 chunks hold 255MB of tensor and graph objects
+#define ML_MAX_META_CHUNKS 8
+
+// tensors of every context whose data was written, mapped to the version of the last write; one table
+// for all contexts, since a graph can read tensors of other contexts
+static Tcl_HashTable ml_Modified_HT;
+static Tcl_Mutex ml_Modified_HT_Mutex;
+static size_t ml_ModifiedVersion = 0;
+
+void ml_InitModifiedHT() {
+    Tcl_MutexLock(&ml_Modified_HT_Mutex);
+    Tcl_InitHashTable(&ml_Modified_HT, TCL_ONE_WORD_KEYS);
+    Tcl_MutexUnlock(&ml_Modified_HT_Mutex);
+}
+
+void ml_DeleteModifiedHT() {
+    Tcl_MutexLock(&ml_Modified_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_Modified_HT);
+    Tcl_MutexUnlock(&ml_Modified_HT_Mutex);
+}
+
+static void ml_InitContextFields(ml_context_t *ctx) {
+    ctx->mem_buffer = NULL;
+    ctx->mapped_size = 0;
+    ctx->numa_node = -1;
+    ctx->ggml_ctx = NULL;
+    ctx->gguf_ctx = NULL;
+    ctx->no_alloc = 0;
+    ctx->chunk_size = 0;
+    ctx->first_meta_chunk_ptr = NULL;
+    ctx->last_meta_chunk_ptr = NULL;
+    ctx->first_data_chunk_ptr = NULL;
+    ctx->last_data_chunk_ptr = NULL;
+    ctx->work_buffer = NULL;
+    ctx->work_size = 0;
+    ctx->first_graph_ptr = NULL;
+    ctx->last_graph_ptr = NULL;
+    ctx->first_tensor_ptr = NULL;
+    ctx->last_tensor_ptr = NULL;
+    ctx->first_buffer_ptr = NULL;
+    ctx->next_pooled_ptr = NULL;
+    ctx->refcount = 0;
+}
+
+static ml_chunk_t *ml_NewChunk(size_t mem_size) {
+    ml_chunk_t *chunk = (ml_chunk_t *) Tcl_Alloc(sizeof(ml_chunk_t));
+    chunk->mem_buffer = Tcl_Alloc(mem_size);
+    chunk->mem_size = mem_size;
+    chunk->offset = 0;
+    chunk->ggml_ctx = NULL;
+    chunk->last_tensor = NULL;
+    chunk->next = NULL;
+    return chunk;
+}
+
+static int ml_AddMetaChunk(ml_context_t *ctx, size_t mem_size, const char **errmsg) {
+    int n_chunks = 0;
+    for (ml_chunk_t *chunk = ctx->first_meta_chunk_ptr; chunk != NULL; chunk = chunk->next) {
+        n_chunks++;
+    }
+    if (n_chunks >= ML_MAX_META_CHUNKS) {
+        *errmsg = "growable context has too many tensors";
+        return TCL_ERROR;
+    }
+    if (ctx->last_meta_chunk_ptr != NULL && mem_size < 2 * ctx->last_meta_chunk_ptr->mem_size) {
+        mem_size = 2 * ctx->last_meta_chunk_ptr->mem_size;
+    }
+
+    ml_chunk_t *chunk = ml_NewChunk(mem_size);
+
+    struct ggml_init_params params = {
+            .mem_size   = mem_size,
+            .mem_buffer = chunk->mem_buffer,
+            .no_alloc   = 1,                             // data is placed in the data chunks
+    };
+    chunk->ggml_ctx = ggml_init(params);
+    if (chunk->ggml_ctx == NULL) {
+        Tcl_Free(chunk->mem_buffer);
+        Tcl_Free((char *) chunk);
+        *errmsg = "could not create ggml context, too many contexts";
+        return TCL_ERROR;
+    }
+
+    if (ctx->first_meta_chunk_ptr == NULL) {
+        ctx->first_meta_chunk_ptr = chunk;
+    } else {
+        ctx->last_meta_chunk_ptr->next = chunk;
+    }
+    ctx->last_meta_chunk_ptr = chunk;
+    ctx->ggml_ctx = chunk->ggml_ctx;
+    return TCL_OK;
+}
+
+static void *ml_ContextAllocData(ml_context_t *ctx, size_t nbytes) {
+    size_t size = GGML_PAD(nbytes, GGML_MEM_ALIGN);
+    ml_chunk_t *chunk = ctx->last_data_chunk_ptr;
+    if (chunk == NULL || chunk->offset + size > chunk->mem_size) {
+        // tensors larger than a chunk get a chunk of their own
+        chunk = ml_NewChunk(size > ctx->chunk_size ? size : ctx->chunk_size);
+        if (ctx->first_data_chunk_ptr == NULL) {
+            ctx->first_data_chunk_ptr = chunk;
+        } else {
+            ctx->last_data_chunk_ptr->next = chunk;
+        }
+        ctx->last_data_chunk_ptr = chunk;
+    }
+    void *data = chunk->mem_buffer + chunk->offset;
+    chunk->offset += size;
+    return data;
+}
+
+int ml_ContextReserveMeta(ml_context_t *ctx, size_t nbytes, const char **errmsg) {
+    if (ctx->chunk_size == 0) {
+        return TCL_OK;
+    }
+    size_t used = ggml_used_mem(ctx->ggml_ctx);
+    size_t needed = nbytes + ML_META_HEADROOM;
+    if (used + needed > ctx->last_meta_chunk_ptr->mem_size) {
+        return ml_AddMetaChunk(ctx, needed > ML_META_CHUNK_SIZE ? needed : ML_META_CHUNK_SIZE, errmsg);
+    }
+    return TCL_OK;
+}
+
+// Gives data to every tensor created in the current meta chunk since the last call. Views are
+// (re)pointed into their source, since ops may create views of tensors that had no data yet.
+void ml_ContextAllocTensors(ml_context_t *ctx) {
+    if (ctx->chunk_size == 0) {
+        return;
+    }
+
+    ml_chunk_t *chunk = ctx->last_meta_chunk_ptr;
+    struct ggml_tensor *t = chunk->last_tensor == NULL
+                            ? ggml_get_first_tensor(chunk->ggml_ctx)
+                            : ggml_get_next_tensor(chunk->ggml_ctx, chunk->last_tensor);
+    for (; t != NULL; t = ggml_get_next_tensor(chunk->ggml_ctx, t)) {
+        if (t->view_src != NULL) {
+            if (t->data == NULL && t->view_src->data != NULL) {
+                t->data = (char *) t->view_src->data + t->view_offs;
+            }
+        } else if (t->data == NULL) {
+            t->data = ml_ContextAllocData(ctx, ggml_nbytes(t));
+        }
+        chunk->last_tensor = t;
+    }
+
+    // a failure leaves the current chunk in place, callers that create many objects reserve them upfront
+    const char *errmsg = NULL;
+    ml_ContextReserveMeta(ctx, 0, &errmsg);
+}
+
+int ml_ContextGraphCompute(ml_context_t *ctx, struct ggml_cgraph *cgraph, int nthreads) {
+    if (ctx->chunk_size == 0) {
+        // the compute threads inherit the affinity of the calling thread, so they run next to the buffer
+        ml_cpu_mask_t saved_mask;
+        int pinned = ctx->numa_node >= 0 && TCL_OK == ml_PinThreadToNode(ctx->numa_node, &saved_mask);
+        ggml_graph_compute_with_ctx(ctx->ggml_ctx, cgraph, nthreads);
+        if (pinned) {
+            ml_RestoreThreadAffinity(&saved_mask);
+        }
+        return TCL_OK;
+    }
+
+    // the meta chunks are no_alloc, so the work buffer is kept by the context and reused between computes
+    struct ggml_cplan cplan = ggml_graph_plan(cgraph, nthreads);
+    if (cplan.work_size > ctx->work_size) {
+        ctx->work_buffer = Tcl_Realloc(ctx->work_buffer, cplan.work_size);
+        ctx->work_size = cplan.work_size;
+    }
+    cplan.work_data = (uint8_t *) ctx->work_buffer;
+    ggml_graph_compute(cgraph, &cplan);
+    return TCL_OK;
+}
+
+static void ml_SetModifiedVersion(struct ggml_tensor *tensor) {
+    int newEntry;
+    Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&ml_Modified_HT, (const char *) tensor, &newEntry);
+    Tcl_SetHashValue(entryPtr, (ClientData) ml_ModifiedVersion);
+}
+
+size_t ml_ContextMarkModified(struct ggml_tensor **tensors, int n_tensors) {
+    Tcl_MutexLock(&ml_Modified_HT_Mutex);
+    size_t version = ++ml_ModifiedVersion;
+    for (int i = 0; i < n_tensors; i++) {
+        ml_SetModifiedVersion(tensors[i]);
+        if (tensors[i]->view_src != NULL) {
+            // a write through a view changes the tensor it points into as well
+            ml_SetModifiedVersion(tensors[i]->view_src);
+        }
+    }
+    Tcl_MutexUnlock(&ml_Modified_HT_Mutex);
+    return version;
+}
+
+int ml_ContextModifiedSince(struct ggml_tensor *tensor, size_t version) {
+    Tcl_MutexLock(&ml_Modified_HT_Mutex);
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&ml_Modified_HT, (const char *) tensor);
+    int modified = entryPtr != NULL && (size_t) Tcl_GetHashValue(entryPtr) > version;
+    Tcl_MutexUnlock(&ml_Modified_HT_Mutex);
+    return modified;
+}
+
+size_t ml_ContextModifiedVersion() {
+    Tcl_MutexLock(&ml_Modified_HT_Mutex);
+    size_t version = ml_ModifiedVersion;
+    Tcl_MutexUnlock(&ml_Modified_HT_Mutex);
+    return version;
+}
+
+// Drops the writes recorded for the tensors of a context before their memory is reused or freed.
+static void ml_ContextForgetModified(ml_context_t *ctx) {
+    Tcl_MutexLock(&ml_Modified_HT_Mutex);
+    if (ml_Modified_HT.numEntries > 0) {
+        ml_chunk_t *chunk = ctx->first_meta_chunk_ptr;
+        struct ggml_context *ggml_ctx = chunk != NULL ? chunk->ggml_ctx : ctx->ggml_ctx;
+        while (ggml_ctx != NULL) {
+            for (struct ggml_tensor *t = ggml_get_first_tensor(ggml_ctx); t != NULL; t = ggml_get_next_tensor(ggml_ctx, t)) {
+                Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&ml_Modified_HT, (const char *) t);
+                if (entryPtr != NULL) {
+                    Tcl_DeleteHashEntry(entryPtr);
+                }
+            }
+            chunk = chunk != NULL ? chunk->next : NULL;
+            ggml_ctx = chunk != NULL ? chunk->ggml_ctx : NULL;
+        }
+    }
+    Tcl_MutexUnlock(&ml_Modified_HT_Mutex);
+}
+
+size_t ml_ContextUsedMem(ml_context_t *ctx) {
+    if (ctx->chunk_size == 0) {
+        return ggml_used_mem(ctx->ggml_ctx);
+    }
+    size_t used_mem = 0;
+    for (ml_chunk_t *chunk = ctx->first_meta_chunk_ptr; chunk != NULL; chunk = chunk->next) {
+        used_mem += ggml_used_mem(chunk->ggml_ctx);
+    }
+    for (ml_chunk_t *chunk = ctx->first_data_chunk_ptr; chunk != NULL; chunk = chunk->next) {
+        used_mem += chunk->offset;
+    }
+    return used_mem;
+}
+
+size_t ml_ContextMemSize(ml_context_t *ctx) {
+    if (ctx->chunk_size == 0) {
+        return ggml_get_mem_size(ctx->ggml_ctx);
+    }
+    size_t mem_size = 0;
+    for (ml_chunk_t *chunk = ctx->first_meta_chunk_ptr; chunk != NULL; chunk = chunk->next) {
+        mem_size += chunk->mem_size;
+    }
+    for (ml_chunk_t *chunk = ctx->first_data_chunk_ptr; chunk != NULL; chunk = chunk->next) {
+        mem_size += chunk->mem_size;
+    }
+    return mem_size;
+}
+
+static void ml_FreeChunks(ml_chunk_t *chunk) {
+    while (chunk != NULL) {
+        ml_chunk_t *next_chunk = chunk->next;
+        if (chunk->ggml_ctx != NULL) {
+            ggml_free(chunk->ggml_ctx);
+        }
+        Tcl_Free(chunk->mem_buffer);
+        Tcl_Free((char *) chunk);
+        chunk = next_chunk;
+    }
+}
+
+static ml_context_t *ml_CreateContext(size_t mem_size, int no_alloc, const ml_membuf_params_t *membuf_params, const char **errmsg) {
 
-static ml_context_t *ml_CreateContext(size_t mem_size) {
+    size_t mapped_size = 0;
+    char *mem_buffer = ml_AllocBuffer(mem_size, membuf_params, &mapped_size, errmsg);
+    if (mem_buffer == NULL) {
+        return NULL;
+    }
 
     ml_context_t *ctx = (ml_context_t *) Tcl_Alloc(sizeof(ml_context_t));
-    ctx->mem_buffer = Tcl_Alloc(mem_size);
+    ml_InitContextFields(ctx);
+    ctx->mem_buffer = mem_buffer;
+    ctx->mapped_size = mapped_size;
+    ctx->no_alloc = no_alloc;
+    if (membuf_params != NULL && membuf_params->numa == ML_NUMA_BIND) {
+        ctx->numa_node = membuf_params->numa_node;
+    }
 
     struct ggml_init_params params = {
             .mem_size   = mem_size,                      // bytes
             .mem_buffer = ctx->mem_buffer,               // if NULL, memory will be allocated internally
-            .no_alloc   = 0,                             // don't allocate memory for the tensor data
+            .no_alloc   = no_alloc,                      // don't allocate memory for the tensor data
     };
 
     // memory allocation happens here
     struct ggml_context *ggml_ctx = ggml_init(params);
+    if (ggml_ctx == NULL) {
+        ml_FreeBuffer(mem_buffer, mapped_size);
+        Tcl_Free((char *) ctx);
+        *errmsg = "could not create ggml context, too many contexts";
+        return NULL;
+    }
     ctx->ggml_ctx = ggml_ctx;
-    ctx->gguf_ctx = NULL;
-    ctx->first_graph_ptr = NULL;
-    ctx->last_graph_ptr = NULL;
-    ctx->first_tensor_ptr = NULL;
-    ctx->last_tensor_ptr = NULL;
 
     CMD_CONTEXT_NAME(ctx->handle, ctx);
+
+    return ctx;
+}
+
+ml_context_t *ml_NewContext(size_t mem_size, int no_alloc) {
+    const char *errmsg = NULL;
+    ml_context_t *ctx = ml_CreateContext(mem_size, no_alloc, NULL, &errmsg);
+    if (ctx == NULL) {
+        return NULL;
+    }
     ml_RegisterContext(ctx->handle, ctx);
+    return ctx;
+}
+
+static ml_context_t *ml_CreateGrowableContext(size_t chunk_size, const char **errmsg) {
+
+    ml_context_t *ctx = (ml_context_t *) Tcl_Alloc(sizeof(ml_context_t));
+    ml_InitContextFields(ctx);
+    ctx->chunk_size = chunk_size;
+
+    // data chunks are only allocated once the first tensor needs one
+    if (TCL_OK != ml_AddMetaChunk(ctx, ML_META_CHUNK_SIZE, errmsg)) {
+        Tcl_Free((char *) ctx);
+        return NULL;
+    }
+
+    CMD_CONTEXT_NAME(ctx->handle, ctx);
 
     return ctx;
 }
 
 int ml_CreateContextCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     DBG(fprintf(stderr, "CreateContextCmd\n"));
-    CheckArgs(2, 2, 1, "mem_size");
+
+    static const char *options[] = {"-no_alloc", "-growable", "-chunk_size", "-hugepages", "-numa", NULL};
+    enum options {
+        OPT_NO_ALLOC, OPT_GROWABLE, OPT_CHUNK_SIZE, OPT_HUGEPAGES, OPT_NUMA
+    };
+    static const char *hugepages_values[] = {"none", "transparent", "hugetlb", NULL};
+
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "mem_size ?-no_alloc boolean? ?-growable boolean? ?-chunk_size bytes? ?-hugepages none|transparent|hugetlb? ?-numa none|interleave|node?");
+        return TCL_ERROR;
+    }
 
     size_t mem_size;
     if (Tcl_GetLongFromObj(interp, objv[1], &mem_size) != TCL_OK || mem_size <= 0) {
@@ -44,55 +367,268 @@ int ml_CreateContextCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
         return TCL_ERROR;
     }
 
-    ml_context_t *ctx = ml_CreateContext(mem_size);
+    int no_alloc = 0;
+    int growable = 0;
+    long chunk_size = 0;
+    ml_membuf_params_t membuf_params = {
+            .hugepages = ML_HUGEPAGES_NONE,
+            .numa = ML_NUMA_NONE,
+            .numa_node = -1,
+    };
+    for (int i = 2; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_NO_ALLOC:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &no_alloc)) {
+                    SetResult("no_alloc is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_GROWABLE:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &growable)) {
+                    SetResult("growable is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_CHUNK_SIZE:
+                if (TCL_OK != Tcl_GetLongFromObj(interp, objv[i + 1], &chunk_size) || chunk_size <= 0) {
+                    SetResult("chunk_size is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                growable = 1;
+                break;
+            case OPT_HUGEPAGES: {
+                int hugepages;
+                if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i + 1], hugepages_values, "hugepages", 0, &hugepages)) {
+                    return TCL_ERROR;
+                }
+                membuf_params.hugepages = (ml_hugepages_t) hugepages;
+                break;
+            }
+            case OPT_NUMA: {
+                const char *numa = Tcl_GetString(objv[i + 1]);
+                if (strcmp(numa, "none") == 0) {
+                    membuf_params.numa = ML_NUMA_NONE;
+                } else if (strcmp(numa, "interleave") == 0) {
+                    membuf_params.numa = ML_NUMA_INTERLEAVE;
+                } else if (TCL_OK == Tcl_GetIntFromObj(interp, objv[i + 1], &membuf_params.numa_node) && membuf_params.numa_node >= 0) {
+                    membuf_params.numa = ML_NUMA_BIND;
+                } else {
+                    SetResult("numa must be none, interleave or a node number");
+                    return TCL_ERROR;
+                }
+                break;
+            }
+        }
+    }
+
+    if (growable && no_alloc) {
+        SetResult("a growable context cannot be no_alloc");
+        return TCL_ERROR;
+    }
+
+    if (growable && (membuf_params.hugepages != ML_HUGEPAGES_NONE || membuf_params.numa != ML_NUMA_NONE)) {
+        SetResult("hugepages and numa are only supported for fixed size contexts");
+        return TCL_ERROR;
+    }
+
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_AcquireNumaPolicy(membuf_params.numa, &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // for growable contexts mem_size is the chunk size, unless given explicitly
+    ml_context_t *ctx = growable
+                        ? ml_CreateGrowableContext(chunk_size > 0 ? (size_t) chunk_size : mem_size, &errmsg)
+                        : ml_CreateContext(mem_size, no_alloc, &membuf_params, &errmsg);
+    if (ctx == NULL) {
+        ml_ReleaseNumaPolicy(membuf_params.numa);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    ml_RegisterContext(ctx->handle, ctx);
 
     SetResult(ctx->handle);
     return TCL_OK;
 
 }
 
-static int ml_DestroyContext(Tcl_Interp *interp, ml_context_t *ctx) {
-    if (!ml_UnregisterContext(ctx->handle)) {
-        SetResult("unregister server name failed");
-        return TCL_ERROR;
+void ml_ContextAddBuffer(ml_context_t *ctx, char *data, size_t mapped_size) {
+    ml_buffer_t *buffer = (ml_buffer_t *) Tcl_Alloc(sizeof(ml_buffer_t));
+    buffer->data = data;
+    buffer->mapped_size = mapped_size;
+    buffer->next = ctx->first_buffer_ptr;
+    ctx->first_buffer_ptr = buffer;
+}
+
+static void ml_FreeContextBuffers(ml_context_t *ctx) {
+    ml_buffer_t *buffer = ctx->first_buffer_ptr;
+    while (buffer != NULL) {
+        ml_buffer_t *next_buffer = buffer->next;
+        ml_FreeBuffer(buffer->data, buffer->mapped_size);
+        Tcl_Free((char *) buffer);
+        buffer = next_buffer;
     }
+    ctx->first_buffer_ptr = NULL;
+}
 
-    ml_tensor_t *tensor_ptr = ctx->first_tensor_ptr;
-    while(tensor_ptr != NULL) {
-        ml_tensor_t *next_tensor_ptr = tensor_ptr->next;
-        if (!ml_UnregisterTensor(tensor_ptr->handle)) {
-            SetResult("unregister tensor name failed");
-            return TCL_ERROR;
-        }
-        Tcl_Free((char *) tensor_ptr);
-        tensor_ptr = next_tensor_ptr;
+static void ml_FreeContext(ml_context_t *ctx) {
+    ml_ContextForgetModified(ctx);
+    ml_FreeContextBuffers(ctx);
+    if (ctx->mem_buffer != NULL) {
+        ml_FreeBuffer(ctx->mem_buffer, ctx->mapped_size);
+    }
+    if (ctx->numa_node >= 0) {
+        ml_ReleaseNumaPolicy(ML_NUMA_BIND);
+    }
+    if (ctx->gguf_ctx != NULL) {
+        gguf_free(ctx->gguf_ctx);
+    } else if (ctx->chunk_size == 0 && ctx->ggml_ctx != NULL) {
+        ggml_free(ctx->ggml_ctx);
+    }
+    ml_FreeChunks(ctx->first_meta_chunk_ptr);
+    ml_FreeChunks(ctx->first_data_chunk_ptr);
+    if (ctx->work_buffer != NULL) {
+        Tcl_Free(ctx->work_buffer);
     }
+    Tcl_Free((char *) ctx);
+}
+
+static int ml_DropWrappers(Tcl_Interp *interp, ml_context_t *ctx) {
+    int tensors_ok = ml_UnregisterTensorList(ctx->first_tensor_ptr);
     ctx->first_tensor_ptr = NULL;
     ctx->last_tensor_ptr = NULL;
 
-    ml_cgraph_t *graph_ptr = ctx->first_graph_ptr;
-    while (graph_ptr) {
-        ml_cgraph_t *next_graph_ptr = graph_ptr->next;
-        if (!ml_UnregisterCGraph(graph_ptr->handle)) {
-            SetResult("unregister cgraph name failed");
-            return TCL_ERROR;
-        }
-        Tcl_Free((char *) graph_ptr);
-        graph_ptr = next_graph_ptr;
-    }
+    int graphs_ok = ml_UnregisterCGraphList(ctx->first_graph_ptr);
     ctx->first_graph_ptr = NULL;
     ctx->last_graph_ptr = NULL;
 
-    if (ctx->mem_buffer != NULL) {
-        Tcl_Free(ctx->mem_buffer);
+    if (!tensors_ok) {
+        SetResult("unregister tensor name failed");
+        return TCL_ERROR;
+    }
+    if (!graphs_ok) {
+        SetResult("unregister cgraph name failed");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// Rewinds the arena so that the context can be reused, keeping its (already faulted) memory.
+// When the arena cannot be set up again the context is left without a ggml context, see ml_DiscardContext.
+static int ml_ResetContext(Tcl_Interp *interp, ml_context_t *ctx) {
+    if (ctx->refcount > 0) {
+        SetResult("context is in use");
+        return TCL_ERROR;
     }
     if (ctx->gguf_ctx != NULL) {
-        gguf_free(ctx->gguf_ctx);
-    } else {
+        SetResult("cannot reset a context loaded from file");
+        return TCL_ERROR;
+    }
+
+    if (TCL_OK != ml_DropWrappers(interp, ctx)) {
+        return TCL_ERROR;
+    }
+    ml_ContextForgetModified(ctx);
+    ml_FreeContextBuffers(ctx);
+
+    if (ctx->chunk_size == 0) {
+        struct ggml_init_params params = {
+                .mem_size   = ggml_get_mem_size(ctx->ggml_ctx),
+                .mem_buffer = ctx->mem_buffer,
+                .no_alloc   = ctx->no_alloc,
+        };
         ggml_free(ctx->ggml_ctx);
+        ctx->ggml_ctx = ggml_init(params);
+        if (ctx->ggml_ctx == NULL) {
+            SetResult("could not create ggml context, too many contexts");
+            return TCL_ERROR;
+        }
+        return TCL_OK;
+    }
+
+    // growable contexts keep their first meta and data chunk and release the rest
+    ml_chunk_t *meta_chunk = ctx->first_meta_chunk_ptr;
+    ml_FreeChunks(meta_chunk->next);
+    meta_chunk->next = NULL;
+    ctx->last_meta_chunk_ptr = meta_chunk;
+
+    struct ggml_init_params params = {
+            .mem_size   = meta_chunk->mem_size,
+            .mem_buffer = meta_chunk->mem_buffer,
+            .no_alloc   = 1,
+    };
+    ggml_free(meta_chunk->ggml_ctx);
+    meta_chunk->ggml_ctx = ggml_init(params);
+    meta_chunk->last_tensor = NULL;
+    ctx->ggml_ctx = meta_chunk->ggml_ctx;
+    if (ctx->ggml_ctx == NULL) {
+        SetResult("could not create ggml context, too many contexts");
+        return TCL_ERROR;
+    }
+
+    ml_chunk_t *data_chunk = ctx->first_data_chunk_ptr;
+    if (data_chunk != NULL) {
+        ml_FreeChunks(data_chunk->next);
+        data_chunk->next = NULL;
+        data_chunk->offset = 0;
+        ctx->last_data_chunk_ptr = data_chunk;
+    }
+    return TCL_OK;
+}
+
+// Frees a context whose reset failed after its wrappers were dropped, it is of no further use.
+static void ml_DiscardContext(ml_context_t *ctx) {
+    if (ctx->ggml_ctx == NULL) {
+        ml_UnregisterContext(ctx->handle);
+        ml_FreeContext(ctx);
+    }
+}
+
+int ml_ResetContextCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "ResetContextCmd\n"));
+    CheckArgs(2, 2, 1, "context_handle");
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_context_t *ctx = ml_GetInternalFromContext(handle);
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (TCL_OK != ml_ResetContext(interp, ctx)) {
+        ml_DiscardContext(ctx);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// Undoes ml_NewContext for a creator that failed before anything else could refer to the context.
+void ml_DeleteContext(ml_context_t *ctx) {
+    ml_UnregisterContext(ctx->handle);
+    ml_UnregisterTensorList(ctx->first_tensor_ptr);
+    ml_UnregisterCGraphList(ctx->first_graph_ptr);
+    ml_FreeContext(ctx);
+}
+
+int ml_DestroyContext(Tcl_Interp *interp, ml_context_t *ctx) {
+    if (ctx->refcount > 0) {
+        SetResult("context is in use");
+        return TCL_ERROR;
+    }
+
+    if (!ml_UnregisterContext(ctx->handle)) {
+        SetResult("unregister server name failed");
+        return TCL_ERROR;
+    }
+
+    if (TCL_OK != ml_DropWrappers(interp, ctx)) {
+        return TCL_ERROR;
     }
-    Tcl_Free((char *) ctx);
 
+    ml_FreeContext(ctx);
     return TCL_OK;
 }
 int ml_DestroyContextCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
@@ -107,11 +643,174 @@ int ml_DestroyContextCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tc
     return ml_DestroyContext(interp, ctx);
 }
 
+// Pool of fixed size contexts whose memory has already been touched, shared by all interpreters.
+// Checked in contexts are reset and unregistered, so their handles are invalid until checked out again.
+// Every pooled context holds one of ggml's GGML_MAX_CONTEXTS (64) slots, so the pool keeps well below that.
+#define ML_CONTEXT_POOL_MAX 16
+
+static Tcl_Mutex ml_ContextPool_Mutex;
+static ml_context_t *ml_ContextPool = NULL;
+static int ml_ContextPoolCount = 0;
+
+static ml_context_t *ml_CreatePrefaultedContext(size_t mem_size, const char **errmsg) {
+    ml_context_t *ctx = ml_CreateContext(mem_size, 0, NULL, errmsg);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    // fault in every page now rather than on first use by a request
+    memset(ctx->mem_buffer, 0, mem_size);
+    return ctx;
+}
+
+// Returns 0 and leaves the context to the caller when the pool is full.
+static int ml_PushPooledContext(ml_context_t *ctx) {
+    int pushed = 0;
+    Tcl_MutexLock(&ml_ContextPool_Mutex);
+    if (ml_ContextPoolCount < ML_CONTEXT_POOL_MAX) {
+        ctx->next_pooled_ptr = ml_ContextPool;
+        ml_ContextPool = ctx;
+        ml_ContextPoolCount++;
+        pushed = 1;
+    }
+    Tcl_MutexUnlock(&ml_ContextPool_Mutex);
+    return pushed;
+}
+
+// Takes the smallest pooled context of at least mem_size bytes, NULL if there is none.
+static ml_context_t *ml_PopPooledContext(size_t mem_size) {
+    Tcl_MutexLock(&ml_ContextPool_Mutex);
+    ml_context_t **best_link = NULL;
+    size_t best_size = 0;
+    for (ml_context_t **link = &ml_ContextPool; *link != NULL; link = &(*link)->next_pooled_ptr) {
+        size_t ctx_mem_size = ggml_get_mem_size((*link)->ggml_ctx);
+        if (ctx_mem_size >= mem_size && (best_link == NULL || ctx_mem_size < best_size)) {
+            best_link = link;
+            best_size = ctx_mem_size;
+        }
+    }
+    ml_context_t *ctx = NULL;
+    if (best_link != NULL) {
+        ctx = *best_link;
+        *best_link = ctx->next_pooled_ptr;
+        ctx->next_pooled_ptr = NULL;
+        ml_ContextPoolCount--;
+    }
+    Tcl_MutexUnlock(&ml_ContextPool_Mutex);
+    return ctx;
+}
+
+int ml_ContextPoolFillCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "ContextPoolFillCmd\n"));
+    CheckArgs(3, 3, 1, "count mem_size");
+
+    int count;
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[1], &count) || count < 0) {
+        SetResult("count is not an integer >= 0");
+        return TCL_ERROR;
+    }
+
+    long mem_size;
+    if (TCL_OK != Tcl_GetLongFromObj(interp, objv[2], &mem_size) || mem_size <= 0) {
+        SetResult("mem_size is not an integer > 0");
+        return TCL_ERROR;
+    }
+
+    int added = 0;
+    for (int i = 0; i < count; i++) {
+        const char *errmsg = NULL;
+        ml_context_t *ctx = ml_CreatePrefaultedContext(mem_size, &errmsg);
+        if (ctx == NULL) {
+            if (added == 0) {
+                SetResult(errmsg);
+                return TCL_ERROR;
+            }
+            break;
+        }
+        if (!ml_PushPooledContext(ctx)) {
+            ml_FreeContext(ctx);
+            break;
+        }
+        added++;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(added));
+    return TCL_OK;
+}
+
+int ml_ContextPoolCheckoutCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "ContextPoolCheckoutCmd\n"));
+    CheckArgs(2, 2, 1, "mem_size");
+
+    long mem_size;
+    if (TCL_OK != Tcl_GetLongFromObj(interp, objv[1], &mem_size) || mem_size <= 0) {
+        SetResult("mem_size is not an integer > 0");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_PopPooledContext(mem_size);
+    if (ctx == NULL) {
+        const char *errmsg = NULL;
+        ctx = ml_CreatePrefaultedContext(mem_size, &errmsg);
+        if (ctx == NULL) {
+            SetResult(errmsg);
+            return TCL_ERROR;
+        }
+    }
+    ml_RegisterContext(ctx->handle, ctx);
+
+    SetResult(ctx->handle);
+    return TCL_OK;
+}
+
+int ml_ContextPoolCheckinCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "ContextPoolCheckinCmd\n"));
+    CheckArgs(2, 2, 1, "context_handle");
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_context_t *ctx = ml_GetInternalFromContext(handle);
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+
+    if (ctx->gguf_ctx != NULL || ctx->chunk_size > 0 || ctx->no_alloc) {
+        SetResult("only fixed size contexts that allocate can be pooled");
+        return TCL_ERROR;
+    }
+
+    if (TCL_OK != ml_ResetContext(interp, ctx)) {
+        ml_DiscardContext(ctx);
+        return TCL_ERROR;
+    }
+
+    if (!ml_UnregisterContext(ctx->handle)) {
+        SetResult("unregister context name failed");
+        return TCL_ERROR;
+    }
+
+    if (!ml_PushPooledContext(ctx)) {
+        ml_FreeContext(ctx);
+    }
+    return TCL_OK;
+}
+
+int ml_ContextPoolSizeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "ContextPoolSizeCmd\n"));
+    CheckArgs(1, 1, 1, "");
+
+    Tcl_MutexLock(&ml_ContextPool_Mutex);
+    int count = ml_ContextPoolCount;
+    Tcl_MutexUnlock(&ml_ContextPool_Mutex);
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(count));
+    return TCL_OK;
+}
+
 int ml_LoadContextFromFileCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     DBG(fprintf(stderr, "LoadContextFromFileCmd\n"));
     CheckArgs(2, 2, 1, "filename");
 
     ml_context_t *ctx = (ml_context_t *) Tcl_Alloc(sizeof(ml_context_t));
+    ml_InitContextFields(ctx);
 
     struct gguf_init_params params = {
             .no_alloc = 0,
@@ -128,11 +827,6 @@ int ml_LoadContextFromFileCmd(ClientData clientData, Tcl_Interp *interp, int obj
     }
 
     ctx->gguf_ctx = gguf_ctx;
-    ctx->mem_buffer = NULL;
-    ctx->first_graph_ptr = NULL;
-    ctx->last_graph_ptr = NULL;
-    ctx->first_tensor_ptr = NULL;
-    ctx->last_tensor_ptr = NULL;
 
     CMD_CONTEXT_NAME(ctx->handle, ctx);
     ml_RegisterContext(ctx->handle, ctx);
@@ -151,7 +845,7 @@ int ml_UsedMemCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *
         return TCL_ERROR;
     }
 
-    size_t used_mem = ggml_used_mem(ctx->ggml_ctx);
+    size_t used_mem = ml_ContextUsedMem(ctx);
 
     Tcl_SetObjResult(interp, Tcl_NewLongObj(used_mem));
     return TCL_OK;
@@ -167,7 +861,17 @@ int ml_GetMaxTensorSizeCmd(ClientData clientData, Tcl_Interp *interp, int objc,
         return TCL_ERROR;
     }
 
-    size_t max_tensor_size = ggml_get_max_tensor_size(ctx->ggml_ctx);
+    size_t max_tensor_size = 0;
+    if (ctx->chunk_size == 0) {
+        max_tensor_size = ggml_get_max_tensor_size(ctx->ggml_ctx);
+    } else {
+        for (ml_chunk_t *chunk = ctx->first_meta_chunk_ptr; chunk != NULL; chunk = chunk->next) {
+            size_t chunk_max_tensor_size = ggml_get_max_tensor_size(chunk->ggml_ctx);
+            if (chunk_max_tensor_size > max_tensor_size) {
+                max_tensor_size = chunk_max_tensor_size;
+            }
+        }
+    }
 
     Tcl_SetObjResult(interp, Tcl_NewLongObj(max_tensor_size));
     return TCL_OK;
@@ -183,7 +887,7 @@ int ml_GetMemSizeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
         return TCL_ERROR;
     }
 
-    size_t mem_size = ggml_get_mem_size(ctx->ggml_ctx);
+    size_t mem_size = ml_ContextMemSize(ctx);
 
     Tcl_SetObjResult(interp, Tcl_NewLongObj(mem_size));
     return TCL_OK;
@@ -6,10 +6,33 @@
 #ifndef GGML_TCL_CONTEXT_H
 #define GGML_TCL_CONTEXT_H
 
-#define GGML_TCL_CMD(x) int (x)(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+#include "common.h"
+
+ml_context_t *ml_NewContext(size_t mem_size, int no_alloc);
+void ml_DeleteContext(ml_context_t *ctx);
+int ml_DestroyContext(Tcl_Interp *interp, ml_context_t *ctx);
+int ml_ContextReserveMeta(ml_context_t *ctx, size_t nbytes, const char **errmsg);
+void ml_ContextAllocTensors(ml_context_t *ctx);
+int ml_ContextGraphCompute(ml_context_t *ctx, struct ggml_cgraph *cgraph, int nthreads);
+void ml_InitModifiedHT();
+void ml_DeleteModifiedHT();
+// Records writes to the data of tensors so that graph_compute_incremental re-evaluates what depends on them,
+// returns the version of the writes.
+size_t ml_ContextMarkModified(struct ggml_tensor **tensors, int n_tensors);
+int ml_ContextModifiedSince(struct ggml_tensor *tensor, size_t version);
+size_t ml_ContextModifiedVersion();
+size_t ml_ContextUsedMem(ml_context_t *ctx);
+size_t ml_ContextMemSize(ml_context_t *ctx);
+// Hands a buffer from ml_AllocBuffer or ml_MapFile over to the context.
+void ml_ContextAddBuffer(ml_context_t *ctx, char *data, size_t mapped_size);
 
 GGML_TCL_CMD(ml_CreateContextCmd);
 GGML_TCL_CMD(ml_DestroyContextCmd);
+GGML_TCL_CMD(ml_ResetContextCmd);
+GGML_TCL_CMD(ml_ContextPoolFillCmd);
+GGML_TCL_CMD(ml_ContextPoolCheckoutCmd);
+GGML_TCL_CMD(ml_ContextPoolCheckinCmd);
+GGML_TCL_CMD(ml_ContextPoolSizeCmd);
 GGML_TCL_CMD(ml_LoadContextFromFileCmd);
 GGML_TCL_CMD(ml_UsedMemCmd);
 GGML_TCL_CMD(ml_GetMaxTensorSizeCmd);
@@ -0,0 +1,539 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "csv.h"
+#include "membuf.h"
+#include "tensor.h"
+
+// files smaller than this are parsed by the calling thread alone
+#define ML_CSV_MIN_CHUNK (1024 * 1024)
+
+typedef struct ml_csv_s {
+    const char *begin;                  // the rows, after the header
+    const char *end;
+    char separator;
+    const int *field_columns;           // output column of every field, -1 for skipped fields
+    int n_fields;
+    int n_columns;
+    enum ggml_type type;                // F32 or I32
+    double missing;                     // value of empty and absent fields
+    char **columns;                     // one output per column, or NULL
+    char *rows;                         // rows of n_columns values, or NULL
+} ml_csv_t;
+
+typedef struct ml_csv_worker_s {
+    const ml_csv_t *csv;
+    const char *begin;
+    const char *end;
+    int counting;                       // the first pass only counts the rows of the chunk
+    int64_t n_rows;
+    int64_t row0;                       // index of the first row of the chunk
+    int64_t error_row;                  // -1, or the first row that could not be parsed
+    int error_column;
+} ml_csv_worker_t;
+
+static const double ml_CsvPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a decimal number that spans the whole field. Up to 19 significant digits are kept and scaled
+// by an exact power of ten where possible, which is exact for the values written by common tools.
+static int ml_CsvParseNumber(const char *p, const char *end, double *value) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    size_t rest = end - p;
+    if ((rest == 3 && strncasecmp(p, "nan", 3) == 0)) {
+        *value = NAN;
+        return 1;
+    }
+    if ((rest == 3 && strncasecmp(p, "inf", 3) == 0) || (rest == 8 && strncasecmp(p, "infinity", 8) == 0)) {
+        *value = negative ? -INFINITY : INFINITY;
+        return 1;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    int any = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        any = 1;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa > 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            any = 1;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa > 0;
+                exponent--;
+            }
+        }
+    }
+    if (!any) {
+        return 0;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int exp_negative = 0;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p == '-';
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            return 0;
+        }
+        int exp_value = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (exp_value < 10000) {
+                exp_value = exp_value * 10 + (*p - '0');
+            }
+        }
+        exponent += exp_negative ? -exp_value : exp_value;
+    }
+    if (p != end) {
+        return 0;
+    }
+
+    double result = (double) mantissa;
+    if (exponent >= 0 && exponent <= 22) {
+        result *= ml_CsvPow10[exponent];
+    } else if (exponent < 0 && exponent >= -22) {
+        result /= ml_CsvPow10[-exponent];
+    } else if (mantissa != 0) {
+        result *= pow(10.0, exponent);
+    }
+    *value = negative ? -result : result;
+    return 1;
+}
+
+// Narrows a field to its contents without blanks and quotes.
+static void ml_CsvTrim(const char **begin, const char **end, char separator) {
+    const char *b = *begin;
+    const char *e = *end;
+    while (b < e && (*b == ' ' || (*b == '\t' && separator != '\t'))) {
+        b++;
+    }
+    while (e > b && (e[-1] == ' ' || e[-1] == '\r' || (e[-1] == '\t' && separator != '\t'))) {
+        e--;
+    }
+    if (e - b >= 2 && *b == '"' && e[-1] == '"') {
+        b++;
+        e--;
+    }
+    *begin = b;
+    *end = e;
+}
+
+// Finds the separator that ends a field, separators between double quotes are part of the field.
+// A doubled quote inside a quoted field toggles twice and so needs no special case.
+static const char *ml_CsvFieldEnd(const char *field, const char *line_end, char separator) {
+    int quoted = 0;
+    for (const char *p = field; p < line_end; p++) {
+        if (*p == '"') {
+            quoted = !quoted;
+        } else if (*p == separator && !quoted) {
+            return p;
+        }
+    }
+    return line_end;
+}
+
+static int ml_CsvIsBlank(const char *p, const char *end) {
+    for (; p < end; p++) {
+        if (*p != ' ' && *p != '\t' && *p != '\r') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Values that truncate to an int32, NaN and infinities do not.
+static int ml_CsvFitsI32(double value) {
+    return value > -2147483649.0 && value < 2147483648.0;
+}
+
+static void ml_CsvStore(const ml_csv_t *csv, int64_t row, int column, double value) {
+    char *dst = csv->columns != NULL
+                ? csv->columns[column] + row * 4
+                : csv->rows + (row * csv->n_columns + column) * 4;
+    if (csv->type == GGML_TYPE_F32) {
+        *(float *) dst = (float) value;
+    } else {
+        *(int32_t *) dst = (int32_t) value;
+    }
+}
+
+static void ml_CsvWork(void *arg) {
+    ml_csv_worker_t *worker = (ml_csv_worker_t *) arg;
+    const ml_csv_t *csv = worker->csv;
+    int64_t row = worker->row0;
+    int64_t n_rows = 0;
+    const char *line = worker->begin;
+    while (line < worker->end) {
+        const char *line_end = memchr(line, '\n', worker->end - line);
+        if (line_end == NULL) {
+            line_end = worker->end;
+        }
+        if (ml_CsvIsBlank(line, line_end)) {
+            line = line_end + 1;
+            continue;
+        }
+        n_rows++;
+        if (worker->counting) {
+            line = line_end + 1;
+            continue;
+        }
+
+        // columns that the line is too short for keep the missing value
+        for (int c = 0; c < csv->n_columns; c++) {
+            ml_CsvStore(csv, row, c, csv->missing);
+        }
+        const char *field = line;
+        for (int f = 0; f < csv->n_fields && field <= line_end; f++) {
+            const char *field_end = ml_CsvFieldEnd(field, line_end, csv->separator);
+            int column = csv->field_columns[f];
+            if (column >= 0) {
+                const char *b = field;
+                const char *e = field_end;
+                ml_CsvTrim(&b, &e, csv->separator);
+                double value;
+                if (b == e) {
+                    value = csv->missing;
+                } else if (!ml_CsvParseNumber(b, e, &value)
+                           || (csv->type == GGML_TYPE_I32 && !ml_CsvFitsI32(value))) {
+                    if (worker->error_row < 0) {
+                        worker->error_row = row;
+                        worker->error_column = column;
+                    }
+                    value = csv->missing;
+                }
+                ml_CsvStore(csv, row, column, value);
+            }
+            field = field_end + 1;
+        }
+        row++;
+        line = line_end + 1;
+    }
+    worker->n_rows = n_rows;
+}
+
+// Splits the first line into at most max fields, returns the number of fields.
+static int ml_CsvSplitLine(const char *line, const char *line_end, char separator, const char **fields,
+                           const char **field_ends, int max) {
+    int n = 0;
+    const char *field = line;
+    while (field <= line_end && n < max) {
+        const char *field_end = ml_CsvFieldEnd(field, line_end, separator);
+        fields[n] = field;
+        field_ends[n] = field_end;
+        ml_CsvTrim(&fields[n], &field_ends[n], separator);
+        n++;
+        field = field_end + 1;
+    }
+    return n;
+}
+
+int ml_LoadCsvCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LoadCsvCmd\n"));
+
+    static const char *options[] = {"-separator", "-header", "-columns", "-type", "-split", "-missing", "-nthreads", NULL};
+    enum options {
+        OPT_SEPARATOR, OPT_HEADER, OPT_COLUMNS, OPT_TYPE, OPT_SPLIT, OPT_MISSING, OPT_NTHREADS
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle path ?-separator char? ?-header boolean? ?-columns list? ?-type F32|I32? ?-split boolean? ?-missing value? ?-nthreads n?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+    const char *path = Tcl_GetString(objv[2]);
+    size_t path_len = strlen(path);
+
+    // tab separated files are recognized by their extension
+    char separator = path_len > 4 && strcmp(path + path_len - 4, ".tsv") == 0 ? '\t' : ',';
+    int header = 0;
+    Tcl_Obj *columns_ptr = NULL;
+    enum ggml_type type = GGML_TYPE_F32;
+    int split = 0;
+    double missing = NAN;
+    int missing_given = 0;
+    int nthreads = 4;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_SEPARATOR: {
+                int len;
+                const char *value = Tcl_GetStringFromObj(objv[i + 1], &len);
+                if (len != 1 || value[0] == '\n' || value[0] == '"') {
+                    SetResult("separator is not a single character");
+                    return TCL_ERROR;
+                }
+                separator = value[0];
+                break;
+            }
+            case OPT_HEADER:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &header)) {
+                    SetResult("header is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_COLUMNS:
+                columns_ptr = objv[i + 1];
+                break;
+            case OPT_TYPE:
+                if (TCL_OK != ml_GetTypeFromObj(interp, objv[i + 1], &type)) {
+                    return TCL_ERROR;
+                }
+                if (type != GGML_TYPE_F32 && type != GGML_TYPE_I32) {
+                    SetResult("type must be F32 or I32");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_SPLIT:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &split)) {
+                    SetResult("split is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_MISSING:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &missing)) {
+                    SetResult("missing is not a number");
+                    return TCL_ERROR;
+                }
+                missing_given = 1;
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    if (type == GGML_TYPE_I32 && !missing_given) {
+        missing = 0.0;
+    }
+    if (type == GGML_TYPE_I32 && !ml_CsvFitsI32(missing)) {
+        SetResult("missing is not a valid I32 value");
+        return TCL_ERROR;
+    }
+
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(path, &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    const char *end = buffer + size;
+    const char *first = buffer;
+    // a byte order mark is not part of the first field
+    if (size >= 3 && memcmp(first, "\xef\xbb\xbf", 3) == 0) {
+        first += 3;
+    }
+    while (first < end) {
+        const char *line_end = memchr(first, '\n', end - first);
+        if (!ml_CsvIsBlank(first, line_end != NULL ? line_end : end)) {
+            break;
+        }
+        first = line_end != NULL ? line_end + 1 : end;
+    }
+    const char *first_end = first < end ? memchr(first, '\n', end - first) : NULL;
+    if (first_end == NULL) {
+        first_end = end;
+    }
+
+    // the fields of the first line give the width of the table and, with a header, the column names
+    int n_fields = 0;
+    for (const char *p = first; p <= first_end; p = ml_CsvFieldEnd(p, first_end, separator) + 1) {
+        n_fields++;
+    }
+    const char **names = (const char **) Tcl_Alloc(sizeof(char *) * n_fields);
+    const char **name_ends = (const char **) Tcl_Alloc(sizeof(char *) * n_fields);
+    ml_CsvSplitLine(first, first_end, separator, names, name_ends, n_fields);
+
+    int *field_columns = (int *) Tcl_Alloc(sizeof(int) * n_fields);
+    int n_columns = 0;
+    int rc = TCL_OK;
+    if (columns_ptr == NULL) {
+        for (int f = 0; f < n_fields; f++) {
+            field_columns[f] = n_columns++;
+        }
+    } else {
+        Tcl_Obj **column_objs;
+        int n_column_objs;
+        for (int f = 0; f < n_fields; f++) {
+            field_columns[f] = -1;
+        }
+        if (TCL_OK != Tcl_ListObjGetElements(interp, columns_ptr, &n_column_objs, &column_objs) || n_column_objs == 0) {
+            errmsg = "columns is not a non-empty list";
+            rc = TCL_ERROR;
+        }
+        // columns are given by index, or by name when there is a header
+        for (int c = 0; rc == TCL_OK && c < n_column_objs; c++) {
+            int field = -1;
+            if (TCL_OK != Tcl_GetIntFromObj(NULL, column_objs[c], &field)) {
+                int len;
+                const char *name = Tcl_GetStringFromObj(column_objs[c], &len);
+                for (int f = 0; header && f < n_fields; f++) {
+                    if (name_ends[f] - names[f] == len && strncmp(names[f], name, len) == 0) {
+                        field = f;
+                        break;
+                    }
+                }
+            }
+            if (field < 0 || field >= n_fields) {
+                errmsg = "column not found";
+                rc = TCL_ERROR;
+            } else if (field_columns[field] >= 0) {
+                errmsg = "column given twice";
+                rc = TCL_ERROR;
+            } else {
+                field_columns[field] = c;
+            }
+        }
+        n_columns = n_column_objs;
+    }
+    Tcl_Free((char *) name_ends);
+    Tcl_Free((char *) names);
+
+    ml_csv_t csv = {
+            .begin = header ? (first_end < end ? first_end + 1 : end) : first,
+            .end = end,
+            .separator = separator,
+            .field_columns = field_columns,
+            .n_fields = n_fields,
+            .n_columns = n_columns,
+            .type = type,
+            .missing = missing,
+            .columns = NULL,
+            .rows = NULL,
+    };
+
+    // chunks start after a newline, so that every row is parsed by exactly one worker
+    size_t data_size = csv.end - csv.begin;
+    int n_workers = (int) (data_size / ML_CSV_MIN_CHUNK) + 1;
+    if (n_workers > nthreads) {
+        n_workers = nthreads;
+    }
+    ml_csv_worker_t *workers = (ml_csv_worker_t *) Tcl_Alloc(sizeof(ml_csv_worker_t) * n_workers);
+    const char *chunk = csv.begin;
+    for (int t = 0; t < n_workers; t++) {
+        const char *chunk_end = t == n_workers - 1 ? csv.end : csv.begin + data_size * (t + 1) / n_workers;
+        if (chunk_end < chunk) {
+            chunk_end = chunk;
+        }
+        if (chunk_end < csv.end) {
+            const char *newline = memchr(chunk_end, '\n', csv.end - chunk_end);
+            chunk_end = newline != NULL ? newline + 1 : csv.end;
+        }
+        workers[t].csv = &csv;
+        workers[t].begin = chunk;
+        workers[t].end = chunk_end;
+        workers[t].counting = 1;
+        workers[t].error_row = -1;
+        workers[t].error_column = -1;
+        chunk = chunk_end;
+    }
+
+    Tcl_Obj *result_ptr = NULL;
+    if (rc == TCL_OK) {
+        ml_RunWorkers(ml_CsvWork, workers, sizeof(ml_csv_worker_t), n_workers);
+        int64_t n_rows = 0;
+        for (int t = 0; t < n_workers; t++) {
+            workers[t].row0 = n_rows;
+            workers[t].counting = 0;
+            n_rows += workers[t].n_rows;
+        }
+        if (n_rows == 0) {
+            errmsg = "file has no rows";
+            rc = TCL_ERROR;
+        }
+
+        if (rc == TCL_OK && split) {
+            result_ptr = Tcl_NewListObj(0, NULL);
+            csv.columns = (char **) Tcl_Alloc(sizeof(char *) * n_columns);
+            for (int c = 0; c < n_columns; c++) {
+                struct ggml_tensor *tensor = ggml_new_tensor_1d(ctx->ggml_ctx, type, n_rows);
+                ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+                csv.columns[c] = (char *) tensor->data;
+                Tcl_ListObjAppendElement(interp, result_ptr, Tcl_NewStringObj(tensor_ptr->handle, -1));
+            }
+        } else if (rc == TCL_OK) {
+            struct ggml_tensor *tensor = ggml_new_tensor_2d(ctx->ggml_ctx, type, n_columns, n_rows);
+            ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+            csv.rows = (char *) tensor->data;
+            result_ptr = Tcl_NewStringObj(tensor_ptr->handle, -1);
+        }
+    }
+    if (rc == TCL_OK) {
+        ml_RunWorkers(ml_CsvWork, workers, sizeof(ml_csv_worker_t), n_workers);
+        for (int t = 0; t < n_workers; t++) {
+            if (workers[t].error_row >= 0) {
+                // the tensors are left in the context, only their handles are removed
+                Tcl_Obj **handle_objs;
+                int n_handles;
+                Tcl_ListObjGetElements(NULL, result_ptr, &n_handles, &handle_objs);
+                for (int h = 0; h < n_handles; h++) {
+                    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(handle_objs[h]));
+                    if (tensor_ptr != NULL) {
+                        ml_DestroyTensorHandle(tensor_ptr);
+                    }
+                }
+                Tcl_DecrRefCount(result_ptr);
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not parse the value of column %d in row %lld",
+                                                       workers[t].error_column, (long long) workers[t].error_row));
+                rc = TCL_ERROR;
+                errmsg = NULL;
+                break;
+            }
+        }
+    }
+
+    if (csv.columns != NULL) {
+        Tcl_Free((char *) csv.columns);
+    }
+    Tcl_Free((char *) workers);
+    Tcl_Free((char *) field_columns);
+    ml_FreeBuffer(buffer, mapped_size);
+    if (rc != TCL_OK) {
+        if (errmsg != NULL) {
+            SetResult(errmsg);
+        }
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, result_ptr);
+    return TCL_OK;
+}
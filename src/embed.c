@@ -0,0 +1,610 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "embed.h"
+#include "tensor.h"
+
+static Tcl_HashTable ml_EmbedderToInternal_HT;
+static Tcl_Mutex ml_EmbedderToInternal_HT_Mutex;
+
+void ml_InitEmbedderHT() {
+    Tcl_MutexLock(&ml_EmbedderToInternal_HT_Mutex);
+    Tcl_InitHashTable(&ml_EmbedderToInternal_HT, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&ml_EmbedderToInternal_HT_Mutex);
+}
+
+void ml_DeleteEmbedderHT() {
+    Tcl_MutexLock(&ml_EmbedderToInternal_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_EmbedderToInternal_HT);
+    Tcl_MutexUnlock(&ml_EmbedderToInternal_HT_Mutex);
+}
+
+static int ml_RegisterEmbedder(const char *name, ml_embedder_t *internal) {
+    Tcl_HashEntry *entryPtr;
+    int newEntry;
+    Tcl_MutexLock(&ml_EmbedderToInternal_HT_Mutex);
+    entryPtr = Tcl_CreateHashEntry(&ml_EmbedderToInternal_HT, (char *) name, &newEntry);
+    if (newEntry) {
+        Tcl_SetHashValue(entryPtr, (ClientData) internal);
+    }
+    Tcl_MutexUnlock(&ml_EmbedderToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> RegisterEmbedder: name=%s internal=%p %s\n", name, internal,
+                newEntry ? "entered into" : "already in"));
+
+    return newEntry;
+}
+
+static int ml_UnregisterEmbedder(const char *name) {
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_EmbedderToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_EmbedderToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_EmbedderToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> UnregisterEmbedder: name=%s entryPtr=%p\n", name, entryPtr));
+
+    return entryPtr != NULL;
+}
+
+static ml_embedder_t *ml_GetInternalFromEmbedder(const char *name) {
+    ml_embedder_t *internal = NULL;
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_EmbedderToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_EmbedderToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        internal = (ml_embedder_t *) Tcl_GetHashValue(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_EmbedderToInternal_HT_Mutex);
+
+    return internal;
+}
+
+// FNV-1a over the token ids.
+static uint64_t ml_EmbedHash(const int32_t *tokens, int n_tokens) {
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char *) tokens;
+    for (size_t i = 0; i < sizeof(int32_t) * n_tokens; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void ml_EmbedUnlinkEntry(ml_embedder_t *embedder, ml_embed_entry_t *entry) {
+    if (entry->prev_lru_ptr != NULL) {
+        entry->prev_lru_ptr->next_lru_ptr = entry->next_lru_ptr;
+    } else {
+        embedder->first_lru_ptr = entry->next_lru_ptr;
+    }
+    if (entry->next_lru_ptr != NULL) {
+        entry->next_lru_ptr->prev_lru_ptr = entry->prev_lru_ptr;
+    } else {
+        embedder->last_lru_ptr = entry->prev_lru_ptr;
+    }
+    entry->prev_lru_ptr = NULL;
+    entry->next_lru_ptr = NULL;
+}
+
+static void ml_EmbedPushEntry(ml_embedder_t *embedder, ml_embed_entry_t *entry) {
+    entry->next_lru_ptr = embedder->first_lru_ptr;
+    if (embedder->first_lru_ptr != NULL) {
+        embedder->first_lru_ptr->prev_lru_ptr = entry;
+    } else {
+        embedder->last_lru_ptr = entry;
+    }
+    embedder->first_lru_ptr = entry;
+}
+
+static void ml_EmbedDeleteEntry(ml_embedder_t *embedder, ml_embed_entry_t *entry) {
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&embedder->cache, (char *) (uintptr_t) entry->hash);
+    if (entryPtr != NULL) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    ml_EmbedUnlinkEntry(embedder, entry);
+    embedder->n_cached--;
+    Tcl_Free((char *) entry->tokens);
+    Tcl_Free((char *) entry->embd);
+    Tcl_Free((char *) entry);
+}
+
+static ml_embed_entry_t *ml_EmbedLookup(ml_embedder_t *embedder, uint64_t hash, const ml_token_buffer_t *input) {
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&embedder->cache, (char *) (uintptr_t) hash);
+    if (entryPtr == NULL) {
+        return NULL;
+    }
+    ml_embed_entry_t *entry = (ml_embed_entry_t *) Tcl_GetHashValue(entryPtr);
+    if (entry->n_tokens != input->size || memcmp(entry->tokens, input->data, sizeof(int32_t) * input->size) != 0) {
+        return NULL;
+    }
+    ml_EmbedUnlinkEntry(embedder, entry);
+    ml_EmbedPushEntry(embedder, entry);
+    return entry;
+}
+
+static void ml_EmbedInsert(ml_embedder_t *embedder, uint64_t hash, const ml_token_buffer_t *input, const float *embd) {
+    const int n_embd = embedder->llama->hparams.n_embd;
+    int newEntry;
+    Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&embedder->cache, (char *) (uintptr_t) hash, &newEntry);
+    if (!newEntry) {
+        // a colliding input keeps its place
+        return;
+    }
+    ml_embed_entry_t *entry = (ml_embed_entry_t *) Tcl_Alloc(sizeof(ml_embed_entry_t));
+    memset(entry, 0, sizeof(ml_embed_entry_t));
+    entry->hash = hash;
+    entry->n_tokens = input->size;
+    entry->tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * input->size);
+    memcpy(entry->tokens, input->data, sizeof(int32_t) * input->size);
+    entry->embd = (float *) Tcl_Alloc(sizeof(float) * n_embd);
+    memcpy(entry->embd, embd, sizeof(float) * n_embd);
+    Tcl_SetHashValue(entryPtr, (ClientData) entry);
+    ml_EmbedPushEntry(embedder, entry);
+    embedder->n_cached++;
+    while (embedder->n_cached > embedder->cache_size) {
+        ml_EmbedDeleteEntry(embedder, embedder->last_lru_ptr);
+    }
+}
+
+static void ml_EmbedFinalize(ml_embedder_t *embedder, float *embd, int n_tokens) {
+    const int n_embd = embedder->llama->hparams.n_embd;
+    if (embedder->pooling == ML_POOLING_MEAN) {
+        for (int d = 0; d < n_embd; d++) {
+            embd[d] /= (float) n_tokens;
+        }
+    }
+    if (embedder->normalize) {
+        double sum = 0.0;
+        for (int d = 0; d < n_embd; d++) {
+            sum += (double) embd[d] * embd[d];
+        }
+        if (sum > 0.0) {
+            float scale = (float) (1.0 / sqrt(sum));
+            for (int d = 0; d < n_embd; d++) {
+                embd[d] *= scale;
+            }
+        }
+    }
+}
+
+int ml_EmbedderRun(ml_embedder_t *embedder, ml_token_buffer_t *inputs, int n_inputs, float *out, const char **errmsg) {
+    ml_llama_t *llama = embedder->llama;
+    const int n_embd = llama->hparams.n_embd;
+    const int n_seq = llama->n_seq;
+
+    for (int i = 0; i < n_inputs; i++) {
+        if (inputs[i].size == 0) {
+            *errmsg = "input has no tokens";
+            return TCL_ERROR;
+        }
+        if (inputs[i].size > llama->n_ctx) {
+            *errmsg = "input does not fit in the context";
+            return TCL_ERROR;
+        }
+        for (int j = 0; j < inputs[i].size; j++) {
+            if (inputs[i].data[j] < 0 || inputs[i].data[j] >= llama->hparams.n_vocab) {
+                *errmsg = "token out of range";
+                return TCL_ERROR;
+            }
+        }
+    }
+
+    // cached inputs are copied, repeated inputs are computed once
+    uint64_t *hashes = (uint64_t *) Tcl_Alloc(sizeof(uint64_t) * n_inputs);
+    int *first = (int *) Tcl_Alloc(sizeof(int) * n_inputs);
+    int *todo = (int *) Tcl_Alloc(sizeof(int) * n_inputs);
+    int n_todo = 0;
+    Tcl_HashTable seen;
+    Tcl_InitHashTable(&seen, TCL_ONE_WORD_KEYS);
+    for (int i = 0; i < n_inputs; i++) {
+        hashes[i] = ml_EmbedHash(inputs[i].data, inputs[i].size);
+        first[i] = i;
+        ml_embed_entry_t *entry = embedder->cache_size > 0 ? ml_EmbedLookup(embedder, hashes[i], &inputs[i]) : NULL;
+        if (entry != NULL) {
+            memcpy(out + (size_t) i * n_embd, entry->embd, sizeof(float) * n_embd);
+            embedder->n_hits++;
+            continue;
+        }
+        int newEntry;
+        Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&seen, (char *) (uintptr_t) hashes[i], &newEntry);
+        if (!newEntry) {
+            int j = (int) (intptr_t) Tcl_GetHashValue(entryPtr);
+            if (inputs[j].size == inputs[i].size
+                && memcmp(inputs[j].data, inputs[i].data, sizeof(int32_t) * inputs[i].size) == 0) {
+                first[i] = j;
+                embedder->n_hits++;
+                continue;
+            }
+        } else {
+            Tcl_SetHashValue(entryPtr, (ClientData) (intptr_t) i);
+        }
+        memset(out + (size_t) i * n_embd, 0, sizeof(float) * n_embd);
+        todo[n_todo++] = i;
+        embedder->n_misses++;
+    }
+    Tcl_DeleteHashTable(&seen);
+
+    // inputs are packed into the batch back to back, each in its own kv cache slot, and long
+    // ones carry over to the next batch
+    int32_t *batch_tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * llama->n_batch);
+    float *hidden = (float *) Tcl_Alloc(sizeof(float) * n_embd * llama->n_batch);
+    ml_llama_segment_t *segments = (ml_llama_segment_t *) Tcl_Alloc(sizeof(ml_llama_segment_t) * n_seq);
+    int *slot_input = (int *) Tcl_Alloc(sizeof(int) * n_seq);
+    int *slot_past = (int *) Tcl_Alloc(sizeof(int) * n_seq);
+    for (int s = 0; s < n_seq; s++) {
+        slot_input[s] = -1;
+    }
+    int next_todo = 0;
+    int n_done = 0;
+    int rc = TCL_OK;
+    while (n_done < n_todo) {
+        int n_segments = 0;
+        int n_tokens = 0;
+        for (int s = 0; s < n_seq && n_tokens < llama->n_batch; s++) {
+            if (slot_input[s] < 0) {
+                if (next_todo == n_todo) {
+                    continue;
+                }
+                slot_input[s] = todo[next_todo++];
+                slot_past[s] = 0;
+            }
+            const ml_token_buffer_t *input = &inputs[slot_input[s]];
+            int n_take = input->size - slot_past[s];
+            if (n_take > llama->n_batch - n_tokens) {
+                n_take = llama->n_batch - n_tokens;
+            }
+            memcpy(batch_tokens + n_tokens, input->data + slot_past[s], sizeof(int32_t) * n_take);
+            segments[n_segments].seq = s;
+            segments[n_segments].n_past = slot_past[s];
+            segments[n_segments].n_tokens = n_take;
+            n_segments++;
+            n_tokens += n_take;
+        }
+
+        if (TCL_OK != ml_LlamaEmbedSegments(llama, batch_tokens, segments, n_segments, hidden, errmsg)) {
+            rc = TCL_ERROR;
+            break;
+        }
+        embedder->n_tokens += n_tokens;
+
+        const float *row = hidden;
+        for (int k = 0; k < n_segments; k++) {
+            const int s = segments[k].seq;
+            const int i = slot_input[s];
+            const int n_seg = segments[k].n_tokens;
+            float *embd = out + (size_t) i * n_embd;
+            switch (embedder->pooling) {
+                case ML_POOLING_MEAN:
+                    for (int j = 0; j < n_seg; j++) {
+                        for (int d = 0; d < n_embd; d++) {
+                            embd[d] += row[(size_t) j * n_embd + d];
+                        }
+                    }
+                    break;
+                case ML_POOLING_CLS:
+                    if (segments[k].n_past == 0) {
+                        memcpy(embd, row, sizeof(float) * n_embd);
+                    }
+                    break;
+                case ML_POOLING_LAST:
+                    memcpy(embd, row + (size_t) (n_seg - 1) * n_embd, sizeof(float) * n_embd);
+                    break;
+            }
+            row += (size_t) n_seg * n_embd;
+
+            slot_past[s] += n_seg;
+            if (slot_past[s] == inputs[i].size) {
+                ml_EmbedFinalize(embedder, embd, inputs[i].size);
+                if (embedder->cache_size > 0) {
+                    ml_EmbedInsert(embedder, hashes[i], &inputs[i], embd);
+                }
+                slot_input[s] = -1;
+                n_done++;
+            }
+        }
+    }
+
+    if (rc == TCL_OK) {
+        for (int i = 0; i < n_inputs; i++) {
+            if (first[i] != i) {
+                memcpy(out + (size_t) i * n_embd, out + (size_t) first[i] * n_embd, sizeof(float) * n_embd);
+            }
+        }
+    }
+
+    Tcl_Free((char *) slot_past);
+    Tcl_Free((char *) slot_input);
+    Tcl_Free((char *) segments);
+    Tcl_Free((char *) hidden);
+    Tcl_Free((char *) batch_tokens);
+    Tcl_Free((char *) todo);
+    Tcl_Free((char *) first);
+    Tcl_Free((char *) hashes);
+    return rc;
+}
+
+int ml_EmbedderCreateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "EmbedderCreateCmd\n"));
+
+    static const char *options[] = {"-n_ctx", "-n_seq", "-n_batch", "-nthreads", "-pooling", "-normalize", "-cache_size", NULL};
+    enum options {
+        OPT_N_CTX, OPT_N_SEQ, OPT_N_BATCH, OPT_NTHREADS, OPT_POOLING, OPT_NORMALIZE, OPT_CACHE_SIZE
+    };
+    static const char *poolings[] = {"mean", "cls", "last", NULL};
+
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle ?-n_ctx n? ?-n_seq n? ?-n_batch n? ?-nthreads n? ?-pooling mean|cls|last? ?-normalize boolean? ?-cache_size n?");
+        return TCL_ERROR;
+    }
+
+    const char *context_handle = Tcl_GetString(objv[1]);
+    ml_context_t *model_ctx = ml_GetInternalFromContext(context_handle);
+    if (!model_ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+
+    int n_ctx = 512;
+    int n_seq = 8;
+    int n_batch = 512;
+    int nthreads = 4;
+    int pooling = ML_POOLING_MEAN;
+    int normalize = 1;
+    int cache_size = 0;
+    for (int i = 2; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_N_CTX:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_ctx) || n_ctx <= 0) {
+                    SetResult("n_ctx is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_SEQ:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_seq) || n_seq <= 0) {
+                    SetResult("n_seq is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_BATCH:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_batch) || n_batch <= 0) {
+                    SetResult("n_batch is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_POOLING:
+                if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i + 1], poolings, "pooling", 0, &pooling)) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NORMALIZE:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &normalize)) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_CACHE_SIZE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &cache_size) || cache_size < 0) {
+                    SetResult("cache_size is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    const char *errmsg = NULL;
+    ml_llama_t *llama = ml_LlamaNew(model_ctx, n_ctx, n_seq, n_batch, nthreads, GGML_TYPE_F16, 0, 0, &errmsg);
+    if (llama == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ml_embedder_t *embedder = (ml_embedder_t *) Tcl_Alloc(sizeof(ml_embedder_t));
+    memset(embedder, 0, sizeof(ml_embedder_t));
+    embedder->llama = llama;
+    embedder->pooling = (ml_pooling_t) pooling;
+    embedder->normalize = normalize;
+    embedder->cache_size = cache_size;
+    Tcl_InitHashTable(&embedder->cache, TCL_ONE_WORD_KEYS);
+
+    CMD_EMBEDDER_NAME(embedder->handle, embedder);
+    ml_RegisterEmbedder(embedder->handle, embedder);
+
+    SetResult(embedder->handle);
+    return TCL_OK;
+}
+
+int ml_EmbedderDestroyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "EmbedderDestroyCmd\n"));
+    CheckArgs(2, 2, 1, "embedder_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_embedder_t *embedder = ml_GetInternalFromEmbedder(handle);
+    if (!embedder) {
+        SetResult("embedder handle not found");
+        return TCL_ERROR;
+    }
+    if (!ml_UnregisterEmbedder(handle)) {
+        SetResult("unregister embedder name failed");
+        return TCL_ERROR;
+    }
+
+    while (embedder->first_lru_ptr != NULL) {
+        ml_EmbedDeleteEntry(embedder, embedder->first_lru_ptr);
+    }
+    Tcl_DeleteHashTable(&embedder->cache);
+    int rc = ml_LlamaFree(interp, embedder->llama);
+    Tcl_Free((char *) embedder);
+    return rc;
+}
+
+int ml_EmbedCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "EmbedCmd\n"));
+
+    static const char *options[] = {"-tokenizer", "-add_bos", NULL};
+    enum options {
+        OPT_TOKENIZER, OPT_ADD_BOS
+    };
+
+    if (objc < 4 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "embedder_handle context_handle inputs ?-tokenizer tokenizer_handle? ?-add_bos boolean?");
+        return TCL_ERROR;
+    }
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_embedder_t *embedder = ml_GetInternalFromEmbedder(handle);
+    if (!embedder) {
+        SetResult("embedder handle not found");
+        return TCL_ERROR;
+    }
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[2]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+
+    ml_tokenizer_t *tokenizer = NULL;
+    int add_bos = -1;
+    for (int i = 4; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_TOKENIZER:
+                tokenizer = ml_GetInternalFromTokenizer(Tcl_GetString(objv[i + 1]));
+                if (!tokenizer) {
+                    SetResult("tokenizer handle not found");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_ADD_BOS:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &add_bos)) {
+                    SetResult("add_bos is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    Tcl_Obj **input_objs;
+    int n_inputs;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objv[3], &n_inputs, &input_objs) || n_inputs == 0) {
+        SetResult("inputs is not a non-empty list");
+        return TCL_ERROR;
+    }
+
+    // texts with a tokenizer, lists of token ids otherwise
+    ml_token_buffer_t *inputs = (ml_token_buffer_t *) Tcl_Alloc(sizeof(ml_token_buffer_t) * n_inputs);
+    memset(inputs, 0, sizeof(ml_token_buffer_t) * n_inputs);
+    int rc = TCL_OK;
+    for (int i = 0; i < n_inputs && rc == TCL_OK; i++) {
+        if (tokenizer != NULL) {
+            int length;
+            const char *text = Tcl_GetStringFromObj(input_objs[i], &length);
+            ml_TokenizerEncode(tokenizer, text, length, add_bos >= 0 ? add_bos : tokenizer->add_bos, &inputs[i]);
+            continue;
+        }
+        Tcl_Obj **token_objs;
+        int n_tokens;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, input_objs[i], &n_tokens, &token_objs)) {
+            SetResult("input is not a list of tokens");
+            rc = TCL_ERROR;
+            break;
+        }
+        inputs[i].data = (int32_t *) Tcl_Alloc(sizeof(int32_t) * (n_tokens > 0 ? n_tokens : 1));
+        inputs[i].capacity = n_tokens > 0 ? n_tokens : 1;
+        for (int j = 0; j < n_tokens; j++) {
+            int token;
+            if (TCL_OK != Tcl_GetIntFromObj(interp, token_objs[j], &token)) {
+                SetResult("token is not an integer");
+                rc = TCL_ERROR;
+                break;
+            }
+            inputs[i].data[inputs[i].size++] = token;
+        }
+    }
+
+    const int n_embd = embedder->llama->hparams.n_embd;
+    float *out = NULL;
+    if (rc == TCL_OK) {
+        out = (float *) Tcl_Alloc(sizeof(float) * n_embd * n_inputs);
+        const char *errmsg = NULL;
+        if (TCL_OK != ml_EmbedderRun(embedder, inputs, n_inputs, out, &errmsg)) {
+            SetResult(errmsg);
+            rc = TCL_ERROR;
+        }
+    }
+    for (int i = 0; i < n_inputs; i++) {
+        ml_TokenBufferFree(&inputs[i]);
+    }
+    Tcl_Free((char *) inputs);
+    if (rc != TCL_OK) {
+        if (out != NULL) {
+            Tcl_Free((char *) out);
+        }
+        return TCL_ERROR;
+    }
+
+    // one row of n_embd values per input
+    struct ggml_tensor *tensor = ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_F32, n_embd, n_inputs);
+    ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+    memcpy(tensor->data, out, sizeof(float) * n_embd * n_inputs);
+    Tcl_Free((char *) out);
+
+    SetResult(tensor_ptr->handle);
+    return TCL_OK;
+}
+
+int ml_EmbedderInfoCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "EmbedderInfoCmd\n"));
+    CheckArgs(2, 2, 1, "embedder_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_embedder_t *embedder = ml_GetInternalFromEmbedder(handle);
+    if (!embedder) {
+        SetResult("embedder handle not found");
+        return TCL_ERROR;
+    }
+
+    static const char *poolings[] = {"mean", "cls", "last"};
+    ml_llama_t *llama = embedder->llama;
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_embd", -1), Tcl_NewIntObj(llama->hparams.n_embd));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_ctx", -1), Tcl_NewIntObj(llama->n_ctx));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_seq", -1), Tcl_NewIntObj(llama->n_seq));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_batch", -1), Tcl_NewIntObj(llama->n_batch));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("pooling", -1), Tcl_NewStringObj(poolings[embedder->pooling], -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("normalize", -1), Tcl_NewBooleanObj(embedder->normalize));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("cache_size", -1), Tcl_NewIntObj(embedder->cache_size));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("cached", -1), Tcl_NewIntObj(embedder->n_cached));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("hits", -1), Tcl_NewWideIntObj(embedder->n_hits));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("misses", -1), Tcl_NewWideIntObj(embedder->n_misses));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("tokens", -1), Tcl_NewWideIntObj(embedder->n_tokens));
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
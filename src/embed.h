@@ -0,0 +1,57 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_EMBED_H
+#define GGML_TCL_EMBED_H
+
+#include "common.h"
+#include "llama.h"
+#include "tokenizer.h"
+
+#define CMD_EMBEDDER_NAME(s, internal) sprintf((s), "_GGML_EMBED_%p", (internal))
+
+typedef enum {
+    ML_POOLING_MEAN,
+    ML_POOLING_CLS,                     // the hidden state of the first token
+    ML_POOLING_LAST                     // the hidden state of the last token, the only one that saw all others
+} ml_pooling_t;
+
+// A recent embedding, keyed by a hash of its tokens.
+typedef struct ml_embed_entry_s {
+    uint64_t hash;
+    int32_t *tokens;
+    int n_tokens;
+    float *embd;
+    struct ml_embed_entry_s *prev_lru_ptr;
+    struct ml_embed_entry_s *next_lru_ptr;
+} ml_embed_entry_t;
+
+typedef struct ml_embedder_s {
+    ml_llama_t *llama;                  // one kv cache slot per input evaluated at the same time
+    ml_pooling_t pooling;
+    int normalize;
+    int cache_size;                     // entries kept, 0 disables the cache
+    Tcl_HashTable cache;                // hash -> ml_embed_entry_t
+    ml_embed_entry_t *first_lru_ptr;    // most recently used
+    ml_embed_entry_t *last_lru_ptr;
+    int n_cached;
+    Tcl_WideInt n_hits;
+    Tcl_WideInt n_misses;
+    Tcl_WideInt n_tokens;               // tokens evaluated
+    char handle[40];
+} ml_embedder_t;
+
+void ml_InitEmbedderHT();
+void ml_DeleteEmbedderHT();
+
+// Writes the pooled embedding of each input, n_embd floats per input, to out.
+int ml_EmbedderRun(ml_embedder_t *embedder, ml_token_buffer_t *inputs, int n_inputs, float *out, const char **errmsg);
+
+GGML_TCL_CMD(ml_EmbedderCreateCmd);
+GGML_TCL_CMD(ml_EmbedderDestroyCmd);
+GGML_TCL_CMD(ml_EmbedCmd);
+GGML_TCL_CMD(ml_EmbedderInfoCmd);
+
+#endif //GGML_TCL_EMBED_H
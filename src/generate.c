@@ -0,0 +1,583 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "generate.h"
+
+typedef enum {
+    ML_GENERATE_EVENT_TOKEN,
+    ML_GENERATE_EVENT_DONE
+} ml_generate_event_type_t;
+
+typedef struct ml_generate_event_s {
+    Tcl_Event header;
+    ml_generate_t *gen;
+    ml_generate_event_type_t type;
+    int32_t token;
+    char *text;                         // Tcl_Alloc'd, NULL without a tokenizer
+    int text_length;
+    const char *reason;
+    const char *errmsg;
+} ml_generate_event_t;
+
+static Tcl_HashTable ml_GenerateToInternal_HT;
+static Tcl_Mutex ml_GenerateToInternal_HT_Mutex;
+
+void ml_InitGenerateHT() {
+    Tcl_MutexLock(&ml_GenerateToInternal_HT_Mutex);
+    Tcl_InitHashTable(&ml_GenerateToInternal_HT, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&ml_GenerateToInternal_HT_Mutex);
+}
+
+void ml_DeleteGenerateHT() {
+    Tcl_MutexLock(&ml_GenerateToInternal_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_GenerateToInternal_HT);
+    Tcl_MutexUnlock(&ml_GenerateToInternal_HT_Mutex);
+}
+
+static int ml_RegisterGenerate(const char *name, ml_generate_t *internal) {
+    Tcl_HashEntry *entryPtr;
+    int newEntry;
+    Tcl_MutexLock(&ml_GenerateToInternal_HT_Mutex);
+    entryPtr = Tcl_CreateHashEntry(&ml_GenerateToInternal_HT, (char *) name, &newEntry);
+    if (newEntry) {
+        Tcl_SetHashValue(entryPtr, (ClientData) internal);
+    }
+    Tcl_MutexUnlock(&ml_GenerateToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> RegisterGenerate: name=%s internal=%p %s\n", name, internal,
+                newEntry ? "entered into" : "already in"));
+
+    return newEntry;
+}
+
+static int ml_UnregisterGenerate(const char *name) {
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_GenerateToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_GenerateToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_GenerateToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> UnregisterGenerate: name=%s entryPtr=%p\n", name, entryPtr));
+
+    return entryPtr != NULL;
+}
+
+static ml_generate_t *ml_GetInternalFromGenerate(const char *name) {
+    ml_generate_t *internal = NULL;
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_GenerateToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_GenerateToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        internal = (ml_generate_t *) Tcl_GetHashValue(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_GenerateToInternal_HT_Mutex);
+
+    return internal;
+}
+
+static void ml_FreeGenerate(ml_generate_t *gen) {
+    Tcl_DecrRefCount(gen->callback);
+    Tcl_Release(gen->interp);
+    if (gen->tokens != NULL) {
+        Tcl_Free((char *) gen->tokens);
+    }
+    if (gen->stop_tokens != NULL) {
+        Tcl_Free((char *) gen->stop_tokens);
+    }
+    Tcl_DStringFree(&gen->text);
+    Tcl_ConditionFinalize(&gen->cond);
+    Tcl_MutexFinalize(&gen->mutex);
+    Tcl_Free((char *) gen);
+}
+
+// Invokes the callback with the event name and a dict, errors are reported as background errors.
+static void ml_GenerateInvokeCallback(ml_generate_t *gen, const char *event_name, Tcl_Obj *dict_ptr) {
+    Tcl_Interp *interp = gen->interp;
+    if (Tcl_InterpDeleted(interp)) {
+        Tcl_DecrRefCount(dict_ptr);
+        return;
+    }
+    Tcl_Obj *cmd_ptr = Tcl_DuplicateObj(gen->callback);
+    Tcl_IncrRefCount(cmd_ptr);
+    Tcl_ListObjAppendElement(interp, cmd_ptr, Tcl_NewStringObj(event_name, -1));
+    Tcl_ListObjAppendElement(interp, cmd_ptr, dict_ptr);
+    Tcl_Preserve(interp);
+    int rc = Tcl_EvalObjEx(interp, cmd_ptr, TCL_EVAL_GLOBAL);
+    if (rc != TCL_OK) {
+        Tcl_BackgroundException(interp, rc);
+    }
+    Tcl_Release(interp);
+    Tcl_DecrRefCount(cmd_ptr);
+}
+
+static int ml_GenerateEventProc(Tcl_Event *evPtr, int flags) {
+    ml_generate_event_t *event = (ml_generate_event_t *) evPtr;
+    ml_generate_t *gen = event->gen;
+    Tcl_Interp *interp = gen->interp;
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    if (event->type == ML_GENERATE_EVENT_TOKEN) {
+        Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("id", -1), Tcl_NewIntObj(event->token));
+        if (event->text != NULL) {
+            Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("text", -1), Tcl_NewStringObj(event->text, event->text_length));
+            Tcl_Free(event->text);
+        }
+        ml_GenerateInvokeCallback(gen, "token", dict_ptr);
+
+        // the producer may go on once the callback has consumed the token
+        Tcl_MutexLock(gen->mutex_ptr);
+        gen->pending--;
+        Tcl_ConditionNotify(gen->cond_ptr);
+        Tcl_MutexUnlock(gen->mutex_ptr);
+        return 1;
+    }
+
+    // the done event is the last one queued for the generation, the producer is finished with it
+    if (gen->on_done != NULL) {
+        gen->on_done(gen);
+    }
+    if (gen->tokenizer != NULL) {
+        ml_TokenizerRelease(gen->tokenizer);
+    }
+    ml_UnregisterGenerate(gen->handle);
+
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("reason", -1), Tcl_NewStringObj(event->reason, -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_tokens", -1), Tcl_NewIntObj(gen->n_generated));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_past", -1), Tcl_NewIntObj(gen->n_past));
+    if (event->text != NULL) {
+        Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("text", -1), Tcl_NewStringObj(event->text, event->text_length));
+        Tcl_Free(event->text);
+    }
+    if (event->errmsg != NULL) {
+        Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("error", -1), Tcl_NewStringObj(event->errmsg, -1));
+    }
+    ml_GenerateInvokeCallback(gen, "done", dict_ptr);
+
+    ml_FreeGenerate(gen);
+    return 1;
+}
+
+static void ml_GenerateQueueEvent(ml_generate_t *gen, ml_generate_event_type_t type, int32_t token,
+                                  int text_length, const char *reason, const char *errmsg) {
+    ml_generate_event_t *event = (ml_generate_event_t *) Tcl_Alloc(sizeof(ml_generate_event_t));
+    event->header.proc = ml_GenerateEventProc;
+    event->header.nextPtr = NULL;
+    event->gen = gen;
+    event->type = type;
+    event->token = token;
+    event->text = NULL;
+    event->text_length = 0;
+    event->reason = reason;
+    event->errmsg = errmsg;
+    if (gen->tokenizer != NULL && text_length > 0) {
+        event->text = Tcl_Alloc(text_length + 1);
+        memcpy(event->text, Tcl_DStringValue(&gen->text), text_length);
+        event->text[text_length] = '\0';
+        event->text_length = text_length;
+
+        int n_rest = Tcl_DStringLength(&gen->text) - text_length;
+        memmove(Tcl_DStringValue(&gen->text), Tcl_DStringValue(&gen->text) + text_length, n_rest);
+        Tcl_DStringSetLength(&gen->text, n_rest);
+    }
+    Tcl_ThreadQueueEvent(gen->owner_thread, (Tcl_Event *) event, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(gen->owner_thread);
+}
+
+// Length of the longest prefix that does not end in the middle of a utf-8 sequence.
+static int ml_Utf8CompleteLength(const char *s, int length) {
+    int i = 0;
+    while (i < length) {
+        unsigned char c = (unsigned char) s[i];
+        int n = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        if (i + n > length) {
+            break;
+        }
+        i += n;
+    }
+    return i;
+}
+
+int32_t ml_GenerateSample(ml_generate_t *gen, const float *logits, int n_vocab, ml_sample_candidate_t *candidates) {
+    int n_history = gen->n_prompt + gen->n_generated;
+    int n_penalty = n_history < gen->penalty_last_n ? n_history : gen->penalty_last_n;
+    gen->sample_params.penalty_tokens = gen->tokens + n_history - n_penalty;
+    gen->sample_params.n_penalty_tokens = n_penalty;
+    int32_t token = ml_Sample(logits, n_vocab, &gen->sample_params, candidates, NULL, 0, NULL);
+    gen->tokens[n_history] = token;
+    gen->n_generated++;
+    return token;
+}
+
+void ml_GenerateEmitToken(ml_generate_t *gen, int32_t token) {
+    Tcl_MutexLock(gen->mutex_ptr);
+    gen->pending++;
+    Tcl_MutexUnlock(gen->mutex_ptr);
+
+    int text_length = 0;
+    if (gen->tokenizer != NULL) {
+        // hold back bytes of a character that the next token completes
+        ml_TokenizerTokenToPiece(gen->tokenizer, token, &gen->text);
+        text_length = ml_Utf8CompleteLength(Tcl_DStringValue(&gen->text), Tcl_DStringLength(&gen->text));
+    }
+    ml_GenerateQueueEvent(gen, ML_GENERATE_EVENT_TOKEN, token, text_length, NULL, NULL);
+}
+
+void ml_GenerateFinish(ml_generate_t *gen, const char *reason, const char *errmsg) {
+    ml_GenerateQueueEvent(gen, ML_GENERATE_EVENT_DONE, -1, Tcl_DStringLength(&gen->text), reason, errmsg);
+}
+
+int ml_GenerateIsStopToken(ml_generate_t *gen, int32_t token) {
+    if (gen->tokenizer != NULL && token == gen->tokenizer->eos_id) {
+        return 1;
+    }
+    for (int i = 0; i < gen->n_stop_tokens; i++) {
+        if (gen->stop_tokens[i] == token) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static Tcl_ThreadCreateType ml_GenerateThread(ClientData clientData) {
+    ml_generate_t *gen = (ml_generate_t *) clientData;
+    ml_llama_t *llama = (ml_llama_t *) gen->producer;
+    const int n_vocab = llama->hparams.n_vocab;
+    const float *logits = (const float *) llama->logits_ptr->ggml_tensor->data;
+
+    ml_sample_candidate_t *candidates = (ml_sample_candidate_t *) Tcl_Alloc(sizeof(ml_sample_candidate_t) * n_vocab);
+
+    const char *reason = "max_tokens";
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_LlamaEval(llama, gen->tokens, gen->n_prompt, &errmsg)) {
+        reason = gen->cancel ? "cancelled" : "error";
+        if (gen->cancel) {
+            errmsg = NULL;
+        }
+        goto done;
+    }
+
+    while (gen->n_generated < gen->max_tokens) {
+        // backpressure: wait until the owner thread has caught up with the queued tokens
+        Tcl_MutexLock(gen->mutex_ptr);
+        while (gen->pending >= gen->max_pending && !gen->cancel) {
+            Tcl_ConditionWait(gen->cond_ptr, gen->mutex_ptr, NULL);
+        }
+        Tcl_MutexUnlock(gen->mutex_ptr);
+        if (gen->cancel) {
+            reason = "cancelled";
+            break;
+        }
+
+        int32_t token = ml_GenerateSample(gen, logits, n_vocab, candidates);
+        ml_GenerateEmitToken(gen, token);
+
+        if (ml_GenerateIsStopToken(gen, token)) {
+            reason = "stop";
+            break;
+        }
+        if (gen->n_generated == gen->max_tokens) {
+            break;
+        }
+        if (llama->n_past >= llama->n_ctx) {
+            reason = "context_full";
+            break;
+        }
+        if (TCL_OK != ml_LlamaEval(llama, &token, 1, &errmsg)) {
+            reason = gen->cancel ? "cancelled" : "error";
+            if (gen->cancel) {
+                errmsg = NULL;
+            }
+            break;
+        }
+    }
+
+done:
+    gen->n_past = llama->n_past;
+    ml_GenerateFinish(gen, reason, errmsg);
+    Tcl_Free((char *) candidates);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static void ml_GenerateThreadDone(ml_generate_t *gen) {
+    ml_llama_t *llama = (ml_llama_t *) gen->producer;
+    int result;
+    Tcl_JoinThread(gen->worker_thread, &result);
+    llama->abort_flag = NULL;
+    llama->busy = 0;
+}
+
+static int ml_GetTokenArrayFromObj(Tcl_Interp *interp, Tcl_Obj *list_ptr, int extra, int32_t **tokens, int *n_tokens) {
+    Tcl_Obj **elems;
+    int n_elems;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, list_ptr, &n_elems, &elems)) {
+        return TCL_ERROR;
+    }
+    int32_t *array = (int32_t *) Tcl_Alloc(sizeof(int32_t) * (n_elems + extra > 0 ? n_elems + extra : 1));
+    for (int i = 0; i < n_elems; i++) {
+        int token;
+        if (TCL_OK != Tcl_GetIntFromObj(interp, elems[i], &token)) {
+            Tcl_Free((char *) array);
+            return TCL_ERROR;
+        }
+        array[i] = token;
+    }
+    *tokens = array;
+    *n_tokens = n_elems;
+    return TCL_OK;
+}
+
+ml_generate_t *ml_GenerateFromArgs(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[], int n_vocab) {
+    static const char *options[] = {"-callback", "-max_tokens", "-tokenizer", "-stop_tokens", "-max_pending",
+                                    "-temperature", "-top_k", "-top_p", "-repeat_penalty", "-penalty_last_n",
+                                    "-seed", NULL};
+    enum options {
+        OPT_CALLBACK, OPT_MAX_TOKENS, OPT_TOKENIZER, OPT_STOP_TOKENS, OPT_MAX_PENDING,
+        OPT_TEMPERATURE, OPT_TOP_K, OPT_TOP_P, OPT_REPEAT_PENALTY, OPT_PENALTY_LAST_N,
+        OPT_SEED
+    };
+
+    Tcl_Obj *callback_ptr = NULL;
+    Tcl_Obj *stop_tokens_ptr = NULL;
+    ml_tokenizer_t *tokenizer = NULL;
+    int max_tokens = 128;
+    int max_pending = 16;
+    int penalty_last_n = 64;
+    uint64_t rng_state = ml_SampleSeed((uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) objv);
+    ml_sample_params_t sample_params = {
+            .temperature = 0.8f,
+            .top_k = 40,
+            .top_p = 0.95f,
+            .repeat_penalty = 1.1f,
+            .frequency_penalty = 0.0f,
+            .presence_penalty = 0.0f,
+            .penalty_tokens = NULL,
+            .n_penalty_tokens = 0,
+            .rng_state = NULL,
+    };
+
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return NULL;
+        }
+        double value;
+        switch ((enum options) optionIndex) {
+            case OPT_CALLBACK:
+                callback_ptr = objv[i + 1];
+                break;
+            case OPT_MAX_TOKENS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &max_tokens) || max_tokens <= 0) {
+                    SetResult("max_tokens is not an integer > 0");
+                    return NULL;
+                }
+                break;
+            case OPT_TOKENIZER:
+                tokenizer = ml_GetInternalFromTokenizer(Tcl_GetString(objv[i + 1]));
+                if (!tokenizer) {
+                    SetResult("tokenizer handle not found");
+                    return NULL;
+                }
+                break;
+            case OPT_STOP_TOKENS:
+                stop_tokens_ptr = objv[i + 1];
+                break;
+            case OPT_MAX_PENDING:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &max_pending) || max_pending <= 0) {
+                    SetResult("max_pending is not an integer > 0");
+                    return NULL;
+                }
+                break;
+            case OPT_TEMPERATURE:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value)) {
+                    SetResult("temperature is not a number");
+                    return NULL;
+                }
+                sample_params.temperature = (float) value;
+                break;
+            case OPT_TOP_K:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &sample_params.top_k) || sample_params.top_k < 0) {
+                    SetResult("top_k is not an integer >= 0");
+                    return NULL;
+                }
+                break;
+            case OPT_TOP_P:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value) || value <= 0.0 || value > 1.0) {
+                    SetResult("top_p is not a number in (0, 1]");
+                    return NULL;
+                }
+                sample_params.top_p = (float) value;
+                break;
+            case OPT_REPEAT_PENALTY:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value) || value <= 0.0) {
+                    SetResult("repeat_penalty is not a number > 0");
+                    return NULL;
+                }
+                sample_params.repeat_penalty = (float) value;
+                break;
+            case OPT_PENALTY_LAST_N:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &penalty_last_n) || penalty_last_n < 0) {
+                    SetResult("penalty_last_n is not an integer >= 0");
+                    return NULL;
+                }
+                break;
+            case OPT_SEED: {
+                Tcl_WideInt seed;
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &seed)) {
+                    SetResult("seed is not an integer");
+                    return NULL;
+                }
+                rng_state = ml_SampleSeed((uint64_t) seed);
+                break;
+            }
+        }
+    }
+
+    if (callback_ptr == NULL) {
+        SetResult("-callback is required");
+        return NULL;
+    }
+
+    int32_t *tokens;
+    int n_prompt;
+    if (TCL_OK != ml_GetTokenArrayFromObj(interp, objv[2], max_tokens, &tokens, &n_prompt)) {
+        SetResult("prompt_tokens is not a list of integers");
+        return NULL;
+    }
+    if (n_prompt == 0) {
+        Tcl_Free((char *) tokens);
+        SetResult("prompt_tokens is empty");
+        return NULL;
+    }
+    for (int i = 0; i < n_prompt; i++) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            Tcl_Free((char *) tokens);
+            SetResult("token out of range");
+            return NULL;
+        }
+    }
+
+    int32_t *stop_tokens = NULL;
+    int n_stop_tokens = 0;
+    if (stop_tokens_ptr != NULL && TCL_OK != ml_GetTokenArrayFromObj(interp, stop_tokens_ptr, 0, &stop_tokens, &n_stop_tokens)) {
+        Tcl_Free((char *) tokens);
+        SetResult("stop_tokens is not a list of integers");
+        return NULL;
+    }
+
+    ml_generate_t *gen = (ml_generate_t *) Tcl_Alloc(sizeof(ml_generate_t));
+    memset(gen, 0, sizeof(ml_generate_t));
+    gen->tokenizer = tokenizer;
+    gen->interp = interp;
+    gen->callback = Tcl_DuplicateObj(callback_ptr);
+    Tcl_IncrRefCount(gen->callback);
+    gen->owner_thread = Tcl_GetCurrentThread();
+    gen->tokens = tokens;
+    gen->n_prompt = n_prompt;
+    gen->max_tokens = max_tokens;
+    gen->stop_tokens = stop_tokens;
+    gen->n_stop_tokens = n_stop_tokens;
+    gen->penalty_last_n = penalty_last_n;
+    gen->sample_params = sample_params;
+    gen->rng_state = rng_state;
+    gen->sample_params.rng_state = &gen->rng_state;
+    Tcl_DStringInit(&gen->text);
+    gen->mutex_ptr = &gen->mutex;
+    gen->cond_ptr = &gen->cond;
+    gen->max_pending = max_pending;
+    gen->seq = -1;
+    Tcl_Preserve(interp);
+    return gen;
+}
+
+void ml_GenerateRegister(ml_generate_t *gen) {
+    if (gen->tokenizer != NULL) {
+        ml_TokenizerRetain(gen->tokenizer);
+    }
+    CMD_GENERATE_NAME(gen->handle, gen);
+    ml_RegisterGenerate(gen->handle, gen);
+}
+
+void ml_GenerateDiscard(ml_generate_t *gen) {
+    if (gen->handle[0] != '\0') {
+        if (gen->tokenizer != NULL) {
+            ml_TokenizerRelease(gen->tokenizer);
+        }
+        ml_UnregisterGenerate(gen->handle);
+    }
+    ml_FreeGenerate(gen);
+}
+
+int ml_GenerateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GenerateCmd\n"));
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "llama_handle " ML_GENERATE_USAGE);
+        return TCL_ERROR;
+    }
+
+    const char *llama_handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(llama_handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+    if (llama->busy) {
+        SetResult("llama is busy generating");
+        return TCL_ERROR;
+    }
+
+    ml_generate_t *gen = ml_GenerateFromArgs(interp, objc, objv, llama->hparams.n_vocab);
+    if (gen == NULL) {
+        return TCL_ERROR;
+    }
+    gen->producer = llama;
+    gen->on_done = ml_GenerateThreadDone;
+    ml_GenerateRegister(gen);
+
+    llama->busy = 1;
+    llama->abort_flag = &gen->cancel;
+
+    if (TCL_OK != Tcl_CreateThread(&gen->worker_thread, ml_GenerateThread, gen,
+                                   TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE)) {
+        llama->busy = 0;
+        llama->abort_flag = NULL;
+        ml_GenerateDiscard(gen);
+        SetResult("could not create generate thread");
+        return TCL_ERROR;
+    }
+
+    SetResult(gen->handle);
+    return TCL_OK;
+}
+
+int ml_GenerateCancelCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GenerateCancelCmd\n"));
+    CheckArgs(2, 2, 1, "generate_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_generate_t *gen = ml_GetInternalFromGenerate(handle);
+    if (!gen) {
+        SetResult("generate handle not found");
+        return TCL_ERROR;
+    }
+
+    // a standalone generation also stops a graph computation in progress, the done event follows shortly
+    Tcl_MutexLock(gen->mutex_ptr);
+    gen->cancel = 1;
+    Tcl_ConditionNotify(gen->cond_ptr);
+    Tcl_MutexUnlock(gen->mutex_ptr);
+    return TCL_OK;
+}
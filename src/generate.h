@@ -0,0 +1,69 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_GENERATE_H
+#define GGML_TCL_GENERATE_H
+
+#include "common.h"
+#include "llama.h"
+#include "sample.h"
+#include "tokenizer.h"
+
+#define CMD_GENERATE_NAME(s, internal) sprintf((s), "_GGML_GEN_%p", (internal))
+
+typedef struct ml_generate_s ml_generate_t;
+
+struct ml_generate_s {
+    ml_tokenizer_t *tokenizer;          // optional, tokens are delivered with their text when set
+    Tcl_Interp *interp;
+    Tcl_Obj *callback;
+    Tcl_ThreadId owner_thread;          // the thread whose event loop runs the callback
+    int32_t *tokens;                    // the prompt followed by the generated tokens
+    int n_prompt;
+    int n_generated;
+    int max_tokens;
+    int32_t *stop_tokens;
+    int n_stop_tokens;
+    int penalty_last_n;
+    ml_sample_params_t sample_params;
+    uint64_t rng_state;
+    Tcl_DString text;                   // bytes of a character that is not complete yet
+    Tcl_Mutex mutex;
+    Tcl_Condition cond;
+    Tcl_Mutex *mutex_ptr;               // guards pending and cancel, &mutex unless the producer has its own
+    Tcl_Condition *cond_ptr;            // notified when pending drops or cancel is set
+    int pending;                        // token events queued but not yet handled by the callback
+    int max_pending;
+    volatile int cancel;
+    void (*on_done)(ml_generate_t *gen); // run by the owner thread before the done callback
+    void *producer;                     // the llama or scheduler producing the tokens
+    Tcl_ThreadId worker_thread;         // standalone generations only
+    int seq;                            // kv cache slot, scheduled generations only
+    int n_past;
+    int n_evaluated;
+    uint64_t prefix_hash;               // hash of the tokens in the first n_prefix_pages kv cache pages
+    int n_prefix_pages;                 // pages matched in or offered to the prefix cache
+    ml_generate_t *next_queued_ptr;
+    char handle[40];
+};
+
+void ml_InitGenerateHT();
+void ml_DeleteGenerateHT();
+
+// Parses "prompt_tokens ?options?" from objv[2] on into a new generation that is not registered yet.
+ml_generate_t *ml_GenerateFromArgs(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[], int n_vocab);
+void ml_GenerateRegister(ml_generate_t *gen);
+void ml_GenerateDiscard(ml_generate_t *gen);
+int32_t ml_GenerateSample(ml_generate_t *gen, const float *logits, int n_vocab, ml_sample_candidate_t *candidates);
+void ml_GenerateEmitToken(ml_generate_t *gen, int32_t token);
+void ml_GenerateFinish(ml_generate_t *gen, const char *reason, const char *errmsg);
+int ml_GenerateIsStopToken(ml_generate_t *gen, int32_t token);
+
+#define ML_GENERATE_USAGE "prompt_tokens -callback cmd ?-max_tokens n? ?-tokenizer tokenizer_handle? ?-stop_tokens list? ?-max_pending n? ?-temperature t? ?-top_k k? ?-top_p p? ?-repeat_penalty r? ?-penalty_last_n n? ?-seed n?"
+
+GGML_TCL_CMD(ml_GenerateCmd);
+GGML_TCL_CMD(ml_GenerateCancelCmd);
+
+#endif //GGML_TCL_GENERATE_H
@@ -0,0 +1,571 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <string.h>
+#include "graphio.h"
+#include "cgraph.h"
+#include "context.h"
+#include "membuf.h"
+
+#define ML_GRAPH_MAGIC 0x48504747   // "GGPH"
+#define ML_GRAPH_VERSION 1
+#define ML_GRAPH_MAX_SRC 6
+#define ML_GRAPH_OP_PARAMS 16
+#define ML_GRAPH_NAME_SIZE 64
+
+// The file is a header, one record per tensor with the sources of every tensor before it,
+// the indices of the nodes and leafs, then the data of the tensors that have it, all in
+// native byte order. Ops and types are stored by number, so the file is tied to a ggml version.
+typedef struct ml_graph_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t op_count;                  // GGML_OP_COUNT and GGML_TYPE_COUNT of the writer
+    uint32_t type_count;
+    uint32_t n_tensors;
+    uint32_t n_nodes;
+    uint32_t n_leafs;
+    uint32_t size;                      // of the graph
+    uint32_t grads;
+    uint32_t reserved;
+} ml_graph_header_t;
+
+typedef struct ml_graph_record_s {
+    int32_t type;
+    int32_t op;
+    int32_t is_param;
+    int32_t view_src;                   // index, or -1
+    int32_t grad;
+    int32_t src[ML_GRAPH_MAX_SRC];
+    int32_t op_params[ML_GRAPH_OP_PARAMS];
+    int32_t reserved;
+    int64_t ne[4];
+    uint64_t nb[4];
+    uint64_t view_offs;
+    uint64_t data_size;                 // bytes of data that follow the indices, 0 if none
+    char name[ML_GRAPH_NAME_SIZE];
+} ml_graph_record_t;
+
+typedef struct ml_graph_walk_s {
+    Tcl_HashTable indices;              // tensor -> index
+    struct ggml_tensor **tensors;
+    int n_tensors;
+    int capacity;
+} ml_graph_walk_t;
+
+static int ml_GraphWalkIndex(ml_graph_walk_t *walk, struct ggml_tensor *tensor) {
+    if (tensor == NULL) {
+        return -1;
+    }
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&walk->indices, (const char *) tensor);
+    return entryPtr != NULL ? (int) (intptr_t) Tcl_GetHashValue(entryPtr) : -1;
+}
+
+static void ml_GraphWalkAdd(ml_graph_walk_t *walk, struct ggml_tensor *tensor) {
+    int newEntry;
+    Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&walk->indices, (const char *) tensor, &newEntry);
+    Tcl_SetHashValue(entryPtr, (ClientData) (intptr_t) walk->n_tensors);
+    if (walk->n_tensors == walk->capacity) {
+        walk->capacity = walk->capacity == 0 ? 256 : 2 * walk->capacity;
+        walk->tensors = (struct ggml_tensor **) Tcl_Realloc((char *) walk->tensors,
+                                                            sizeof(struct ggml_tensor *) * walk->capacity);
+    }
+    walk->tensors[walk->n_tensors++] = tensor;
+}
+
+static struct ggml_tensor *ml_GraphWalkChild(struct ggml_tensor *tensor, int i) {
+    return i < GGML_MAX_SRC ? tensor->src[i] : tensor->view_src;
+}
+
+// Numbers the tensor and everything it is computed from or views, sources first. The walk
+// is iterative, since the chains of a deep model are longer than a comfortable recursion.
+static void ml_GraphWalkVisit(ml_graph_walk_t *walk, struct ggml_tensor *root, struct ggml_tensor ***stack_ptr,
+                              int **next_ptr, int *stack_capacity) {
+    if (root == NULL || Tcl_FindHashEntry(&walk->indices, (const char *) root) != NULL) {
+        return;
+    }
+    int depth = 0;
+    (*stack_ptr)[0] = root;
+    (*next_ptr)[0] = 0;
+    while (depth >= 0) {
+        struct ggml_tensor *tensor = (*stack_ptr)[depth];
+        int i = (*next_ptr)[depth];
+        if (i > GGML_MAX_SRC) {
+            if (Tcl_FindHashEntry(&walk->indices, (const char *) tensor) == NULL) {
+                ml_GraphWalkAdd(walk, tensor);
+            }
+            depth--;
+            continue;
+        }
+        (*next_ptr)[depth] = i + 1;
+        struct ggml_tensor *child = ml_GraphWalkChild(tensor, i);
+        if (child == NULL || Tcl_FindHashEntry(&walk->indices, (const char *) child) != NULL) {
+            continue;
+        }
+        if (depth + 1 == *stack_capacity) {
+            *stack_capacity *= 2;
+            *stack_ptr = (struct ggml_tensor **) Tcl_Realloc((char *) *stack_ptr,
+                                                             sizeof(struct ggml_tensor *) * *stack_capacity);
+            *next_ptr = (int *) Tcl_Realloc((char *) *next_ptr, sizeof(int) * *stack_capacity);
+        }
+        depth++;
+        (*stack_ptr)[depth] = child;
+        (*next_ptr)[depth] = 0;
+    }
+}
+
+static void ml_GraphWalk(ml_graph_walk_t *walk, struct ggml_cgraph *cgraph) {
+    Tcl_InitHashTable(&walk->indices, TCL_ONE_WORD_KEYS);
+    walk->tensors = NULL;
+    walk->n_tensors = 0;
+    walk->capacity = 0;
+
+    int stack_capacity = 64;
+    struct ggml_tensor **stack = (struct ggml_tensor **) Tcl_Alloc(sizeof(struct ggml_tensor *) * stack_capacity);
+    int *next = (int *) Tcl_Alloc(sizeof(int) * stack_capacity);
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        ml_GraphWalkVisit(walk, cgraph->leafs[i], &stack, &next, &stack_capacity);
+    }
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        ml_GraphWalkVisit(walk, cgraph->nodes[i], &stack, &next, &stack_capacity);
+    }
+    // gradients may depend on the tensors they belong to, so they are linked after all tensors exist
+    for (int i = 0; i < walk->n_tensors; i++) {
+        ml_GraphWalkVisit(walk, walk->tensors[i]->grad, &stack, &next, &stack_capacity);
+    }
+    Tcl_Free((char *) next);
+    Tcl_Free((char *) stack);
+}
+
+static void ml_GraphWalkFree(ml_graph_walk_t *walk) {
+    Tcl_DeleteHashTable(&walk->indices);
+    if (walk->tensors != NULL) {
+        Tcl_Free((char *) walk->tensors);
+    }
+}
+
+// Only tensors that own their data and are not computed by the graph carry data: inputs and weights.
+static int ml_GraphHasData(const struct ggml_tensor *tensor) {
+    return tensor->data != NULL && tensor->view_src == NULL && tensor->op == GGML_OP_NONE;
+}
+
+int ml_GraphExportCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GraphExportCmd\n"));
+
+    static const char *options[] = {"-weights", NULL};
+    enum options {
+        OPT_WEIGHTS
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "cgraph_handle path ?-weights boolean?");
+        return TCL_ERROR;
+    }
+
+    ml_cgraph_t *cgraph_ptr = ml_GetInternalFromCGraph(Tcl_GetString(objv[1]));
+    if (!cgraph_ptr) {
+        SetResult("cgraph handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_cgraph *cgraph = cgraph_ptr->ggml_cgraph;
+
+    int weights = 1;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_WEIGHTS:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &weights)) {
+                    SetResult("weights is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    ml_graph_walk_t walk;
+    ml_GraphWalk(&walk, cgraph);
+
+    ml_graph_header_t header = {
+            .magic = ML_GRAPH_MAGIC,
+            .version = ML_GRAPH_VERSION,
+            .op_count = GGML_OP_COUNT,
+            .type_count = GGML_TYPE_COUNT,
+            .n_tensors = (uint32_t) walk.n_tensors,
+            .n_nodes = (uint32_t) cgraph->n_nodes,
+            .n_leafs = (uint32_t) cgraph->n_leafs,
+            .size = (uint32_t) cgraph->size,
+            .grads = cgraph->grads != NULL,
+            .reserved = 0,
+    };
+
+    FILE *fp = fopen(Tcl_GetString(objv[2]), "wb");
+    if (fp == NULL) {
+        ml_GraphWalkFree(&walk);
+        SetResult("could not open file for writing");
+        return TCL_ERROR;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    Tcl_WideInt file_size = sizeof(header);
+    for (int i = 0; ok && i < walk.n_tensors; i++) {
+        struct ggml_tensor *tensor = walk.tensors[i];
+        ml_graph_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.type = tensor->type;
+        record.op = tensor->op;
+        record.is_param = tensor->is_param;
+        record.view_src = ml_GraphWalkIndex(&walk, tensor->view_src);
+        record.grad = ml_GraphWalkIndex(&walk, tensor->grad);
+        for (int j = 0; j < ML_GRAPH_MAX_SRC; j++) {
+            record.src[j] = j < GGML_MAX_SRC ? ml_GraphWalkIndex(&walk, tensor->src[j]) : -1;
+        }
+        size_t op_params_size = sizeof(tensor->op_params) < sizeof(record.op_params)
+                                ? sizeof(tensor->op_params) : sizeof(record.op_params);
+        memcpy(record.op_params, tensor->op_params, op_params_size);
+        for (int j = 0; j < 4; j++) {
+            record.ne[j] = tensor->ne[j];
+            record.nb[j] = tensor->nb[j];
+        }
+        record.view_offs = tensor->view_offs;
+        record.data_size = weights && ml_GraphHasData(tensor) ? ggml_nbytes(tensor) : 0;
+        strncpy(record.name, tensor->name, sizeof(record.name) - 1);
+        ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+        file_size += sizeof(record);
+    }
+    for (int i = 0; ok && i < cgraph->n_nodes; i++) {
+        int32_t index = ml_GraphWalkIndex(&walk, cgraph->nodes[i]);
+        ok = fwrite(&index, sizeof(index), 1, fp) == 1;
+        file_size += sizeof(index);
+    }
+    for (int i = 0; ok && i < cgraph->n_leafs; i++) {
+        int32_t index = ml_GraphWalkIndex(&walk, cgraph->leafs[i]);
+        ok = fwrite(&index, sizeof(index), 1, fp) == 1;
+        file_size += sizeof(index);
+    }
+    for (int i = 0; ok && weights && i < walk.n_tensors; i++) {
+        struct ggml_tensor *tensor = walk.tensors[i];
+        if (ml_GraphHasData(tensor)) {
+            size_t nbytes = ggml_nbytes(tensor);
+            ok = nbytes == 0 || fwrite(tensor->data, nbytes, 1, fp) == 1;
+            file_size += nbytes;
+        }
+    }
+    ml_GraphWalkFree(&walk);
+    if (fclose(fp) != 0 || !ok) {
+        SetResult("could not write graph file");
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(file_size));
+    return TCL_OK;
+}
+
+// Size of the data a tensor of the record spans, the same as ggml_nbytes.
+static uint64_t ml_GraphRecordBytes(const ml_graph_record_t *record) {
+    enum ggml_type type = (enum ggml_type) record->type;
+    uint64_t nbytes = ggml_blck_size(type) == 1
+                      ? ggml_type_size(type)
+                      : record->ne[0] * record->nb[0] / ggml_blck_size(type);
+    for (int j = ggml_blck_size(type) == 1 ? 0 : 1; j < 4; j++) {
+        nbytes += (record->ne[j] - 1) * record->nb[j];
+    }
+    return nbytes;
+}
+
+// Whether a view of the record at its offset ends within limit bytes, hostile strides cannot overflow the sum.
+static int ml_GraphViewFits(const ml_graph_record_t *record, uint64_t limit) {
+    enum ggml_type type = (enum ggml_type) record->type;
+    int blck = ggml_blck_size(type);
+    uint64_t end = record->view_offs;
+    uint64_t first = blck == 1 ? ggml_type_size(type) : 0;
+    if (end > limit || first > limit - end) {
+        return 0;
+    }
+    end += first;
+    for (int j = 0; j < 4; j++) {
+        uint64_t count = j == 0 && blck != 1 ? (uint64_t) (record->ne[0] / blck) : (uint64_t) (record->ne[j] - 1);
+        if (count > 0 && record->nb[j] > (limit - end) / count) {
+            return 0;
+        }
+        end += count * record->nb[j];
+    }
+    return 1;
+}
+
+// Number of leading sources an op reads without checking them, every op other than NONE reads src[0].
+static int ml_GraphRequiredSources(enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_NONE:
+            return 0;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_ACC:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_CONCAT:
+        case GGML_OP_SILU_BACK:
+        case GGML_OP_RMS_NORM_BACK:
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_OUT_PROD:
+        case GGML_OP_SET:
+        case GGML_OP_CPY:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_GET_ROWS_BACK:
+        case GGML_OP_SOFT_MAX_BACK:
+        case GGML_OP_ROPE:
+        case GGML_OP_ROPE_BACK:
+        case GGML_OP_CONV_TRANSPOSE_1D:
+        case GGML_OP_CONV_TRANSPOSE_2D:
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM2:
+            return 2;
+        case GGML_OP_FLASH_ATTN:
+        case GGML_OP_ADD_REL_POS:
+        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM3:
+            return 3;
+        case GGML_OP_FLASH_ATTN_BACK:
+            return 4;
+        case GGML_OP_FLASH_FF:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+static const char *ml_GraphCheckRecord(const ml_graph_record_t *records, int i, int n_tensors) {
+    const ml_graph_record_t *record = &records[i];
+    if (record->type < 0 || record->type >= GGML_TYPE_COUNT || record->op < 0 || record->op >= GGML_OP_COUNT) {
+        return "invalid tensor type or op";
+    }
+    for (int j = 0; j < 4; j++) {
+        if (record->ne[j] <= 0) {
+            return "invalid tensor shape";
+        }
+    }
+    if (record->ne[0] % ggml_blck_size((enum ggml_type) record->type) != 0) {
+        return "invalid tensor shape";
+    }
+    for (int j = 0; j < ML_GRAPH_MAX_SRC; j++) {
+        if (record->src[j] < -1 || record->src[j] >= i || (j >= GGML_MAX_SRC && record->src[j] != -1)) {
+            return "invalid tensor source";
+        }
+    }
+    for (int j = 0; j < ml_GraphRequiredSources((enum ggml_op) record->op); j++) {
+        if (record->src[j] < 0) {
+            return "missing tensor source";
+        }
+    }
+    if (record->grad < -1 || record->grad >= n_tensors) {
+        return "invalid tensor gradient";
+    }
+    if (record->view_src < -1 || record->view_src >= i) {
+        return "invalid view source";
+    }
+    if (record->view_src >= 0) {
+        const ml_graph_record_t *src = &records[record->view_src];
+        if (src->type != record->type || src->view_src != -1 || !ml_GraphViewFits(record, ml_GraphRecordBytes(src))) {
+            return "invalid view";
+        }
+        if (record->data_size != 0) {
+            return "view with data";
+        }
+        return NULL;
+    }
+
+    // other tensors are created contiguous, so the record must have the strides ggml_new_tensor gives them
+    enum ggml_type type = (enum ggml_type) record->type;
+    uint64_t stride = ggml_type_size(type);
+    for (int j = 0; j < 4; j++) {
+        if (record->nb[j] != stride) {
+            return "invalid tensor strides";
+        }
+        uint64_t count = j == 0 ? (uint64_t) (record->ne[0] / ggml_blck_size(type)) : (uint64_t) record->ne[j];
+        if (stride > (uint64_t) INT64_MAX / count) {
+            return "invalid tensor shape";
+        }
+        stride *= count;
+    }
+    if (record->data_size != 0 && record->data_size != stride) {
+        return "invalid tensor data size";
+    }
+    return NULL;
+}
+
+int ml_GraphImportCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GraphImportCmd\n"));
+
+    static const char *options[] = {"-weights", NULL};
+    enum options {
+        OPT_WEIGHTS
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle path ?-weights boolean?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+
+    int weights = 1;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_WEIGHTS:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &weights)) {
+                    SetResult("weights is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    // the whole file is read with one mapping
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(Tcl_GetString(objv[2]), &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ml_graph_header_t header;
+    if (size < sizeof(header)) {
+        errmsg = "not a graph file";
+    } else {
+        memcpy(&header, buffer, sizeof(header));
+        if (header.magic != ML_GRAPH_MAGIC) {
+            errmsg = "not a graph file";
+        } else if (header.version != ML_GRAPH_VERSION) {
+            errmsg = "unsupported graph file version";
+        } else if (header.op_count != GGML_OP_COUNT || header.type_count != GGML_TYPE_COUNT) {
+            errmsg = "graph file was written with a different ggml version";
+        } else if (header.size == 0 || header.n_nodes > header.size || header.n_leafs > header.size
+                   || header.n_nodes + (uint64_t) header.n_leafs > header.n_tensors
+                   || (size - sizeof(header)) / sizeof(ml_graph_record_t) < header.n_tensors) {
+            errmsg = "graph file is truncated";
+        }
+    }
+
+    const ml_graph_record_t *records = NULL;
+    const int32_t *indices = NULL;
+    int n_tensors = 0;
+    if (errmsg == NULL) {
+        n_tensors = (int) header.n_tensors;
+        records = (const ml_graph_record_t *) (buffer + sizeof(header));
+        size_t offset = sizeof(header) + sizeof(ml_graph_record_t) * n_tensors;
+        size_t n_indices = (size_t) header.n_nodes + header.n_leafs;
+        if ((size - offset) / sizeof(int32_t) < n_indices) {
+            errmsg = "graph file is truncated";
+        } else {
+            indices = (const int32_t *) (buffer + offset);
+            offset += sizeof(int32_t) * n_indices;
+        }
+        for (size_t i = 0; errmsg == NULL && i < n_indices; i++) {
+            if (indices[i] < 0 || indices[i] >= n_tensors) {
+                errmsg = "invalid node index";
+            }
+        }
+        for (int i = 0; errmsg == NULL && i < n_tensors; i++) {
+            errmsg = ml_GraphCheckRecord(records, i, n_tensors);
+            if (errmsg == NULL && records[i].data_size > size - offset) {
+                errmsg = "graph file is truncated";
+            }
+            offset += errmsg == NULL ? records[i].data_size : 0;
+        }
+    }
+    if (errmsg != NULL) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // expanding the nodes also adds their ancestors, so the graph must have room for every tensor in the file
+    size_t graph_size = header.size > (uint32_t) n_tensors ? header.size : (size_t) n_tensors;
+
+    // all objects of the graph go into one meta chunk, where ml_ContextAllocTensors finds them
+    if (TCL_OK != ml_ContextReserveMeta(ctx, n_tensors * ggml_tensor_overhead()
+                                             + ggml_graph_overhead_custom(graph_size, header.grads), &errmsg)) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    struct ggml_tensor **tensors = (struct ggml_tensor **) Tcl_Alloc(sizeof(struct ggml_tensor *) * n_tensors);
+    for (int i = 0; i < n_tensors; i++) {
+        const ml_graph_record_t *record = &records[i];
+        struct ggml_tensor *tensor;
+        if (record->view_src >= 0) {
+            tensor = ggml_view_4d(ctx->ggml_ctx, tensors[record->view_src],
+                                  record->ne[0], record->ne[1], record->ne[2], record->ne[3],
+                                  record->nb[1], record->nb[2], record->nb[3], record->view_offs);
+            for (int j = 0; j < 4; j++) {
+                tensor->nb[j] = record->nb[j];
+            }
+        } else {
+            tensor = ggml_new_tensor(ctx->ggml_ctx, (enum ggml_type) record->type, 4, record->ne);
+        }
+        tensor->op = (enum ggml_op) record->op;
+        tensor->is_param = record->is_param != 0;
+        size_t op_params_size = sizeof(tensor->op_params) < sizeof(record->op_params)
+                                ? sizeof(tensor->op_params) : sizeof(record->op_params);
+        memcpy(tensor->op_params, record->op_params, op_params_size);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            tensor->src[j] = j < ML_GRAPH_MAX_SRC && record->src[j] >= 0 ? tensors[record->src[j]] : NULL;
+        }
+        char name[ML_GRAPH_NAME_SIZE];
+        memcpy(name, record->name, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        ggml_set_name(tensor, name);
+        tensors[i] = tensor;
+    }
+    for (int i = 0; i < n_tensors; i++) {
+        tensors[i]->grad = records[i].grad >= 0 ? tensors[records[i].grad] : NULL;
+    }
+    ml_ContextAllocTensors(ctx);
+
+    // inputs and weights, unless the context has no data
+    const char *data = (const char *) (indices + header.n_nodes + header.n_leafs);
+    for (int i = 0; i < n_tensors; i++) {
+        if (weights && records[i].data_size > 0 && records[i].data_size == ggml_nbytes(tensors[i])
+            && tensors[i]->data != NULL) {
+            memcpy(tensors[i]->data, data, records[i].data_size);
+        }
+        data += records[i].data_size;
+    }
+
+    // expanding the nodes in their order rebuilds the graph with the same order of evaluation
+    struct ggml_cgraph *cgraph = ggml_new_graph_custom(ctx->ggml_ctx, graph_size, header.grads);
+    for (uint32_t i = 0; i < header.n_nodes; i++) {
+        ggml_build_forward_expand(cgraph, tensors[indices[i]]);
+    }
+    for (uint32_t i = 0; i < header.n_leafs; i++) {
+        ggml_build_forward_expand(cgraph, tensors[indices[header.n_nodes + i]]);
+    }
+    ml_cgraph_t *cgraph_ptr = ml_CreateCGraphHandle(ctx, cgraph);
+
+    Tcl_Free((char *) tensors);
+    ml_FreeBuffer(buffer, mapped_size);
+
+    SetResult(cgraph_ptr->handle);
+    return TCL_OK;
+}
@@ -0,0 +1,14 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_GRAPHIO_H
+#define GGML_TCL_GRAPHIO_H
+
+#include "common.h"
+
+GGML_TCL_CMD(ml_GraphExportCmd);
+GGML_TCL_CMD(ml_GraphImportCmd);
+
+#endif //GGML_TCL_GRAPHIO_H
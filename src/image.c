@@ -0,0 +1,541 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <string.h>
+#include "image.h"
+#include "membuf.h"
+#include "tensor.h"
+
+#define ML_IMAGE_MAX_CHANNELS 3
+// larger images are rejected before their pixels are read
+#define ML_IMAGE_MAX_SIDE 65536
+
+typedef enum {
+    ML_IMAGE_PNM_BINARY,                // P5, P6
+    ML_IMAGE_PNM_ASCII,                 // P2, P3
+    ML_IMAGE_BMP
+} ml_image_format_t;
+
+typedef struct ml_image_s {
+    char *buffer;
+    size_t mapped_size;
+    size_t size;
+    ml_image_format_t format;
+    int width;
+    int height;
+    int channels;                       // 1 or 3
+    int maxval;                         // pnm only
+    int bits;                           // bmp only: 8, 24 or 32
+    int top_down;                       // bmp only
+    const unsigned char *palette;       // bmp only
+    int n_palette;
+    size_t offset;                      // start of the pixels
+} ml_image_t;
+
+typedef struct ml_image_batch_s {
+    ml_image_t *images;
+    Tcl_Obj **paths;
+    int n_images;
+    int width;                          // of the tensor
+    int height;
+    int channels;
+    float mean[ML_IMAGE_MAX_CHANNELS];
+    float std[ML_IMAGE_MAX_CHANNELS];
+    float *data;                        // [width, height, channels, n_images]
+} ml_image_batch_t;
+
+typedef struct ml_image_worker_s {
+    const ml_image_batch_t *batch;
+    int first;                          // images first, first + stride, ...
+    int stride;
+    int error_image;                    // -1, or the first image that could not be decoded
+    const char *errmsg;
+} ml_image_worker_t;
+
+static uint32_t ml_ImageLe32(const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t ml_ImageLe16(const unsigned char *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+// Reads the next decimal number of a pnm header or ascii raster, skipping blanks and comments.
+static int ml_ImagePnmNumber(const unsigned char *data, size_t size, size_t *pos, int *value) {
+    size_t p = *pos;
+    for (;;) {
+        while (p < size && (data[p] == ' ' || data[p] == '\t' || data[p] == '\r' || data[p] == '\n')) {
+            p++;
+        }
+        if (p < size && data[p] == '#') {
+            while (p < size && data[p] != '\n') {
+                p++;
+            }
+            continue;
+        }
+        break;
+    }
+    if (p == size || data[p] < '0' || data[p] > '9') {
+        return 0;
+    }
+    int64_t v = 0;
+    while (p < size && data[p] >= '0' && data[p] <= '9') {
+        if (v <= INT32_MAX) {
+            v = v * 10 + (data[p] - '0');
+        }
+        p++;
+    }
+    if (v > INT32_MAX) {
+        return 0;
+    }
+    *value = (int) v;
+    *pos = p;
+    return 1;
+}
+
+static int ml_ImageParsePnm(ml_image_t *image, const char **errmsg) {
+    const unsigned char *data = (const unsigned char *) image->buffer;
+    char kind = (char) data[1];
+    image->format = kind == '5' || kind == '6' ? ML_IMAGE_PNM_BINARY : ML_IMAGE_PNM_ASCII;
+    image->channels = kind == '3' || kind == '6' ? 3 : 1;
+    size_t pos = 2;
+    if (!ml_ImagePnmNumber(data, image->size, &pos, &image->width)
+        || !ml_ImagePnmNumber(data, image->size, &pos, &image->height)
+        || !ml_ImagePnmNumber(data, image->size, &pos, &image->maxval)) {
+        *errmsg = "invalid pnm header";
+        return 0;
+    }
+    if (image->width <= 0 || image->height <= 0) {
+        *errmsg = "invalid image size";
+        return 0;
+    }
+    if (image->maxval <= 0 || image->maxval > 65535) {
+        *errmsg = "invalid pnm maxval";
+        return 0;
+    }
+    if (image->format == ML_IMAGE_PNM_BINARY) {
+        // a single blank separates the header from binary pixels
+        image->offset = pos + 1;
+        size_t sample_size = image->maxval > 255 ? 2 : 1;
+        if (image->offset > image->size
+            || (image->size - image->offset) / sample_size / image->channels / image->width < (size_t) image->height) {
+            *errmsg = "pnm file is truncated";
+            return 0;
+        }
+    } else {
+        // every ascii sample takes at least a blank and a digit
+        image->offset = pos;
+        if ((image->size - image->offset) / 2 / image->channels / image->width < (size_t) image->height) {
+            *errmsg = "pnm file is truncated";
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int ml_ImageParseBmp(ml_image_t *image, const char **errmsg) {
+    const unsigned char *data = (const unsigned char *) image->buffer;
+    if (image->size < 54) {
+        *errmsg = "bmp file is truncated";
+        return 0;
+    }
+    uint32_t offset = ml_ImageLe32(data + 10);
+    uint32_t dib_size = ml_ImageLe32(data + 14);
+    int32_t width = (int32_t) ml_ImageLe32(data + 18);
+    int32_t height = (int32_t) ml_ImageLe32(data + 22);
+    uint32_t compression = ml_ImageLe32(data + 30);
+    uint32_t n_palette = ml_ImageLe32(data + 46);
+    image->bits = ml_ImageLe16(data + 28);
+    if (dib_size < 40 || width <= 0 || height == 0 || height == INT32_MIN) {
+        *errmsg = "unsupported bmp header";
+        return 0;
+    }
+    if (compression != 0 || (image->bits != 8 && image->bits != 24 && image->bits != 32)) {
+        *errmsg = "only uncompressed 8, 24 and 32 bit bmp files are supported";
+        return 0;
+    }
+    image->format = ML_IMAGE_BMP;
+    image->width = width;
+    image->height = height < 0 ? -height : height;
+    image->top_down = height < 0;
+    image->channels = 3;
+    image->offset = offset;
+    if (image->bits == 8) {
+        image->n_palette = n_palette == 0 || n_palette > 256 ? 256 : (int) n_palette;
+        image->palette = data + 14 + dib_size;
+        if (14 + (size_t) dib_size + (size_t) image->n_palette * 4 > image->size) {
+            *errmsg = "bmp file is truncated";
+            return 0;
+        }
+    }
+    // rows are padded to four bytes
+    size_t stride = (((size_t) image->bits * image->width + 31) / 32) * 4;
+    if (offset > image->size || (image->size - offset) / stride < (size_t) image->height) {
+        *errmsg = "bmp file is truncated";
+        return 0;
+    }
+    return 1;
+}
+
+static int ml_ImageOpen(const char *path, ml_image_t *image, const char **errmsg) {
+    image->buffer = ml_MapFile(path, &image->size, &image->mapped_size, errmsg);
+    if (image->buffer == NULL) {
+        return 0;
+    }
+    const char *data = image->buffer;
+    int ok;
+    if (image->size >= 2 && data[0] == 'P' && data[1] >= '2' && data[1] <= '6' && data[1] != '4') {
+        ok = ml_ImageParsePnm(image, errmsg);
+    } else if (image->size >= 2 && data[0] == 'B' && data[1] == 'M') {
+        ok = ml_ImageParseBmp(image, errmsg);
+    } else {
+        *errmsg = "unsupported image format, expected PPM, PGM or BMP";
+        ok = 0;
+    }
+    if (ok && (image->width <= 0 || image->height <= 0
+               || image->width > ML_IMAGE_MAX_SIDE || image->height > ML_IMAGE_MAX_SIDE)) {
+        *errmsg = "invalid image size";
+        ok = 0;
+    }
+    if (!ok) {
+        ml_FreeBuffer(image->buffer, image->mapped_size);
+        image->buffer = NULL;
+    }
+    return ok;
+}
+
+// Decodes the pixels into interleaved (HWC) floats in [0, 1], rows top to bottom.
+static int ml_ImageDecode(const ml_image_t *image, float *hwc, const char **errmsg) {
+    const unsigned char *data = (const unsigned char *) image->buffer;
+    size_t n_samples = (size_t) image->width * image->height * image->channels;
+    switch (image->format) {
+        case ML_IMAGE_PNM_BINARY: {
+            const unsigned char *p = data + image->offset;
+            float scale = 1.0f / (float) image->maxval;
+            if (image->maxval > 255) {
+                for (size_t i = 0; i < n_samples; i++) {
+                    hwc[i] = (float) ((p[2 * i] << 8) | p[2 * i + 1]) * scale;
+                }
+            } else {
+                for (size_t i = 0; i < n_samples; i++) {
+                    hwc[i] = (float) p[i] * scale;
+                }
+            }
+            break;
+        }
+        case ML_IMAGE_PNM_ASCII: {
+            size_t pos = image->offset;
+            float scale = 1.0f / (float) image->maxval;
+            for (size_t i = 0; i < n_samples; i++) {
+                int value;
+                if (!ml_ImagePnmNumber(data, image->size, &pos, &value)) {
+                    *errmsg = "pnm file is truncated";
+                    return 0;
+                }
+                hwc[i] = (float) value * scale;
+            }
+            break;
+        }
+        case ML_IMAGE_BMP: {
+            size_t stride = (((size_t) image->bits * image->width + 31) / 32) * 4;
+            const float scale = 1.0f / 255.0f;
+            for (int y = 0; y < image->height; y++) {
+                // rows are stored bottom up unless the height is negative
+                const unsigned char *row = data + image->offset
+                                           + stride * (image->top_down ? y : image->height - 1 - y);
+                float *out = hwc + (size_t) y * image->width * 3;
+                for (int x = 0; x < image->width; x++) {
+                    const unsigned char *bgr;
+                    if (image->bits == 8) {
+                        int index = row[x] < image->n_palette ? row[x] : 0;
+                        bgr = image->palette + index * 4;
+                    } else {
+                        bgr = row + x * (image->bits / 8);
+                    }
+                    out[3 * x + 0] = (float) bgr[2] * scale;
+                    out[3 * x + 1] = (float) bgr[1] * scale;
+                    out[3 * x + 2] = (float) bgr[0] * scale;
+                }
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+// Samples a channel of the decoded image at the center of an output pixel, bilinear like
+// the half pixel resize of PIL and torch, and converts between gray and rgb.
+static float ml_ImageSample(const ml_image_t *image, const float *hwc, int channels, int c,
+                            int x0, int x1, float fx, int y0, int y1, float fy) {
+    int in_channels = image->channels;
+    int w = image->width;
+    float v[4];
+    const int xs[4] = {x0, x1, x0, x1};
+    const int ys[4] = {y0, y0, y1, y1};
+    for (int i = 0; i < 4; i++) {
+        const float *pixel = hwc + ((size_t) ys[i] * w + xs[i]) * in_channels;
+        if (in_channels == channels) {
+            v[i] = pixel[c];
+        } else if (in_channels == 1) {
+            v[i] = pixel[0];
+        } else {
+            v[i] = 0.299f * pixel[0] + 0.587f * pixel[1] + 0.114f * pixel[2];
+        }
+    }
+    float top = v[0] + (v[1] - v[0]) * fx;
+    float bottom = v[2] + (v[3] - v[2]) * fx;
+    return top + (bottom - top) * fy;
+}
+
+static void ml_ImageSourceCoordinate(int out, int out_size, int in_size, int *i0, int *i1, float *f) {
+    float s = ((float) out + 0.5f) * (float) in_size / (float) out_size - 0.5f;
+    if (s < 0.0f) {
+        s = 0.0f;
+    }
+    int i = (int) s;
+    if (i > in_size - 1) {
+        i = in_size - 1;
+    }
+    *i0 = i;
+    *i1 = i + 1 < in_size ? i + 1 : in_size - 1;
+    *f = s - (float) i;
+}
+
+static void ml_ImageWork(void *arg) {
+    ml_image_worker_t *worker = (ml_image_worker_t *) arg;
+    const ml_image_batch_t *batch = worker->batch;
+    size_t plane = (size_t) batch->width * batch->height;
+    float *hwc = NULL;
+    size_t hwc_size = 0;
+    int *x0 = (int *) Tcl_Alloc(sizeof(int) * batch->width * 2);
+    int *x1 = x0 + batch->width;
+    float *fx = (float *) Tcl_Alloc(sizeof(float) * batch->width);
+    for (int n = worker->first; n < batch->n_images; n += worker->stride) {
+        const ml_image_t *image = &batch->images[n];
+        size_t size = (size_t) image->width * image->height * image->channels;
+        if (size > hwc_size) {
+            if (hwc != NULL) {
+                Tcl_Free((char *) hwc);
+            }
+            hwc = (float *) Tcl_Alloc(sizeof(float) * size);
+            hwc_size = size;
+        }
+        if (!ml_ImageDecode(image, hwc, &worker->errmsg)) {
+            worker->error_image = n;
+            break;
+        }
+
+        // conversion to planes, with the normalization folded into a scale and an offset per channel
+        for (int x = 0; x < batch->width; x++) {
+            ml_ImageSourceCoordinate(x, batch->width, image->width, &x0[x], &x1[x], &fx[x]);
+        }
+        float *out = batch->data + (size_t) n * batch->channels * plane;
+        for (int c = 0; c < batch->channels; c++) {
+            float scale = 1.0f / batch->std[c];
+            float offset = -batch->mean[c] * scale;
+            for (int y = 0; y < batch->height; y++) {
+                int y0, y1;
+                float fy;
+                ml_ImageSourceCoordinate(y, batch->height, image->height, &y0, &y1, &fy);
+                float *row = out + c * plane + (size_t) y * batch->width;
+                for (int x = 0; x < batch->width; x++) {
+                    float v = ml_ImageSample(image, hwc, batch->channels, c, x0[x], x1[x], fx[x], y0, y1, fy);
+                    row[x] = v * scale + offset;
+                }
+            }
+        }
+    }
+    if (hwc != NULL) {
+        Tcl_Free((char *) hwc);
+    }
+    Tcl_Free((char *) fx);
+    Tcl_Free((char *) x0);
+}
+
+static int ml_GetImageChannelValues(Tcl_Interp *interp, Tcl_Obj *list_ptr, float *values, const char *name) {
+    Tcl_Obj **objs;
+    int n;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, list_ptr, &n, &objs)
+        || (n != 1 && n != ML_IMAGE_MAX_CHANNELS)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s is not a list of 1 or 3 numbers", name));
+        return TCL_ERROR;
+    }
+    for (int c = 0; c < ML_IMAGE_MAX_CHANNELS; c++) {
+        double value;
+        if (TCL_OK != Tcl_GetDoubleFromObj(interp, objs[n == 1 ? 0 : c], &value)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s is not a list of 1 or 3 numbers", name));
+            return TCL_ERROR;
+        }
+        values[c] = (float) value;
+    }
+    return TCL_OK;
+}
+
+int ml_LoadImagesCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LoadImagesCmd\n"));
+
+    static const char *options[] = {"-width", "-height", "-channels", "-mean", "-std", "-nthreads", NULL};
+    enum options {
+        OPT_WIDTH, OPT_HEIGHT, OPT_CHANNELS, OPT_MEAN, OPT_STD, OPT_NTHREADS
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle path_list ?-width w? ?-height h? ?-channels 1|3? ?-mean list? ?-std list? ?-nthreads n?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+
+    ml_image_batch_t batch = {
+            .width = 0,
+            .height = 0,
+            .channels = 0,
+            .mean = {0.0f, 0.0f, 0.0f},
+            .std = {1.0f, 1.0f, 1.0f},
+    };
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objv[2], &batch.n_images, &batch.paths) || batch.n_images == 0) {
+        SetResult("path_list is not a non-empty list");
+        return TCL_ERROR;
+    }
+
+    int nthreads = 4;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_WIDTH:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &batch.width) || batch.width <= 0
+                    || batch.width > ML_IMAGE_MAX_SIDE) {
+                    SetResult("width is not a valid image size");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_HEIGHT:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &batch.height) || batch.height <= 0
+                    || batch.height > ML_IMAGE_MAX_SIDE) {
+                    SetResult("height is not a valid image size");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_CHANNELS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &batch.channels)
+                    || (batch.channels != 1 && batch.channels != 3)) {
+                    SetResult("channels must be 1 or 3");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_MEAN:
+                if (TCL_OK != ml_GetImageChannelValues(interp, objv[i + 1], batch.mean, "mean")) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_STD:
+                if (TCL_OK != ml_GetImageChannelValues(interp, objv[i + 1], batch.std, "std")) {
+                    return TCL_ERROR;
+                }
+                for (int c = 0; c < ML_IMAGE_MAX_CHANNELS; c++) {
+                    if (batch.std[c] == 0.0f) {
+                        SetResult("std must not be zero");
+                        return TCL_ERROR;
+                    }
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    if ((batch.width == 0) != (batch.height == 0)) {
+        SetResult("width and height must be given together");
+        return TCL_ERROR;
+    }
+    int resize = batch.width != 0;
+
+    // the headers decide the shape of the tensor before any pixel is decoded
+    batch.images = (ml_image_t *) Tcl_Alloc(sizeof(ml_image_t) * batch.n_images);
+    memset(batch.images, 0, sizeof(ml_image_t) * batch.n_images);
+    int rc = TCL_OK;
+    for (int n = 0; n < batch.n_images; n++) {
+        const char *errmsg = NULL;
+        if (!ml_ImageOpen(Tcl_GetString(batch.paths[n]), &batch.images[n], &errmsg)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", Tcl_GetString(batch.paths[n]), errmsg));
+            rc = TCL_ERROR;
+            break;
+        }
+        if (n == 0) {
+            if (batch.width == 0) {
+                batch.width = batch.images[0].width;
+                batch.height = batch.images[0].height;
+            }
+            if (batch.channels == 0) {
+                batch.channels = batch.images[0].channels;
+            }
+        }
+        // only resizing allows images of different sizes
+        if (!resize && (batch.images[n].width != batch.width || batch.images[n].height != batch.height)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: image size differs from the first image, give -width and -height",
+                                                   Tcl_GetString(batch.paths[n])));
+            rc = TCL_ERROR;
+            break;
+        }
+    }
+
+    if (rc == TCL_OK) {
+        struct ggml_tensor *tensor = ggml_new_tensor_4d(ctx->ggml_ctx, GGML_TYPE_F32, batch.width, batch.height,
+                                                        batch.channels, batch.n_images);
+        ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+        batch.data = (float *) tensor->data;
+
+        int n_workers = nthreads < batch.n_images ? nthreads : batch.n_images;
+        ml_image_worker_t *workers = (ml_image_worker_t *) Tcl_Alloc(sizeof(ml_image_worker_t) * n_workers);
+        for (int t = 0; t < n_workers; t++) {
+            workers[t].batch = &batch;
+            workers[t].first = t;
+            workers[t].stride = n_workers;
+            workers[t].error_image = -1;
+            workers[t].errmsg = NULL;
+        }
+        ml_RunWorkers(ml_ImageWork, workers, sizeof(ml_image_worker_t), n_workers);
+        for (int t = 0; t < n_workers; t++) {
+            if (workers[t].error_image >= 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", Tcl_GetString(batch.paths[workers[t].error_image]),
+                                                       workers[t].errmsg));
+                rc = TCL_ERROR;
+                break;
+            }
+        }
+        if (rc == TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(tensor_ptr->handle, -1));
+        } else {
+            ml_DestroyTensorHandle(tensor_ptr);
+        }
+        Tcl_Free((char *) workers);
+    }
+
+    for (int n = 0; n < batch.n_images; n++) {
+        if (batch.images[n].buffer != NULL) {
+            ml_FreeBuffer(batch.images[n].buffer, batch.images[n].mapped_size);
+        }
+    }
+    Tcl_Free((char *) batch.images);
+    return rc;
+}
@@ -0,0 +1,13 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_IMAGE_H
+#define GGML_TCL_IMAGE_H
+
+#include "common.h"
+
+GGML_TCL_CMD(ml_LoadImagesCmd);
+
+#endif //GGML_TCL_IMAGE_H
@@ -0,0 +1,902 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "ivf.h"
+#include "kmeans.h"
+#include "tensor.h"
+
+static Tcl_HashTable ml_IvfToInternal_HT;
+static Tcl_Mutex ml_IvfToInternal_HT_Mutex;
+
+void ml_InitIvfHT() {
+    Tcl_MutexLock(&ml_IvfToInternal_HT_Mutex);
+    Tcl_InitHashTable(&ml_IvfToInternal_HT, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&ml_IvfToInternal_HT_Mutex);
+}
+
+void ml_DeleteIvfHT() {
+    Tcl_MutexLock(&ml_IvfToInternal_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_IvfToInternal_HT);
+    Tcl_MutexUnlock(&ml_IvfToInternal_HT_Mutex);
+}
+
+static int ml_RegisterIvf(const char *name, ml_ivf_t *internal) {
+    Tcl_HashEntry *entryPtr;
+    int newEntry;
+    Tcl_MutexLock(&ml_IvfToInternal_HT_Mutex);
+    entryPtr = Tcl_CreateHashEntry(&ml_IvfToInternal_HT, (char *) name, &newEntry);
+    if (newEntry) {
+        Tcl_SetHashValue(entryPtr, (ClientData) internal);
+    }
+    Tcl_MutexUnlock(&ml_IvfToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> RegisterIvf: name=%s internal=%p %s\n", name, internal,
+                newEntry ? "entered into" : "already in"));
+
+    return newEntry;
+}
+
+static int ml_UnregisterIvf(const char *name) {
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_IvfToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_IvfToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_IvfToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> UnregisterIvf: name=%s entryPtr=%p\n", name, entryPtr));
+
+    return entryPtr != NULL;
+}
+
+static ml_ivf_t *ml_GetInternalFromIvf(const char *name) {
+    ml_ivf_t *internal = NULL;
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_IvfToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_IvfToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        internal = (ml_ivf_t *) Tcl_GetHashValue(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_IvfToInternal_HT_Mutex);
+
+    return internal;
+}
+
+static const char *ml_IvfMetricNames[] = {"cosine", "dot", "l2", NULL};
+
+static ml_ivf_t *ml_IvfNew(int dim, int n_lists, ml_knn_metric_t metric, enum ggml_type type) {
+    ml_ivf_t *ivf = (ml_ivf_t *) Tcl_Alloc(sizeof(ml_ivf_t));
+    memset(ivf, 0, sizeof(ml_ivf_t));
+    ivf->dim = dim;
+    ivf->n_lists = n_lists;
+    ivf->metric = metric;
+    ivf->type = type;
+    ivf->row_size = ggml_row_size(type, dim);
+    ivf->centroids = (float *) Tcl_Alloc(sizeof(float) * dim * n_lists);
+    memset(ivf->centroids, 0, sizeof(float) * dim * n_lists);
+    ivf->lists = (ml_ivf_list_t *) Tcl_Alloc(sizeof(ml_ivf_list_t) * n_lists);
+    memset(ivf->lists, 0, sizeof(ml_ivf_list_t) * n_lists);
+    return ivf;
+}
+
+static void ml_IvfFree(ml_ivf_t *ivf) {
+    for (int l = 0; l < ivf->n_lists; l++) {
+        ml_ivf_list_t *list = &ivf->lists[l];
+        if (list->capacity > 0) {
+            Tcl_Free(list->vectors);
+            Tcl_Free((char *) list->ids);
+            Tcl_Free((char *) list->norms);
+        }
+    }
+    if (ivf->ctx != NULL) {
+        ivf->ctx->refcount--;
+    }
+    Tcl_Free((char *) ivf->lists);
+    Tcl_Free((char *) ivf->centroids);
+    Tcl_Free((char *) ivf);
+}
+
+// Makes room for n_more rows, taking over borrowed rows into memory of the list's own.
+static void ml_IvfListReserve(ml_ivf_t *ivf, ml_ivf_list_t *list, int64_t n_more) {
+    if (list->n + n_more <= list->capacity) {
+        return;
+    }
+    int64_t capacity = list->capacity > 0 ? list->capacity : 16;
+    while (capacity < list->n + n_more) {
+        capacity *= 2;
+    }
+    char *vectors = Tcl_Alloc(ivf->row_size * capacity);
+    int32_t *ids = (int32_t *) Tcl_Alloc(sizeof(int32_t) * capacity);
+    float *norms = (float *) Tcl_Alloc(sizeof(float) * capacity);
+    if (list->n > 0) {
+        memcpy(vectors, list->vectors, ivf->row_size * list->n);
+        memcpy(ids, list->ids, sizeof(int32_t) * list->n);
+        memcpy(norms, list->norms, sizeof(float) * list->n);
+    }
+    if (list->capacity > 0) {
+        Tcl_Free(list->vectors);
+        Tcl_Free((char *) list->ids);
+        Tcl_Free((char *) list->norms);
+    }
+    list->vectors = vectors;
+    list->ids = ids;
+    list->norms = norms;
+    list->capacity = capacity;
+}
+
+// Copies the rows of an F32 tensor, normalized for the cosine metric.
+static float *ml_IvfPrepareRows(ml_ivf_t *ivf, const struct ggml_tensor *tensor, int64_t n) {
+    const int d = ivf->dim;
+    float *rows = (float *) Tcl_Alloc(sizeof(float) * d * n);
+    memcpy(rows, tensor->data, sizeof(float) * d * n);
+    if (ivf->metric == ML_KNN_COSINE) {
+        for (int64_t i = 0; i < n; i++) {
+            float *row = rows + (size_t) i * d;
+            double sum = 0.0;
+            for (int j = 0; j < d; j++) {
+                sum += (double) row[j] * row[j];
+            }
+            if (sum > 0.0) {
+                float scale = (float) (1.0 / sqrt(sum));
+                for (int j = 0; j < d; j++) {
+                    row[j] *= scale;
+                }
+            }
+        }
+    }
+    return rows;
+}
+
+static int ml_IvfGetRows(Tcl_Interp *interp, ml_ivf_t *ivf, Tcl_Obj *objPtr, struct ggml_tensor **tensor) {
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(objPtr));
+    if (!tensor_ptr) {
+        SetResult("tensor handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *t = tensor_ptr->ggml_tensor;
+    if (t->data == NULL || t->type != GGML_TYPE_F32 || !ggml_is_contiguous(t) || t->ne[2] != 1 || t->ne[3] != 1) {
+        SetResult("tensor must be a contiguous 1D or 2D F32 tensor with data");
+        return TCL_ERROR;
+    }
+    if (t->ne[0] != ivf->dim) {
+        SetResult("tensor rows differ in length from the index dimension");
+        return TCL_ERROR;
+    }
+    *tensor = t;
+    return TCL_OK;
+}
+
+// Scores the rows of a list against a query converted to the vec_dot type of the storage type.
+static void ml_IvfScanList(const ml_ivf_t *ivf, const ml_ivf_list_t *list, const void *query, float query_norm,
+                           ggml_vec_dot_t vec_dot, ml_knn_hit_t *heap, int *n_hits, int k) {
+    for (int64_t r = 0; r < list->n; r++) {
+        float score;
+        vec_dot(ivf->dim, &score, list->vectors + ivf->row_size * r, query);
+        if (ivf->metric == ML_KNN_L2) {
+            score = 2.0f * score - list->norms[r] - query_norm;
+        }
+        ml_KnnHeapPush(heap, n_hits, k, score, list->ids[r]);
+    }
+}
+
+typedef struct ml_ivf_search_s {
+    const ml_ivf_t *ivf;
+    const float *queries;               // normalized for the cosine metric
+    const float *query_norms;
+    const int32_t *probes;              // nprobe lists per query
+    int n_queries;
+    int nprobe;
+    int k;
+    int nthreads;
+} ml_ivf_search_t;
+
+typedef struct ml_ivf_worker_s {
+    const ml_ivf_search_t *search;
+    int index;
+    ml_knn_hit_t *hits;                 // k per query
+    int *n_hits;
+} ml_ivf_worker_t;
+
+// Every worker takes every nthreads-th (query, probe) pair and keeps its own heaps.
+static void ml_IvfSearchWork(void *arg) {
+    ml_ivf_worker_t *worker = (ml_ivf_worker_t *) arg;
+    const ml_ivf_search_t *search = worker->search;
+    const ml_ivf_t *ivf = search->ivf;
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(ivf->type);
+    const enum ggml_type dot_type = traits.vec_dot_type;
+    void *converted = Tcl_Alloc(ggml_row_size(dot_type, ivf->dim));
+    int converted_query = -1;
+
+    for (int q = 0; q < search->n_queries; q++) {
+        worker->n_hits[q] = 0;
+    }
+    const int n_items = search->n_queries * search->nprobe;
+    for (int item = worker->index; item < n_items; item += search->nthreads) {
+        const int q = item / search->nprobe;
+        const int32_t l = search->probes[item];
+        if (l < 0 || ivf->lists[l].n == 0) {
+            continue;
+        }
+        const float *query = search->queries + (size_t) q * ivf->dim;
+        if (converted_query != q) {
+            if (dot_type == GGML_TYPE_F32) {
+                memcpy(converted, query, sizeof(float) * ivf->dim);
+            } else {
+                ggml_internal_get_type_traits(dot_type).from_float(query, converted, ivf->dim);
+            }
+            converted_query = q;
+        }
+        ml_IvfScanList(ivf, &ivf->lists[l], converted, search->query_norms[q], traits.vec_dot,
+                       worker->hits + (size_t) q * search->k, &worker->n_hits[q], search->k);
+    }
+    Tcl_Free(converted);
+}
+
+static void ml_IvfSearch(const ml_ivf_t *ivf, const float *queries, int n_queries, int k, int nprobe, int nthreads,
+                         ml_knn_hit_t *hits, int *n_hits) {
+    const int d = ivf->dim;
+    float *query_norms = (float *) Tcl_Alloc(sizeof(float) * n_queries);
+    for (int q = 0; q < n_queries; q++) {
+        double sum = 0.0;
+        for (int j = 0; j < d; j++) {
+            sum += (double) queries[(size_t) q * d + j] * queries[(size_t) q * d + j];
+        }
+        query_norms[q] = (float) sum;
+    }
+
+    // the nprobe nearest centroids of every query
+    int32_t *probes = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n_queries * nprobe);
+    ml_knn_hit_t *heap = (ml_knn_hit_t *) Tcl_Alloc(sizeof(ml_knn_hit_t) * nprobe);
+    for (int q = 0; q < n_queries; q++) {
+        const float *query = queries + (size_t) q * d;
+        int n_heap = 0;
+        for (int l = 0; l < ivf->n_lists; l++) {
+            const float *centroid = ivf->centroids + (size_t) l * d;
+            float score = 0.0f;
+            for (int j = 0; j < d; j++) {
+                float diff = query[j] - centroid[j];
+                score -= diff * diff;
+            }
+            ml_KnnHeapPush(heap, &n_heap, nprobe, score, l);
+        }
+        for (int i = 0; i < nprobe; i++) {
+            probes[(size_t) q * nprobe + i] = i < n_heap ? (int32_t) heap[i].index : -1;
+        }
+    }
+    Tcl_Free((char *) heap);
+
+    ml_ivf_search_t search = {
+            .ivf = ivf,
+            .queries = queries,
+            .query_norms = query_norms,
+            .probes = probes,
+            .n_queries = n_queries,
+            .nprobe = nprobe,
+            .k = k,
+            .nthreads = nthreads,
+    };
+    ml_ivf_worker_t *workers = (ml_ivf_worker_t *) Tcl_Alloc(sizeof(ml_ivf_worker_t) * nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].search = &search;
+        workers[t].index = t;
+        workers[t].hits = t == 0 ? hits : (ml_knn_hit_t *) Tcl_Alloc(sizeof(ml_knn_hit_t) * k * n_queries);
+        workers[t].n_hits = t == 0 ? n_hits : (int *) Tcl_Alloc(sizeof(int) * n_queries);
+    }
+    ml_RunWorkers(ml_IvfSearchWork, workers, sizeof(ml_ivf_worker_t), nthreads);
+
+    // merge the heaps of the other workers into the first one
+    for (int t = 1; t < nthreads; t++) {
+        for (int q = 0; q < n_queries; q++) {
+            for (int i = 0; i < workers[t].n_hits[q]; i++) {
+                const ml_knn_hit_t *hit = &workers[t].hits[(size_t) q * k + i];
+                ml_KnnHeapPush(hits + (size_t) q * k, &n_hits[q], k, hit->score, hit->index);
+            }
+        }
+        Tcl_Free((char *) workers[t].hits);
+        Tcl_Free((char *) workers[t].n_hits);
+    }
+    for (int q = 0; q < n_queries; q++) {
+        ml_KnnFinish(hits + (size_t) q * k, n_hits[q], ivf->metric);
+    }
+
+    Tcl_Free((char *) workers);
+    Tcl_Free((char *) probes);
+    Tcl_Free((char *) query_norms);
+}
+
+int ml_IvfCreateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfCreateCmd\n"));
+
+    static const char *options[] = {"-metric", "-type", NULL};
+    enum options {
+        OPT_METRIC, OPT_TYPE
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "dim n_lists ?-metric cosine|dot|l2? ?-type F32|F16|Q8_0|Q4_0?");
+        return TCL_ERROR;
+    }
+
+    int dim;
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[1], &dim) || dim <= 0) {
+        SetResult("dim is not an integer > 0");
+        return TCL_ERROR;
+    }
+    int n_lists;
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[2], &n_lists) || n_lists <= 0) {
+        SetResult("n_lists is not an integer > 0");
+        return TCL_ERROR;
+    }
+
+    ml_knn_metric_t metric = ML_KNN_COSINE;
+    enum ggml_type type = GGML_TYPE_F32;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_METRIC:
+                if (TCL_OK != ml_GetKnnMetricFromObj(interp, objv[i + 1], &metric)) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_TYPE:
+                if (TCL_OK != ml_GetTypeFromObj(interp, objv[i + 1], &type)) {
+                    return TCL_ERROR;
+                }
+                if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0 && type != GGML_TYPE_Q4_0) {
+                    SetResult("type must be F32, F16, Q8_0 or Q4_0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    if (dim % ggml_blck_size(type) != 0) {
+        SetResult("dim is not a multiple of the block size of the type");
+        return TCL_ERROR;
+    }
+
+    ml_ivf_t *ivf = ml_IvfNew(dim, n_lists, metric, type);
+    CMD_IVF_NAME(ivf->handle, ivf);
+    ml_RegisterIvf(ivf->handle, ivf);
+
+    SetResult(ivf->handle);
+    return TCL_OK;
+}
+
+int ml_IvfDestroyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfDestroyCmd\n"));
+    CheckArgs(2, 2, 1, "ivf_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_ivf_t *ivf = ml_GetInternalFromIvf(handle);
+    if (!ivf) {
+        SetResult("ivf handle not found");
+        return TCL_ERROR;
+    }
+    if (!ml_UnregisterIvf(handle)) {
+        SetResult("unregister ivf name failed");
+        return TCL_ERROR;
+    }
+
+    ml_IvfFree(ivf);
+    return TCL_OK;
+}
+
+int ml_IvfTrainCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfTrainCmd\n"));
+
+    static const char *options[] = {"-iterations", "-nthreads", "-seed", NULL};
+    enum options {
+        OPT_ITERATIONS, OPT_NTHREADS, OPT_SEED
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "ivf_handle tensor_handle ?-iterations n? ?-nthreads n? ?-seed n?");
+        return TCL_ERROR;
+    }
+
+    ml_ivf_t *ivf = ml_GetInternalFromIvf(Tcl_GetString(objv[1]));
+    if (!ivf) {
+        SetResult("ivf handle not found");
+        return TCL_ERROR;
+    }
+    if (ivf->n_total > 0) {
+        SetResult("index already holds vectors");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *tensor;
+    if (TCL_OK != ml_IvfGetRows(interp, ivf, objv[2], &tensor)) {
+        return TCL_ERROR;
+    }
+
+    int iterations = 10;
+    int nthreads = 4;
+    Tcl_WideInt seed = 0;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_ITERATIONS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &iterations) || iterations <= 0) {
+                    SetResult("iterations is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_SEED:
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &seed)) {
+                    SetResult("seed is not an integer");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    int64_t n = tensor->ne[1];
+    float *rows = ml_IvfPrepareRows(ivf, tensor, n);
+    const char *errmsg = NULL;
+    ml_kmeans_params_t params = {
+            .k = ivf->n_lists,
+            .n_iter = iterations,
+            .init = ML_KMEANS_INIT_RANDOM,
+            .batch_size = 0,
+            .nthreads = nthreads,
+            .seed = (uint64_t) seed,
+    };
+    int rc = ml_KMeansTrain(rows, n, ivf->dim, &params, ivf->centroids, &errmsg);
+    Tcl_Free((char *) rows);
+    if (rc != TCL_OK) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ivf->trained = 1;
+    return TCL_OK;
+}
+
+int ml_IvfAddCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfAddCmd\n"));
+
+    static const char *options[] = {"-ids", "-nthreads", NULL};
+    enum options {
+        OPT_IDS, OPT_NTHREADS
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "ivf_handle tensor_handle ?-ids id_list? ?-nthreads n?");
+        return TCL_ERROR;
+    }
+
+    ml_ivf_t *ivf = ml_GetInternalFromIvf(Tcl_GetString(objv[1]));
+    if (!ivf) {
+        SetResult("ivf handle not found");
+        return TCL_ERROR;
+    }
+    if (!ivf->trained) {
+        SetResult("index is not trained");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *tensor;
+    if (TCL_OK != ml_IvfGetRows(interp, ivf, objv[2], &tensor)) {
+        return TCL_ERROR;
+    }
+    const int64_t n = tensor->ne[1];
+
+    Tcl_Obj *ids_ptr = NULL;
+    int nthreads = 4;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_IDS:
+                ids_ptr = objv[i + 1];
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    // ids default to the order of insertion
+    int32_t *ids = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n);
+    if (ids_ptr != NULL) {
+        Tcl_Obj **id_objs;
+        int n_ids;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, ids_ptr, &n_ids, &id_objs) || n_ids != n) {
+            Tcl_Free((char *) ids);
+            SetResult("ids is not a list with one id per row");
+            return TCL_ERROR;
+        }
+        for (int64_t i = 0; i < n; i++) {
+            int id;
+            if (TCL_OK != Tcl_GetIntFromObj(interp, id_objs[i], &id) || id < 0) {
+                Tcl_Free((char *) ids);
+                SetResult("id is not an integer >= 0");
+                return TCL_ERROR;
+            }
+            ids[i] = id;
+        }
+    } else {
+        for (int64_t i = 0; i < n; i++) {
+            ids[i] = ivf->next_id + (int32_t) i;
+        }
+    }
+
+    float *rows = ml_IvfPrepareRows(ivf, tensor, n);
+    int32_t *assign = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_KMeansAssign(rows, n, ivf->dim, ivf->centroids, ivf->n_lists, nthreads, assign, &errmsg)) {
+        Tcl_Free((char *) assign);
+        Tcl_Free((char *) rows);
+        Tcl_Free((char *) ids);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    for (int64_t i = 0; i < n; i++) {
+        const float *row = rows + (size_t) i * ivf->dim;
+        ml_ivf_list_t *list = &ivf->lists[assign[i]];
+        ml_IvfListReserve(ivf, list, 1);
+        char *dst = list->vectors + ivf->row_size * list->n;
+        switch (ivf->type) {
+            case GGML_TYPE_F32:
+                memcpy(dst, row, sizeof(float) * ivf->dim);
+                break;
+            case GGML_TYPE_F16:
+                ggml_fp32_to_fp16_row(row, (ggml_fp16_t *) dst, ivf->dim);
+                break;
+            default: {
+                int64_t hist[16] = {0};
+                ggml_quantize_chunk(ivf->type, row, dst, 0, ivf->dim, hist);
+            }
+        }
+        double sum = 0.0;
+        for (int j = 0; j < ivf->dim; j++) {
+            sum += (double) row[j] * row[j];
+        }
+        list->norms[list->n] = (float) sum;
+        list->ids[list->n] = ids[i];
+        list->n++;
+        if (ids[i] >= ivf->next_id) {
+            ivf->next_id = ids[i] + 1;
+        }
+    }
+    ivf->n_total += n;
+
+    Tcl_Free((char *) assign);
+    Tcl_Free((char *) rows);
+    Tcl_Free((char *) ids);
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(ivf->n_total));
+    return TCL_OK;
+}
+
+int ml_IvfSearchCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfSearchCmd\n"));
+
+    static const char *options[] = {"-nprobe", "-nthreads", NULL};
+    enum options {
+        OPT_NPROBE, OPT_NTHREADS
+    };
+
+    if (objc < 4 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "ivf_handle query_tensor_handle k ?-nprobe n? ?-nthreads n?");
+        return TCL_ERROR;
+    }
+
+    ml_ivf_t *ivf = ml_GetInternalFromIvf(Tcl_GetString(objv[1]));
+    if (!ivf) {
+        SetResult("ivf handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *tensor;
+    if (TCL_OK != ml_IvfGetRows(interp, ivf, objv[2], &tensor)) {
+        return TCL_ERROR;
+    }
+    int k;
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[3], &k) || k <= 0) {
+        SetResult("k is not an integer > 0");
+        return TCL_ERROR;
+    }
+
+    int nprobe = 8;
+    int nthreads = 4;
+    for (int i = 4; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_NPROBE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nprobe) || nprobe <= 0) {
+                    SetResult("nprobe is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    if (nprobe > ivf->n_lists) {
+        nprobe = ivf->n_lists;
+    }
+
+    const int n_queries = (int) tensor->ne[1];
+    if (nthreads > n_queries * nprobe) {
+        nthreads = n_queries * nprobe;
+    }
+    float *queries = ml_IvfPrepareRows(ivf, tensor, n_queries);
+    ml_knn_hit_t *hits = (ml_knn_hit_t *) Tcl_Alloc(sizeof(ml_knn_hit_t) * k * n_queries);
+    int *n_hits = (int *) Tcl_Alloc(sizeof(int) * n_queries);
+    ml_IvfSearch(ivf, queries, n_queries, k, nprobe, nthreads, hits, n_hits);
+    Tcl_Free((char *) queries);
+
+    // the same shape as the result of ::ggml::knn
+    Tcl_Obj *result_ptr = Tcl_NewListObj(0, NULL);
+    for (int q = 0; q < n_queries; q++) {
+        Tcl_Obj *list_ptr = Tcl_NewListObj(0, NULL);
+        for (int i = 0; i < n_hits[q]; i++) {
+            const ml_knn_hit_t *hit = &hits[(size_t) q * k + i];
+            Tcl_ListObjAppendElement(interp, list_ptr, Tcl_NewWideIntObj(hit->index));
+            Tcl_ListObjAppendElement(interp, list_ptr, Tcl_NewDoubleObj(hit->score));
+        }
+        if (n_queries == 1) {
+            Tcl_DecrRefCount(result_ptr);
+            result_ptr = list_ptr;
+            break;
+        }
+        Tcl_ListObjAppendElement(interp, result_ptr, list_ptr);
+    }
+    Tcl_Free((char *) n_hits);
+    Tcl_Free((char *) hits);
+
+    Tcl_SetObjResult(interp, result_ptr);
+    return TCL_OK;
+}
+
+int ml_IvfSaveCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfSaveCmd\n"));
+    CheckArgs(3, 3, 1, "ivf_handle path");
+
+    ml_ivf_t *ivf = ml_GetInternalFromIvf(Tcl_GetString(objv[1]));
+    if (!ivf) {
+        SetResult("ivf handle not found");
+        return TCL_ERROR;
+    }
+    if (!ivf->trained || ivf->n_total == 0) {
+        SetResult("index is empty");
+        return TCL_ERROR;
+    }
+
+    // gguf_write_to_file asserts when it cannot open the file, which would take the process down
+    const char *path = Tcl_GetString(objv[2]);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        SetResult("could not open file for writing");
+        return TCL_ERROR;
+    }
+    fclose(fp);
+
+    // the tensors only describe the buffers below, gguf writes their data
+    struct ggml_init_params params = {
+            .mem_size   = ggml_tensor_overhead() * 5,
+            .mem_buffer = NULL,
+            .no_alloc   = true,
+    };
+    struct ggml_context *ctx0 = ggml_init(params);
+    if (ctx0 == NULL) {
+        SetResult("could not create ggml context, too many contexts");
+        return TCL_ERROR;
+    }
+
+    // the lists are written back to back, offsets[l] is the first row of list l
+    const int64_t n = ivf->n_total;
+    char *vectors = Tcl_Alloc(ivf->row_size * n);
+    int32_t *ids = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n);
+    float *norms = (float *) Tcl_Alloc(sizeof(float) * n);
+    int32_t *offsets = (int32_t *) Tcl_Alloc(sizeof(int32_t) * (ivf->n_lists + 1));
+    int64_t row = 0;
+    for (int l = 0; l < ivf->n_lists; l++) {
+        const ml_ivf_list_t *list = &ivf->lists[l];
+        offsets[l] = (int32_t) row;
+        if (list->n > 0) {
+            memcpy(vectors + ivf->row_size * row, list->vectors, ivf->row_size * list->n);
+            memcpy(ids + row, list->ids, sizeof(int32_t) * list->n);
+            memcpy(norms + row, list->norms, sizeof(float) * list->n);
+        }
+        row += list->n;
+    }
+    offsets[ivf->n_lists] = (int32_t) row;
+
+    struct ggml_tensor *centroids_t = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, ivf->dim, ivf->n_lists);
+    centroids_t->data = ivf->centroids;
+    ggml_set_name(centroids_t, "ivf.centroids");
+    struct ggml_tensor *vectors_t = ggml_new_tensor_2d(ctx0, ivf->type, ivf->dim, n);
+    vectors_t->data = vectors;
+    ggml_set_name(vectors_t, "ivf.vectors");
+    struct ggml_tensor *ids_t = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n);
+    ids_t->data = ids;
+    ggml_set_name(ids_t, "ivf.ids");
+    struct ggml_tensor *norms_t = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n);
+    norms_t->data = norms;
+    ggml_set_name(norms_t, "ivf.norms");
+    struct ggml_tensor *offsets_t = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, ivf->n_lists + 1);
+    offsets_t->data = offsets;
+    ggml_set_name(offsets_t, "ivf.offsets");
+
+    struct gguf_context *gguf_ctx = gguf_init_empty();
+    gguf_set_val_u32(gguf_ctx, "ivf.dim", ivf->dim);
+    gguf_set_val_u32(gguf_ctx, "ivf.n_lists", ivf->n_lists);
+    gguf_set_val_str(gguf_ctx, "ivf.metric", ml_IvfMetricNames[ivf->metric]);
+    gguf_set_val_i32(gguf_ctx, "ivf.next_id", ivf->next_id);
+    gguf_add_tensor(gguf_ctx, centroids_t);
+    gguf_add_tensor(gguf_ctx, vectors_t);
+    gguf_add_tensor(gguf_ctx, ids_t);
+    gguf_add_tensor(gguf_ctx, norms_t);
+    gguf_add_tensor(gguf_ctx, offsets_t);
+    gguf_write_to_file(gguf_ctx, path, false);
+    gguf_free(gguf_ctx);
+    ggml_free(ctx0);
+
+    Tcl_Free((char *) offsets);
+    Tcl_Free((char *) norms);
+    Tcl_Free((char *) ids);
+    Tcl_Free(vectors);
+    return TCL_OK;
+}
+
+int ml_IvfLoadCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfLoadCmd\n"));
+    CheckArgs(2, 2, 1, "context_handle");
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->gguf_ctx == NULL) {
+        SetResult("context was not loaded from a gguf file");
+        return TCL_ERROR;
+    }
+
+    int dim_key = gguf_find_key(ctx->gguf_ctx, "ivf.dim");
+    int n_lists_key = gguf_find_key(ctx->gguf_ctx, "ivf.n_lists");
+    int metric_key = gguf_find_key(ctx->gguf_ctx, "ivf.metric");
+    int next_id_key = gguf_find_key(ctx->gguf_ctx, "ivf.next_id");
+    struct ggml_tensor *centroids_t = ggml_get_tensor(ctx->ggml_ctx, "ivf.centroids");
+    struct ggml_tensor *vectors_t = ggml_get_tensor(ctx->ggml_ctx, "ivf.vectors");
+    struct ggml_tensor *ids_t = ggml_get_tensor(ctx->ggml_ctx, "ivf.ids");
+    struct ggml_tensor *norms_t = ggml_get_tensor(ctx->ggml_ctx, "ivf.norms");
+    struct ggml_tensor *offsets_t = ggml_get_tensor(ctx->ggml_ctx, "ivf.offsets");
+    if (dim_key < 0 || n_lists_key < 0 || metric_key < 0 || next_id_key < 0 || centroids_t == NULL
+        || vectors_t == NULL || ids_t == NULL || norms_t == NULL || offsets_t == NULL) {
+        SetResult("context does not hold an ivf index");
+        return TCL_ERROR;
+    }
+    // the gguf getters assert on a value of another type
+    if (gguf_get_kv_type(ctx->gguf_ctx, dim_key) != GGUF_TYPE_UINT32
+        || gguf_get_kv_type(ctx->gguf_ctx, n_lists_key) != GGUF_TYPE_UINT32
+        || gguf_get_kv_type(ctx->gguf_ctx, metric_key) != GGUF_TYPE_STRING
+        || gguf_get_kv_type(ctx->gguf_ctx, next_id_key) != GGUF_TYPE_INT32) {
+        SetResult("ivf index in context is inconsistent");
+        return TCL_ERROR;
+    }
+    // searches need vec_dot and adding vectors needs from_float, which only these types are known to have
+    enum ggml_type type = vectors_t->type;
+    if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0 && type != GGML_TYPE_Q4_0) {
+        SetResult("ivf vectors must be F32, F16, Q8_0 or Q4_0");
+        return TCL_ERROR;
+    }
+
+    int dim = (int) gguf_get_val_u32(ctx->gguf_ctx, dim_key);
+    int n_lists = (int) gguf_get_val_u32(ctx->gguf_ctx, n_lists_key);
+    const char *metric_name = gguf_get_val_str(ctx->gguf_ctx, metric_key);
+    int metric = -1;
+    for (int i = 0; ml_IvfMetricNames[i] != NULL; i++) {
+        if (strcmp(metric_name, ml_IvfMetricNames[i]) == 0) {
+            metric = i;
+        }
+    }
+    const int64_t n = vectors_t->ne[1];
+    if (metric < 0 || dim <= 0 || n_lists <= 0 || centroids_t->type != GGML_TYPE_F32 || centroids_t->ne[0] != dim
+        || centroids_t->ne[1] != n_lists || vectors_t->ne[0] != dim || dim % ggml_blck_size(type) != 0 || ids_t->type != GGML_TYPE_I32 || ids_t->ne[0] != n
+        || norms_t->type != GGML_TYPE_F32 || norms_t->ne[0] != n || offsets_t->type != GGML_TYPE_I32
+        || offsets_t->ne[0] != n_lists + 1) {
+        SetResult("ivf index in context is inconsistent");
+        return TCL_ERROR;
+    }
+    const int32_t *offsets = (const int32_t *) offsets_t->data;
+    for (int l = 0; l < n_lists; l++) {
+        if (offsets[l] < 0 || offsets[l] > offsets[l + 1] || offsets[l + 1] > n) {
+            SetResult("ivf index in context is inconsistent");
+            return TCL_ERROR;
+        }
+    }
+
+    // the lists point into the context until vectors are added to them
+    ml_ivf_t *ivf = ml_IvfNew(dim, n_lists, (ml_knn_metric_t) metric, vectors_t->type);
+    memcpy(ivf->centroids, centroids_t->data, sizeof(float) * dim * n_lists);
+    ivf->trained = 1;
+    for (int l = 0; l < n_lists; l++) {
+        ml_ivf_list_t *list = &ivf->lists[l];
+        list->vectors = (char *) vectors_t->data + ivf->row_size * offsets[l];
+        list->ids = (int32_t *) ids_t->data + offsets[l];
+        list->norms = (float *) norms_t->data + offsets[l];
+        list->n = offsets[l + 1] - offsets[l];
+        list->capacity = 0;
+    }
+    ivf->n_total = n;
+    ivf->next_id = gguf_get_val_i32(ctx->gguf_ctx, next_id_key);
+    ivf->ctx = ctx;
+    ctx->refcount++;
+
+    CMD_IVF_NAME(ivf->handle, ivf);
+    ml_RegisterIvf(ivf->handle, ivf);
+
+    SetResult(ivf->handle);
+    return TCL_OK;
+}
+
+int ml_IvfInfoCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "IvfInfoCmd\n"));
+    CheckArgs(2, 2, 1, "ivf_handle");
+
+    ml_ivf_t *ivf = ml_GetInternalFromIvf(Tcl_GetString(objv[1]));
+    if (!ivf) {
+        SetResult("ivf handle not found");
+        return TCL_ERROR;
+    }
+
+    int64_t min_list = ivf->n_lists > 0 ? ivf->lists[0].n : 0;
+    int64_t max_list = 0;
+    for (int l = 0; l < ivf->n_lists; l++) {
+        if (ivf->lists[l].n < min_list) {
+            min_list = ivf->lists[l].n;
+        }
+        if (ivf->lists[l].n > max_list) {
+            max_list = ivf->lists[l].n;
+        }
+    }
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("dim", -1), Tcl_NewIntObj(ivf->dim));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_lists", -1), Tcl_NewIntObj(ivf->n_lists));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("metric", -1), Tcl_NewStringObj(ml_IvfMetricNames[ivf->metric], -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("type", -1), Tcl_NewStringObj(ggml_type_name(ivf->type), -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("trained", -1), Tcl_NewBooleanObj(ivf->trained));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("size", -1), Tcl_NewWideIntObj(ivf->n_total));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("min_list", -1), Tcl_NewWideIntObj(min_list));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("max_list", -1), Tcl_NewWideIntObj(max_list));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("vector_bytes", -1), Tcl_NewWideIntObj((Tcl_WideInt) (ivf->row_size * ivf->n_total)));
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
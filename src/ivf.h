@@ -0,0 +1,51 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_IVF_H
+#define GGML_TCL_IVF_H
+
+#include <ggml.h>
+#include "common.h"
+#include "knn.h"
+
+#define CMD_IVF_NAME(s, internal) sprintf((s), "_GGML_IVF_%p", (internal))
+
+// The vectors assigned to one centroid.
+typedef struct ml_ivf_list_s {
+    char *vectors;                      // n rows of row_size bytes
+    int32_t *ids;
+    float *norms;                       // squared L2 norms of the vectors before compression
+    int64_t n;
+    int64_t capacity;                   // 0 while the rows are borrowed from a loaded context
+} ml_ivf_list_t;
+
+typedef struct ml_ivf_s {
+    int dim;
+    int n_lists;
+    ml_knn_metric_t metric;             // cosine vectors are normalized and searched by dot product
+    enum ggml_type type;                // storage type of the vectors
+    size_t row_size;
+    float *centroids;                   // dim x n_lists, set by training
+    int trained;
+    ml_ivf_list_t *lists;
+    int64_t n_total;
+    int32_t next_id;
+    ml_context_t *ctx;                  // the gguf context the lists were loaded from
+    char handle[40];
+} ml_ivf_t;
+
+void ml_InitIvfHT();
+void ml_DeleteIvfHT();
+
+GGML_TCL_CMD(ml_IvfCreateCmd);
+GGML_TCL_CMD(ml_IvfDestroyCmd);
+GGML_TCL_CMD(ml_IvfTrainCmd);
+GGML_TCL_CMD(ml_IvfAddCmd);
+GGML_TCL_CMD(ml_IvfSearchCmd);
+GGML_TCL_CMD(ml_IvfSaveCmd);
+GGML_TCL_CMD(ml_IvfLoadCmd);
+GGML_TCL_CMD(ml_IvfInfoCmd);
+
+#endif //GGML_TCL_IVF_H
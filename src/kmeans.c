@@ -0,0 +1,437 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <string.h>
+#include "kmeans.h"
+#include "sample.h"
+#include "tensor.h"
+
+// scores computed per graph, a block of points times the centroids
+#define ML_KMEANS_BLOCK_VALUES (4 * 1024 * 1024)
+
+static uint64_t ml_KMeansRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+int ml_KMeansAssign(const float *data, int64_t n, int d, const float *centroids, int k, int nthreads,
+                    int32_t *assign, const char **errmsg) {
+    // -|c|^2 / 2 is added to the dot products, the largest sum is the nearest centroid
+    float *bias = (float *) Tcl_Alloc(sizeof(float) * k);
+    for (int c = 0; c < k; c++) {
+        const float *centroid = centroids + (size_t) c * d;
+        double sum = 0.0;
+        for (int i = 0; i < d; i++) {
+            sum += (double) centroid[i] * centroid[i];
+        }
+        bias[c] = (float) (-0.5 * sum);
+    }
+
+    int64_t block = ML_KMEANS_BLOCK_VALUES / k;
+    if (block < 1) {
+        block = 1;
+    }
+    if (block > n) {
+        block = n;
+    }
+    size_t mem_size = ggml_tensor_overhead() * 8 + ggml_graph_overhead()
+                      + 2 * sizeof(float) * k * block + sizeof(int32_t) * block + 4 * GGML_MEM_ALIGN;
+    char *mem = Tcl_Alloc(mem_size);
+    char *work = NULL;
+    size_t work_size = 0;
+
+    int rc = TCL_OK;
+    for (int64_t row0 = 0; row0 < n; row0 += block) {
+        int64_t n_block = n - row0 < block ? n - row0 : block;
+        struct ggml_init_params params = {
+                .mem_size   = mem_size,
+                .mem_buffer = mem,
+                .no_alloc   = true,
+        };
+        struct ggml_context *ctx0 = ggml_init(params);
+        if (ctx0 == NULL) {
+            *errmsg = "could not create the assignment context";
+            rc = TCL_ERROR;
+            break;
+        }
+
+        // the inputs point at the caller's buffers, only the intermediate results are allocated
+        struct ggml_tensor *points = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, d, n_block);
+        points->data = (void *) (data + (size_t) row0 * d);
+        struct ggml_tensor *cents = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, d, k);
+        cents->data = (void *) centroids;
+        struct ggml_tensor *bias_t = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, k);
+        bias_t->data = bias;
+        ggml_set_no_alloc(ctx0, false);
+
+        struct ggml_tensor *scores = ggml_add(ctx0, ggml_mul_mat(ctx0, cents, points), bias_t);
+        struct ggml_tensor *nearest = ggml_argmax(ctx0, scores);
+        struct ggml_cgraph *gf = ggml_new_graph(ctx0);
+        ggml_build_forward_expand(gf, nearest);
+
+        struct ggml_cplan cplan = ggml_graph_plan(gf, nthreads);
+        if (cplan.work_size > work_size) {
+            work = Tcl_Realloc(work, cplan.work_size);
+            work_size = cplan.work_size;
+        }
+        cplan.work_data = (uint8_t *) work;
+        if (GGML_EXIT_SUCCESS != ggml_graph_compute(gf, &cplan)) {
+            ggml_free(ctx0);
+            *errmsg = "assignment failed";
+            rc = TCL_ERROR;
+            break;
+        }
+        memcpy(assign + row0, nearest->data, sizeof(int32_t) * n_block);
+        ggml_free(ctx0);
+    }
+
+    if (work != NULL) {
+        Tcl_Free(work);
+    }
+    Tcl_Free(mem);
+    Tcl_Free((char *) bias);
+    return rc;
+}
+
+// k-means++: every next centroid is a point drawn with probability proportional to its squared
+// distance from the nearest centroid chosen so far.
+static void ml_KMeansPlusPlus(const float *data, int64_t n, int d, int k, uint64_t *state, float *centroids) {
+    double *nearest = (double *) Tcl_Alloc(sizeof(double) * n);
+    int64_t first = (int64_t) (ml_KMeansRandom(state) % (uint64_t) n);
+    memcpy(centroids, data + (size_t) first * d, sizeof(float) * d);
+    for (int64_t i = 0; i < n; i++) {
+        nearest[i] = -1.0;
+    }
+    for (int c = 1; c < k; c++) {
+        const float *last = centroids + (size_t) (c - 1) * d;
+        double total = 0.0;
+        for (int64_t i = 0; i < n; i++) {
+            const float *point = data + (size_t) i * d;
+            double dist = 0.0;
+            for (int j = 0; j < d; j++) {
+                double diff = (double) point[j] - last[j];
+                dist += diff * diff;
+            }
+            if (nearest[i] < 0.0 || dist < nearest[i]) {
+                nearest[i] = dist;
+            }
+            total += nearest[i];
+        }
+        int64_t chosen = n - 1;
+        if (total > 0.0) {
+            double target = (double) (ml_KMeansRandom(state) >> 11) * (1.0 / 9007199254740992.0) * total;
+            for (int64_t i = 0; i < n; i++) {
+                target -= nearest[i];
+                if (target < 0.0) {
+                    chosen = i;
+                    break;
+                }
+            }
+        } else {
+            chosen = (int64_t) (ml_KMeansRandom(state) % (uint64_t) n);
+        }
+        memcpy(centroids + (size_t) c * d, data + (size_t) chosen * d, sizeof(float) * d);
+    }
+    Tcl_Free((char *) nearest);
+}
+
+// k distinct points, a partial Fisher-Yates shuffle of the indices
+static void ml_KMeansRandomInit(const float *data, int64_t n, int d, int k, uint64_t *state, float *centroids) {
+    int64_t *order = (int64_t *) Tcl_Alloc(sizeof(int64_t) * n);
+    for (int64_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (int c = 0; c < k; c++) {
+        int64_t j = c + (int64_t) (ml_KMeansRandom(state) % (uint64_t) (n - c));
+        int64_t tmp = order[c];
+        order[c] = order[j];
+        order[j] = tmp;
+        memcpy(centroids + (size_t) c * d, data + (size_t) order[c] * d, sizeof(float) * d);
+    }
+    Tcl_Free((char *) order);
+}
+
+static int ml_KMeansLloyd(const float *data, int64_t n, int d, const ml_kmeans_params_t *params, uint64_t *state,
+                          float *centroids, const char **errmsg) {
+    const int k = params->k;
+    int32_t *assign = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n);
+    int64_t *counts = (int64_t *) Tcl_Alloc(sizeof(int64_t) * k);
+    double *sums = (double *) Tcl_Alloc(sizeof(double) * k * d);
+    int rc = TCL_OK;
+    for (int iter = 0; iter < params->n_iter; iter++) {
+        if (TCL_OK != ml_KMeansAssign(data, n, d, centroids, k, params->nthreads, assign, errmsg)) {
+            rc = TCL_ERROR;
+            break;
+        }
+        memset(counts, 0, sizeof(int64_t) * k);
+        memset(sums, 0, sizeof(double) * k * d);
+        for (int64_t i = 0; i < n; i++) {
+            const float *point = data + (size_t) i * d;
+            double *sum = sums + (size_t) assign[i] * d;
+            for (int j = 0; j < d; j++) {
+                sum[j] += point[j];
+            }
+            counts[assign[i]]++;
+        }
+        for (int c = 0; c < k; c++) {
+            float *centroid = centroids + (size_t) c * d;
+            if (counts[c] == 0) {
+                // an empty cluster restarts from a random point
+                int64_t i = (int64_t) (ml_KMeansRandom(state) % (uint64_t) n);
+                memcpy(centroid, data + (size_t) i * d, sizeof(float) * d);
+                continue;
+            }
+            for (int j = 0; j < d; j++) {
+                centroid[j] = (float) (sums[(size_t) c * d + j] / (double) counts[c]);
+            }
+        }
+    }
+
+    Tcl_Free((char *) sums);
+    Tcl_Free((char *) counts);
+    Tcl_Free((char *) assign);
+    return rc;
+}
+
+// Mini-batch k-means (Sculley, 2010): every iteration assigns a random batch of points and moves
+// each centroid towards its points with a per-centroid learning rate of 1 / points seen.
+static int ml_KMeansMiniBatch(const float *data, int64_t n, int d, const ml_kmeans_params_t *params, uint64_t *state,
+                              float *centroids, const char **errmsg) {
+    const int k = params->k;
+    const int64_t batch_size = params->batch_size < n ? params->batch_size : n;
+    float *batch = (float *) Tcl_Alloc(sizeof(float) * d * batch_size);
+    int32_t *assign = (int32_t *) Tcl_Alloc(sizeof(int32_t) * batch_size);
+    int64_t *counts = (int64_t *) Tcl_Alloc(sizeof(int64_t) * k);
+    memset(counts, 0, sizeof(int64_t) * k);
+    int rc = TCL_OK;
+    for (int iter = 0; iter < params->n_iter; iter++) {
+        for (int64_t b = 0; b < batch_size; b++) {
+            int64_t i = (int64_t) (ml_KMeansRandom(state) % (uint64_t) n);
+            memcpy(batch + (size_t) b * d, data + (size_t) i * d, sizeof(float) * d);
+        }
+        if (TCL_OK != ml_KMeansAssign(batch, batch_size, d, centroids, k, params->nthreads, assign, errmsg)) {
+            rc = TCL_ERROR;
+            break;
+        }
+        for (int64_t b = 0; b < batch_size; b++) {
+            const float *point = batch + (size_t) b * d;
+            float *centroid = centroids + (size_t) assign[b] * d;
+            float eta = 1.0f / (float) ++counts[assign[b]];
+            for (int j = 0; j < d; j++) {
+                centroid[j] += eta * (point[j] - centroid[j]);
+            }
+        }
+    }
+
+    Tcl_Free((char *) counts);
+    Tcl_Free((char *) assign);
+    Tcl_Free((char *) batch);
+    return rc;
+}
+
+int ml_KMeansTrain(const float *data, int64_t n, int d, const ml_kmeans_params_t *params, float *centroids,
+                   const char **errmsg) {
+    if (n < params->k) {
+        *errmsg = "fewer points than clusters";
+        return TCL_ERROR;
+    }
+
+    uint64_t state = ml_SampleSeed(params->seed);
+    if (params->init == ML_KMEANS_INIT_PLUSPLUS) {
+        ml_KMeansPlusPlus(data, n, d, params->k, &state, centroids);
+    } else {
+        ml_KMeansRandomInit(data, n, d, params->k, &state, centroids);
+    }
+
+    if (params->batch_size > 0) {
+        return ml_KMeansMiniBatch(data, n, d, params, &state, centroids, errmsg);
+    }
+    return ml_KMeansLloyd(data, n, d, params, &state, centroids, errmsg);
+}
+
+static int ml_KMeansGetPoints(Tcl_Interp *interp, Tcl_Obj *objPtr, struct ggml_tensor **tensor) {
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(objPtr));
+    if (!tensor_ptr) {
+        SetResult("tensor handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *t = tensor_ptr->ggml_tensor;
+    if (t->data == NULL || t->type != GGML_TYPE_F32 || !ggml_is_contiguous(t) || t->ne[2] != 1 || t->ne[3] != 1) {
+        SetResult("tensor must be a contiguous 1D or 2D F32 tensor with data");
+        return TCL_ERROR;
+    }
+    *tensor = t;
+    return TCL_OK;
+}
+
+int ml_KMeansCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "KMeansCmd\n"));
+
+    static const char *options[] = {"-iterations", "-init", "-batch_size", "-nthreads", "-seed", NULL};
+    enum options {
+        OPT_ITERATIONS, OPT_INIT, OPT_BATCH_SIZE, OPT_NTHREADS, OPT_SEED
+    };
+    static const char *inits[] = {"random", "kmeans++", NULL};
+
+    if (objc < 4 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle tensor_handle k ?-iterations n? ?-init kmeans++|random? ?-batch_size n? ?-nthreads n? ?-seed n?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *points;
+    if (TCL_OK != ml_KMeansGetPoints(interp, objv[2], &points)) {
+        return TCL_ERROR;
+    }
+    int k;
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[3], &k) || k <= 0) {
+        SetResult("k is not an integer > 0");
+        return TCL_ERROR;
+    }
+
+    ml_kmeans_params_t params = {
+            .k = k,
+            .n_iter = 0,
+            .init = ML_KMEANS_INIT_PLUSPLUS,
+            .batch_size = 0,
+            .nthreads = 4,
+            .seed = 0,
+    };
+    for (int i = 4; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_ITERATIONS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &params.n_iter) || params.n_iter <= 0) {
+                    SetResult("iterations is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_INIT: {
+                int initIndex;
+                if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i + 1], inits, "init", 0, &initIndex)) {
+                    return TCL_ERROR;
+                }
+                params.init = initIndex == 0 ? ML_KMEANS_INIT_RANDOM : ML_KMEANS_INIT_PLUSPLUS;
+                break;
+            }
+            case OPT_BATCH_SIZE: {
+                Tcl_WideInt batch_size;
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &batch_size) || batch_size < 0) {
+                    SetResult("batch_size is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                params.batch_size = batch_size;
+                break;
+            }
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &params.nthreads) || params.nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_SEED: {
+                Tcl_WideInt seed;
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &seed)) {
+                    SetResult("seed is not an integer");
+                    return TCL_ERROR;
+                }
+                params.seed = (uint64_t) seed;
+                break;
+            }
+        }
+    }
+    // a batch moves the centroids much less than a pass over all points
+    if (params.n_iter == 0) {
+        params.n_iter = params.batch_size > 0 ? 100 : 10;
+    }
+
+    const int d = (int) points->ne[0];
+    float *centroids = (float *) Tcl_Alloc(sizeof(float) * d * k);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_KMeansTrain((const float *) points->data, points->ne[1], d, &params, centroids, &errmsg)) {
+        Tcl_Free((char *) centroids);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // one row of d values per centroid
+    struct ggml_tensor *tensor = ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_F32, d, k);
+    ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+    memcpy(tensor->data, centroids, sizeof(float) * d * k);
+    Tcl_Free((char *) centroids);
+
+    SetResult(tensor_ptr->handle);
+    return TCL_OK;
+}
+
+int ml_KMeansAssignCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "KMeansAssignCmd\n"));
+    CheckArgs(4, 5, 1, "context_handle tensor_handle centroids_tensor_handle ?nthreads?");
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *points;
+    if (TCL_OK != ml_KMeansGetPoints(interp, objv[2], &points)) {
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *centroids;
+    if (TCL_OK != ml_KMeansGetPoints(interp, objv[3], &centroids)) {
+        return TCL_ERROR;
+    }
+    if (centroids->ne[0] != points->ne[0]) {
+        SetResult("centroids differ in length from the points");
+        return TCL_ERROR;
+    }
+    int nthreads = 4;
+    if (objc == 5) {
+        if (TCL_OK != Tcl_GetIntFromObj(interp, objv[4], &nthreads) || nthreads <= 0) {
+            SetResult("nthreads is not an integer > 0");
+            return TCL_ERROR;
+        }
+    }
+
+    const int64_t n = points->ne[1];
+    int32_t *assign = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_KMeansAssign((const float *) points->data, n, (int) points->ne[0], (const float *) centroids->data,
+                                  (int) centroids->ne[1], nthreads, assign, &errmsg)) {
+        Tcl_Free((char *) assign);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *tensor = ggml_new_tensor_1d(ctx->ggml_ctx, GGML_TYPE_I32, n);
+    ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+    memcpy(tensor->data, assign, sizeof(int32_t) * n);
+    Tcl_Free((char *) assign);
+
+    SetResult(tensor_ptr->handle);
+    return TCL_OK;
+}
@@ -0,0 +1,37 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_KMEANS_H
+#define GGML_TCL_KMEANS_H
+
+#include "common.h"
+
+// Writes the nearest of the k centroids (d floats each) for each of the n points (d floats each).
+// Distances are ranked with argmax(x.c - |c|^2 / 2), computed by mul_mat and argmax on nthreads threads.
+int ml_KMeansAssign(const float *data, int64_t n, int d, const float *centroids, int k, int nthreads,
+                    int32_t *assign, const char **errmsg);
+
+typedef enum {
+    ML_KMEANS_INIT_RANDOM,              // k distinct random points
+    ML_KMEANS_INIT_PLUSPLUS             // k-means++ seeding
+} ml_kmeans_init_t;
+
+typedef struct ml_kmeans_params_s {
+    int k;
+    int n_iter;                         // Lloyd iterations, or batches in mini-batch mode
+    ml_kmeans_init_t init;
+    int64_t batch_size;                 // 0 for Lloyd iterations over all points
+    int nthreads;
+    uint64_t seed;
+} ml_kmeans_params_t;
+
+// Writes k centroids of d floats, trained from the n points of d floats.
+int ml_KMeansTrain(const float *data, int64_t n, int d, const ml_kmeans_params_t *params, float *centroids,
+                   const char **errmsg);
+
+GGML_TCL_CMD(ml_KMeansCmd);
+GGML_TCL_CMD(ml_KMeansAssignCmd);
+
+#endif //GGML_TCL_KMEANS_H
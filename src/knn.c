@@ -0,0 +1,325 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knn.h"
+
+// scores computed per graph, which bounds the scratch memory of a search over a large matrix
+#define ML_KNN_BLOCK_VALUES (4 * 1024 * 1024)
+
+// Runs on every compute thread, each one takes its share of the rows.
+static void ml_KnnRowNormsOp(struct ggml_tensor *dst, const struct ggml_tensor *a, const struct ggml_tensor *rows,
+                             int ith, int nth, void *userdata) {
+    const int64_t n_rows = rows->ne[1];
+    const int64_t per_thread = (n_rows + nth - 1) / nth;
+    const int64_t r0 = per_thread * ith;
+    const int64_t r1 = r0 + per_thread < n_rows ? r0 + per_thread : n_rows;
+    if (r0 < r1) {
+        ml_KnnRowNorms(rows, r0, r1 - r0, (float *) dst->data + r0);
+    }
+}
+
+int ml_KnnDotRows(struct ggml_tensor *matrix, int64_t row0, int64_t n_rows, struct ggml_tensor *queries, int nthreads,
+                  float *out, float *norms, const char **errmsg) {
+    // the graph only holds views and the results, whose data are the caller's buffers
+    size_t meta_size = ggml_tensor_overhead() * 6 + ggml_graph_overhead();
+    char *meta = Tcl_Alloc(meta_size);
+    struct ggml_init_params params = {
+            .mem_size   = meta_size,
+            .mem_buffer = meta,
+            .no_alloc   = true,
+    };
+    struct ggml_context *ctx0 = ggml_init(params);
+    if (ctx0 == NULL) {
+        Tcl_Free(meta);
+        *errmsg = "could not create the scoring context";
+        return TCL_ERROR;
+    }
+
+    struct ggml_tensor *rows = ggml_view_2d(ctx0, matrix, matrix->ne[0], n_rows, matrix->nb[1], row0 * matrix->nb[1]);
+    struct ggml_tensor *scores = ggml_mul_mat(ctx0, rows, queries);
+    scores->data = out;
+    struct ggml_cgraph *gf = ggml_new_graph(ctx0);
+    ggml_build_forward_expand(gf, scores);
+    if (norms != NULL) {
+        // in the same graph, so the norms are taken on all threads while the block is being scored
+        struct ggml_tensor *norms_t = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_rows);
+        norms_t->data = norms;
+        ggml_build_forward_expand(gf, ggml_map_custom2_inplace(ctx0, norms_t, rows, ml_KnnRowNormsOp, GGML_N_TASKS_MAX, NULL));
+    }
+
+    struct ggml_cplan cplan = ggml_graph_plan(gf, nthreads);
+    char *work = cplan.work_size > 0 ? Tcl_Alloc(cplan.work_size) : NULL;
+    cplan.work_data = (uint8_t *) work;
+    int rc = ggml_graph_compute(gf, &cplan);
+    if (work != NULL) {
+        Tcl_Free(work);
+    }
+    ggml_free(ctx0);
+    Tcl_Free(meta);
+
+    if (rc != GGML_EXIT_SUCCESS) {
+        *errmsg = "scoring failed";
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// F32, F16 and the quantized types that mul_mat can score and the row norms can dequantize.
+static int ml_KnnIsSupportedType(enum ggml_type type) {
+    if (type == GGML_TYPE_F32 || type == GGML_TYPE_F16) {
+        return 1;
+    }
+    ggml_type_traits_t traits = ggml_internal_get_type_traits(type);
+    return traits.is_quantized && traits.to_float != NULL && traits.vec_dot != NULL;
+}
+
+void ml_KnnRowNorms(const struct ggml_tensor *matrix, int64_t row0, int64_t n_rows, float *out) {
+    const int64_t d = matrix->ne[0];
+    float *row = matrix->type == GGML_TYPE_F32 ? NULL : (float *) Tcl_Alloc(sizeof(float) * d);
+    for (int64_t r = 0; r < n_rows; r++) {
+        const char *src = (const char *) matrix->data + (row0 + r) * matrix->nb[1];
+        const float *values = (const float *) src;
+        if (matrix->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, row, (int) d);
+            values = row;
+        } else if (matrix->type != GGML_TYPE_F32) {
+            ggml_internal_get_type_traits(matrix->type).to_float(src, row, (int) d);
+            values = row;
+        }
+        double sum = 0.0;
+        for (int64_t i = 0; i < d; i++) {
+            sum += (double) values[i] * values[i];
+        }
+        out[r] = (float) sum;
+    }
+    if (row != NULL) {
+        Tcl_Free((char *) row);
+    }
+}
+
+void ml_KnnHeapPush(ml_knn_hit_t *heap, int *n, int k, float score, int64_t index) {
+    int i;
+    if (*n < k) {
+        // sift up
+        i = (*n)++;
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (heap[parent].score <= score) {
+                break;
+            }
+            heap[i] = heap[parent];
+            i = parent;
+        }
+    } else {
+        if (score <= heap[0].score) {
+            return;
+        }
+        // replace the worst hit and sift down
+        i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= k) {
+                break;
+            }
+            if (child + 1 < k && heap[child + 1].score < heap[child].score) {
+                child++;
+            }
+            if (heap[child].score >= score) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+    }
+    heap[i].score = score;
+    heap[i].index = index;
+}
+
+static int ml_KnnCompareHits(const void *a, const void *b) {
+    float sa = ((const ml_knn_hit_t *) a)->score;
+    float sb = ((const ml_knn_hit_t *) b)->score;
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+void ml_KnnFinish(ml_knn_hit_t *heap, int n, ml_knn_metric_t metric) {
+    qsort(heap, n, sizeof(ml_knn_hit_t), ml_KnnCompareHits);
+    if (metric == ML_KNN_L2) {
+        // L2 hits are ranked by the negated squared distance
+        for (int i = 0; i < n; i++) {
+            heap[i].score = heap[i].score < 0.0f ? sqrtf(-heap[i].score) : 0.0f;
+        }
+    }
+}
+
+int ml_KnnSearch(struct ggml_tensor *matrix, struct ggml_tensor *queries, int k, ml_knn_metric_t metric, int nthreads,
+                 ml_knn_hit_t *hits, int *n_hits, const char **errmsg) {
+    const int64_t n_rows = matrix->ne[1];
+    const int64_t n_queries = queries->ne[1];
+
+    float *query_norms = NULL;
+    if (metric != ML_KNN_DOT) {
+        query_norms = (float *) Tcl_Alloc(sizeof(float) * n_queries);
+        ml_KnnRowNorms(queries, 0, n_queries, query_norms);
+    }
+    for (int64_t q = 0; q < n_queries; q++) {
+        n_hits[q] = 0;
+    }
+
+    int64_t block_rows = ML_KNN_BLOCK_VALUES / n_queries;
+    if (block_rows < 1024) {
+        block_rows = 1024;
+    }
+    if (block_rows > n_rows) {
+        block_rows = n_rows;
+    }
+    float *scores = (float *) Tcl_Alloc(sizeof(float) * block_rows * n_queries);
+    float *row_norms = metric != ML_KNN_DOT ? (float *) Tcl_Alloc(sizeof(float) * block_rows) : NULL;
+
+    int rc = TCL_OK;
+    for (int64_t row0 = 0; row0 < n_rows; row0 += block_rows) {
+        int64_t n_block = n_rows - row0 < block_rows ? n_rows - row0 : block_rows;
+        if (TCL_OK != ml_KnnDotRows(matrix, row0, n_block, queries, nthreads, scores, row_norms, errmsg)) {
+            rc = TCL_ERROR;
+            break;
+        }
+        for (int64_t q = 0; q < n_queries; q++) {
+            const float *s = scores + q * n_block;
+            ml_knn_hit_t *heap = hits + q * k;
+            for (int64_t r = 0; r < n_block; r++) {
+                float score = s[r];
+                if (metric == ML_KNN_COSINE) {
+                    float norm = sqrtf(row_norms[r] * query_norms[q]);
+                    score = norm > 0.0f ? score / norm : 0.0f;
+                } else if (metric == ML_KNN_L2) {
+                    score = 2.0f * score - row_norms[r] - query_norms[q];
+                }
+                ml_KnnHeapPush(heap, &n_hits[q], k, score, row0 + r);
+            }
+        }
+    }
+
+    if (rc == TCL_OK) {
+        for (int64_t q = 0; q < n_queries; q++) {
+            ml_KnnFinish(hits + q * k, n_hits[q], metric);
+        }
+    }
+    if (row_norms != NULL) {
+        Tcl_Free((char *) row_norms);
+    }
+    Tcl_Free((char *) scores);
+    if (query_norms != NULL) {
+        Tcl_Free((char *) query_norms);
+    }
+    return rc;
+}
+
+int ml_GetKnnMetricFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, ml_knn_metric_t *metric) {
+    static const char *metrics[] = {"cosine", "dot", "l2", NULL};
+    int index;
+    if (TCL_OK != Tcl_GetIndexFromObj(interp, objPtr, metrics, "metric", 0, &index)) {
+        return TCL_ERROR;
+    }
+    *metric = (ml_knn_metric_t) index;
+    return TCL_OK;
+}
+
+int ml_KnnCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "KnnCmd\n"));
+    CheckArgs(4, 6, 1, "matrix_tensor_handle query_tensor_handle k ?cosine|dot|l2? ?nthreads?");
+
+    ml_tensor_t *matrix_ptr = ml_GetInternalFromTensor(Tcl_GetString(objv[1]));
+    if (!matrix_ptr) {
+        SetResult("matrix tensor handle not found");
+        return TCL_ERROR;
+    }
+    ml_tensor_t *query_ptr = ml_GetInternalFromTensor(Tcl_GetString(objv[2]));
+    if (!query_ptr) {
+        SetResult("query tensor handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *matrix = matrix_ptr->ggml_tensor;
+    struct ggml_tensor *queries = query_ptr->ggml_tensor;
+
+    int k;
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[3], &k) || k <= 0) {
+        SetResult("k is not an integer > 0");
+        return TCL_ERROR;
+    }
+    ml_knn_metric_t metric = ML_KNN_COSINE;
+    if (objc > 4 && TCL_OK != ml_GetKnnMetricFromObj(interp, objv[4], &metric)) {
+        return TCL_ERROR;
+    }
+    int nthreads = 4;
+    if (objc > 5 && (TCL_OK != Tcl_GetIntFromObj(interp, objv[5], &nthreads) || nthreads <= 0)) {
+        SetResult("nthreads is not a positive integer");
+        return TCL_ERROR;
+    }
+
+    // one row per vector, one column per query
+    if (matrix->data == NULL || !ggml_is_contiguous(matrix) || matrix->ne[2] != 1 || matrix->ne[3] != 1) {
+        SetResult("matrix must be a contiguous 2D tensor with data");
+        return TCL_ERROR;
+    }
+    if (queries->data == NULL || queries->type != GGML_TYPE_F32 || !ggml_is_contiguous(queries)
+        || queries->ne[2] != 1 || queries->ne[3] != 1) {
+        SetResult("query must be a contiguous 1D or 2D F32 tensor with data");
+        return TCL_ERROR;
+    }
+    if (queries->ne[0] != matrix->ne[0]) {
+        SetResult("query and matrix rows differ in length");
+        return TCL_ERROR;
+    }
+    if (!ml_KnnIsSupportedType(matrix->type)) {
+        SetResult("unsupported matrix type");
+        return TCL_ERROR;
+    }
+    if (matrix->ne[0] % ggml_blck_size(matrix->type) != 0) {
+        SetResult("matrix rows are not a multiple of the block size of its type");
+        return TCL_ERROR;
+    }
+    if (k > matrix->ne[1]) {
+        k = (int) matrix->ne[1];
+    }
+
+    const int64_t n_queries = queries->ne[1];
+    ml_knn_hit_t *hits = (ml_knn_hit_t *) Tcl_Alloc(sizeof(ml_knn_hit_t) * k * n_queries);
+    int *n_hits = (int *) Tcl_Alloc(sizeof(int) * n_queries);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_KnnSearch(matrix, queries, k, metric, nthreads, hits, n_hits, &errmsg)) {
+        Tcl_Free((char *) n_hits);
+        Tcl_Free((char *) hits);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // a flat list of index score pairs for a single query vector, a list of them for a batch
+    Tcl_Obj *result_ptr = Tcl_NewListObj(0, NULL);
+    for (int64_t q = 0; q < n_queries; q++) {
+        Tcl_Obj *list_ptr = Tcl_NewListObj(0, NULL);
+        for (int i = 0; i < n_hits[q]; i++) {
+            const ml_knn_hit_t *hit = &hits[q * k + i];
+            Tcl_ListObjAppendElement(interp, list_ptr, Tcl_NewWideIntObj(hit->index));
+            Tcl_ListObjAppendElement(interp, list_ptr, Tcl_NewDoubleObj(hit->score));
+        }
+        if (n_queries == 1) {
+            Tcl_DecrRefCount(result_ptr);
+            result_ptr = list_ptr;
+            break;
+        }
+        Tcl_ListObjAppendElement(interp, result_ptr, list_ptr);
+    }
+    Tcl_Free((char *) n_hits);
+    Tcl_Free((char *) hits);
+
+    Tcl_SetObjResult(interp, result_ptr);
+    return TCL_OK;
+}
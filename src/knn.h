@@ -0,0 +1,43 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_KNN_H
+#define GGML_TCL_KNN_H
+
+#include <ggml.h>
+#include "common.h"
+
+typedef enum {
+    ML_KNN_COSINE,
+    ML_KNN_DOT,
+    ML_KNN_L2
+} ml_knn_metric_t;
+
+typedef struct ml_knn_hit_s {
+    float score;                        // higher is better while searching, see ml_KnnFinish
+    int64_t index;
+} ml_knn_hit_t;
+
+// Writes the dot products of rows [row0, row0 + n_rows) of matrix with every column of the
+// F32 queries, n_rows values per query, computed by mul_mat on nthreads threads.
+// Unless norms is NULL, the squared norms of the rows are written to it by the same graph.
+int ml_KnnDotRows(struct ggml_tensor *matrix, int64_t row0, int64_t n_rows, struct ggml_tensor *queries, int nthreads,
+                  float *out, float *norms, const char **errmsg);
+// Squared L2 norms of rows [row0, row0 + n_rows) of matrix.
+void ml_KnnRowNorms(const struct ggml_tensor *matrix, int64_t row0, int64_t n_rows, float *out);
+
+// Keeps the k best hits in a min heap, the worst of them at the root.
+void ml_KnnHeapPush(ml_knn_hit_t *heap, int *n, int k, float score, int64_t index);
+// Sorts the hits best first and turns L2 search scores back into distances.
+void ml_KnnFinish(ml_knn_hit_t *heap, int n, ml_knn_metric_t metric);
+
+// Scores all rows of matrix against the queries and keeps the k best per query in hits (k per query).
+int ml_KnnSearch(struct ggml_tensor *matrix, struct ggml_tensor *queries, int k, ml_knn_metric_t metric, int nthreads,
+                 ml_knn_hit_t *hits, int *n_hits, const char **errmsg);
+int ml_GetKnnMetricFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, ml_knn_metric_t *metric);
+
+GGML_TCL_CMD(ml_KnnCmd);
+
+#endif //GGML_TCL_KNN_H
@@ -0,0 +1,343 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <stdio.h>
+#include <string.h>
+#include "kvcache.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+ml_kv_pages_t *ml_KvPagesNew(int n_pages, int page_size, int n_seq, int n_ctx) {
+    ml_kv_pages_t *pages = (ml_kv_pages_t *) Tcl_Alloc(sizeof(ml_kv_pages_t));
+    memset(pages, 0, sizeof(ml_kv_pages_t));
+    pages->page_size = page_size;
+    pages->n_pages = n_pages;
+    pages->n_seq = n_seq;
+    pages->max_seq_pages = (n_ctx + page_size - 1) / page_size;
+    pages->free_pages = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n_pages);
+    pages->page_tables = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n_seq * pages->max_seq_pages);
+    pages->n_seq_pages = (int *) Tcl_Alloc(sizeof(int) * n_seq);
+    memset(pages->n_seq_pages, 0, sizeof(int) * n_seq);
+    pages->page_refs = (int *) Tcl_Alloc(sizeof(int) * n_pages);
+    memset(pages->page_refs, 0, sizeof(int) * n_pages);
+
+    // low pages are handed out first, which keeps the touched part of the cache small
+    for (int i = 0; i < n_pages; i++) {
+        pages->free_pages[i] = n_pages - 1 - i;
+    }
+    pages->n_free = n_pages;
+    return pages;
+}
+
+static void ml_KvPagesUnlinkEntry(ml_kv_pages_t *pages, ml_prefix_entry_t *entry) {
+    if (entry->prev_lru_ptr != NULL) {
+        entry->prev_lru_ptr->next_lru_ptr = entry->next_lru_ptr;
+    } else {
+        pages->first_lru_ptr = entry->next_lru_ptr;
+    }
+    if (entry->next_lru_ptr != NULL) {
+        entry->next_lru_ptr->prev_lru_ptr = entry->prev_lru_ptr;
+    } else {
+        pages->last_lru_ptr = entry->prev_lru_ptr;
+    }
+    entry->prev_lru_ptr = NULL;
+    entry->next_lru_ptr = NULL;
+}
+
+static void ml_KvPagesTouchEntry(ml_kv_pages_t *pages, ml_prefix_entry_t *entry) {
+    if (pages->first_lru_ptr == entry) {
+        return;
+    }
+    if (entry->prev_lru_ptr != NULL || entry->next_lru_ptr != NULL || pages->last_lru_ptr == entry) {
+        ml_KvPagesUnlinkEntry(pages, entry);
+    }
+    entry->next_lru_ptr = pages->first_lru_ptr;
+    if (pages->first_lru_ptr != NULL) {
+        pages->first_lru_ptr->prev_lru_ptr = entry;
+    } else {
+        pages->last_lru_ptr = entry;
+    }
+    pages->first_lru_ptr = entry;
+}
+
+static void ml_KvPagesPutPage(ml_kv_pages_t *pages, int32_t page) {
+    if (--pages->page_refs[page] == 0) {
+        pages->free_pages[pages->n_free++] = page;
+    } else if (pages->page_refs[page] == 1 && pages->page_entries != NULL && pages->page_entries[page] != NULL) {
+        // only the prefix cache holds it now
+        pages->n_evictable++;
+    }
+}
+
+static void ml_KvPagesDeleteEntry(ml_kv_pages_t *pages, ml_prefix_entry_t *entry) {
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&pages->prefix_entries, (char *) (uintptr_t) entry->hash);
+    if (entryPtr != NULL && Tcl_GetHashValue(entryPtr) == entry) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    ml_KvPagesUnlinkEntry(pages, entry);
+    if (entry->spill_slot >= 0) {
+        pages->free_spill_slots[pages->n_free_spill++] = entry->spill_slot;
+    }
+    pages->n_entries--;
+    Tcl_Free((char *) entry->tokens);
+    Tcl_Free((char *) entry);
+}
+
+// Copies the keys and values of a page from or to its slot in the spill file.
+static void ml_KvPagesCopySpill(ml_kv_pages_t *pages, int32_t page, int slot, int to_spill) {
+    const size_t page_bytes = pages->row_size * pages->page_size;
+    char *spill = pages->spill_data + (size_t) slot * page_bytes * 2 * pages->n_layer;
+    for (int il = 0; il < pages->n_layer; il++) {
+        size_t offset = il * pages->layer_size + (size_t) page * page_bytes;
+        char *k_spill = spill + (size_t) (2 * il) * page_bytes;
+        char *v_spill = k_spill + page_bytes;
+        if (to_spill) {
+            memcpy(k_spill, pages->k_data + offset, page_bytes);
+            memcpy(v_spill, pages->v_data + offset, page_bytes);
+        } else {
+            memcpy(pages->k_data + offset, k_spill, page_bytes);
+            memcpy(pages->v_data + offset, v_spill, page_bytes);
+        }
+    }
+}
+
+// Takes back the page of the least recently used entry that no sequence holds, spilling its
+// contents when there is a free spill slot and dropping the entry otherwise.
+static int32_t ml_KvPagesEvict(ml_kv_pages_t *pages) {
+    for (ml_prefix_entry_t *entry = pages->last_lru_ptr; entry != NULL; entry = entry->prev_lru_ptr) {
+        int32_t page = entry->page;
+        if (page < 0 || pages->page_refs[page] != 1) {
+            continue;
+        }
+        pages->page_entries[page] = NULL;
+        pages->page_refs[page] = 0;
+        pages->n_evictable--;
+        if (pages->n_free_spill > 0) {
+            entry->spill_slot = pages->free_spill_slots[--pages->n_free_spill];
+            entry->page = -1;
+            ml_KvPagesCopySpill(pages, page, entry->spill_slot, 1);
+        } else {
+            ml_KvPagesDeleteEntry(pages, entry);
+        }
+        return page;
+    }
+    return -1;
+}
+
+static int32_t ml_KvPagesTakePage(ml_kv_pages_t *pages) {
+    int32_t page = pages->n_free > 0 ? pages->free_pages[--pages->n_free] : ml_KvPagesEvict(pages);
+    if (page >= 0) {
+        pages->page_refs[page] = 1;
+    }
+    return page;
+}
+
+void ml_KvPagesFree(ml_kv_pages_t *pages) {
+    if (pages->prefix_cache) {
+        while (pages->first_lru_ptr != NULL) {
+            ml_KvPagesDeleteEntry(pages, pages->first_lru_ptr);
+        }
+        Tcl_DeleteHashTable(&pages->prefix_entries);
+        Tcl_Free((char *) pages->page_entries);
+    }
+    if (pages->spill_data != NULL) {
+#ifdef __linux__
+        munmap(pages->spill_data, pages->spill_size);
+#endif
+        Tcl_Free((char *) pages->free_spill_slots);
+    }
+    Tcl_Free((char *) pages->page_refs);
+    Tcl_Free((char *) pages->n_seq_pages);
+    Tcl_Free((char *) pages->page_tables);
+    Tcl_Free((char *) pages->free_pages);
+    Tcl_Free((char *) pages);
+}
+
+void ml_KvPagesBind(ml_kv_pages_t *pages, char *k_data, char *v_data, size_t row_size, int n_layer) {
+    pages->k_data = k_data;
+    pages->v_data = v_data;
+    pages->row_size = row_size;
+    pages->layer_size = row_size * pages->n_pages * pages->page_size;
+    pages->n_layer = n_layer;
+}
+
+int ml_KvPagesReserve(ml_kv_pages_t *pages, int seq, int n_positions) {
+    int needed = (n_positions + pages->page_size - 1) / pages->page_size;
+    if (needed > pages->max_seq_pages || needed - pages->n_seq_pages[seq] > pages->n_free + pages->n_evictable) {
+        return TCL_ERROR;
+    }
+    int32_t *table = pages->page_tables + seq * pages->max_seq_pages;
+    while (pages->n_seq_pages[seq] < needed) {
+        table[pages->n_seq_pages[seq]++] = ml_KvPagesTakePage(pages);
+    }
+    return TCL_OK;
+}
+
+int ml_KvPagesCapacity(ml_kv_pages_t *pages, int seq) {
+    int n = pages->n_seq_pages[seq] + pages->n_free + pages->n_evictable;
+    if (n > pages->max_seq_pages) {
+        n = pages->max_seq_pages;
+    }
+    return n * pages->page_size;
+}
+
+void ml_KvPagesRelease(ml_kv_pages_t *pages, int seq) {
+    int32_t *table = pages->page_tables + seq * pages->max_seq_pages;
+    while (pages->n_seq_pages[seq] > 0) {
+        ml_KvPagesPutPage(pages, table[--pages->n_seq_pages[seq]]);
+    }
+}
+
+int ml_KvPagesEnablePrefixCache(ml_kv_pages_t *pages, const char *spill_path, int n_spill_slots, const char **errmsg) {
+    if (spill_path != NULL && n_spill_slots > 0) {
+#ifdef __linux__
+        size_t size = (size_t) n_spill_slots * pages->page_size * pages->row_size * 2 * pages->n_layer;
+        int fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            *errmsg = "could not open the spill file";
+            return TCL_ERROR;
+        }
+        if (ftruncate(fd, (off_t) size) != 0) {
+            close(fd);
+            unlink(spill_path);
+            *errmsg = "could not size the spill file";
+            return TCL_ERROR;
+        }
+        char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        // the mapping keeps the file alive, nothing is left behind once it goes away
+        unlink(spill_path);
+        if (data == MAP_FAILED) {
+            *errmsg = "could not map the spill file";
+            return TCL_ERROR;
+        }
+        pages->spill_data = data;
+        pages->spill_size = size;
+        pages->n_spill_slots = n_spill_slots;
+        pages->free_spill_slots = (int32_t *) Tcl_Alloc(sizeof(int32_t) * n_spill_slots);
+        for (int i = 0; i < n_spill_slots; i++) {
+            pages->free_spill_slots[i] = n_spill_slots - 1 - i;
+        }
+        pages->n_free_spill = n_spill_slots;
+#else
+        *errmsg = "spilling the prefix cache to a file is not supported on this platform";
+        return TCL_ERROR;
+#endif
+    }
+
+    Tcl_InitHashTable(&pages->prefix_entries, TCL_ONE_WORD_KEYS);
+    pages->page_entries = (ml_prefix_entry_t **) Tcl_Alloc(sizeof(ml_prefix_entry_t *) * pages->n_pages);
+    memset(pages->page_entries, 0, sizeof(ml_prefix_entry_t *) * pages->n_pages);
+    pages->prefix_cache = 1;
+    return TCL_OK;
+}
+
+// FNV-1a over the token ids, chained from the hash of the preceding prefix.
+uint64_t ml_KvPagesPrefixHash(uint64_t parent_hash, const int32_t *tokens, int n_tokens) {
+    uint64_t hash = parent_hash != 0 ? parent_hash : 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char *) tokens;
+    for (size_t i = 0; i < sizeof(int32_t) * n_tokens; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    // 0 stands for the empty prefix
+    return hash != 0 ? hash : 1;
+}
+
+static ml_prefix_entry_t *ml_KvPagesFindEntry(ml_kv_pages_t *pages, uint64_t hash, uint64_t parent_hash, const int32_t *tokens) {
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&pages->prefix_entries, (char *) (uintptr_t) hash);
+    if (entryPtr == NULL) {
+        return NULL;
+    }
+    ml_prefix_entry_t *entry = (ml_prefix_entry_t *) Tcl_GetHashValue(entryPtr);
+    // a hash collision must not hand out the keys and values of other tokens
+    if (entry->parent_hash != parent_hash || memcmp(entry->tokens, tokens, sizeof(int32_t) * pages->page_size) != 0) {
+        return NULL;
+    }
+    return entry;
+}
+
+int ml_KvPagesMatchPrefix(ml_kv_pages_t *pages, int seq, const int32_t *tokens, int n_tokens, uint64_t *last_hash) {
+    *last_hash = 0;
+    if (!pages->prefix_cache || pages->n_seq_pages[seq] != 0) {
+        return 0;
+    }
+
+    const int page_size = pages->page_size;
+    int32_t *table = pages->page_tables + seq * pages->max_seq_pages;
+    uint64_t parent_hash = 0;
+    // the last token is always evaluated, its logits are needed to sample
+    int max_match = (n_tokens - 1) / page_size;
+    int n_matched = 0;
+    while (n_matched < max_match) {
+        const int32_t *page_tokens = tokens + (size_t) n_matched * page_size;
+        uint64_t hash = ml_KvPagesPrefixHash(parent_hash, page_tokens, page_size);
+        ml_prefix_entry_t *entry = ml_KvPagesFindEntry(pages, hash, parent_hash, page_tokens);
+        if (entry == NULL) {
+            break;
+        }
+        if (entry->page < 0) {
+            // bring a spilled page back, the pages matched so far are held and cannot be evicted for it
+            int32_t page = ml_KvPagesTakePage(pages);
+            if (page < 0) {
+                break;
+            }
+            ml_KvPagesCopySpill(pages, page, entry->spill_slot, 0);
+            pages->free_spill_slots[pages->n_free_spill++] = entry->spill_slot;
+            entry->spill_slot = -1;
+            entry->page = page;
+            pages->page_entries[page] = entry;
+            pages->page_refs[page] = 2;
+            pages->n_spill_hit_pages++;
+        } else if (pages->page_refs[entry->page]++ == 1) {
+            pages->n_evictable--;
+        }
+        ml_KvPagesTouchEntry(pages, entry);
+        table[n_matched++] = entry->page;
+        pages->n_seq_pages[seq] = n_matched;
+        parent_hash = hash;
+    }
+    pages->n_hit_pages += n_matched;
+    *last_hash = parent_hash;
+    return n_matched * page_size;
+}
+
+uint64_t ml_KvPagesInsertPrefix(ml_kv_pages_t *pages, int seq, int page_index, uint64_t parent_hash, const int32_t *tokens) {
+    const int page_size = pages->page_size;
+    uint64_t hash = ml_KvPagesPrefixHash(parent_hash, tokens, page_size);
+    int32_t page = pages->page_tables[seq * pages->max_seq_pages + page_index];
+    if (pages->page_entries[page] != NULL) {
+        return hash;
+    }
+
+    int newEntry;
+    Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&pages->prefix_entries, (char *) (uintptr_t) hash, &newEntry);
+    if (!newEntry) {
+        // another sequence cached the same prefix first
+        ml_KvPagesTouchEntry(pages, (ml_prefix_entry_t *) Tcl_GetHashValue(entryPtr));
+        return hash;
+    }
+
+    ml_prefix_entry_t *entry = (ml_prefix_entry_t *) Tcl_Alloc(sizeof(ml_prefix_entry_t));
+    memset(entry, 0, sizeof(ml_prefix_entry_t));
+    entry->hash = hash;
+    entry->parent_hash = parent_hash;
+    entry->tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * page_size);
+    memcpy(entry->tokens, tokens, sizeof(int32_t) * page_size);
+    entry->page = page;
+    entry->spill_slot = -1;
+    Tcl_SetHashValue(entryPtr, (ClientData) entry);
+    ml_KvPagesTouchEntry(pages, entry);
+    pages->page_entries[page] = entry;
+    pages->page_refs[page]++;
+    pages->n_entries++;
+    return hash;
+}
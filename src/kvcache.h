@@ -0,0 +1,82 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_KVCACHE_H
+#define GGML_TCL_KVCACHE_H
+
+#include <stdint.h>
+#include "common.h"
+
+// A full page of a token prefix whose keys and values are kept for reuse. The hash covers
+// every token from the start of the sequence up to the end of the page.
+typedef struct ml_prefix_entry_s {
+    uint64_t hash;
+    uint64_t parent_hash;               // hash of the prefix before this page, 0 for the first page
+    int32_t *tokens;                    // the page_size tokens of this page
+    int page;                           // -1 while spilled
+    int spill_slot;                     // -1 unless spilled
+    struct ml_prefix_entry_s *prev_lru_ptr;
+    struct ml_prefix_entry_s *next_lru_ptr;
+} ml_prefix_entry_t;
+
+// Fixed size pages of kv cache positions shared by all sequences. Each sequence maps its
+// logical positions to physical ones through its page table.
+typedef struct ml_kv_pages_s {
+    int page_size;                      // positions per page
+    int n_pages;
+    int n_seq;
+    int max_seq_pages;                  // page table capacity of a sequence, n_ctx / page_size rounded up
+    int32_t *free_pages;                // stack of free page indices
+    int n_free;
+    int32_t *page_tables;               // n_seq x max_seq_pages
+    int *n_seq_pages;                   // pages held by each sequence
+    int *page_refs;                     // sequences and prefix entries holding each page
+    // prefix cache
+    int prefix_cache;
+    Tcl_HashTable prefix_entries;       // hash -> ml_prefix_entry_t
+    ml_prefix_entry_t **page_entries;   // the entry of each cached page, NULL otherwise
+    ml_prefix_entry_t *first_lru_ptr;   // most recently used
+    ml_prefix_entry_t *last_lru_ptr;
+    int n_entries;
+    int n_evictable;                    // cached pages that no sequence holds
+    Tcl_WideInt n_hit_pages;
+    Tcl_WideInt n_spill_hit_pages;
+    // page data, set by ml_KvPagesBind
+    char *k_data;
+    char *v_data;
+    size_t row_size;                    // bytes of one position in one layer
+    size_t layer_size;                  // bytes of all pages in one layer
+    int n_layer;
+    // spill file for evicted pages
+    char *spill_data;
+    size_t spill_size;
+    int n_spill_slots;
+    int32_t *free_spill_slots;
+    int n_free_spill;
+} ml_kv_pages_t;
+
+ml_kv_pages_t *ml_KvPagesNew(int n_pages, int page_size, int n_seq, int n_ctx);
+void ml_KvPagesFree(ml_kv_pages_t *pages);
+void ml_KvPagesBind(ml_kv_pages_t *pages, char *k_data, char *v_data, size_t row_size, int n_layer);
+// Makes sure that the first n_positions positions of the sequence are backed by pages.
+int ml_KvPagesReserve(ml_kv_pages_t *pages, int seq, int n_positions);
+// Number of positions the sequence can grow to with the pages that are free or evictable now.
+int ml_KvPagesCapacity(ml_kv_pages_t *pages, int seq);
+void ml_KvPagesRelease(ml_kv_pages_t *pages, int seq);
+
+int ml_KvPagesEnablePrefixCache(ml_kv_pages_t *pages, const char *spill_path, int n_spill_slots, const char **errmsg);
+uint64_t ml_KvPagesPrefixHash(uint64_t parent_hash, const int32_t *tokens, int n_tokens);
+// Attaches the cached pages of the longest prefix of tokens to an empty sequence, leaving at least
+// one token to evaluate. Returns the number of positions that need no evaluation.
+int ml_KvPagesMatchPrefix(ml_kv_pages_t *pages, int seq, const int32_t *tokens, int n_tokens, uint64_t *last_hash);
+// Offers page page_index of the sequence, now full with tokens, to the prefix cache.
+uint64_t ml_KvPagesInsertPrefix(ml_kv_pages_t *pages, int seq, int page_index, uint64_t parent_hash, const int32_t *tokens);
+
+static inline int32_t ml_KvPagesPosition(const ml_kv_pages_t *pages, int seq, int pos) {
+    return pages->page_tables[seq * pages->max_seq_pages + pos / pages->page_size] * pages->page_size
+           + pos % pages->page_size;
+}
+
+#endif //GGML_TCL_KVCACHE_H
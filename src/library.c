@@ -12,6 +12,25 @@
 #include "tensor.h"
 #include "cgraph.h"
 #include "opt.h"
+#include "bench.h"
+#include "llama.h"
+#include "sample.h"
+#include "tokenizer.h"
+#include "generate.h"
+#include "scheduler.h"
+#include "session.h"
+#include "embed.h"
+#include "knn.h"
+#include "ivf.h"
+#include "kmeans.h"
+#include "pca.h"
+#include "npy.h"
+#include "safetensors.h"
+#include "csv.h"
+#include "image.h"
+#include "wav.h"
+#include "mel.h"
+#include "graphio.h"
 
 #define XSTR(s) STR(s)
 #define STR(s) #s
@@ -22,6 +41,14 @@ static void ml_ExitHandler(ClientData unused) {
     ml_DeleteContextHT();
     ml_DeleteCGraphHT();
     ml_DeleteTensorHT();
+    ml_DeleteModifiedHT();
+    ml_DeleteLlamaHT();
+    ml_DeleteTokenizerHT();
+    ml_DeleteGenerateHT();
+    ml_DeleteSchedulerHT();
+    ml_DeleteEmbedderHT();
+    ml_DeleteIvfHT();
+    ml_DeleteMelPlans();
 }
 
 
@@ -31,6 +58,13 @@ void ml_InitModule() {
         ml_InitContextHT();
         ml_InitCGraphHT();
         ml_InitTensorHT();
+        ml_InitModifiedHT();
+        ml_InitLlamaHT();
+        ml_InitTokenizerHT();
+        ml_InitGenerateHT();
+        ml_InitSchedulerHT();
+        ml_InitEmbedderHT();
+        ml_InitIvfHT();
 
         ml_ModuleInitialized = 1;
         DBG(fprintf(stderr, "ggml-tcl module initialized\n"));
@@ -47,6 +81,11 @@ int Ggml_Init(Tcl_Interp *interp) {
     Tcl_CreateNamespace(interp, "::ggml", NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::create_context", ml_CreateContextCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::destroy_context", ml_DestroyContextCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::reset_context", ml_ResetContextCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::context_pool_fill", ml_ContextPoolFillCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::context_pool_checkout", ml_ContextPoolCheckoutCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::context_pool_checkin", ml_ContextPoolCheckinCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::context_pool_size", ml_ContextPoolSizeCmd, NULL, NULL);
 //    Tcl_CreateObjCommand(interp, "::ggml::write_context_to_file", ml_WriteContextToFileCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::load_context_from_file", ml_LoadContextFromFileCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::used_mem", ml_UsedMemCmd, NULL, NULL);
@@ -59,9 +98,13 @@ int Ggml_Init(Tcl_Interp *interp) {
     Tcl_CreateObjCommand(interp, "::ggml::new_graph", ml_NewGraphCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::new_graph_custom", ml_NewGraphCustomCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::graph_compute", ml_GraphComputeCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::graph_compute_incremental", ml_GraphComputeIncrementalCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::graph_estimate_mem", ml_GraphEstimateMemCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::graph_reset", ml_GraphResetCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::graph_dump_dot", ml_GraphDumpDotCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::graph_cpy", ml_GraphCpyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::graph_export", ml_GraphExportCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::graph_import", ml_GraphImportCmd, NULL, NULL);
 
     Tcl_CreateObjCommand(interp, "::ggml::opt_default_params", ml_OptDefaultParamsCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::opt", ml_OptCmd, NULL, NULL);
@@ -85,6 +128,7 @@ int Ggml_Init(Tcl_Interp *interp) {
     Tcl_CreateObjCommand(interp, "::ggml::set_i32_1d", ml_SetI321DCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::get_f32_1d", ml_GetF321DCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::set_f32_1d", ml_SetF321DCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::get_tensor", ml_GetTensorCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::dup", ml_DupCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::dup_inplace", ml_DupInplaceCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::add", ml_AddCmd, NULL, NULL);
@@ -204,6 +248,56 @@ int Ggml_Init(Tcl_Interp *interp) {
     Tcl_CreateObjCommand(interp, "::ggml::add_rel_pos", ml_AddRelPosCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::ggml::add_rel_pos_inplace", ml_AddRelPosInplaceCmd, NULL, NULL);
 
+    Tcl_CreateObjCommand(interp, "::ggml::bench_matmul", ml_BenchMatMulCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::ggml::llama_create", ml_LlamaCreateCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::llama_destroy", ml_LlamaDestroyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::llama_eval", ml_LlamaEvalCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::llama_reset", ml_LlamaResetCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::llama_info", ml_LlamaInfoCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::llama_save_session", ml_LlamaSaveSessionCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::llama_load_session", ml_LlamaLoadSessionCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::sample", ml_SampleCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::tokenizer_create", ml_TokenizerCreateCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::tokenizer_destroy", ml_TokenizerDestroyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::tokenize", ml_TokenizeCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::tokenize_batch", ml_TokenizeBatchCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::detokenize", ml_DetokenizeCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::generate", ml_GenerateCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::generate_cancel", ml_GenerateCancelCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::scheduler_create", ml_SchedulerCreateCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::scheduler_destroy", ml_SchedulerDestroyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::scheduler_submit", ml_SchedulerSubmitCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::scheduler_info", ml_SchedulerInfoCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::ggml::embedder_create", ml_EmbedderCreateCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::embedder_destroy", ml_EmbedderDestroyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::embed", ml_EmbedCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::embedder_info", ml_EmbedderInfoCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::ggml::knn", ml_KnnCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::load_safetensors", ml_LoadSafetensorsCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::load_npy", ml_LoadNpyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::save_npy", ml_SaveNpyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::load_npz", ml_LoadNpzCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::save_npz", ml_SaveNpzCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::load_csv", ml_LoadCsvCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::load_images", ml_LoadImagesCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::load_wav", ml_LoadWavCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::wav_info", ml_WavInfoCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::log_mel", ml_LogMelCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::kmeans", ml_KMeansCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::kmeans_assign", ml_KMeansAssignCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::pca", ml_PcaCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_create", ml_IvfCreateCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_destroy", ml_IvfDestroyCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_train", ml_IvfTrainCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_add", ml_IvfAddCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_search", ml_IvfSearchCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_save", ml_IvfSaveCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_load", ml_IvfLoadCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::ggml::ivf_info", ml_IvfInfoCmd, NULL, NULL);
+
     return Tcl_PkgProvide(interp, "ggml", XSTR(PROJECT_VERSION));
 }
 
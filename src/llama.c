@@ -0,0 +1,857 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "llama.h"
+#include "context.h"
+#include "tensor.h"
+#include "kvcache.h"
+
+// enough for the 80 layers of the largest llama models
+#define ML_LLAMA_MAX_NODES 8192
+// attention nodes added per layer by every additional sequence in a batch
+#define ML_LLAMA_NODES_PER_SEGMENT 24
+#define ML_LLAMA_TENSOR_ALIGNMENT 32
+
+static Tcl_HashTable ml_LlamaToInternal_HT;
+static Tcl_Mutex ml_LlamaToInternal_HT_Mutex;
+
+void ml_InitLlamaHT() {
+    Tcl_MutexLock(&ml_LlamaToInternal_HT_Mutex);
+    Tcl_InitHashTable(&ml_LlamaToInternal_HT, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&ml_LlamaToInternal_HT_Mutex);
+}
+
+void ml_DeleteLlamaHT() {
+    Tcl_MutexLock(&ml_LlamaToInternal_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_LlamaToInternal_HT);
+    Tcl_MutexUnlock(&ml_LlamaToInternal_HT_Mutex);
+}
+
+static int ml_RegisterLlama(const char *name, ml_llama_t *internal) {
+    Tcl_HashEntry *entryPtr;
+    int newEntry;
+    Tcl_MutexLock(&ml_LlamaToInternal_HT_Mutex);
+    entryPtr = Tcl_CreateHashEntry(&ml_LlamaToInternal_HT, (char *) name, &newEntry);
+    if (newEntry) {
+        Tcl_SetHashValue(entryPtr, (ClientData) internal);
+    }
+    Tcl_MutexUnlock(&ml_LlamaToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> RegisterLlama: name=%s internal=%p %s\n", name, internal,
+                newEntry ? "entered into" : "already in"));
+
+    return newEntry;
+}
+
+static int ml_UnregisterLlama(const char *name) {
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_LlamaToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_LlamaToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_LlamaToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> UnregisterLlama: name=%s entryPtr=%p\n", name, entryPtr));
+
+    return entryPtr != NULL;
+}
+
+ml_llama_t *ml_GetInternalFromLlama(const char *name) {
+    ml_llama_t *internal = NULL;
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_LlamaToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_LlamaToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        internal = (ml_llama_t *) Tcl_GetHashValue(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_LlamaToInternal_HT_Mutex);
+
+    return internal;
+}
+
+static int ml_GgufGetInt(struct gguf_context *gguf_ctx, const char *arch, const char *suffix, int *value) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s.%s", arch, suffix);
+    int key_id = gguf_find_key(gguf_ctx, key);
+    if (key_id < 0) {
+        return 0;
+    }
+    switch (gguf_get_kv_type(gguf_ctx, key_id)) {
+        case GGUF_TYPE_UINT32:
+            *value = (int) gguf_get_val_u32(gguf_ctx, key_id);
+            return 1;
+        case GGUF_TYPE_INT32:
+            *value = gguf_get_val_i32(gguf_ctx, key_id);
+            return 1;
+        case GGUF_TYPE_UINT64:
+            *value = (int) gguf_get_val_u64(gguf_ctx, key_id);
+            return 1;
+        case GGUF_TYPE_INT64:
+            *value = (int) gguf_get_val_i64(gguf_ctx, key_id);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int ml_GgufGetFloat(struct gguf_context *gguf_ctx, const char *arch, const char *suffix, float *value) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s.%s", arch, suffix);
+    int key_id = gguf_find_key(gguf_ctx, key);
+    if (key_id < 0 || gguf_get_kv_type(gguf_ctx, key_id) != GGUF_TYPE_FLOAT32) {
+        return 0;
+    }
+    *value = gguf_get_val_f32(gguf_ctx, key_id);
+    return 1;
+}
+
+static struct ggml_tensor *ml_LlamaGetWeight(ml_context_t *model_ctx, const char *name, int layer) {
+    char tensor_name[GGML_MAX_NAME];
+    if (layer >= 0) {
+        snprintf(tensor_name, sizeof(tensor_name), "blk.%d.%s.weight", layer, name);
+    } else {
+        snprintf(tensor_name, sizeof(tensor_name), "%s.weight", name);
+    }
+    return ggml_get_tensor(model_ctx->ggml_ctx, tensor_name);
+}
+
+static int ml_LlamaLoadModel(ml_llama_t *llama, const char **errmsg) {
+    struct gguf_context *gguf_ctx = llama->model_ctx->gguf_ctx;
+    ml_llama_hparams_t *hparams = &llama->hparams;
+
+    int arch_id = gguf_find_key(gguf_ctx, "general.architecture");
+    const char *arch = arch_id >= 0 ? gguf_get_val_str(gguf_ctx, arch_id) : "llama";
+
+    if (!ml_GgufGetInt(gguf_ctx, arch, "embedding_length", &hparams->n_embd)
+        || !ml_GgufGetInt(gguf_ctx, arch, "block_count", &hparams->n_layer)
+        || !ml_GgufGetInt(gguf_ctx, arch, "feed_forward_length", &hparams->n_ff)
+        || !ml_GgufGetInt(gguf_ctx, arch, "attention.head_count", &hparams->n_head)) {
+        *errmsg = "model is missing llama hyperparameters";
+        return TCL_ERROR;
+    }
+    if (!ml_GgufGetInt(gguf_ctx, arch, "context_length", &hparams->n_ctx_train)) {
+        hparams->n_ctx_train = 2048;
+    }
+    if (!ml_GgufGetInt(gguf_ctx, arch, "attention.head_count_kv", &hparams->n_head_kv)) {
+        hparams->n_head_kv = hparams->n_head;
+    }
+    if (!ml_GgufGetInt(gguf_ctx, arch, "rope.dimension_count", &hparams->n_rot)) {
+        hparams->n_rot = hparams->n_embd / hparams->n_head;
+    }
+    if (!ml_GgufGetFloat(gguf_ctx, arch, "attention.layer_norm_rms_epsilon", &hparams->rms_norm_eps)) {
+        hparams->rms_norm_eps = 1e-5f;
+    }
+    if (!ml_GgufGetFloat(gguf_ctx, arch, "rope.freq_base", &hparams->rope_freq_base)) {
+        hparams->rope_freq_base = 10000.0f;
+    }
+    float rope_scale;
+    hparams->rope_freq_scale = ml_GgufGetFloat(gguf_ctx, arch, "rope.scale_linear", &rope_scale) && rope_scale > 0
+                               ? 1.0f / rope_scale
+                               : 1.0f;
+
+    if (hparams->n_head <= 0 || hparams->n_head_kv <= 0 || hparams->n_embd % hparams->n_head != 0
+        || hparams->n_head % hparams->n_head_kv != 0) {
+        *errmsg = "model has invalid attention head counts";
+        return TCL_ERROR;
+    }
+
+    llama->tok_embd = ml_LlamaGetWeight(llama->model_ctx, "token_embd", -1);
+    llama->output_norm = ml_LlamaGetWeight(llama->model_ctx, "output_norm", -1);
+    llama->output = ml_LlamaGetWeight(llama->model_ctx, "output", -1);
+    if (llama->output == NULL) {
+        // tied embeddings
+        llama->output = llama->tok_embd;
+    }
+    if (llama->tok_embd == NULL || llama->output_norm == NULL) {
+        *errmsg = "model is missing token_embd or output_norm weights";
+        return TCL_ERROR;
+    }
+    hparams->n_vocab = (int) llama->tok_embd->ne[1];
+
+    llama->layers = (ml_llama_layer_t *) Tcl_Alloc(sizeof(ml_llama_layer_t) * hparams->n_layer);
+    for (int il = 0; il < hparams->n_layer; il++) {
+        ml_llama_layer_t *layer = &llama->layers[il];
+        layer->attn_norm = ml_LlamaGetWeight(llama->model_ctx, "attn_norm", il);
+        layer->wq = ml_LlamaGetWeight(llama->model_ctx, "attn_q", il);
+        layer->wk = ml_LlamaGetWeight(llama->model_ctx, "attn_k", il);
+        layer->wv = ml_LlamaGetWeight(llama->model_ctx, "attn_v", il);
+        layer->wo = ml_LlamaGetWeight(llama->model_ctx, "attn_output", il);
+        layer->ffn_norm = ml_LlamaGetWeight(llama->model_ctx, "ffn_norm", il);
+        layer->ffn_gate = ml_LlamaGetWeight(llama->model_ctx, "ffn_gate", il);
+        layer->ffn_down = ml_LlamaGetWeight(llama->model_ctx, "ffn_down", il);
+        layer->ffn_up = ml_LlamaGetWeight(llama->model_ctx, "ffn_up", il);
+        if (!layer->attn_norm || !layer->wq || !layer->wk || !layer->wv || !layer->wo
+            || !layer->ffn_norm || !layer->ffn_gate || !layer->ffn_down || !layer->ffn_up) {
+            *errmsg = "model is missing layer weights";
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+
+// Builds the graph for a batch made of one or more sequences. The tokens of each segment are
+// contiguous in the batch; the projections and the feed forward network run on the whole batch,
+// attention runs per segment over the kv cache slot of its sequence. The graph ends with the logits
+// of the last token of every segment, or with the normalized hidden states of all tokens for embeddings.
+static struct ggml_cgraph *ml_LlamaBuildGraph(ml_llama_t *llama, struct ggml_context *ctx0, const int32_t *tokens,
+                                              const ml_llama_segment_t *segments, int n_segments, int embeddings) {
+    const ml_llama_hparams_t *hparams = &llama->hparams;
+    const int n_embd = hparams->n_embd;
+    const int n_head = hparams->n_head;
+    const int n_head_kv = hparams->n_head_kv;
+    const int head_dim = n_embd / n_head;
+    const int n_embd_gqa = head_dim * n_head_kv;
+    const int n_ctx = llama->n_ctx;
+    const ml_kv_pages_t *pages = llama->pages;
+    // positions per layer, over all slots or all pages
+    const int n_cache = pages != NULL ? pages->n_pages * pages->page_size : llama->n_ctx * llama->n_seq;
+    const int measure = ggml_allocr_is_measure(llama->allocr);
+    const size_t esize = ggml_element_size(llama->k_cache);
+    const float eps = hparams->rms_norm_eps;
+
+    int n_tokens = 0;
+    for (int s = 0; s < n_segments; s++) {
+        n_tokens += segments[s].n_tokens;
+    }
+
+    struct ggml_cgraph *gf = ggml_new_graph_custom(ctx0, llama->max_nodes, false);
+
+    struct ggml_tensor *inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_allocr_alloc(llama->allocr, inp_tokens);
+    struct ggml_tensor *inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_allocr_alloc(llama->allocr, inp_pos);
+    struct ggml_tensor *inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_segments);
+    ggml_allocr_alloc(llama->allocr, inp_out_ids);
+    struct ggml_tensor *kq_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    ggml_allocr_alloc(llama->allocr, kq_scale);
+    if (!ggml_allocr_is_measure(llama->allocr)) {
+        memcpy(inp_tokens->data, tokens, n_tokens * sizeof(int32_t));
+        int i = 0;
+        for (int s = 0; s < n_segments; s++) {
+            for (int j = 0; j < segments[s].n_tokens; j++) {
+                ((int32_t *) inp_pos->data)[i++] = segments[s].n_past + j;
+            }
+            // the logits of the last token of every segment are kept
+            ((int32_t *) inp_out_ids->data)[s] = i - 1;
+        }
+        ((float *) kq_scale->data)[0] = 1.0f / sqrtf((float) head_dim);
+    }
+
+    // with a paged cache every segment gathers its keys and values by physical position
+    struct ggml_tensor **inp_kv_ids = NULL;
+    if (pages != NULL) {
+        inp_kv_ids = (struct ggml_tensor **) Tcl_Alloc(sizeof(struct ggml_tensor *) * n_segments);
+        for (int s = 0; s < n_segments; s++) {
+            int n_kv = segments[s].n_past + segments[s].n_tokens;
+            inp_kv_ids[s] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+            ggml_allocr_alloc(llama->allocr, inp_kv_ids[s]);
+            if (!measure) {
+                for (int pos = 0; pos < n_kv; pos++) {
+                    ((int32_t *) inp_kv_ids[s]->data)[pos] = ml_KvPagesPosition(pages, segments[s].seq, pos);
+                }
+            }
+        }
+    }
+
+    struct ggml_tensor *inpL = ggml_get_rows(ctx0, llama->tok_embd, inp_tokens);
+
+    for (int il = 0; il < hparams->n_layer; il++) {
+        const ml_llama_layer_t *layer = &llama->layers[il];
+        struct ggml_tensor *inpSA = inpL;
+
+        struct ggml_tensor *cur = ggml_rms_norm(ctx0, inpL, eps);
+        cur = ggml_mul(ctx0, cur, layer->attn_norm);
+
+        struct ggml_tensor *Qcur = ggml_mul_mat(ctx0, layer->wq, cur);
+        struct ggml_tensor *Kcur = ggml_mul_mat(ctx0, layer->wk, cur);
+        struct ggml_tensor *Vcur = ggml_mul_mat(ctx0, layer->wv, cur);
+
+        Qcur = ggml_rope_custom(ctx0, ggml_reshape_3d(ctx0, Qcur, head_dim, n_head, n_tokens), inp_pos,
+                                hparams->n_rot, 0, 0, hparams->n_ctx_train,
+                                hparams->rope_freq_base, hparams->rope_freq_scale, 0.0f, 1.0f, 32.0f, 1.0f);
+        Kcur = ggml_rope_custom(ctx0, ggml_reshape_3d(ctx0, Kcur, head_dim, n_head_kv, n_tokens), inp_pos,
+                                hparams->n_rot, 0, 0, hparams->n_ctx_train,
+                                hparams->rope_freq_base, hparams->rope_freq_scale, 0.0f, 1.0f, 32.0f, 1.0f);
+
+        // attention outputs of all segments are copied side by side into one tensor
+        struct ggml_tensor *attn_out = n_segments > 1 ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens) : NULL;
+
+        int offset = 0;
+        for (int s = 0; s < n_segments; s++) {
+            const int n_seg = segments[s].n_tokens;
+            const int n_past = segments[s].n_past;
+            const int n_kv = n_past + n_seg;
+            const int slot = segments[s].seq * n_ctx;
+
+            struct ggml_tensor *q_seg = ggml_view_3d(ctx0, Qcur, head_dim, n_head, n_seg, Qcur->nb[1], Qcur->nb[2],
+                                                     offset * Qcur->nb[2]);
+            struct ggml_tensor *Q = ggml_permute(ctx0, q_seg, 0, 2, 1, 3);
+            struct ggml_tensor *K;
+            struct ggml_tensor *V;
+
+            if (pages == NULL) {
+                // append the new keys and values to the slot, values are stored transposed
+                struct ggml_tensor *k_seg = ggml_view_1d(ctx0, Kcur, n_seg * n_embd_gqa, offset * Kcur->nb[2]);
+                struct ggml_tensor *v_seg = ggml_view_2d(ctx0, Vcur, n_embd_gqa, n_seg, Vcur->nb[1], offset * Vcur->nb[1]);
+                struct ggml_tensor *k_view = ggml_view_1d(ctx0, llama->k_cache, n_seg * n_embd_gqa,
+                                                          esize * n_embd_gqa * (il * n_cache + slot + n_past));
+                struct ggml_tensor *v_view = ggml_view_2d(ctx0, llama->v_cache, n_seg, n_embd_gqa, esize * n_cache,
+                                                          esize * (il * n_cache * n_embd_gqa + slot + n_past));
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_seg, k_view));
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_transpose(ctx0, v_seg), v_view));
+
+                K = ggml_view_3d(ctx0, llama->k_cache, head_dim, n_kv, n_head_kv,
+                                 esize * n_embd_gqa, esize * head_dim,
+                                 esize * n_embd_gqa * (n_cache * il + slot));
+                V = ggml_view_3d(ctx0, llama->v_cache, n_kv, head_dim, n_head_kv,
+                                 esize * n_cache, esize * n_cache * head_dim,
+                                 esize * (n_cache * n_embd_gqa * il + slot));
+            } else {
+                // keys and values are stored by position, a run of tokens is contiguous up to the end of its page
+                for (int j = 0; j < n_seg;) {
+                    int pos = n_past + j;
+                    int n_run = pages->page_size - pos % pages->page_size;
+                    if (n_run > n_seg - j) {
+                        n_run = n_seg - j;
+                    }
+                    int32_t phys = measure ? pos % pages->page_size : ml_KvPagesPosition(pages, segments[s].seq, pos);
+                    struct ggml_tensor *k_run = ggml_view_1d(ctx0, Kcur, n_run * n_embd_gqa, (offset + j) * Kcur->nb[2]);
+                    struct ggml_tensor *v_run = ggml_view_1d(ctx0, Vcur, n_run * n_embd_gqa, (offset + j) * Vcur->nb[1]);
+                    struct ggml_tensor *k_view = ggml_view_1d(ctx0, llama->k_cache, n_run * n_embd_gqa,
+                                                              esize * n_embd_gqa * ((size_t) il * n_cache + phys));
+                    struct ggml_tensor *v_view = ggml_view_1d(ctx0, llama->v_cache, n_run * n_embd_gqa,
+                                                              esize * n_embd_gqa * ((size_t) il * n_cache + phys));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_run, k_view));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_run, v_view));
+                    j += n_run;
+                }
+
+                struct ggml_tensor *k_layer = ggml_view_2d(ctx0, llama->k_cache, n_embd_gqa, n_cache, esize * n_embd_gqa,
+                                                           esize * n_embd_gqa * (size_t) n_cache * il);
+                struct ggml_tensor *v_layer = ggml_view_2d(ctx0, llama->v_cache, n_embd_gqa, n_cache, esize * n_embd_gqa,
+                                                           esize * n_embd_gqa * (size_t) n_cache * il);
+                struct ggml_tensor *k_rows = ggml_get_rows(ctx0, k_layer, inp_kv_ids[s]);
+                struct ggml_tensor *v_rows = ggml_get_rows(ctx0, v_layer, inp_kv_ids[s]);
+                K = ggml_permute(ctx0, ggml_reshape_3d(ctx0, k_rows, head_dim, n_head_kv, n_kv), 0, 2, 1, 3);
+                V = ggml_reshape_3d(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, v_rows)), n_kv, head_dim, n_head_kv);
+            }
+
+            // mul_mat broadcasts the kv heads over the query heads (grouped query attention)
+            struct ggml_tensor *KQ = ggml_mul_mat(ctx0, K, Q);
+            KQ = ggml_scale_inplace(ctx0, KQ, kq_scale);
+            KQ = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+            KQ = ggml_soft_max_inplace(ctx0, KQ);
+
+            struct ggml_tensor *KQV = ggml_mul_mat(ctx0, V, KQ);
+            struct ggml_tensor *KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+            if (attn_out == NULL) {
+                cur = ggml_cpy(ctx0, KQV_merged, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens));
+            } else {
+                struct ggml_tensor *dst = ggml_view_2d(ctx0, attn_out, n_embd, n_seg, attn_out->nb[1], offset * attn_out->nb[1]);
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, KQV_merged, dst));
+            }
+            offset += n_seg;
+        }
+        if (attn_out != NULL) {
+            cur = attn_out;
+        }
+        cur = ggml_mul_mat(ctx0, layer->wo, cur);
+
+        struct ggml_tensor *ffn_inp = ggml_add(ctx0, cur, inpSA);
+
+        cur = ggml_rms_norm(ctx0, ffn_inp, eps);
+        cur = ggml_mul(ctx0, cur, layer->ffn_norm);
+
+        struct ggml_tensor *tmp = ggml_mul_mat(ctx0, layer->ffn_up, cur);
+        cur = ggml_mul_mat(ctx0, layer->ffn_gate, cur);
+        cur = ggml_silu(ctx0, cur);
+        cur = ggml_mul(ctx0, cur, tmp);
+        cur = ggml_mul_mat(ctx0, layer->ffn_down, cur);
+
+        inpL = ggml_add(ctx0, cur, ffn_inp);
+    }
+
+    struct ggml_tensor *cur = ggml_rms_norm(ctx0, inpL, eps);
+    cur = ggml_mul(ctx0, cur, llama->output_norm);
+
+    if (inp_kv_ids != NULL) {
+        Tcl_Free((char *) inp_kv_ids);
+    }
+
+    if (embeddings) {
+        ggml_set_name(cur, "result_embd");
+    } else {
+        cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+        cur = ggml_mul_mat(ctx0, llama->output, cur);
+        ggml_set_name(cur, "result_output");
+    }
+
+    ggml_build_forward_expand(gf, cur);
+    return gf;
+}
+
+static bool ml_LlamaAbortCallback(void *data) {
+    return *(volatile int *) data != 0;
+}
+
+static int ml_LlamaCompute(ml_llama_t *llama, struct ggml_cgraph *gf) {
+    struct ggml_cplan cplan = ggml_graph_plan(gf, llama->nthreads);
+    if (cplan.work_size > llama->work_size) {
+        llama->work_buffer = Tcl_Realloc(llama->work_buffer, cplan.work_size);
+        llama->work_size = cplan.work_size;
+    }
+    cplan.work_data = (uint8_t *) llama->work_buffer;
+    if (llama->abort_flag != NULL) {
+        cplan.abort_callback = ml_LlamaAbortCallback;
+        cplan.abort_callback_data = (void *) llama->abort_flag;
+    }
+    return ggml_graph_compute(gf, &cplan);
+}
+
+static int ml_LlamaMeasure(ml_llama_t *llama, int n_segments, int n_tokens_per_segment, size_t *alloc_size,
+                           const char **errmsg) {
+    struct ggml_init_params params = {
+            .mem_size   = llama->compute_meta_size,
+            .mem_buffer = llama->compute_meta,
+            .no_alloc   = true,
+    };
+    struct ggml_context *ctx0 = ggml_init(params);
+    if (ctx0 == NULL) {
+        *errmsg = "could not create the compute context";
+        return TCL_ERROR;
+    }
+
+    ml_llama_segment_t *segments = (ml_llama_segment_t *) Tcl_Alloc(sizeof(ml_llama_segment_t) * n_segments);
+    for (int s = 0; s < n_segments; s++) {
+        segments[s].seq = s % llama->n_seq;
+        segments[s].n_past = llama->n_ctx - n_tokens_per_segment;
+        segments[s].n_tokens = n_tokens_per_segment;
+    }
+
+    llama->allocr = ggml_allocr_new_measure(ML_LLAMA_TENSOR_ALIGNMENT);
+    struct ggml_cgraph *gf = ml_LlamaBuildGraph(llama, ctx0, NULL, segments, n_segments, 0);
+    *alloc_size = ggml_allocr_alloc_graph(llama->allocr, gf) + ML_LLAMA_TENSOR_ALIGNMENT;
+    ggml_free(ctx0);
+    ggml_allocr_free(llama->allocr);
+    llama->allocr = NULL;
+
+    Tcl_Free((char *) segments);
+    return TCL_OK;
+}
+
+// Sizes the allocator for the worst case graphs at the end of the context: one sequence with a
+// full batch, and as many sequences as fit in a batch sharing it.
+static int ml_LlamaInitAllocator(ml_llama_t *llama, const char **errmsg) {
+    int max_segments = llama->n_seq < llama->n_batch ? llama->n_seq : llama->n_batch;
+    llama->max_nodes = ML_LLAMA_MAX_NODES + llama->hparams.n_layer * ML_LLAMA_NODES_PER_SEGMENT * (max_segments - 1);
+    if (llama->pages != NULL) {
+        // a run of tokens is stored with six nodes per page it touches
+        int max_runs = llama->n_batch / llama->pages->page_size + 2 * max_segments;
+        llama->max_nodes += llama->hparams.n_layer * 6 * max_runs;
+    }
+    llama->compute_meta_size = ggml_tensor_overhead() * llama->max_nodes
+                               + ggml_graph_overhead_custom(llama->max_nodes, false);
+    llama->compute_meta = Tcl_Alloc(llama->compute_meta_size);
+
+    size_t alloc_size;
+    if (TCL_OK != ml_LlamaMeasure(llama, 1, llama->n_batch, &alloc_size, errmsg)) {
+        return TCL_ERROR;
+    }
+    if (max_segments > 1) {
+        size_t shared_size;
+        if (TCL_OK != ml_LlamaMeasure(llama, max_segments, llama->n_batch / max_segments, &shared_size, errmsg)) {
+            return TCL_ERROR;
+        }
+        if (shared_size > alloc_size) {
+            alloc_size = shared_size;
+        }
+    }
+
+    llama->alloc_buffer = Tcl_Alloc(alloc_size);
+    llama->allocr = ggml_allocr_new(llama->alloc_buffer, alloc_size, ML_LLAMA_TENSOR_ALIGNMENT);
+    return TCL_OK;
+}
+
+// The output of the graph is copied out, output_size bytes of it.
+static int ml_LlamaRun(ml_llama_t *llama, const int32_t *tokens, const ml_llama_segment_t *segments, int n_segments,
+                       int embeddings, float *output, size_t output_size, const char **errmsg) {
+    struct ggml_init_params params = {
+            .mem_size   = llama->compute_meta_size,
+            .mem_buffer = llama->compute_meta,
+            .no_alloc   = true,
+    };
+    struct ggml_context *ctx0 = ggml_init(params);
+    if (ctx0 == NULL) {
+        *errmsg = "could not create the compute context";
+        return TCL_ERROR;
+    }
+
+    ggml_allocr_reset(llama->allocr);
+    struct ggml_cgraph *gf = ml_LlamaBuildGraph(llama, ctx0, tokens, segments, n_segments, embeddings);
+    ggml_allocr_alloc_graph(llama->allocr, gf);
+
+    if (GGML_EXIT_SUCCESS != ml_LlamaCompute(llama, gf)) {
+        ggml_free(ctx0);
+        *errmsg = "evaluation aborted";
+        return TCL_ERROR;
+    }
+
+    struct ggml_tensor *result = gf->nodes[gf->n_nodes - 1];
+    memcpy(output, result->data, output_size);
+
+    ggml_free(ctx0);
+    return TCL_OK;
+}
+
+int ml_LlamaEvalSegments(ml_llama_t *llama, const int32_t *tokens, const ml_llama_segment_t *segments, int n_segments,
+                         float *logits, const char **errmsg) {
+    return ml_LlamaRun(llama, tokens, segments, n_segments, 0, logits,
+                       (size_t) n_segments * llama->hparams.n_vocab * sizeof(float), errmsg);
+}
+
+int ml_LlamaEmbedSegments(ml_llama_t *llama, const int32_t *tokens, const ml_llama_segment_t *segments, int n_segments,
+                          float *embeddings, const char **errmsg) {
+    int n_tokens = 0;
+    for (int s = 0; s < n_segments; s++) {
+        n_tokens += segments[s].n_tokens;
+    }
+    return ml_LlamaRun(llama, tokens, segments, n_segments, 1, embeddings,
+                       (size_t) n_tokens * llama->hparams.n_embd * sizeof(float), errmsg);
+}
+
+int ml_LlamaEval(ml_llama_t *llama, const int32_t *tokens, int n_tokens, const char **errmsg) {
+    if (n_tokens <= 0) {
+        *errmsg = "no tokens to evaluate";
+        return TCL_ERROR;
+    }
+    if (llama->n_past + n_tokens > llama->n_ctx) {
+        *errmsg = "context is full";
+        return TCL_ERROR;
+    }
+    for (int i = 0; i < n_tokens; i++) {
+        if (tokens[i] < 0 || tokens[i] >= llama->hparams.n_vocab) {
+            *errmsg = "token out of range";
+            return TCL_ERROR;
+        }
+    }
+
+    // long prompts are split into batches so that the graph never exceeds the measured size
+    for (int i = 0; i < n_tokens; i += llama->n_batch) {
+        ml_llama_segment_t segment = {
+                .seq = 0,
+                .n_past = llama->n_past,
+                .n_tokens = n_tokens - i < llama->n_batch ? n_tokens - i : llama->n_batch,
+        };
+        if (TCL_OK != ml_LlamaEvalSegments(llama, tokens + i, &segment, 1, (float *) llama->logits_ptr->ggml_tensor->data,
+                                           errmsg)) {
+            return TCL_ERROR;
+        }
+        llama->n_past += segment.n_tokens;
+    }
+    return TCL_OK;
+}
+
+static void ml_FreeLlamaBuffers(ml_llama_t *llama) {
+    if (llama->allocr != NULL) {
+        ggml_allocr_free(llama->allocr);
+    }
+    if (llama->alloc_buffer != NULL) {
+        Tcl_Free(llama->alloc_buffer);
+    }
+    if (llama->compute_meta != NULL) {
+        Tcl_Free(llama->compute_meta);
+    }
+    if (llama->work_buffer != NULL) {
+        Tcl_Free(llama->work_buffer);
+    }
+    if (llama->layers != NULL) {
+        Tcl_Free((char *) llama->layers);
+    }
+    if (llama->pages != NULL) {
+        ml_KvPagesFree(llama->pages);
+    }
+    Tcl_Free((char *) llama);
+}
+
+ml_llama_t *ml_LlamaNew(ml_context_t *model_ctx, int n_ctx, int n_seq, int n_batch, int nthreads, enum ggml_type kv_type,
+                        int page_size, int n_pages, const char **errmsg) {
+    if (model_ctx->gguf_ctx == NULL) {
+        *errmsg = "context was not loaded from a gguf file";
+        return NULL;
+    }
+    if (n_batch > n_ctx) {
+        n_batch = n_ctx;
+    }
+
+    ml_llama_t *llama = (ml_llama_t *) Tcl_Alloc(sizeof(ml_llama_t));
+    memset(llama, 0, sizeof(ml_llama_t));
+    llama->model_ctx = model_ctx;
+    llama->n_ctx = n_ctx;
+    llama->n_seq = n_seq;
+    llama->n_batch = n_batch;
+    llama->nthreads = nthreads;
+
+    if (TCL_OK != ml_LlamaLoadModel(llama, errmsg)) {
+        ml_FreeLlamaBuffers(llama);
+        return NULL;
+    }
+
+    // one slot of n_ctx positions per sequence, or a pool of pages that sequences take from as they grow
+    const ml_llama_hparams_t *hparams = &llama->hparams;
+    const int64_t n_embd_gqa = (int64_t) hparams->n_embd / hparams->n_head * hparams->n_head_kv;
+    int64_t n_cache = (int64_t) n_ctx * n_seq;
+    if (page_size > 0) {
+        llama->pages = ml_KvPagesNew(n_pages, page_size, n_seq, n_ctx);
+        n_cache = (int64_t) n_pages * page_size;
+    }
+    const int64_t n_kv_elements = n_embd_gqa * n_cache * hparams->n_layer;
+    size_t state_size = 2 * n_kv_elements * ggml_type_size(kv_type)
+                        + hparams->n_vocab * sizeof(float)
+                        + 4 * ggml_tensor_overhead();
+    llama->state_ctx = ml_NewContext(state_size, 0);
+    if (llama->state_ctx == NULL) {
+        ml_FreeLlamaBuffers(llama);
+        *errmsg = "could not create the kv cache context";
+        return NULL;
+    }
+
+    llama->k_cache = ggml_new_tensor_1d(llama->state_ctx->ggml_ctx, kv_type, n_kv_elements);
+    llama->v_cache = ggml_new_tensor_1d(llama->state_ctx->ggml_ctx, kv_type, n_kv_elements);
+    ggml_set_name(llama->k_cache, "cache_k");
+    ggml_set_name(llama->v_cache, "cache_v");
+    if (llama->pages != NULL) {
+        ml_KvPagesBind(llama->pages, llama->k_cache->data, llama->v_cache->data,
+                       n_embd_gqa * ggml_type_size(kv_type), hparams->n_layer);
+    }
+    struct ggml_tensor *logits = ggml_new_tensor_1d(llama->state_ctx->ggml_ctx, GGML_TYPE_F32, hparams->n_vocab);
+    ggml_set_name(logits, "logits");
+    ggml_set_zero(logits);
+    llama->logits_ptr = ml_CreateTensorHandle(llama->state_ctx, logits);
+
+    if (TCL_OK != ml_LlamaInitAllocator(llama, errmsg)) {
+        ml_DeleteContext(llama->state_ctx);
+        ml_FreeLlamaBuffers(llama);
+        return NULL;
+    }
+
+    // neither context may go away while the engine points into it
+    model_ctx->refcount++;
+    llama->state_ctx->refcount++;
+    return llama;
+}
+
+// Always releases the engine, its handle is already gone; an error only reports that the state context leaked.
+int ml_LlamaFree(Tcl_Interp *interp, ml_llama_t *llama) {
+    llama->model_ctx->refcount--;
+    llama->state_ctx->refcount--;
+    int rc = ml_DestroyContext(interp, llama->state_ctx);
+    ml_FreeLlamaBuffers(llama);
+    return rc;
+}
+
+int ml_LlamaCreateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaCreateCmd\n"));
+
+    static const char *options[] = {"-n_ctx", "-n_batch", "-nthreads", "-kv_type", NULL};
+    enum options {
+        OPT_N_CTX, OPT_N_BATCH, OPT_NTHREADS, OPT_KV_TYPE
+    };
+
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle ?-n_ctx n? ?-n_batch n? ?-nthreads n? ?-kv_type F16|F32?");
+        return TCL_ERROR;
+    }
+
+    const char *context_handle = Tcl_GetString(objv[1]);
+    ml_context_t *model_ctx = ml_GetInternalFromContext(context_handle);
+    if (!model_ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+
+    int n_ctx = 512;
+    int n_batch = 512;
+    int nthreads = 4;
+    enum ggml_type kv_type = GGML_TYPE_F16;
+    for (int i = 2; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_N_CTX:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_ctx) || n_ctx <= 0) {
+                    SetResult("n_ctx is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_BATCH:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_batch) || n_batch <= 0) {
+                    SetResult("n_batch is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_KV_TYPE:
+                if (TCL_OK != ml_GetTypeFromObj(interp, objv[i + 1], &kv_type)) {
+                    return TCL_ERROR;
+                }
+                if (kv_type != GGML_TYPE_F16 && kv_type != GGML_TYPE_F32) {
+                    SetResult("kv_type must be F16 or F32");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    const char *errmsg = NULL;
+    ml_llama_t *llama = ml_LlamaNew(model_ctx, n_ctx, 1, n_batch, nthreads, kv_type, 0, 0, &errmsg);
+    if (llama == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    CMD_LLAMA_NAME(llama->handle, llama);
+    ml_RegisterLlama(llama->handle, llama);
+
+    SetResult(llama->handle);
+    return TCL_OK;
+}
+
+int ml_LlamaDestroyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaDestroyCmd\n"));
+    CheckArgs(2, 2, 1, "llama_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+    if (llama->busy) {
+        SetResult("llama is busy generating");
+        return TCL_ERROR;
+    }
+
+    if (!ml_UnregisterLlama(handle)) {
+        SetResult("unregister llama name failed");
+        return TCL_ERROR;
+    }
+
+    return ml_LlamaFree(interp, llama);
+}
+
+int ml_LlamaEvalCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaEvalCmd\n"));
+    CheckArgs(3, 3, 1, "llama_handle tokens");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+    if (llama->busy) {
+        SetResult("llama is busy generating");
+        return TCL_ERROR;
+    }
+
+    int n_tokens;
+    Tcl_Obj **token_objs;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objv[2], &n_tokens, &token_objs)) {
+        SetResult("tokens is not a list");
+        return TCL_ERROR;
+    }
+
+    int32_t *tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * (n_tokens > 0 ? n_tokens : 1));
+    for (int i = 0; i < n_tokens; i++) {
+        int token;
+        if (TCL_OK != Tcl_GetIntFromObj(interp, token_objs[i], &token)) {
+            Tcl_Free((char *) tokens);
+            SetResult("token is not an integer");
+            return TCL_ERROR;
+        }
+        tokens[i] = token;
+    }
+
+    const char *errmsg = NULL;
+    int rc = ml_LlamaEval(llama, tokens, n_tokens, &errmsg);
+    Tcl_Free((char *) tokens);
+    if (rc != TCL_OK) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    SetResult(llama->logits_ptr->handle);
+    return TCL_OK;
+}
+
+int ml_LlamaResetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaResetCmd\n"));
+    CheckArgs(2, 3, 1, "llama_handle ?n_past?");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+    if (llama->busy) {
+        SetResult("llama is busy generating");
+        return TCL_ERROR;
+    }
+
+    // rewinding only moves the position, entries past it are overwritten by the next eval
+    int n_past = 0;
+    if (objc == 3 && (TCL_OK != Tcl_GetIntFromObj(interp, objv[2], &n_past) || n_past < 0 || n_past > llama->n_past)) {
+        SetResult("n_past is not an integer between 0 and the current position");
+        return TCL_ERROR;
+    }
+    llama->n_past = n_past;
+    return TCL_OK;
+}
+
+int ml_LlamaInfoCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaInfoCmd\n"));
+    CheckArgs(2, 2, 1, "llama_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+
+    const ml_llama_hparams_t *hparams = &llama->hparams;
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_vocab", -1), Tcl_NewIntObj(hparams->n_vocab));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_ctx_train", -1), Tcl_NewIntObj(hparams->n_ctx_train));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_embd", -1), Tcl_NewIntObj(hparams->n_embd));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_layer", -1), Tcl_NewIntObj(hparams->n_layer));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_ff", -1), Tcl_NewIntObj(hparams->n_ff));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_head", -1), Tcl_NewIntObj(hparams->n_head));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_head_kv", -1), Tcl_NewIntObj(hparams->n_head_kv));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_ctx", -1), Tcl_NewIntObj(llama->n_ctx));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_batch", -1), Tcl_NewIntObj(llama->n_batch));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_past", -1), Tcl_NewIntObj(llama->n_past));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("state_context", -1), Tcl_NewStringObj(llama->state_ctx->handle, -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("logits", -1), Tcl_NewStringObj(llama->logits_ptr->handle, -1));
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_LLAMA_H
+#define GGML_TCL_LLAMA_H
+
+#include <ggml-alloc.h>
+#include "common.h"
+#include "kvcache.h"
+
+#define CMD_LLAMA_NAME(s, internal) sprintf((s), "_GGML_LLAMA_%p", (internal))
+
+typedef struct ml_llama_hparams_s {
+    int n_vocab;
+    int n_ctx_train;
+    int n_embd;
+    int n_layer;
+    int n_ff;
+    int n_head;
+    int n_head_kv;
+    int n_rot;
+    float rms_norm_eps;
+    float rope_freq_base;
+    float rope_freq_scale;
+} ml_llama_hparams_t;
+
+typedef struct ml_llama_layer_s {
+    struct ggml_tensor *attn_norm;
+    struct ggml_tensor *wq;
+    struct ggml_tensor *wk;
+    struct ggml_tensor *wv;
+    struct ggml_tensor *wo;
+    struct ggml_tensor *ffn_norm;
+    struct ggml_tensor *ffn_gate;
+    struct ggml_tensor *ffn_down;
+    struct ggml_tensor *ffn_up;
+} ml_llama_layer_t;
+
+typedef struct ml_llama_s {
+    ml_context_t *model_ctx;            // the gguf context holding the weights
+    ml_context_t *state_ctx;            // kv cache and logits, so that they can be used from Tcl
+    ml_llama_hparams_t hparams;
+    struct ggml_tensor *tok_embd;
+    struct ggml_tensor *output_norm;
+    struct ggml_tensor *output;
+    ml_llama_layer_t *layers;
+    int n_ctx;                          // positions per sequence
+    int n_seq;                          // sequences with their own kv cache slot
+    int n_batch;                        // longest run of tokens evaluated by a single graph
+    int nthreads;
+    int n_past;                         // number of positions filled in the kv cache
+    struct ggml_tensor *k_cache;        // n_embd_gqa x (n_ctx * n_seq) x n_layer
+    struct ggml_tensor *v_cache;        // (n_ctx * n_seq) x n_embd_gqa x n_layer (transposed per layer)
+    ml_kv_pages_t *pages;               // when set both caches are n_embd_gqa x (n_pages * page_size) x n_layer
+    ml_tensor_t *logits_ptr;            // n_vocab logits of the last evaluated token
+    int max_nodes;
+    char *compute_meta;                 // objects of the per eval graph
+    size_t compute_meta_size;
+    char *alloc_buffer;                 // data of the per eval graph, reused by the allocator
+    struct ggml_allocr *allocr;
+    char *work_buffer;
+    size_t work_size;
+    int busy;                           // set while a generation runs on a worker thread
+    volatile int *abort_flag;           // graph computation stops early when this becomes non-zero
+    char handle[40];
+} ml_llama_t;
+
+// A run of tokens of one sequence within a batch.
+typedef struct ml_llama_segment_s {
+    int seq;                            // kv cache slot
+    int n_past;                         // positions of the slot already filled
+    int n_tokens;
+} ml_llama_segment_t;
+
+void ml_InitLlamaHT();
+void ml_DeleteLlamaHT();
+ml_llama_t *ml_GetInternalFromLlama(const char *name);
+
+// A page_size > 0 backs the sequences with n_pages shared pages instead of a slot of n_ctx positions each.
+ml_llama_t *ml_LlamaNew(ml_context_t *model_ctx, int n_ctx, int n_seq, int n_batch, int nthreads, enum ggml_type kv_type,
+                        int page_size, int n_pages, const char **errmsg);
+int ml_LlamaFree(Tcl_Interp *interp, ml_llama_t *llama);
+int ml_LlamaEval(ml_llama_t *llama, const int32_t *tokens, int n_tokens, const char **errmsg);
+// Evaluates the segments in one graph, at most n_batch tokens, and writes n_vocab logits per segment.
+int ml_LlamaEvalSegments(ml_llama_t *llama, const int32_t *tokens, const ml_llama_segment_t *segments, int n_segments,
+                         float *logits, const char **errmsg);
+// Same graph without the output layer, writes the n_embd normalized hidden states of every token.
+int ml_LlamaEmbedSegments(ml_llama_t *llama, const int32_t *tokens, const ml_llama_segment_t *segments, int n_segments,
+                          float *embeddings, const char **errmsg);
+
+GGML_TCL_CMD(ml_LlamaCreateCmd);
+GGML_TCL_CMD(ml_LlamaDestroyCmd);
+GGML_TCL_CMD(ml_LlamaEvalCmd);
+GGML_TCL_CMD(ml_LlamaResetCmd);
+GGML_TCL_CMD(ml_LlamaInfoCmd);
+
+#endif //GGML_TCL_LLAMA_H
@@ -0,0 +1,492 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "mel.h"
+#include "tensor.h"
+
+#define ML_MEL_MAX_FACTORS 32
+#define ML_MEL_LOG_FLOOR 1e-10f
+
+typedef struct ml_complex_s {
+    float re;
+    float im;
+} ml_complex_t;
+
+typedef enum {
+    ML_MEL_LOG10,
+    ML_MEL_LN,
+    ML_MEL_WHISPER,                     // log10, clamped to 8 below the maximum and scaled to about [-1, 1]
+    ML_MEL_POWER                        // no logarithm
+} ml_mel_log_t;
+
+// Everything that only depends on the configuration: the fft factors and twiddles, the window
+// and the filterbank. Plans are cached for the lifetime of the process.
+typedef struct ml_mel_plan_s {
+    int rate;
+    int n_fft;
+    int n_mels;
+    float fmin;
+    float fmax;
+    int factors[2 * ML_MEL_MAX_FACTORS];    // pairs of radix and remaining length
+    int max_radix;
+    ml_complex_t *twiddles;
+    float *window;
+    int *filter_first;                  // first fft bin of every filter
+    int *filter_count;
+    int *filter_offset;                 // into filter_weights
+    float *filter_weights;
+    struct ml_mel_plan_s *next;
+} ml_mel_plan_t;
+
+typedef struct ml_mel_worker_s {
+    const ml_mel_plan_t *plan;
+    const float *pcm;
+    int64_t n_samples;
+    int hop;
+    int center;
+    int64_t n_frames;
+    int64_t first_frame;
+    int64_t last_frame;                 // exclusive
+    float *out;                         // [n_frames, n_mels]
+} ml_mel_worker_t;
+
+static Tcl_Mutex ml_MelPlansMutex;
+static ml_mel_plan_t *ml_MelPlans = NULL;
+
+static void ml_FreeMelPlan(ml_mel_plan_t *plan) {
+    Tcl_Free((char *) plan->twiddles);
+    Tcl_Free((char *) plan->window);
+    Tcl_Free((char *) plan->filter_first);
+    Tcl_Free((char *) plan->filter_count);
+    Tcl_Free((char *) plan->filter_offset);
+    Tcl_Free((char *) plan->filter_weights);
+    Tcl_Free((char *) plan);
+}
+
+void ml_DeleteMelPlans() {
+    Tcl_MutexLock(&ml_MelPlansMutex);
+    while (ml_MelPlans != NULL) {
+        ml_mel_plan_t *next = ml_MelPlans->next;
+        ml_FreeMelPlan(ml_MelPlans);
+        ml_MelPlans = next;
+    }
+    Tcl_MutexUnlock(&ml_MelPlansMutex);
+}
+
+// Slaney's mel scale, linear below 1 kHz and logarithmic above, as used by librosa and whisper.
+static double ml_HzToMel(double hz) {
+    const double f_sp = 200.0 / 3.0;
+    const double log_step = log(6.4) / 27.0;
+    return hz < 1000.0 ? hz / f_sp : 15.0 + log(hz / 1000.0) / log_step;
+}
+
+static double ml_MelToHz(double mel) {
+    const double f_sp = 200.0 / 3.0;
+    const double log_step = log(6.4) / 27.0;
+    return mel < 15.0 ? mel * f_sp : 1000.0 * exp((mel - 15.0) * log_step);
+}
+
+static ml_mel_plan_t *ml_NewMelPlan(int rate, int n_fft, int n_mels, float fmin, float fmax) {
+    ml_mel_plan_t *plan = (ml_mel_plan_t *) Tcl_Alloc(sizeof(ml_mel_plan_t));
+    plan->rate = rate;
+    plan->n_fft = n_fft;
+    plan->n_mels = n_mels;
+    plan->fmin = fmin;
+    plan->fmax = fmax;
+    plan->next = NULL;
+
+    // radix 2 stages first, the generic butterfly handles the odd factors
+    int n = n_fft;
+    int i = 0;
+    int p = 2;
+    plan->max_radix = 1;
+    while (n > 1) {
+        while (n % p != 0) {
+            p = p == 2 ? 3 : p + 2;
+            if ((int64_t) p * p > n) {
+                p = n;
+            }
+        }
+        n /= p;
+        plan->factors[i++] = p;
+        plan->factors[i++] = n;
+        if (p > plan->max_radix) {
+            plan->max_radix = p;
+        }
+    }
+
+    plan->twiddles = (ml_complex_t *) Tcl_Alloc(sizeof(ml_complex_t) * n_fft);
+    plan->window = (float *) Tcl_Alloc(sizeof(float) * n_fft);
+    for (int k = 0; k < n_fft; k++) {
+        double phase = -2.0 * M_PI * k / n_fft;
+        plan->twiddles[k].re = (float) cos(phase);
+        plan->twiddles[k].im = (float) sin(phase);
+        // periodic hann window, like torch.hann_window
+        plan->window[k] = (float) (0.5 - 0.5 * cos(2.0 * M_PI * k / n_fft));
+    }
+
+    // triangular filters between mel spaced points, normalized to equal area
+    int n_bins = n_fft / 2 + 1;
+    double mel_min = ml_HzToMel(fmin);
+    double mel_max = ml_HzToMel(fmax);
+    double *hz = (double *) Tcl_Alloc(sizeof(double) * (n_mels + 2));
+    for (int m = 0; m < n_mels + 2; m++) {
+        hz[m] = ml_MelToHz(mel_min + (mel_max - mel_min) * m / (n_mels + 1));
+    }
+    plan->filter_first = (int *) Tcl_Alloc(sizeof(int) * n_mels);
+    plan->filter_count = (int *) Tcl_Alloc(sizeof(int) * n_mels);
+    plan->filter_offset = (int *) Tcl_Alloc(sizeof(int) * n_mels);
+    float *weights = (float *) Tcl_Alloc(sizeof(float) * n_bins * n_mels);
+    int n_weights = 0;
+    for (int m = 0; m < n_mels; m++) {
+        double enorm = 2.0 / (hz[m + 2] - hz[m]);
+        plan->filter_first[m] = 0;
+        plan->filter_count[m] = 0;
+        plan->filter_offset[m] = n_weights;
+        for (int k = 0; k < n_bins; k++) {
+            double f = (double) k * rate / n_fft;
+            double lower = (f - hz[m]) / (hz[m + 1] - hz[m]);
+            double upper = (hz[m + 2] - f) / (hz[m + 2] - hz[m + 1]);
+            double w = lower < upper ? lower : upper;
+            if (w <= 0.0) {
+                if (plan->filter_count[m] > 0) {
+                    break;
+                }
+                continue;
+            }
+            if (plan->filter_count[m] == 0) {
+                plan->filter_first[m] = k;
+            }
+            weights[n_weights++] = (float) (w * enorm);
+            plan->filter_count[m]++;
+        }
+    }
+    plan->filter_weights = weights;
+    Tcl_Free((char *) hz);
+    return plan;
+}
+
+static const ml_mel_plan_t *ml_GetMelPlan(int rate, int n_fft, int n_mels, float fmin, float fmax) {
+    Tcl_MutexLock(&ml_MelPlansMutex);
+    ml_mel_plan_t *plan = ml_MelPlans;
+    while (plan != NULL && (plan->rate != rate || plan->n_fft != n_fft || plan->n_mels != n_mels
+                            || plan->fmin != fmin || plan->fmax != fmax)) {
+        plan = plan->next;
+    }
+    if (plan == NULL) {
+        plan = ml_NewMelPlan(rate, n_fft, n_mels, fmin, fmax);
+        plan->next = ml_MelPlans;
+        ml_MelPlans = plan;
+    }
+    Tcl_MutexUnlock(&ml_MelPlansMutex);
+    return plan;
+}
+
+// Mixed radix decimation in time fft: the input, read with a stride, is split into p interleaved
+// sequences of length m that are transformed recursively and joined by radix p butterflies.
+static void ml_MelFft(ml_complex_t *out, const ml_complex_t *in, size_t fstride, const int *factors,
+                      const ml_mel_plan_t *plan, ml_complex_t *scratch) {
+    int p = factors[0];
+    int m = factors[1];
+    int n = plan->n_fft;
+    const ml_complex_t *tw = plan->twiddles;
+    if (m == 1) {
+        for (int j = 0; j < p; j++) {
+            out[j] = in[j * fstride];
+        }
+    } else {
+        for (int j = 0; j < p; j++) {
+            ml_MelFft(out + j * m, in + j * fstride, fstride * p, factors + 2, plan, scratch);
+        }
+    }
+
+    if (p == 2) {
+        for (int k = 0; k < m; k++) {
+            ml_complex_t w = tw[k * fstride];
+            ml_complex_t a = out[k];
+            ml_complex_t b = out[k + m];
+            ml_complex_t t = {b.re * w.re - b.im * w.im, b.re * w.im + b.im * w.re};
+            out[k].re = a.re + t.re;
+            out[k].im = a.im + t.im;
+            out[k + m].re = a.re - t.re;
+            out[k + m].im = a.im - t.im;
+        }
+        return;
+    }
+    for (int k = 0; k < m; k++) {
+        for (int q = 0; q < p; q++) {
+            scratch[q] = out[k + q * m];
+        }
+        for (int u = 0; u < p; u++) {
+            int idx = k + u * m;
+            size_t step = (fstride * idx) % n;
+            size_t t = 0;
+            ml_complex_t sum = scratch[0];
+            for (int q = 1; q < p; q++) {
+                t += step;
+                if (t >= (size_t) n) {
+                    t -= n;
+                }
+                sum.re += scratch[q].re * tw[t].re - scratch[q].im * tw[t].im;
+                sum.im += scratch[q].re * tw[t].im + scratch[q].im * tw[t].re;
+            }
+            out[idx] = sum;
+        }
+    }
+}
+
+// Windowed frame with the signal reflected at both ends when it is centered, like torch.stft.
+static float ml_MelSample(const ml_mel_worker_t *worker, int64_t frame, int j) {
+    int64_t s = frame * worker->hop + j - (worker->center ? worker->plan->n_fft / 2 : 0);
+    int64_t n = worker->n_samples;
+    if (s < 0) {
+        s = -s;
+    }
+    if (s >= n) {
+        s = 2 * (n - 1) - s;
+    }
+    return s >= 0 && s < n ? worker->pcm[s] * worker->plan->window[j] : 0.0f;
+}
+
+static void ml_MelFilter(const ml_mel_worker_t *worker, const float *power, int64_t frame) {
+    const ml_mel_plan_t *plan = worker->plan;
+    for (int m = 0; m < plan->n_mels; m++) {
+        const float *w = plan->filter_weights + plan->filter_offset[m];
+        const float *p = power + plan->filter_first[m];
+        float sum = 0.0f;
+        for (int k = 0; k < plan->filter_count[m]; k++) {
+            sum += w[k] * p[k];
+        }
+        worker->out[m * worker->n_frames + frame] = sum;
+    }
+}
+
+static void ml_MelWork(void *arg) {
+    ml_mel_worker_t *worker = (ml_mel_worker_t *) arg;
+    const ml_mel_plan_t *plan = worker->plan;
+    int n_fft = plan->n_fft;
+    int n_bins = n_fft / 2 + 1;
+    ml_complex_t *in = (ml_complex_t *) Tcl_Alloc(sizeof(ml_complex_t) * n_fft);
+    ml_complex_t *out = (ml_complex_t *) Tcl_Alloc(sizeof(ml_complex_t) * n_fft);
+    ml_complex_t *scratch = (ml_complex_t *) Tcl_Alloc(sizeof(ml_complex_t) * plan->max_radix);
+    float *power_a = (float *) Tcl_Alloc(sizeof(float) * n_bins * 2);
+    float *power_b = power_a + n_bins;
+
+    // two real frames share one complex fft, as the real and the imaginary part of the input
+    for (int64_t f = worker->first_frame; f < worker->last_frame; f += 2) {
+        int pair = f + 1 < worker->last_frame;
+        for (int j = 0; j < n_fft; j++) {
+            in[j].re = ml_MelSample(worker, f, j);
+            in[j].im = pair ? ml_MelSample(worker, f + 1, j) : 0.0f;
+        }
+        ml_MelFft(out, in, 1, plan->factors, plan, scratch);
+        for (int k = 0; k < n_bins; k++) {
+            ml_complex_t z = out[k];
+            ml_complex_t zc = out[(n_fft - k) % n_fft];
+            float a_re = z.re + zc.re;
+            float a_im = z.im - zc.im;
+            float b_re = z.im + zc.im;
+            float b_im = z.re - zc.re;
+            power_a[k] = 0.25f * (a_re * a_re + a_im * a_im);
+            power_b[k] = 0.25f * (b_re * b_re + b_im * b_im);
+        }
+        ml_MelFilter(worker, power_a, f);
+        if (pair) {
+            ml_MelFilter(worker, power_b, f + 1);
+        }
+    }
+
+    Tcl_Free((char *) power_a);
+    Tcl_Free((char *) scratch);
+    Tcl_Free((char *) out);
+    Tcl_Free((char *) in);
+}
+
+static void ml_MelLog(float *data, int64_t n, ml_mel_log_t log_type) {
+    switch (log_type) {
+        case ML_MEL_POWER:
+            break;
+        case ML_MEL_LN:
+            for (int64_t i = 0; i < n; i++) {
+                data[i] = logf(data[i] > ML_MEL_LOG_FLOOR ? data[i] : ML_MEL_LOG_FLOOR);
+            }
+            break;
+        case ML_MEL_LOG10:
+        case ML_MEL_WHISPER: {
+            float max = -INFINITY;
+            for (int64_t i = 0; i < n; i++) {
+                data[i] = log10f(data[i] > ML_MEL_LOG_FLOOR ? data[i] : ML_MEL_LOG_FLOOR);
+                if (data[i] > max) {
+                    max = data[i];
+                }
+            }
+            if (log_type == ML_MEL_WHISPER) {
+                for (int64_t i = 0; i < n; i++) {
+                    float value = data[i] > max - 8.0f ? data[i] : max - 8.0f;
+                    data[i] = (value + 4.0f) / 4.0f;
+                }
+            }
+            break;
+        }
+    }
+}
+
+int ml_LogMelCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LogMelCmd\n"));
+
+    static const char *options[] = {"-rate", "-n_fft", "-hop", "-n_mels", "-fmin", "-fmax", "-center", "-log",
+                                    "-nthreads", NULL};
+    enum options {
+        OPT_RATE, OPT_N_FFT, OPT_HOP, OPT_N_MELS, OPT_FMIN, OPT_FMAX, OPT_CENTER, OPT_LOG, OPT_NTHREADS
+    };
+    static const char *log_types[] = {"log10", "ln", "whisper", "none", NULL};
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle tensor_handle ?-rate hz? ?-n_fft n? ?-hop n? ?-n_mels n? ?-fmin hz? ?-fmax hz? ?-center boolean? ?-log log10|ln|whisper|none? ?-nthreads n?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(objv[2]));
+    if (!tensor_ptr) {
+        SetResult("tensor handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *pcm = tensor_ptr->ggml_tensor;
+    if (pcm->type != GGML_TYPE_F32 || !ggml_is_contiguous(pcm) || pcm->data == NULL) {
+        SetResult("tensor must be a contiguous F32 tensor with data");
+        return TCL_ERROR;
+    }
+
+    int rate = 16000;
+    int n_fft = 400;
+    int hop = 160;
+    int n_mels = 80;
+    double fmin = 0.0;
+    double fmax = -1.0;
+    int center = 1;
+    int log_type = ML_MEL_LOG10;
+    int nthreads = 4;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_RATE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &rate) || rate <= 0) {
+                    SetResult("rate is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_FFT:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_fft) || n_fft < 2 || n_fft > 1048576) {
+                    SetResult("n_fft is not an integer in [2, 1048576]");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_HOP:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &hop) || hop <= 0) {
+                    SetResult("hop is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_MELS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_mels) || n_mels <= 0) {
+                    SetResult("n_mels is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_FMIN:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &fmin) || fmin < 0.0) {
+                    SetResult("fmin is not a number >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_FMAX:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &fmax) || fmax <= 0.0) {
+                    SetResult("fmax is not a number > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_CENTER:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &center)) {
+                    SetResult("center is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_LOG:
+                if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i + 1], log_types, "log", 0, &log_type)) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    if (fmax < 0.0) {
+        fmax = rate / 2.0;
+    }
+    if (fmin >= fmax) {
+        SetResult("fmin must be below fmax");
+        return TCL_ERROR;
+    }
+
+    int64_t n_samples = ggml_nelements(pcm);
+    int64_t n_frames = center ? 1 + n_samples / hop : (n_samples >= n_fft ? 1 + (n_samples - n_fft) / hop : 0);
+    if (n_frames == 0) {
+        SetResult("signal is shorter than n_fft");
+        return TCL_ERROR;
+    }
+
+    const ml_mel_plan_t *plan = ml_GetMelPlan(rate, n_fft, n_mels, (float) fmin, (float) fmax);
+
+    // ne = [frames, n_mels], the layout conv_1d takes with the mels as channels
+    struct ggml_tensor *tensor = ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_F32, n_frames, n_mels);
+    ml_tensor_t *result_ptr = ml_CreateTensorHandle(ctx, tensor);
+
+    // workers get ranges of an even number of frames, so that frames are paired within a worker
+    int64_t n_pairs = (n_frames + 1) / 2;
+    int n_workers = nthreads < n_pairs ? nthreads : (int) n_pairs;
+    ml_mel_worker_t *workers = (ml_mel_worker_t *) Tcl_Alloc(sizeof(ml_mel_worker_t) * n_workers);
+    for (int t = 0; t < n_workers; t++) {
+        int64_t first = 2 * (n_pairs * t / n_workers);
+        int64_t last = 2 * (n_pairs * (t + 1) / n_workers);
+        workers[t].plan = plan;
+        workers[t].pcm = (const float *) pcm->data;
+        workers[t].n_samples = n_samples;
+        workers[t].hop = hop;
+        workers[t].center = center;
+        workers[t].n_frames = n_frames;
+        workers[t].first_frame = first;
+        workers[t].last_frame = last < n_frames ? last : n_frames;
+        workers[t].out = (float *) tensor->data;
+    }
+    ml_RunWorkers(ml_MelWork, workers, sizeof(ml_mel_worker_t), n_workers);
+    Tcl_Free((char *) workers);
+
+    ml_MelLog((float *) tensor->data, n_frames * n_mels, (ml_mel_log_t) log_type);
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(result_ptr->handle, -1));
+    return TCL_OK;
+}
@@ -0,0 +1,15 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_MEL_H
+#define GGML_TCL_MEL_H
+
+#include "common.h"
+
+void ml_DeleteMelPlans();
+
+GGML_TCL_CMD(ml_LogMelCmd);
+
+#endif //GGML_TCL_MEL_H
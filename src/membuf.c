@@ -0,0 +1,300 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#define _GNU_SOURCE
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "membuf.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#define ML_MAX_NUMA_NODES 1024
+#define ML_DEFAULT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// from linux/mempolicy.h
+#define ML_MPOL_BIND 2
+#define ML_MPOL_INTERLEAVE 3
+
+#ifdef __linux__
+
+// Parses a sysfs list such as "0-3,8,10-11" and sets the listed bits of mask.
+static int ml_ParseRangeList(const char *path, unsigned long *mask, int max_bits) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[4096];
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    int count = 0;
+    char *p = line;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long i = first; i <= last && i < max_bits; i++) {
+            mask[i / (8 * sizeof(unsigned long))] |= 1UL << (i % (8 * sizeof(unsigned long)));
+            count++;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return count;
+}
+
+static size_t ml_HugePageSize() {
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp == NULL) {
+        return ML_DEFAULT_HUGE_PAGE_SIZE;
+    }
+    size_t size = ML_DEFAULT_HUGE_PAGE_SIZE;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long kb;
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+            size = kb * 1024;
+            break;
+        }
+    }
+    fclose(fp);
+    return size;
+}
+
+static int ml_ApplyNumaPolicy(char *buffer, size_t size, const ml_membuf_params_t *params, const char **errmsg) {
+    unsigned long nodemask[ML_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    memset(nodemask, 0, sizeof(nodemask));
+
+    int mode;
+    if (params->numa == ML_NUMA_INTERLEAVE) {
+        if (ml_ParseRangeList("/sys/devices/system/node/online", nodemask, ML_MAX_NUMA_NODES) == 0) {
+            *errmsg = "could not read the online numa nodes";
+            return TCL_ERROR;
+        }
+        mode = ML_MPOL_INTERLEAVE;
+    } else {
+        if (params->numa_node < 0 || params->numa_node >= ML_MAX_NUMA_NODES) {
+            *errmsg = "numa node out of range";
+            return TCL_ERROR;
+        }
+        nodemask[params->numa_node / (8 * sizeof(unsigned long))] |= 1UL << (params->numa_node % (8 * sizeof(unsigned long)));
+        mode = ML_MPOL_BIND;
+    }
+
+    // the policy has to be in place before the pages are touched for the first time
+    if (syscall(SYS_mbind, buffer, size, mode, nodemask, (unsigned long) ML_MAX_NUMA_NODES + 1, 0) != 0) {
+        *errmsg = "mbind failed";
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+char *ml_AllocBuffer(size_t size, const ml_membuf_params_t *params, size_t *mapped_size, const char **errmsg) {
+    if (params == NULL || (params->hugepages == ML_HUGEPAGES_NONE && params->numa == ML_NUMA_NONE)) {
+        *mapped_size = 0;
+        return Tcl_Alloc(size);
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t length = size;
+    if (params->hugepages != ML_HUGEPAGES_NONE) {
+        size_t huge_page_size = ml_HugePageSize();
+        length = GGML_PAD(size, huge_page_size);
+        if (params->hugepages == ML_HUGEPAGES_HUGETLB) {
+            flags |= MAP_HUGETLB;
+        }
+    }
+
+    char *buffer = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (buffer == MAP_FAILED) {
+        *errmsg = params->hugepages == ML_HUGEPAGES_HUGETLB
+                  ? "mmap with MAP_HUGETLB failed, are huge pages reserved?"
+                  : "mmap failed";
+        return NULL;
+    }
+
+    if (params->hugepages == ML_HUGEPAGES_TRANSPARENT && madvise(buffer, length, MADV_HUGEPAGE) != 0) {
+        munmap(buffer, length);
+        *errmsg = "madvise(MADV_HUGEPAGE) failed, are transparent huge pages enabled?";
+        return NULL;
+    }
+
+    if (params->numa != ML_NUMA_NONE && TCL_OK != ml_ApplyNumaPolicy(buffer, length, params, errmsg)) {
+        munmap(buffer, length);
+        return NULL;
+    }
+
+    *mapped_size = length;
+    return buffer;
+}
+
+void ml_FreeBuffer(char *buffer, size_t mapped_size) {
+    if (mapped_size > 0) {
+        munmap(buffer, mapped_size);
+    } else {
+        Tcl_Free(buffer);
+    }
+}
+
+char *ml_MapFile(const char *path, size_t *size, size_t *mapped_size, const char **errmsg) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = "could not open file";
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        *errmsg = "file is empty";
+        return NULL;
+    }
+    // private and writable, so that tensors in the mapping can be modified without touching the file
+    char *buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        *errmsg = "mmap failed";
+        return NULL;
+    }
+    *size = st.st_size;
+    *mapped_size = st.st_size;
+    return buffer;
+}
+
+_Static_assert(sizeof(ml_cpu_mask_t) >= sizeof(cpu_set_t), "ml_cpu_mask_t cannot hold a cpu_set_t");
+
+int ml_PinThreadToNode(int node, ml_cpu_mask_t *saved_mask) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    cpu_set_t node_mask;
+    CPU_ZERO(&node_mask);
+    if (ml_ParseRangeList(path, (unsigned long *) &node_mask, CPU_SETSIZE) == 0) {
+        return TCL_ERROR;
+    }
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t *) saved_mask) != 0) {
+        return TCL_ERROR;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_mask) != 0) {
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+void ml_RestoreThreadAffinity(const ml_cpu_mask_t *saved_mask) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (const cpu_set_t *) saved_mask);
+}
+
+#else
+
+char *ml_AllocBuffer(size_t size, const ml_membuf_params_t *params, size_t *mapped_size, const char **errmsg) {
+    if (params == NULL || (params->hugepages == ML_HUGEPAGES_NONE && params->numa == ML_NUMA_NONE)) {
+        *mapped_size = 0;
+        return Tcl_Alloc(size);
+    }
+    *errmsg = "huge pages and numa placement are only supported on linux";
+    return NULL;
+}
+
+void ml_FreeBuffer(char *buffer, size_t mapped_size) {
+    Tcl_Free(buffer);
+}
+
+char *ml_MapFile(const char *path, size_t *size, size_t *mapped_size, const char **errmsg) {
+    // without mmap the file is read into memory, which the caller frees the same way
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *errmsg = "could not open file";
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (length <= 0) {
+        fclose(fp);
+        *errmsg = "file is empty";
+        return NULL;
+    }
+    char *buffer = Tcl_Alloc(length);
+    if (fread(buffer, length, 1, fp) != 1) {
+        fclose(fp);
+        Tcl_Free(buffer);
+        *errmsg = "could not read file";
+        return NULL;
+    }
+    fclose(fp);
+    *size = length;
+    *mapped_size = 0;
+    return buffer;
+}
+
+int ml_PinThreadToNode(int node, ml_cpu_mask_t *saved_mask) {
+    return TCL_ERROR;
+}
+
+void ml_RestoreThreadAffinity(const ml_cpu_mask_t *saved_mask) {
+}
+
+#endif
+
+static Tcl_Mutex ml_NumaPolicy_Mutex;
+static int ml_NumaInterleaved = 0;
+static int ml_NumaBoundContexts = 0;
+
+int ml_AcquireNumaPolicy(ml_numa_policy_t numa, const char **errmsg) {
+    int rc = TCL_OK;
+    Tcl_MutexLock(&ml_NumaPolicy_Mutex);
+    if (numa == ML_NUMA_INTERLEAVE) {
+        if (ml_NumaBoundContexts > 0) {
+            *errmsg = "numa interleave cannot be used while contexts are bound to a node";
+            rc = TCL_ERROR;
+        } else if (!ml_NumaInterleaved) {
+            // ggml pins its compute threads round robin across the nodes it detects
+            ggml_numa_init();
+            ml_NumaInterleaved = 1;
+        }
+    } else if (numa == ML_NUMA_BIND) {
+        if (ml_NumaInterleaved) {
+            *errmsg = "a context cannot be bound to a node once numa interleave is in use";
+            rc = TCL_ERROR;
+        } else {
+            ml_NumaBoundContexts++;
+        }
+    }
+    Tcl_MutexUnlock(&ml_NumaPolicy_Mutex);
+    return rc;
+}
+
+void ml_ReleaseNumaPolicy(ml_numa_policy_t numa) {
+    if (numa != ML_NUMA_BIND) {
+        return;
+    }
+    Tcl_MutexLock(&ml_NumaPolicy_Mutex);
+    ml_NumaBoundContexts--;
+    Tcl_MutexUnlock(&ml_NumaPolicy_Mutex);
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_MEMBUF_H
+#define GGML_TCL_MEMBUF_H
+
+#include <stddef.h>
+
+typedef enum {
+    ML_HUGEPAGES_NONE,
+    ML_HUGEPAGES_TRANSPARENT,   // anonymous mapping with madvise(MADV_HUGEPAGE)
+    ML_HUGEPAGES_HUGETLB        // MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages
+} ml_hugepages_t;
+
+typedef enum {
+    ML_NUMA_NONE,               // first touch placement
+    ML_NUMA_INTERLEAVE,         // pages interleaved across all online nodes
+    ML_NUMA_BIND                // pages bound to a single node
+} ml_numa_policy_t;
+
+typedef struct ml_membuf_params_s {
+    ml_hugepages_t hugepages;
+    ml_numa_policy_t numa;
+    int numa_node;              // used with ML_NUMA_BIND
+} ml_membuf_params_t;
+
+// Allocates a buffer of at least size bytes. mapped_size is set to the length of the mapping,
+// or to 0 when the buffer came from Tcl_Alloc, and has to be passed back to ml_FreeBuffer.
+char *ml_AllocBuffer(size_t size, const ml_membuf_params_t *params, size_t *mapped_size, const char **errmsg);
+void ml_FreeBuffer(char *buffer, size_t mapped_size);
+
+// Maps a file copy-on-write (reads it into memory where mmap is not available).
+// The buffer is released with ml_FreeBuffer(buffer, mapped_size).
+char *ml_MapFile(const char *path, size_t *size, size_t *mapped_size, const char **errmsg);
+
+// Storage for a thread affinity, sized and aligned like a cpu_set_t (1024 cpus).
+typedef struct ml_cpu_mask_s {
+    unsigned long bits[1024 / (8 * sizeof(unsigned long))];
+} ml_cpu_mask_t;
+
+// Restricts the calling thread (and the threads it creates) to the cpus of a node.
+// The previous affinity is saved in saved_mask.
+int ml_PinThreadToNode(int node, ml_cpu_mask_t *saved_mask);
+void ml_RestoreThreadAffinity(const ml_cpu_mask_t *saved_mask);
+
+// ggml pins its compute threads across all nodes process wide once interleaving is enabled, which would undo
+// the pinning of contexts bound to a node, so the two modes exclude each other. Binding is counted per context.
+int ml_AcquireNumaPolicy(ml_numa_policy_t numa, const char **errmsg);
+void ml_ReleaseNumaPolicy(ml_numa_policy_t numa);
+
+#endif //GGML_TCL_MEMBUF_H
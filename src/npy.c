@@ -0,0 +1,870 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "npy.h"
+#include "context.h"
+#include "membuf.h"
+#include "tensor.h"
+
+#define ML_NPY_MAGIC "\x93NUMPY"
+#define ML_NPY_MAGIC_SIZE 6
+// numpy pads the header so that the data starts at a multiple of 64 bytes
+#define ML_NPY_HEADER_ALIGN 64
+
+#define ML_ZIP_LOCAL_SIG 0x04034b50
+#define ML_ZIP_CENTRAL_SIG 0x02014b50
+#define ML_ZIP_END_SIG 0x06054b50
+#define ML_ZIP64_END_SIG 0x06064b50
+#define ML_ZIP64_LOCATOR_SIG 0x07064b50
+
+typedef struct ml_npy_array_s {
+    char kind;                          // 'f', 'i', 'u' or 'b' as in the numpy descr
+    int itemsize;
+    enum ggml_type type;                // type of the tensor the array loads into
+    int direct;                         // elements are stored as they are in the tensor
+    int fortran_order;
+    int n_dims;
+    int64_t shape[GGML_MAX_DIMS];       // numpy order, the last dimension varies fastest
+    int64_t n_elements;
+    const char *data;
+} ml_npy_array_t;
+
+static uint16_t ml_NpyGet16(const char *p) {
+    const unsigned char *u = (const unsigned char *) p;
+    return (uint16_t) (u[0] | (u[1] << 8));
+}
+
+static uint32_t ml_NpyGet32(const char *p) {
+    const unsigned char *u = (const unsigned char *) p;
+    return (uint32_t) u[0] | ((uint32_t) u[1] << 8) | ((uint32_t) u[2] << 16) | ((uint32_t) u[3] << 24);
+}
+
+static uint64_t ml_NpyGet64(const char *p) {
+    return (uint64_t) ml_NpyGet32(p) | ((uint64_t) ml_NpyGet32(p + 4) << 32);
+}
+
+static void ml_NpyPut16(char *p, uint16_t value) {
+    p[0] = (char) (value & 0xff);
+    p[1] = (char) (value >> 8);
+}
+
+static void ml_NpyPut32(char *p, uint32_t value) {
+    ml_NpyPut16(p, (uint16_t) (value & 0xffff));
+    ml_NpyPut16(p + 2, (uint16_t) (value >> 16));
+}
+
+// Unsigned integers are widened so that every value is kept, int64 is narrowed to I32 when every value fits
+// (see ml_NpyFitsI32) and float64 is narrowed to F32.
+static int ml_NpyGetType(ml_npy_array_t *array) {
+    switch (array->kind) {
+        case 'f':
+            array->type = array->itemsize == 2 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+            array->direct = array->itemsize != 8;
+            return array->itemsize == 2 || array->itemsize == 4 || array->itemsize == 8;
+        case 'i':
+            array->type = array->itemsize == 1 ? GGML_TYPE_I8 : array->itemsize == 2 ? GGML_TYPE_I16 : GGML_TYPE_I32;
+            array->direct = array->itemsize != 8;
+            return array->itemsize == 1 || array->itemsize == 2 || array->itemsize == 4 || array->itemsize == 8;
+        case 'u':
+            array->type = array->itemsize == 1 ? GGML_TYPE_I16 : GGML_TYPE_I32;
+            array->direct = 0;
+            return array->itemsize == 1 || array->itemsize == 2;
+        case 'b':
+            array->type = GGML_TYPE_I8;
+            array->direct = 1;
+            return array->itemsize == 1;
+        default:
+            return 0;
+    }
+}
+
+// Parses the header of a .npy file of size bytes, the python dict literal written by numpy.lib.format.
+static int ml_NpyParse(const char *buffer, size_t size, ml_npy_array_t *array, const char **errmsg) {
+    if (size < ML_NPY_MAGIC_SIZE + 4 || memcmp(buffer, ML_NPY_MAGIC, ML_NPY_MAGIC_SIZE) != 0) {
+        *errmsg = "not a .npy file";
+        return TCL_ERROR;
+    }
+    int major = (unsigned char) buffer[6];
+    size_t header_len;
+    size_t header_start;
+    if (major == 1) {
+        header_len = ml_NpyGet16(buffer + 8);
+        header_start = 10;
+    } else if (major == 2 || major == 3) {
+        if (size < 12) {
+            *errmsg = "truncated .npy header";
+            return TCL_ERROR;
+        }
+        header_len = ml_NpyGet32(buffer + 8);
+        header_start = 12;
+    } else {
+        *errmsg = "unsupported .npy version";
+        return TCL_ERROR;
+    }
+    if (header_start + header_len > size) {
+        *errmsg = "truncated .npy header";
+        return TCL_ERROR;
+    }
+
+    // the header is not null terminated
+    char *header = Tcl_Alloc(header_len + 1);
+    memcpy(header, buffer + header_start, header_len);
+    header[header_len] = '\0';
+
+    const char *descr = strstr(header, "'descr'");
+    const char *fortran_order = strstr(header, "'fortran_order'");
+    const char *shape = strstr(header, "'shape'");
+    if (descr == NULL || fortran_order == NULL || shape == NULL) {
+        Tcl_Free(header);
+        *errmsg = "malformed .npy header";
+        return TCL_ERROR;
+    }
+
+    descr = strchr(descr + 7, '\'');
+    char byte_order = descr != NULL ? descr[1] : '\0';
+    if (descr == NULL || byte_order == '\0' || descr[2] == '\0') {
+        Tcl_Free(header);
+        *errmsg = "malformed .npy header";
+        return TCL_ERROR;
+    }
+    array->kind = descr[2];
+    array->itemsize = (int) strtol(descr + 3, NULL, 10);
+    if (byte_order == '>' && array->itemsize > 1) {
+        Tcl_Free(header);
+        *errmsg = "big endian arrays are not supported";
+        return TCL_ERROR;
+    }
+    if ((byte_order != '<' && byte_order != '|' && byte_order != '=' && byte_order != '>') || !ml_NpyGetType(array)) {
+        Tcl_Free(header);
+        *errmsg = "unsupported .npy dtype";
+        return TCL_ERROR;
+    }
+
+    const char *value = fortran_order + 15;
+    while (*value == ':' || *value == ' ') {
+        value++;
+    }
+    array->fortran_order = strncmp(value, "True", 4) == 0;
+
+    const char *p = strchr(shape, '(');
+    array->n_dims = 0;
+    array->n_elements = 1;
+    int ok = p != NULL;
+    int overflow = 0;
+    while (ok) {
+        while (*p == '(' || *p == ' ' || *p == ',') {
+            p++;
+        }
+        if (*p == ')') {
+            break;
+        }
+        char *end;
+        long long dim = strtoll(p, &end, 10);
+        if (end == p || dim < 0 || array->n_dims == GGML_MAX_DIMS) {
+            ok = 0;
+            break;
+        }
+        if (dim > 0 && array->n_elements > INT64_MAX / dim) {
+            overflow = 1;
+            break;
+        }
+        array->shape[array->n_dims++] = dim;
+        array->n_elements *= dim;
+        p = end;
+    }
+    Tcl_Free(header);
+    if (overflow) {
+        *errmsg = ".npy shape is too large";
+        return TCL_ERROR;
+    }
+    if (!ok) {
+        *errmsg = "unsupported .npy shape, at most 4 dimensions";
+        return TCL_ERROR;
+    }
+
+    size_t offset = header_start + header_len;
+    if ((size - offset) / array->itemsize < (size_t) array->n_elements) {
+        *errmsg = "truncated .npy data";
+        return TCL_ERROR;
+    }
+    array->data = buffer + offset;
+    return TCL_OK;
+}
+
+// Writes element src_index of the array to element dst_index of a tensor of the array's type.
+static void ml_NpyConvert(const ml_npy_array_t *array, int64_t src_index, char *dst, int64_t dst_index) {
+    const char *src = array->data + src_index * array->itemsize;
+    if (array->direct) {
+        memcpy(dst + dst_index * array->itemsize, src, array->itemsize);
+        return;
+    }
+    switch (array->kind) {
+        case 'f': {
+            double value;
+            memcpy(&value, src, sizeof(double));
+            ((float *) dst)[dst_index] = (float) value;
+            break;
+        }
+        case 'i': {
+            int64_t value;
+            memcpy(&value, src, sizeof(int64_t));
+            ((int32_t *) dst)[dst_index] = (int32_t) value;
+            break;
+        }
+        case 'u':
+            if (array->itemsize == 1) {
+                ((int16_t *) dst)[dst_index] = (int16_t) (unsigned char) src[0];
+            } else {
+                ((int32_t *) dst)[dst_index] = (int32_t) ml_NpyGet16(src);
+            }
+            break;
+    }
+}
+
+// Fills dst in C order, transposing arrays stored in Fortran order.
+static void ml_NpyCopy(const ml_npy_array_t *array, char *dst) {
+    if (array->direct && (!array->fortran_order || array->n_dims < 2)) {
+        memcpy(dst, array->data, array->n_elements * array->itemsize);
+        return;
+    }
+    if (!array->fortran_order || array->n_dims < 2) {
+        for (int64_t i = 0; i < array->n_elements; i++) {
+            ml_NpyConvert(array, i, dst, i);
+        }
+        return;
+    }
+
+    // the first dimension varies fastest in the source, the last one in the destination
+    int64_t strides[GGML_MAX_DIMS];
+    int64_t index[GGML_MAX_DIMS] = {0};
+    int64_t stride = 1;
+    for (int k = 0; k < array->n_dims; k++) {
+        strides[k] = stride;
+        stride *= array->shape[k];
+    }
+    int64_t src_index = 0;
+    for (int64_t i = 0; i < array->n_elements; i++) {
+        ml_NpyConvert(array, src_index, dst, i);
+        for (int k = array->n_dims - 1; k >= 0; k--) {
+            src_index += strides[k];
+            if (++index[k] < array->shape[k]) {
+                break;
+            }
+            src_index -= strides[k] * array->shape[k];
+            index[k] = 0;
+        }
+    }
+}
+
+// Creates a tensor for the array. With use_mmap, tensors of no_alloc contexts point into the buffer
+// when no conversion is needed and the data is aligned, and borrowed is set.
+static int ml_NpyFitsI32(const ml_npy_array_t *array) {
+    for (int64_t i = 0; i < array->n_elements; i++) {
+        int64_t value;
+        memcpy(&value, array->data + i * sizeof(int64_t), sizeof(int64_t));
+        if (value < INT32_MIN || value > INT32_MAX) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static ml_tensor_t *ml_NpyLoadArray(ml_context_t *ctx, const ml_npy_array_t *array, const char *name, int use_mmap,
+                                    int *borrowed, const char **errmsg) {
+    if (array->kind == 'i' && array->itemsize == 8 && !ml_NpyFitsI32(array)) {
+        *errmsg = "int64 values do not fit in I32";
+        return NULL;
+    }
+    int64_t ne[GGML_MAX_DIMS] = {1, 1, 1, 1};
+    for (int k = 0; k < array->n_dims; k++) {
+        ne[k] = array->shape[array->n_dims - 1 - k];
+    }
+    struct ggml_tensor *tensor = ggml_new_tensor(ctx->ggml_ctx, array->type, array->n_dims > 0 ? array->n_dims : 1, ne);
+    if (tensor == NULL) {
+        *errmsg = "tensor allocation failed";
+        return NULL;
+    }
+    ggml_set_name(tensor, name);
+    ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+
+    if (ctx->no_alloc) {
+        int mappable = array->direct && (!array->fortran_order || array->n_dims < 2)
+                       && ((uintptr_t) array->data) % GGML_MEM_ALIGN == 0;
+        if (use_mmap && mappable) {
+            tensor->data = (void *) array->data;
+            *borrowed = 1;
+            return tensor_ptr;
+        }
+        char *data = Tcl_Alloc(ggml_nbytes(tensor) > 0 ? ggml_nbytes(tensor) : 1);
+        ml_ContextAddBuffer(ctx, data, 0);
+        tensor->data = data;
+    }
+    ml_NpyCopy(array, (char *) tensor->data);
+    return tensor_ptr;
+}
+
+static int ml_NpyGetLoadOptions(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[], int first, const char **name,
+                                int *use_mmap) {
+    static const char *options[] = {"-name", "-mmap", NULL};
+    enum options {
+        OPT_NAME, OPT_MMAP
+    };
+
+    for (int i = first; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_NAME:
+                if (name == NULL) {
+                    SetResult("-name is not supported for archives");
+                    return TCL_ERROR;
+                }
+                *name = Tcl_GetString(objv[i + 1]);
+                break;
+            case OPT_MMAP:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], use_mmap)) {
+                    SetResult("mmap is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    return TCL_OK;
+}
+
+int ml_LoadNpyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LoadNpyCmd\n"));
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle path ?-name name? ?-mmap boolean?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    const char *path = Tcl_GetString(objv[2]);
+    const char *name = "";
+    int use_mmap = 1;
+    if (TCL_OK != ml_NpyGetLoadOptions(interp, objc, objv, 3, &name, &use_mmap)) {
+        return TCL_ERROR;
+    }
+
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(path, &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ml_npy_array_t array;
+    int borrowed = 0;
+    ml_tensor_t *tensor_ptr = NULL;
+    if (TCL_OK == ml_NpyParse(buffer, size, &array, &errmsg)) {
+        tensor_ptr = ml_NpyLoadArray(ctx, &array, name, use_mmap, &borrowed, &errmsg);
+    }
+    // a tensor that points into the file keeps it mapped for the lifetime of the context
+    if (borrowed) {
+        ml_ContextAddBuffer(ctx, buffer, mapped_size);
+    } else {
+        ml_FreeBuffer(buffer, mapped_size);
+    }
+    if (tensor_ptr == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    SetResult(tensor_ptr->handle);
+    return TCL_OK;
+}
+
+// Finds the central directory of a zip archive, following the zip64 records numpy writes for large archives.
+static int ml_ZipFindDirectory(const char *buffer, size_t size, uint64_t *n_entries, uint64_t *offset,
+                               const char **errmsg) {
+    if (size < 22) {
+        *errmsg = "not a .npz file";
+        return TCL_ERROR;
+    }
+    // the end record is followed by a comment of up to 64k
+    size_t end = size - 22;
+    size_t lowest = size - 22 > 65535 ? size - 22 - 65535 : 0;
+    while (ml_NpyGet32(buffer + end) != ML_ZIP_END_SIG) {
+        if (end == lowest) {
+            *errmsg = "not a .npz file";
+            return TCL_ERROR;
+        }
+        end--;
+    }
+    *n_entries = ml_NpyGet16(buffer + end + 10);
+    *offset = ml_NpyGet32(buffer + end + 16);
+
+    if ((*n_entries == 0xffff || *offset == 0xffffffff) && end >= 20
+        && ml_NpyGet32(buffer + end - 20) == ML_ZIP64_LOCATOR_SIG) {
+        uint64_t end64 = ml_NpyGet64(buffer + end - 20 + 8);
+        if (end64 + 56 > size || ml_NpyGet32(buffer + end64) != ML_ZIP64_END_SIG) {
+            *errmsg = "malformed zip64 end record";
+            return TCL_ERROR;
+        }
+        *n_entries = ml_NpyGet64(buffer + end64 + 32);
+        *offset = ml_NpyGet64(buffer + end64 + 48);
+    }
+    if (*offset > size) {
+        *errmsg = "malformed .npz directory";
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+int ml_LoadNpzCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LoadNpzCmd\n"));
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle path ?-mmap boolean?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    const char *path = Tcl_GetString(objv[2]);
+    int use_mmap = 1;
+    if (TCL_OK != ml_NpyGetLoadOptions(interp, objc, objv, 3, NULL, &use_mmap)) {
+        return TCL_ERROR;
+    }
+
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(path, &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    uint64_t n_entries;
+    uint64_t entry;
+    int borrowed = 0;
+    int rc = ml_ZipFindDirectory(buffer, size, &n_entries, &entry, &errmsg);
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    for (uint64_t i = 0; rc == TCL_OK && i < n_entries; i++) {
+        if (entry + 46 > size || ml_NpyGet32(buffer + entry) != ML_ZIP_CENTRAL_SIG) {
+            errmsg = "malformed .npz directory";
+            rc = TCL_ERROR;
+            break;
+        }
+        int method = ml_NpyGet16(buffer + entry + 10);
+        uint64_t entry_size = ml_NpyGet32(buffer + entry + 24);
+        int name_len = ml_NpyGet16(buffer + entry + 28);
+        int extra_len = ml_NpyGet16(buffer + entry + 30);
+        int comment_len = ml_NpyGet16(buffer + entry + 32);
+        uint64_t local = ml_NpyGet32(buffer + entry + 42);
+        const char *name = buffer + entry + 46;
+        if (entry + 46 + name_len + extra_len > size) {
+            errmsg = "malformed .npz directory";
+            rc = TCL_ERROR;
+            break;
+        }
+
+        // 0xffffffff fields are found in the zip64 extra field, in this order
+        const char *extra = name + name_len;
+        int zip64_ok = 1;
+        for (int e = 0; e + 4 <= extra_len;) {
+            int id = ml_NpyGet16(extra + e);
+            int len = ml_NpyGet16(extra + e + 2);
+            if (e + 4 + len > extra_len) {
+                zip64_ok = 0;
+                break;
+            }
+            if (id == 0x0001) {
+                // each 8-byte field must lie within this record
+                int pos = 0;
+                if (entry_size == 0xffffffff) {
+                    if (pos + 8 > len) {
+                        zip64_ok = 0;
+                        break;
+                    }
+                    entry_size = ml_NpyGet64(extra + e + 4 + pos);
+                    pos += 8;
+                }
+                if (ml_NpyGet32(buffer + entry + 20) == 0xffffffff) {
+                    pos += 8;
+                }
+                if (local == 0xffffffff) {
+                    if (pos + 8 > len) {
+                        zip64_ok = 0;
+                        break;
+                    }
+                    local = ml_NpyGet64(extra + e + 4 + pos);
+                }
+            }
+            e += 4 + len;
+        }
+        if (!zip64_ok) {
+            errmsg = "malformed .npz zip64 extra field";
+            rc = TCL_ERROR;
+            break;
+        }
+        entry += 46 + name_len + extra_len + comment_len;
+
+        if (method != 0) {
+            errmsg = "compressed .npz entries are not supported, save with numpy.savez";
+            rc = TCL_ERROR;
+            break;
+        }
+        if (local + 30 > size || ml_NpyGet32(buffer + local) != ML_ZIP_LOCAL_SIG) {
+            errmsg = "malformed .npz entry";
+            rc = TCL_ERROR;
+            break;
+        }
+        uint64_t data = local + 30 + ml_NpyGet16(buffer + local + 26) + ml_NpyGet16(buffer + local + 28);
+        if (data + entry_size > size) {
+            errmsg = "truncated .npz entry";
+            rc = TCL_ERROR;
+            break;
+        }
+
+        // numpy stores the array "x" as "x.npy"
+        Tcl_Obj *name_ptr = Tcl_NewStringObj(name, name_len >= 4 && strncmp(name + name_len - 4, ".npy", 4) == 0
+                                                   ? name_len - 4 : name_len);
+        ml_npy_array_t array;
+        ml_tensor_t *tensor_ptr = NULL;
+        if (TCL_OK == ml_NpyParse(buffer + data, entry_size, &array, &errmsg)) {
+            tensor_ptr = ml_NpyLoadArray(ctx, &array, Tcl_GetString(name_ptr), use_mmap, &borrowed, &errmsg);
+        }
+        if (tensor_ptr == NULL) {
+            Tcl_DecrRefCount(name_ptr);
+            rc = TCL_ERROR;
+            break;
+        }
+        Tcl_DictObjPut(interp, dict_ptr, name_ptr, Tcl_NewStringObj(tensor_ptr->handle, -1));
+    }
+
+    if (borrowed) {
+        ml_ContextAddBuffer(ctx, buffer, mapped_size);
+    } else {
+        ml_FreeBuffer(buffer, mapped_size);
+    }
+    if (rc != TCL_OK) {
+        // drop the handles of the entries loaded before the failure
+        Tcl_DictSearch search;
+        Tcl_Obj *key_ptr, *value_ptr;
+        int done;
+        Tcl_DictObjFirst(interp, dict_ptr, &search, &key_ptr, &value_ptr, &done);
+        for (; !done; Tcl_DictObjNext(&search, &key_ptr, &value_ptr, &done)) {
+            ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(value_ptr));
+            if (tensor_ptr != NULL) {
+                ml_DestroyTensorHandle(tensor_ptr);
+            }
+        }
+        Tcl_DictObjDone(&search);
+        Tcl_DecrRefCount(dict_ptr);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
+
+// crc-32 of zip entries, updated incrementally
+static uint32_t ml_ZipCrc32(uint32_t crc, const char *data, size_t size) {
+    static uint32_t table[256];
+    static int initialized = 0;
+    if (!initialized) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        initialized = 1;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+typedef struct ml_npy_writer_s {
+    const struct ggml_tensor *tensor;
+    const char *descr;
+    int converted;                      // rows are written as float32
+    char header[256];
+    size_t header_size;
+    size_t data_size;
+} ml_npy_writer_t;
+
+static int ml_NpyPrepare(const struct ggml_tensor *tensor, ml_npy_writer_t *writer, const char **errmsg) {
+    if (tensor->data == NULL) {
+        *errmsg = "tensor has no data";
+        return TCL_ERROR;
+    }
+    if (!ggml_is_contiguous(tensor)) {
+        *errmsg = "tensor is not contiguous";
+        return TCL_ERROR;
+    }
+
+    writer->tensor = tensor;
+    writer->converted = 0;
+    switch (tensor->type) {
+        case GGML_TYPE_F32:
+            writer->descr = "<f4";
+            break;
+        case GGML_TYPE_F16:
+            writer->descr = "<f2";
+            break;
+        case GGML_TYPE_I32:
+            writer->descr = "<i4";
+            break;
+        case GGML_TYPE_I16:
+            writer->descr = "<i2";
+            break;
+        case GGML_TYPE_I8:
+            writer->descr = "|i1";
+            break;
+        default:
+            // quantized types are dequantized
+            if (ggml_internal_get_type_traits(tensor->type).to_float == NULL) {
+                *errmsg = "unsupported tensor type";
+                return TCL_ERROR;
+            }
+            writer->descr = "<f4";
+            writer->converted = 1;
+    }
+    writer->data_size = writer->converted ? sizeof(float) * ggml_nelements(tensor) : ggml_nbytes(tensor);
+
+    int n_dims = GGML_MAX_DIMS;
+    while (n_dims > 1 && tensor->ne[n_dims - 1] == 1) {
+        n_dims--;
+    }
+    char shape[128];
+    int len = 0;
+    for (int k = n_dims - 1; k >= 0; k--) {
+        len += snprintf(shape + len, sizeof(shape) - len, "%lld, ", (long long) tensor->ne[k]);
+    }
+    if (n_dims > 1) {
+        len -= 2;
+    } else {
+        len -= 1;
+    }
+    shape[len] = '\0';
+
+    // version 1.0: magic, version, little endian header length, dict padded with spaces and ended by a newline
+    char dict[200];
+    int dict_len = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%s), }",
+                            writer->descr, shape);
+    size_t total = GGML_PAD(10 + dict_len + 1, ML_NPY_HEADER_ALIGN);
+    memcpy(writer->header, ML_NPY_MAGIC, ML_NPY_MAGIC_SIZE);
+    writer->header[6] = 1;
+    writer->header[7] = 0;
+    ml_NpyPut16(writer->header + 8, (uint16_t) (total - 10));
+    memcpy(writer->header + 10, dict, dict_len);
+    memset(writer->header + 10 + dict_len, ' ', total - 10 - dict_len - 1);
+    writer->header[total - 1] = '\n';
+    writer->header_size = total;
+    return TCL_OK;
+}
+
+static int ml_NpyWrite(FILE *fp, const ml_npy_writer_t *writer, uint32_t *crc) {
+    if (fwrite(writer->header, writer->header_size, 1, fp) != 1) {
+        return TCL_ERROR;
+    }
+    *crc = ml_ZipCrc32(*crc, writer->header, writer->header_size);
+
+    const struct ggml_tensor *tensor = writer->tensor;
+    if (!writer->converted) {
+        if (writer->data_size > 0 && fwrite(tensor->data, writer->data_size, 1, fp) != 1) {
+            return TCL_ERROR;
+        }
+        *crc = ml_ZipCrc32(*crc, tensor->data, writer->data_size);
+        return TCL_OK;
+    }
+
+    const int64_t n_rows = ggml_nrows(tensor);
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(tensor->type);
+    float *row = (float *) Tcl_Alloc(sizeof(float) * tensor->ne[0]);
+    int rc = TCL_OK;
+    for (int64_t r = 0; r < n_rows; r++) {
+        traits.to_float((const char *) tensor->data + r * tensor->nb[1], row, (int) tensor->ne[0]);
+        if (fwrite(row, sizeof(float) * tensor->ne[0], 1, fp) != 1) {
+            rc = TCL_ERROR;
+            break;
+        }
+        *crc = ml_ZipCrc32(*crc, (const char *) row, sizeof(float) * tensor->ne[0]);
+    }
+    Tcl_Free((char *) row);
+    return rc;
+}
+
+int ml_SaveNpyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SaveNpyCmd\n"));
+    CheckArgs(3, 3, 1, "tensor_handle path");
+
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(objv[1]));
+    if (!tensor_ptr) {
+        SetResult("tensor handle not found");
+        return TCL_ERROR;
+    }
+
+    ml_npy_writer_t writer;
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_NpyPrepare(tensor_ptr->ggml_tensor, &writer, &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    FILE *fp = fopen(Tcl_GetString(objv[2]), "wb");
+    if (fp == NULL) {
+        SetResult("could not open file for writing");
+        return TCL_ERROR;
+    }
+    uint32_t crc = 0;
+    int rc = ml_NpyWrite(fp, &writer, &crc);
+    if (fclose(fp) != 0 || rc != TCL_OK) {
+        SetResult("could not write file");
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) (writer.header_size + writer.data_size)));
+    return TCL_OK;
+}
+
+int ml_SaveNpzCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SaveNpzCmd\n"));
+    CheckArgs(3, 3, 1, "path tensor_dict");
+
+    int n_entries;
+    if (TCL_OK != Tcl_DictObjSize(interp, objv[2], &n_entries) || n_entries == 0 || n_entries > 0xffff) {
+        SetResult("tensor_dict is not a non-empty dict of names and tensor handles");
+        return TCL_ERROR;
+    }
+
+    // the archive holds stored (uncompressed) entries, which is what numpy.savez writes
+    ml_npy_writer_t *writers = (ml_npy_writer_t *) Tcl_Alloc(sizeof(ml_npy_writer_t) * n_entries);
+    const char **names = (const char **) Tcl_Alloc(sizeof(char *) * n_entries);
+    Tcl_DictSearch search;
+    Tcl_Obj *key_ptr, *value_ptr;
+    int done;
+    int i = 0;
+    const char *errmsg = NULL;
+    Tcl_DictObjFirst(interp, objv[2], &search, &key_ptr, &value_ptr, &done);
+    for (; !done; Tcl_DictObjNext(&search, &key_ptr, &value_ptr, &done)) {
+        ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(value_ptr));
+        if (!tensor_ptr) {
+            errmsg = "tensor handle not found";
+            break;
+        }
+        if (TCL_OK != ml_NpyPrepare(tensor_ptr->ggml_tensor, &writers[i], &errmsg)) {
+            break;
+        }
+        names[i++] = Tcl_GetString(key_ptr);
+    }
+    Tcl_DictObjDone(&search);
+
+    FILE *fp = NULL;
+    if (errmsg == NULL) {
+        fp = fopen(Tcl_GetString(objv[1]), "wb");
+        if (fp == NULL) {
+            errmsg = "could not open file for writing";
+        }
+    }
+
+    uint32_t *crcs = (uint32_t *) Tcl_Alloc(sizeof(uint32_t) * n_entries);
+    uint32_t *offsets = (uint32_t *) Tcl_Alloc(sizeof(uint32_t) * n_entries);
+    uint64_t offset = 0;
+    char record[46];
+    for (i = 0; errmsg == NULL && i < n_entries; i++) {
+        uint64_t entry_size = writers[i].header_size + writers[i].data_size;
+        size_t name_len = strlen(names[i]) + 4;
+        if (offset + 30 + name_len + entry_size >= 0xffffffff) {
+            errmsg = "archives of 4 GB or more are not supported";
+            break;
+        }
+        offsets[i] = (uint32_t) offset;
+        memset(record, 0, 30);
+        ml_NpyPut32(record, ML_ZIP_LOCAL_SIG);
+        ml_NpyPut16(record + 4, 20);
+        ml_NpyPut32(record + 18, (uint32_t) entry_size);
+        ml_NpyPut32(record + 22, (uint32_t) entry_size);
+        ml_NpyPut16(record + 26, (uint16_t) name_len);
+        crcs[i] = 0;
+        if (fwrite(record, 30, 1, fp) != 1 || fwrite(names[i], name_len - 4, 1, fp) != 1
+            || fwrite(".npy", 4, 1, fp) != 1 || TCL_OK != ml_NpyWrite(fp, &writers[i], &crcs[i])) {
+            errmsg = "could not write file";
+            break;
+        }
+        // the crc is only known once the data has been written
+        ml_NpyPut32(record, crcs[i]);
+        if (fseek(fp, (long) (offset + 14), SEEK_SET) != 0 || fwrite(record, 4, 1, fp) != 1
+            || fseek(fp, 0, SEEK_END) != 0) {
+            errmsg = "could not write file";
+            break;
+        }
+        offset += 30 + name_len + entry_size;
+    }
+
+    uint64_t directory = offset;
+    for (i = 0; errmsg == NULL && i < n_entries; i++) {
+        uint64_t entry_size = writers[i].header_size + writers[i].data_size;
+        size_t name_len = strlen(names[i]) + 4;
+        memset(record, 0, 46);
+        ml_NpyPut32(record, ML_ZIP_CENTRAL_SIG);
+        ml_NpyPut16(record + 4, 20);
+        ml_NpyPut16(record + 6, 20);
+        ml_NpyPut32(record + 16, crcs[i]);
+        ml_NpyPut32(record + 20, (uint32_t) entry_size);
+        ml_NpyPut32(record + 24, (uint32_t) entry_size);
+        ml_NpyPut16(record + 28, (uint16_t) name_len);
+        ml_NpyPut32(record + 42, offsets[i]);
+        if (fwrite(record, 46, 1, fp) != 1 || fwrite(names[i], name_len - 4, 1, fp) != 1
+            || fwrite(".npy", 4, 1, fp) != 1) {
+            errmsg = "could not write file";
+            break;
+        }
+        offset += 46 + name_len;
+    }
+    if (errmsg == NULL) {
+        memset(record, 0, 22);
+        ml_NpyPut32(record, ML_ZIP_END_SIG);
+        ml_NpyPut16(record + 8, (uint16_t) n_entries);
+        ml_NpyPut16(record + 10, (uint16_t) n_entries);
+        ml_NpyPut32(record + 12, (uint32_t) (offset - directory));
+        ml_NpyPut32(record + 16, (uint32_t) directory);
+        if (fwrite(record, 22, 1, fp) != 1) {
+            errmsg = "could not write file";
+        }
+    }
+    if (fp != NULL && fclose(fp) != 0 && errmsg == NULL) {
+        errmsg = "could not write file";
+    }
+
+    Tcl_Free((char *) offsets);
+    Tcl_Free((char *) crcs);
+    Tcl_Free((char *) names);
+    Tcl_Free((char *) writers);
+    if (errmsg != NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) (offset + 22)));
+    return TCL_OK;
+}
@@ -0,0 +1,16 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_NPY_H
+#define GGML_TCL_NPY_H
+
+#include "common.h"
+
+GGML_TCL_CMD(ml_LoadNpyCmd);
+GGML_TCL_CMD(ml_SaveNpyCmd);
+GGML_TCL_CMD(ml_LoadNpzCmd);
+GGML_TCL_CMD(ml_SaveNpzCmd);
+
+#endif //GGML_TCL_NPY_H
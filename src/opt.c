@@ -8,6 +8,8 @@
 #include <ggml.h>
 #include <stdlib.h>
 #include "opt.h"
+#include "cgraph.h"
+#include "context.h"
 
 static Tcl_Obj *ml_NewFloatStringObj(float value) {
     char buffer[32];
@@ -794,6 +796,27 @@ static int ml_GetOptParamsFromDict(Tcl_Interp *interp, Tcl_Obj *dict_ptr, struct
     return TCL_OK;
 }
 
+// Collects the tensors ggml_opt evaluates on the way to f, which is every tensor it writes: the params it
+// updates are among the leafs and the other tensors are recomputed.
+static void ml_OptCollectTensors(struct ggml_tensor *tensor, Tcl_HashTable *visited_ht, struct ggml_tensor ***tensors,
+                                 int *n_tensors, int *capacity) {
+    int newEntry;
+    Tcl_CreateHashEntry(visited_ht, (const char *) tensor, &newEntry);
+    if (!newEntry) {
+        return;
+    }
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        if (tensor->src[j] != NULL) {
+            ml_OptCollectTensors(tensor->src[j], visited_ht, tensors, n_tensors, capacity);
+        }
+    }
+    if (*n_tensors == *capacity) {
+        *capacity = *capacity == 0 ? 64 : 2 * *capacity;
+        *tensors = (struct ggml_tensor **) Tcl_Realloc((char *) *tensors, sizeof(struct ggml_tensor *) * *capacity);
+    }
+    (*tensors)[(*n_tensors)++] = tensor;
+}
+
 int ml_OptCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     DBG(fprintf(stderr, "OptCmd\n"));
     CheckArgs(4, 4, 1, "context_handle opt_params_dict tensor_handle");
@@ -812,6 +835,17 @@ int ml_OptCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *cons
         return TCL_ERROR;
     }
 
+    if (ggml_get_no_alloc(ctx->ggml_ctx)) {
+        SetResult("cannot optimize in a no_alloc context");
+        return TCL_ERROR;
+    }
+
+    if (ctx->chunk_size > 0) {
+        // ggml_opt allocates its state straight from the ggml context, which a growable context cannot back
+        SetResult("cannot optimize in a growable context");
+        return TCL_ERROR;
+    }
+
     struct ggml_opt_params opt_params;
 
     if (TCL_OK != ml_GetOptParamsFromDict(interp, objv[2], &opt_params)) {
@@ -820,5 +854,22 @@ int ml_OptCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *cons
 
     ggml_opt(ctx->ggml_ctx, opt_params, tensor_ptr->ggml_tensor);
 
+    // graphs computed incrementally must see the new params and the values computed with them
+    Tcl_HashTable visited_ht;
+    Tcl_InitHashTable(&visited_ht, TCL_ONE_WORD_KEYS);
+    struct ggml_tensor **tensors = NULL;
+    int n_tensors = 0;
+    int capacity = 0;
+    ml_OptCollectTensors(tensor_ptr->ggml_tensor, &visited_ht, &tensors, &n_tensors, &capacity);
+    Tcl_DeleteHashTable(&visited_ht);
+    int n_written = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        if (tensors[i]->is_param || !ml_IsViewOp(tensors[i]->op)) {
+            tensors[n_written++] = tensors[i];
+        }
+    }
+    ml_ContextMarkModified(tensors, n_written);
+    Tcl_Free((char *) tensors);
+
     return TCL_OK;
 }
\ No newline at end of file
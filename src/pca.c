@@ -0,0 +1,423 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "pca.h"
+#include "sample.h"
+#include "tensor.h"
+
+static uint64_t ml_PcaRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// standard normal samples by the Box-Muller transform
+static float ml_PcaGaussian(uint64_t *state) {
+    double u1 = ((double) (ml_PcaRandom(state) >> 11) + 1.0) * (1.0 / 9007199254740993.0);
+    double u2 = (double) (ml_PcaRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+    return (float) (sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+}
+
+// out holds nb rows of m values, out[c][i] = a[i] . b[c], where a has m rows and b has nb rows of k values.
+static int ml_PcaMulMat(const float *a, int64_t k, int64_t m, const float *b, int64_t nb, int nthreads, float *out,
+                        const char **errmsg) {
+    // the graph only holds the inputs and the result, whose data are the caller's buffers
+    size_t meta_size = ggml_tensor_overhead() * 4 + ggml_graph_overhead();
+    char *meta = Tcl_Alloc(meta_size);
+    struct ggml_init_params params = {
+            .mem_size   = meta_size,
+            .mem_buffer = meta,
+            .no_alloc   = true,
+    };
+    struct ggml_context *ctx0 = ggml_init(params);
+    if (ctx0 == NULL) {
+        Tcl_Free(meta);
+        *errmsg = "could not create the projection context";
+        return TCL_ERROR;
+    }
+
+    struct ggml_tensor *a_t = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, k, m);
+    a_t->data = (void *) a;
+    struct ggml_tensor *b_t = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, k, nb);
+    b_t->data = (void *) b;
+    struct ggml_tensor *result = ggml_mul_mat(ctx0, a_t, b_t);
+    result->data = out;
+    struct ggml_cgraph *gf = ggml_new_graph(ctx0);
+    ggml_build_forward_expand(gf, result);
+
+    struct ggml_cplan cplan = ggml_graph_plan(gf, nthreads);
+    char *work = cplan.work_size > 0 ? Tcl_Alloc(cplan.work_size) : NULL;
+    cplan.work_data = (uint8_t *) work;
+    int rc = ggml_graph_compute(gf, &cplan);
+    if (work != NULL) {
+        Tcl_Free(work);
+    }
+    ggml_free(ctx0);
+    Tcl_Free(meta);
+
+    if (rc != GGML_EXIT_SUCCESS) {
+        *errmsg = "projection failed";
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// Modified Gram-Schmidt over the l rows of len values, run twice to keep the rows orthogonal in F32.
+// Rows that are dependent on the previous ones are zeroed.
+static void ml_PcaOrthonormalize(float *rows, int l, int64_t len) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int c = 0; c < l; c++) {
+            float *row = rows + (size_t) c * len;
+            for (int p = 0; p < c; p++) {
+                const float *prev = rows + (size_t) p * len;
+                double dot = 0.0;
+                for (int64_t i = 0; i < len; i++) {
+                    dot += (double) row[i] * prev[i];
+                }
+                for (int64_t i = 0; i < len; i++) {
+                    row[i] -= (float) dot * prev[i];
+                }
+            }
+            double norm = 0.0;
+            for (int64_t i = 0; i < len; i++) {
+                norm += (double) row[i] * row[i];
+            }
+            float scale = norm > 1e-20 ? (float) (1.0 / sqrt(norm)) : 0.0f;
+            for (int64_t i = 0; i < len; i++) {
+                row[i] *= scale;
+            }
+        }
+    }
+}
+
+// Cyclic Jacobi eigenvalue iteration of the symmetric l x l matrix g, which is destroyed.
+// The eigenvalues are left on the diagonal of g, the eigenvectors in the columns of u.
+static void ml_PcaJacobi(double *g, int l, double *u) {
+    for (int i = 0; i < l; i++) {
+        for (int j = 0; j < l; j++) {
+            u[i * l + j] = i == j ? 1.0 : 0.0;
+        }
+    }
+    for (int sweep = 0; sweep < 100; sweep++) {
+        double off = 0.0;
+        for (int p = 0; p < l; p++) {
+            for (int q = p + 1; q < l; q++) {
+                off += g[p * l + q] * g[p * l + q];
+            }
+        }
+        if (off < 1e-24) {
+            break;
+        }
+        for (int p = 0; p < l; p++) {
+            for (int q = p + 1; q < l; q++) {
+                double gpq = g[p * l + q];
+                if (fabs(gpq) < 1e-300) {
+                    continue;
+                }
+                double theta = (g[q * l + q] - g[p * l + p]) / (2.0 * gpq);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0);
+                double s = t * c;
+                for (int r = 0; r < l; r++) {
+                    double grp = g[r * l + p];
+                    double grq = g[r * l + q];
+                    g[r * l + p] = c * grp - s * grq;
+                    g[r * l + q] = s * grp + c * grq;
+                }
+                for (int r = 0; r < l; r++) {
+                    double gpr = g[p * l + r];
+                    double gqr = g[q * l + r];
+                    g[p * l + r] = c * gpr - s * gqr;
+                    g[q * l + r] = s * gpr + c * gqr;
+                }
+                for (int r = 0; r < l; r++) {
+                    double urp = u[r * l + p];
+                    double urq = u[r * l + q];
+                    u[r * l + p] = c * urp - s * urq;
+                    u[r * l + q] = s * urp + c * urq;
+                }
+            }
+        }
+    }
+}
+
+int ml_PcaFit(const float *data, int64_t n, int d, const ml_pca_params_t *params, float *components, float *mean,
+              float *variance, const char **errmsg) {
+    const int r = params->n_components;
+    if (r > n || r > d) {
+        *errmsg = "more components than points or dimensions";
+        return TCL_ERROR;
+    }
+    int l = r + params->oversample;
+    if (l > n) {
+        l = (int) n;
+    }
+    if (l > d) {
+        l = d;
+    }
+
+    // the centered points, by rows (x) and by columns (xt)
+    memset(mean, 0, sizeof(float) * d);
+    if (params->center) {
+        double *sum = (double *) Tcl_Alloc(sizeof(double) * d);
+        memset(sum, 0, sizeof(double) * d);
+        for (int64_t i = 0; i < n; i++) {
+            for (int j = 0; j < d; j++) {
+                sum[j] += data[(size_t) i * d + j];
+            }
+        }
+        for (int j = 0; j < d; j++) {
+            mean[j] = (float) (sum[j] / (double) n);
+        }
+        Tcl_Free((char *) sum);
+    }
+    float *x = (float *) Tcl_Alloc(sizeof(float) * n * d);
+    float *xt = (float *) Tcl_Alloc(sizeof(float) * n * d);
+    for (int64_t i = 0; i < n; i++) {
+        for (int j = 0; j < d; j++) {
+            float value = data[(size_t) i * d + j] - mean[j];
+            x[(size_t) i * d + j] = value;
+            xt[(size_t) j * n + i] = value;
+        }
+    }
+
+    // q: an orthonormal basis of the range of x, l rows of n values
+    // z: an orthonormal basis of the range of x^T, l rows of d values
+    uint64_t state = ml_SampleSeed(params->seed);
+    float *z = (float *) Tcl_Alloc(sizeof(float) * l * d);
+    float *q = (float *) Tcl_Alloc(sizeof(float) * l * n);
+    for (int64_t i = 0; i < (int64_t) l * d; i++) {
+        z[i] = ml_PcaGaussian(&state);
+    }
+    int rc = ml_PcaMulMat(x, d, n, z, l, params->nthreads, q, errmsg);
+    if (rc == TCL_OK) {
+        ml_PcaOrthonormalize(q, l, n);
+    }
+    for (int iter = 0; rc == TCL_OK && iter < params->n_power_iter; iter++) {
+        rc = ml_PcaMulMat(xt, n, d, q, l, params->nthreads, z, errmsg);
+        if (rc == TCL_OK) {
+            ml_PcaOrthonormalize(z, l, d);
+            rc = ml_PcaMulMat(x, d, n, z, l, params->nthreads, q, errmsg);
+        }
+        if (rc == TCL_OK) {
+            ml_PcaOrthonormalize(q, l, n);
+        }
+    }
+
+    // b = q^T x is small, l rows of d values, its singular vectors are those of x
+    float *b = z;
+    if (rc == TCL_OK) {
+        rc = ml_PcaMulMat(xt, n, d, q, l, params->nthreads, b, errmsg);
+    }
+    Tcl_Free((char *) q);
+    Tcl_Free((char *) xt);
+    Tcl_Free((char *) x);
+    if (rc != TCL_OK) {
+        Tcl_Free((char *) z);
+        return TCL_ERROR;
+    }
+
+    // the eigenvectors u of b b^T give the right singular vectors b^T u / sigma
+    double *g = (double *) Tcl_Alloc(sizeof(double) * l * l);
+    double *u = (double *) Tcl_Alloc(sizeof(double) * l * l);
+    for (int p = 0; p < l; p++) {
+        for (int c = p; c < l; c++) {
+            double dot = 0.0;
+            for (int j = 0; j < d; j++) {
+                dot += (double) b[(size_t) p * d + j] * b[(size_t) c * d + j];
+            }
+            g[p * l + c] = dot;
+            g[c * l + p] = dot;
+        }
+    }
+    ml_PcaJacobi(g, l, u);
+
+    int *order = (int *) Tcl_Alloc(sizeof(int) * l);
+    for (int c = 0; c < l; c++) {
+        order[c] = c;
+    }
+    for (int c = 1; c < l; c++) {
+        int key = order[c];
+        int p = c - 1;
+        while (p >= 0 && g[order[p] * l + order[p]] < g[key * l + key]) {
+            order[p + 1] = order[p];
+            p--;
+        }
+        order[p + 1] = key;
+    }
+
+    double *axis = (double *) Tcl_Alloc(sizeof(double) * d);
+    for (int c = 0; c < r; c++) {
+        const int e = order[c];
+        double lambda = g[e * l + e] > 0.0 ? g[e * l + e] : 0.0;
+        variance[c] = (float) (lambda / (double) (n > 1 ? n - 1 : 1));
+
+        memset(axis, 0, sizeof(double) * d);
+        for (int p = 0; p < l; p++) {
+            double weight = u[p * l + e];
+            for (int j = 0; j < d; j++) {
+                axis[j] += weight * b[(size_t) p * d + j];
+            }
+        }
+        double norm = 0.0;
+        int largest = 0;
+        for (int j = 0; j < d; j++) {
+            norm += axis[j] * axis[j];
+            if (fabs(axis[j]) > fabs(axis[largest])) {
+                largest = j;
+            }
+        }
+        // the sign is chosen to make the largest coordinate positive, so that results are reproducible
+        double scale = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0;
+        if (axis[largest] < 0.0) {
+            scale = -scale;
+        }
+        for (int j = 0; j < d; j++) {
+            components[(size_t) c * d + j] = (float) (axis[j] * scale);
+        }
+    }
+
+    Tcl_Free((char *) axis);
+    Tcl_Free((char *) order);
+    Tcl_Free((char *) u);
+    Tcl_Free((char *) g);
+    Tcl_Free((char *) z);
+    return TCL_OK;
+}
+
+int ml_PcaCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "PcaCmd\n"));
+
+    static const char *options[] = {"-oversample", "-power_iterations", "-center", "-nthreads", "-seed", NULL};
+    enum options {
+        OPT_OVERSAMPLE, OPT_POWER_ITERATIONS, OPT_CENTER, OPT_NTHREADS, OPT_SEED
+    };
+
+    if (objc < 4 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle tensor_handle n_components ?-oversample n? ?-power_iterations n? ?-center boolean? ?-nthreads n? ?-seed n?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(objv[2]));
+    if (!tensor_ptr) {
+        SetResult("tensor handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *points = tensor_ptr->ggml_tensor;
+    if (points->data == NULL || points->type != GGML_TYPE_F32 || !ggml_is_contiguous(points) || points->ne[2] != 1
+        || points->ne[3] != 1) {
+        SetResult("tensor must be a contiguous 1D or 2D F32 tensor with data");
+        return TCL_ERROR;
+    }
+
+    ml_pca_params_t params = {
+            .n_components = 0,
+            .oversample = 10,
+            .n_power_iter = 2,
+            .center = 1,
+            .nthreads = 4,
+            .seed = 0,
+    };
+    if (TCL_OK != Tcl_GetIntFromObj(interp, objv[3], &params.n_components) || params.n_components <= 0) {
+        SetResult("n_components is not an integer > 0");
+        return TCL_ERROR;
+    }
+    for (int i = 4; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_OVERSAMPLE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &params.oversample) || params.oversample < 0) {
+                    SetResult("oversample is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_POWER_ITERATIONS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &params.n_power_iter) || params.n_power_iter < 0) {
+                    SetResult("power_iterations is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_CENTER:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &params.center)) {
+                    SetResult("center is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &params.nthreads) || params.nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_SEED: {
+                Tcl_WideInt seed;
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &seed)) {
+                    SetResult("seed is not an integer");
+                    return TCL_ERROR;
+                }
+                params.seed = (uint64_t) seed;
+                break;
+            }
+        }
+    }
+
+    const int d = (int) points->ne[0];
+    const int r = params.n_components;
+    float *components = (float *) Tcl_Alloc(sizeof(float) * r * d);
+    float *mean = (float *) Tcl_Alloc(sizeof(float) * d);
+    float *variance = (float *) Tcl_Alloc(sizeof(float) * r);
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_PcaFit((const float *) points->data, points->ne[1], d, &params, components, mean, variance, &errmsg)) {
+        Tcl_Free((char *) variance);
+        Tcl_Free((char *) mean);
+        Tcl_Free((char *) components);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // one row of d values per axis, so that mul_mat(components, x - mean) projects the points of x
+    struct ggml_tensor *components_t = ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_F32, d, r);
+    ml_tensor_t *components_ptr = ml_CreateTensorHandle(ctx, components_t);
+    memcpy(components_t->data, components, sizeof(float) * r * d);
+    struct ggml_tensor *mean_t = ggml_new_tensor_1d(ctx->ggml_ctx, GGML_TYPE_F32, d);
+    ml_tensor_t *mean_ptr = ml_CreateTensorHandle(ctx, mean_t);
+    memcpy(mean_t->data, mean, sizeof(float) * d);
+
+    Tcl_Obj *variance_ptr = Tcl_NewListObj(0, NULL);
+    for (int c = 0; c < r; c++) {
+        Tcl_ListObjAppendElement(interp, variance_ptr, Tcl_NewDoubleObj(variance[c]));
+    }
+    Tcl_Free((char *) variance);
+    Tcl_Free((char *) mean);
+    Tcl_Free((char *) components);
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("components", -1), Tcl_NewStringObj(components_ptr->handle, -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("mean", -1), Tcl_NewStringObj(mean_ptr->handle, -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("variance", -1), variance_ptr);
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
@@ -0,0 +1,28 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_PCA_H
+#define GGML_TCL_PCA_H
+
+#include "common.h"
+
+typedef struct ml_pca_params_s {
+    int n_components;
+    int oversample;                     // extra random directions beyond n_components
+    int n_power_iter;                   // power iterations, sharpen the spectrum of slowly decaying data
+    int center;
+    int nthreads;
+    uint64_t seed;
+} ml_pca_params_t;
+
+// Randomized SVD (Halko, Martinsson, Tropp) of the n points of d floats.
+// Writes the principal axes as n_components rows of d floats, the mean (zero unless centered)
+// and the variance along each axis.
+int ml_PcaFit(const float *data, int64_t n, int d, const ml_pca_params_t *params, float *components, float *mean,
+              float *variance, const char **errmsg);
+
+GGML_TCL_CMD(ml_PcaCmd);
+
+#endif //GGML_TCL_PCA_H
@@ -0,0 +1,450 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "safetensors.h"
+#include "context.h"
+#include "membuf.h"
+#include "tensor.h"
+
+typedef struct ml_st_entry_s {
+    char name[GGML_MAX_NAME];
+    char dtype[8];
+    int n_dims;
+    int64_t shape[GGML_MAX_DIMS];       // row major, the last dimension varies fastest
+    uint64_t begin;                     // offsets into the data that follows the header
+    uint64_t end;
+} ml_st_entry_t;
+
+typedef struct ml_st_dtype_s {
+    const char *name;
+    int size;
+    enum ggml_type type;                // type of the tensor the data loads into
+    int direct;                         // the data is used as it is
+} ml_st_dtype_t;
+
+// BF16 and F64 have no ggml counterpart of the same width and are widened or narrowed to F32,
+// I64 is narrowed to I32, U8 is widened to I16.
+static const ml_st_dtype_t ml_StDtypes[] = {
+        {"F32",  4, GGML_TYPE_F32, 1},
+        {"F16",  2, GGML_TYPE_F16, 1},
+        {"I32",  4, GGML_TYPE_I32, 1},
+        {"I16",  2, GGML_TYPE_I16, 1},
+        {"I8",   1, GGML_TYPE_I8,  1},
+        {"BOOL", 1, GGML_TYPE_I8,  1},
+        {"BF16", 2, GGML_TYPE_F32, 0},
+        {"F64",  8, GGML_TYPE_F32, 0},
+        {"I64",  8, GGML_TYPE_I32, 0},
+        {"U8",   1, GGML_TYPE_I16, 0},
+        {NULL,   0, GGML_TYPE_F32, 0},
+};
+
+static const char *ml_JsonSkipSpace(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// Copies a string of at most size - 1 bytes, returns NULL if it is malformed or longer.
+// Names only ever use plain characters, escapes other than \" and \\ are kept as they are.
+static const char *ml_JsonParseString(const char *p, const char *end, char *out, size_t size) {
+    if (p >= end || *p != '"') {
+        return NULL;
+    }
+    p++;
+    size_t len = 0;
+    while (p < end && *p != '"') {
+        char c = *p++;
+        if (c == '\\' && p < end && (*p == '"' || *p == '\\')) {
+            c = *p++;
+        }
+        if (len + 1 >= size) {
+            return NULL;
+        }
+        out[len++] = c;
+    }
+    if (p >= end) {
+        return NULL;
+    }
+    out[len] = '\0';
+    return p + 1;
+}
+
+static const char *ml_JsonSkipValue(const char *p, const char *end, int depth) {
+    p = ml_JsonSkipSpace(p, end);
+    if (p >= end || depth > 64) {
+        return NULL;
+    }
+    if (*p == '"') {
+        p++;
+        while (p < end && *p != '"') {
+            p += *p == '\\' ? 2 : 1;
+        }
+        return p < end ? p + 1 : NULL;
+    }
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = ml_JsonSkipSpace(p + 1, end);
+        if (p < end && *p == close) {
+            return p + 1;
+        }
+        while (p != NULL && p < end) {
+            if (close == '}') {
+                p = ml_JsonSkipValue(p, end, depth + 1);
+                p = p != NULL ? ml_JsonSkipSpace(p, end) : NULL;
+                if (p == NULL || p >= end || *p != ':') {
+                    return NULL;
+                }
+                p++;
+            }
+            p = ml_JsonSkipValue(p, end, depth + 1);
+            p = p != NULL ? ml_JsonSkipSpace(p, end) : NULL;
+            if (p == NULL || p >= end) {
+                return NULL;
+            }
+            if (*p == close) {
+                return p + 1;
+            }
+            if (*p != ',') {
+                return NULL;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    // numbers, true, false and null
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+static const char *ml_JsonParseIntArray(const char *p, const char *end, int64_t *values, int max, int *n) {
+    p = ml_JsonSkipSpace(p, end);
+    if (p >= end || *p != '[') {
+        return NULL;
+    }
+    p = ml_JsonSkipSpace(p + 1, end);
+    *n = 0;
+    if (p < end && *p == ']') {
+        return p + 1;
+    }
+    while (p < end) {
+        char *num_end;
+        long long value = strtoll(p, &num_end, 10);
+        if (num_end == p || num_end > end || value < 0 || *n == max) {
+            return NULL;
+        }
+        values[(*n)++] = value;
+        p = ml_JsonSkipSpace(num_end, end);
+        if (p < end && *p == ']') {
+            return p + 1;
+        }
+        if (p >= end || *p != ',') {
+            return NULL;
+        }
+        p = ml_JsonSkipSpace(p + 1, end);
+    }
+    return NULL;
+}
+
+// Parses {"dtype": ..., "shape": [...], "data_offsets": [begin, end]}.
+static const char *ml_StParseEntry(const char *p, const char *end, ml_st_entry_t *entry) {
+    p = ml_JsonSkipSpace(p, end);
+    if (p >= end || *p != '{') {
+        return NULL;
+    }
+    p++;
+    // one bit per field, a repeated field is refused rather than counted twice
+    enum { ML_ST_DTYPE = 1, ML_ST_SHAPE = 2, ML_ST_OFFSETS = 4 };
+    int seen = 0;
+    while (p != NULL) {
+        p = ml_JsonSkipSpace(p, end);
+        if (p < end && *p == '}') {
+            return seen == (ML_ST_DTYPE | ML_ST_SHAPE | ML_ST_OFFSETS) ? p + 1 : NULL;
+        }
+        char key[32];
+        p = ml_JsonParseString(p, end, key, sizeof(key));
+        p = p != NULL ? ml_JsonSkipSpace(p, end) : NULL;
+        if (p == NULL || p >= end || *p != ':') {
+            return NULL;
+        }
+        p = ml_JsonSkipSpace(p + 1, end);
+        if (strcmp(key, "dtype") == 0) {
+            if (seen & ML_ST_DTYPE) {
+                return NULL;
+            }
+            p = ml_JsonParseString(p, end, entry->dtype, sizeof(entry->dtype));
+            seen |= ML_ST_DTYPE;
+        } else if (strcmp(key, "shape") == 0) {
+            if (seen & ML_ST_SHAPE) {
+                return NULL;
+            }
+            p = ml_JsonParseIntArray(p, end, entry->shape, GGML_MAX_DIMS, &entry->n_dims);
+            seen |= ML_ST_SHAPE;
+        } else if (strcmp(key, "data_offsets") == 0) {
+            if (seen & ML_ST_OFFSETS) {
+                return NULL;
+            }
+            int64_t offsets[2];
+            int n;
+            p = ml_JsonParseIntArray(p, end, offsets, 2, &n);
+            if (p != NULL && n != 2) {
+                p = NULL;
+            }
+            if (p != NULL) {
+                entry->begin = offsets[0];
+                entry->end = offsets[1];
+            }
+            seen |= ML_ST_OFFSETS;
+        } else {
+            p = ml_JsonSkipValue(p, end, 0);
+        }
+        p = p != NULL ? ml_JsonSkipSpace(p, end) : NULL;
+        if (p != NULL && p < end && *p == ',') {
+            p++;
+        }
+    }
+    return NULL;
+}
+
+static void ml_StConvert(const ml_st_dtype_t *dtype, const char *src, int64_t n, char *dst) {
+    if (strcmp(dtype->name, "BF16") == 0) {
+        // bf16 is the upper half of a float32
+        for (int64_t i = 0; i < n; i++) {
+            uint32_t bits = (uint32_t) ((unsigned char) src[2 * i] | ((unsigned char) src[2 * i + 1] << 8)) << 16;
+            memcpy((float *) dst + i, &bits, sizeof(float));
+        }
+    } else if (strcmp(dtype->name, "F64") == 0) {
+        for (int64_t i = 0; i < n; i++) {
+            double value;
+            memcpy(&value, src + 8 * i, sizeof(double));
+            ((float *) dst)[i] = (float) value;
+        }
+    } else if (strcmp(dtype->name, "I64") == 0) {
+        for (int64_t i = 0; i < n; i++) {
+            int64_t value;
+            memcpy(&value, src + 8 * i, sizeof(int64_t));
+            ((int32_t *) dst)[i] = (int32_t) value;
+        }
+    } else {
+        for (int64_t i = 0; i < n; i++) {
+            ((int16_t *) dst)[i] = (int16_t) (unsigned char) src[i];
+        }
+    }
+}
+
+// Parses the json header into entries, tensor names longer than ggml allows are refused.
+static int ml_StParseHeader(const char *p, const char *end, ml_st_entry_t **entries_ptr, int *n_entries,
+                            const char **errmsg) {
+    int capacity = 64;
+    ml_st_entry_t *entries = (ml_st_entry_t *) Tcl_Alloc(sizeof(ml_st_entry_t) * capacity);
+    int n = 0;
+
+    p = ml_JsonSkipSpace(p, end);
+    if (p >= end || *p != '{') {
+        Tcl_Free((char *) entries);
+        *errmsg = "malformed safetensors header";
+        return TCL_ERROR;
+    }
+    p++;
+    while (1) {
+        p = ml_JsonSkipSpace(p, end);
+        if (p < end && *p == '}') {
+            break;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            entries = (ml_st_entry_t *) Tcl_Realloc((char *) entries, sizeof(ml_st_entry_t) * capacity);
+        }
+        ml_st_entry_t *entry = &entries[n];
+        const char *key = p;
+        p = ml_JsonParseString(p, end, entry->name, sizeof(entry->name));
+        if (p == NULL) {
+            Tcl_Free((char *) entries);
+            *errmsg = key < end && *key == '"' ? "tensor name is longer than ggml allows" : "malformed safetensors header";
+            return TCL_ERROR;
+        }
+        p = ml_JsonSkipSpace(p, end);
+        if (p >= end || *p != ':') {
+            Tcl_Free((char *) entries);
+            *errmsg = "malformed safetensors header";
+            return TCL_ERROR;
+        }
+        p++;
+        if (strcmp(entry->name, "__metadata__") == 0) {
+            p = ml_JsonSkipValue(p, end, 0);
+        } else {
+            p = ml_StParseEntry(p, end, entry);
+            n++;
+        }
+        p = p != NULL ? ml_JsonSkipSpace(p, end) : NULL;
+        if (p == NULL || p >= end) {
+            Tcl_Free((char *) entries);
+            *errmsg = "malformed safetensors header";
+            return TCL_ERROR;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    *entries_ptr = entries;
+    *n_entries = n;
+    return TCL_OK;
+}
+
+int ml_LoadSafetensorsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LoadSafetensorsCmd\n"));
+
+    static const char *options[] = {"-mmap", NULL};
+    enum options {
+        OPT_MMAP
+    };
+
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "path ?-mmap boolean?");
+        return TCL_ERROR;
+    }
+
+    int use_mmap = 1;
+    for (int i = 2; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_MMAP:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &use_mmap)) {
+                    SetResult("mmap is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(Tcl_GetString(objv[1]), &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // an 8 byte little endian header size, the json header, then the data
+    uint64_t header_size = 0;
+    if (size >= 8) {
+        for (int i = 7; i >= 0; i--) {
+            header_size = (header_size << 8) | (unsigned char) buffer[i];
+        }
+    }
+    if (size < 8 || header_size > size - 8) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult("not a safetensors file");
+        return TCL_ERROR;
+    }
+    const char *data = buffer + 8 + header_size;
+    const uint64_t data_size = size - 8 - header_size;
+
+    ml_st_entry_t *entries;
+    int n_entries;
+    if (TCL_OK != ml_StParseHeader(buffer + 8, data, &entries, &n_entries, &errmsg)) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    const ml_st_dtype_t **dtypes = (const ml_st_dtype_t **) Tcl_Alloc(sizeof(ml_st_dtype_t *) * (n_entries + 1));
+    for (int i = 0; i < n_entries && errmsg == NULL; i++) {
+        ml_st_entry_t *entry = &entries[i];
+        dtypes[i] = NULL;
+        for (const ml_st_dtype_t *dtype = ml_StDtypes; dtype->name != NULL; dtype++) {
+            if (strcmp(dtype->name, entry->dtype) == 0) {
+                dtypes[i] = dtype;
+            }
+        }
+        int64_t n_elements = 1;
+        int shape_ok = 1;
+        for (int k = 0; k < entry->n_dims; k++) {
+            if (entry->shape[k] < 0 || (entry->shape[k] > 0 && n_elements > INT64_MAX / entry->shape[k])) {
+                shape_ok = 0;
+                break;
+            }
+            n_elements *= entry->shape[k];
+        }
+        if (dtypes[i] == NULL) {
+            errmsg = "unsupported safetensors dtype";
+        } else if (!shape_ok || (uint64_t) n_elements > data_size / dtypes[i]->size) {
+            errmsg = "invalid safetensors shape";
+        } else if (entry->begin > entry->end || entry->end > data_size
+                   || entry->end - entry->begin != (uint64_t) n_elements * dtypes[i]->size) {
+            errmsg = "tensor data out of bounds";
+        }
+    }
+    if (errmsg != NULL) {
+        Tcl_Free((char *) dtypes);
+        Tcl_Free((char *) entries);
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // the context only holds the tensor objects, their data is in the mapping
+    ml_context_t *ctx = ml_NewContext(ggml_tensor_overhead() * (n_entries + 1), 1);
+    if (ctx == NULL) {
+        Tcl_Free((char *) dtypes);
+        Tcl_Free((char *) entries);
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult("could not create context");
+        return TCL_ERROR;
+    }
+
+    int borrowed = 0;
+    for (int i = 0; i < n_entries; i++) {
+        const ml_st_entry_t *entry = &entries[i];
+        const ml_st_dtype_t *dtype = dtypes[i];
+        int64_t ne[GGML_MAX_DIMS] = {1, 1, 1, 1};
+        for (int k = 0; k < entry->n_dims; k++) {
+            ne[k] = entry->shape[entry->n_dims - 1 - k];
+        }
+        struct ggml_tensor *tensor = ggml_new_tensor(ctx->ggml_ctx, dtype->type, entry->n_dims > 0 ? entry->n_dims : 1, ne);
+        ggml_set_name(tensor, entry->name);
+
+        // offsets in the file are not aligned by the format, data that is not aligned to its element is copied
+        const char *src = data + entry->begin;
+        if (use_mmap && dtype->direct && ((uintptr_t) src) % dtype->size == 0) {
+            tensor->data = (void *) src;
+            borrowed = 1;
+        } else {
+            char *dst = Tcl_Alloc(ggml_nbytes(tensor) > 0 ? ggml_nbytes(tensor) : 1);
+            if (dtype->direct) {
+                memcpy(dst, src, ggml_nbytes(tensor));
+            } else {
+                ml_StConvert(dtype, src, ggml_nelements(tensor), dst);
+            }
+            ml_ContextAddBuffer(ctx, dst, 0);
+            tensor->data = dst;
+        }
+        ml_CreateTensorHandle(ctx, tensor);
+    }
+
+    if (borrowed) {
+        ml_ContextAddBuffer(ctx, buffer, mapped_size);
+    } else {
+        ml_FreeBuffer(buffer, mapped_size);
+    }
+    Tcl_Free((char *) dtypes);
+    Tcl_Free((char *) entries);
+
+    SetResult(ctx->handle);
+    return TCL_OK;
+}
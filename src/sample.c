@@ -0,0 +1,429 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sample.h"
+
+// first window of the nucleus search, grown until it holds top_p of the mass
+#define ML_TOP_P_WINDOW 64
+
+typedef struct ml_SampleThreadData_s {
+    uint64_t rng_state;
+    ml_sample_candidate_t *candidates;
+    int capacity;
+} ml_SampleThreadData_t;
+
+static Tcl_ThreadDataKey ml_SampleDataKey;
+
+static void ml_SampleThreadExit(ClientData clientData) {
+    ml_SampleThreadData_t *tsd = (ml_SampleThreadData_t *) clientData;
+    if (tsd->candidates != NULL) {
+        Tcl_Free((char *) tsd->candidates);
+        tsd->candidates = NULL;
+        tsd->capacity = 0;
+    }
+}
+
+uint64_t ml_SampleSeed(uint64_t seed) {
+    // splitmix64, so that small seeds still give well mixed xorshift states
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return z != 0 ? z : 1;
+}
+
+static float ml_SampleUniform(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (float) ((x * 0x2545F4914F6CDD1DULL) >> 40) / (float) (1 << 24);
+}
+
+static void ml_SwapCandidates(ml_sample_candidate_t *a, ml_sample_candidate_t *b) {
+    ml_sample_candidate_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Moves the k largest logits of c[0..n) to c[0..k), in no particular order (nth_element).
+// The three-way partition keeps runs of equal logits, common after penalties or masking, linear.
+static void ml_SelectTopK(ml_sample_candidate_t *c, int n, int k) {
+    int lo = 0;
+    int hi = n - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        // median of three as pivot
+        if (c[mid].logit > c[lo].logit) ml_SwapCandidates(&c[mid], &c[lo]);
+        if (c[hi].logit > c[lo].logit) ml_SwapCandidates(&c[hi], &c[lo]);
+        if (c[mid].logit > c[hi].logit) ml_SwapCandidates(&c[mid], &c[hi]);
+        float pivot = c[hi].logit;
+
+        // c[lo..gt) > pivot, c[gt..i) == pivot, c(lt..hi] < pivot
+        int gt = lo;
+        int lt = hi;
+        int i = lo;
+        while (i <= lt) {
+            if (c[i].logit > pivot) {
+                ml_SwapCandidates(&c[i], &c[gt]);
+                gt++;
+                i++;
+            } else if (c[i].logit < pivot) {
+                ml_SwapCandidates(&c[i], &c[lt]);
+                lt--;
+            } else {
+                i++;
+            }
+        }
+
+        if (k <= gt) {
+            hi = gt - 1;
+        } else if (k <= lt + 1) {
+            return;
+        } else {
+            lo = lt + 1;
+        }
+    }
+}
+
+static int ml_CompareCandidates(const void *a, const void *b) {
+    float la = ((const ml_sample_candidate_t *) a)->logit;
+    float lb = ((const ml_sample_candidate_t *) b)->logit;
+    return (la < lb) - (la > lb);
+}
+
+// Sorts the k largest logits of c[0..n) to the front, in descending order.
+static void ml_SortTopK(ml_sample_candidate_t *c, int n, int k) {
+    if (k < n) {
+        ml_SelectTopK(c, n, k);
+    }
+    qsort(c, k, sizeof(ml_sample_candidate_t), ml_CompareCandidates);
+}
+
+static int ml_CompareTokens(const void *a, const void *b) {
+    int32_t ta = *(const int32_t *) a;
+    int32_t tb = *(const int32_t *) b;
+    return (ta > tb) - (ta < tb);
+}
+
+static void ml_ApplyPenalties(ml_sample_candidate_t *c, int n_vocab, const ml_sample_params_t *params) {
+    if (params->n_penalty_tokens == 0
+        || (params->repeat_penalty == 1.0f && params->frequency_penalty == 0.0f && params->presence_penalty == 0.0f)) {
+        return;
+    }
+
+    // count occurrences by sorting a copy
+    int32_t *tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * params->n_penalty_tokens);
+    memcpy(tokens, params->penalty_tokens, sizeof(int32_t) * params->n_penalty_tokens);
+    qsort(tokens, params->n_penalty_tokens, sizeof(int32_t), ml_CompareTokens);
+
+    for (int i = 0; i < params->n_penalty_tokens;) {
+        int32_t id = tokens[i];
+        int count = 0;
+        while (i < params->n_penalty_tokens && tokens[i] == id) {
+            count++;
+            i++;
+        }
+        if (id < 0 || id >= n_vocab) {
+            continue;
+        }
+        float logit = c[id].logit;
+        logit = logit > 0 ? logit / params->repeat_penalty : logit * params->repeat_penalty;
+        logit -= (float) count * params->frequency_penalty + params->presence_penalty;
+        c[id].logit = logit;
+    }
+    Tcl_Free((char *) tokens);
+}
+
+int ml_Sample(const float *logits, int n_vocab, const ml_sample_params_t *params,
+              ml_sample_candidate_t *c, ml_sample_candidate_t *top, int n_top, int *n_top_written) {
+
+    for (int i = 0; i < n_vocab; i++) {
+        c[i].id = i;
+        c[i].logit = logits[i];
+    }
+    ml_ApplyPenalties(c, n_vocab, params);
+
+    if (n_top > n_vocab) {
+        n_top = n_vocab;
+    }
+
+    int chosen;
+    int n_keep;
+    float temperature = params->temperature;
+    if (temperature <= 0.0f) {
+        // greedy, reported probabilities are those of the unfiltered distribution
+        n_keep = n_vocab;
+        temperature = 1.0f;
+        ml_SortTopK(c, n_vocab, n_top > 0 ? n_top : 1);
+        chosen = c[0].id;
+    } else {
+        n_keep = params->top_k > 0 && params->top_k < n_vocab ? params->top_k : n_vocab;
+        if (n_keep < n_vocab) {
+            ml_SelectTopK(c, n_vocab, n_keep);
+        }
+
+        if (params->top_p < 1.0f) {
+            float max_logit = c[0].logit;
+            for (int i = 1; i < n_keep; i++) {
+                if (c[i].logit > max_logit) max_logit = c[i].logit;
+            }
+            double sum = 0.0;
+            for (int i = 0; i < n_keep; i++) {
+                sum += exp(c[i].logit - max_logit);
+            }
+
+            // sort a growing window of the best tokens until it covers top_p of the mass
+            int window = ML_TOP_P_WINDOW < n_keep ? ML_TOP_P_WINDOW : n_keep;
+            for (;;) {
+                ml_SortTopK(c, n_keep, window);
+                double cum = 0.0;
+                int i;
+                for (i = 0; i < window; i++) {
+                    cum += exp(c[i].logit - max_logit) / sum;
+                    if (cum >= params->top_p) {
+                        break;
+                    }
+                }
+                if (i < window) {
+                    n_keep = i + 1;
+                    break;
+                }
+                if (window == n_keep) {
+                    break;
+                }
+                window = window * 4 < n_keep ? window * 4 : n_keep;
+            }
+        }
+
+        float max_logit = c[0].logit;
+        for (int i = 1; i < n_keep; i++) {
+            if (c[i].logit > max_logit) max_logit = c[i].logit;
+        }
+        double sum = 0.0;
+        for (int i = 0; i < n_keep; i++) {
+            sum += exp((c[i].logit - max_logit) / temperature);
+        }
+
+        double r = ml_SampleUniform(params->rng_state) * sum;
+        chosen = c[n_keep - 1].id;
+        for (int i = 0; i < n_keep; i++) {
+            r -= exp((c[i].logit - max_logit) / temperature);
+            if (r <= 0.0) {
+                chosen = c[i].id;
+                break;
+            }
+        }
+
+        if (n_top > n_keep) {
+            n_top = n_keep;
+        }
+        if (n_top > 0) {
+            ml_SortTopK(c, n_keep, n_top);
+        }
+    }
+
+    if (top != NULL && n_top > 0) {
+        float max_logit = c[0].logit;
+        double sum = 0.0;
+        for (int i = 0; i < n_keep; i++) {
+            sum += exp((c[i].logit - max_logit) / temperature);
+        }
+        for (int i = 0; i < n_top; i++) {
+            top[i].id = c[i].id;
+            top[i].logit = (float) (exp((c[i].logit - max_logit) / temperature) / sum);
+        }
+    }
+    if (n_top_written != NULL) {
+        *n_top_written = top != NULL ? n_top : 0;
+    }
+    return chosen;
+}
+
+int ml_SampleCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SampleCmd\n"));
+
+    static const char *options[] = {"-temperature", "-top_k", "-top_p", "-repeat_penalty", "-frequency_penalty",
+                                    "-presence_penalty", "-penalty_tokens", "-candidates", "-seed", NULL};
+    enum options {
+        OPT_TEMPERATURE, OPT_TOP_K, OPT_TOP_P, OPT_REPEAT_PENALTY, OPT_FREQUENCY_PENALTY,
+        OPT_PRESENCE_PENALTY, OPT_PENALTY_TOKENS, OPT_CANDIDATES, OPT_SEED
+    };
+
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "logits_tensor ?-temperature t? ?-top_k k? ?-top_p p? ?-repeat_penalty r? ?-frequency_penalty f? ?-presence_penalty p? ?-penalty_tokens list? ?-candidates n? ?-seed n?");
+        return TCL_ERROR;
+    }
+
+    const char *tensor_handle = Tcl_GetString(objv[1]);
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(tensor_handle);
+    if (!tensor_ptr) {
+        SetResult("tensor handle not found");
+        return TCL_ERROR;
+    }
+    struct ggml_tensor *logits = tensor_ptr->ggml_tensor;
+    if (logits->type != GGML_TYPE_F32 || logits->data == NULL || !ggml_is_contiguous(logits)) {
+        SetResult("logits must be a contiguous F32 tensor with data");
+        return TCL_ERROR;
+    }
+
+    ml_SampleThreadData_t *tsd = (ml_SampleThreadData_t *) Tcl_GetThreadData(&ml_SampleDataKey, sizeof(ml_SampleThreadData_t));
+    if (tsd->rng_state == 0) {
+        tsd->rng_state = ml_SampleSeed((uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) tsd);
+    }
+
+    ml_sample_params_t params = {
+            .temperature = 0.8f,
+            .top_k = 40,
+            .top_p = 0.95f,
+            .repeat_penalty = 1.0f,
+            .frequency_penalty = 0.0f,
+            .presence_penalty = 0.0f,
+            .penalty_tokens = NULL,
+            .n_penalty_tokens = 0,
+            .rng_state = &tsd->rng_state,
+    };
+    int n_candidates = 0;
+    Tcl_Obj *penalty_tokens_ptr = NULL;
+
+    for (int i = 2; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        double value;
+        switch ((enum options) optionIndex) {
+            case OPT_TEMPERATURE:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value)) {
+                    SetResult("temperature is not a number");
+                    return TCL_ERROR;
+                }
+                params.temperature = (float) value;
+                break;
+            case OPT_TOP_K:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &params.top_k) || params.top_k < 0) {
+                    SetResult("top_k is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_TOP_P:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value) || value <= 0.0 || value > 1.0) {
+                    SetResult("top_p is not a number in (0, 1]");
+                    return TCL_ERROR;
+                }
+                params.top_p = (float) value;
+                break;
+            case OPT_REPEAT_PENALTY:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value) || value <= 0.0) {
+                    SetResult("repeat_penalty is not a number > 0");
+                    return TCL_ERROR;
+                }
+                params.repeat_penalty = (float) value;
+                break;
+            case OPT_FREQUENCY_PENALTY:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value)) {
+                    SetResult("frequency_penalty is not a number");
+                    return TCL_ERROR;
+                }
+                params.frequency_penalty = (float) value;
+                break;
+            case OPT_PRESENCE_PENALTY:
+                if (TCL_OK != Tcl_GetDoubleFromObj(interp, objv[i + 1], &value)) {
+                    SetResult("presence_penalty is not a number");
+                    return TCL_ERROR;
+                }
+                params.presence_penalty = (float) value;
+                break;
+            case OPT_PENALTY_TOKENS:
+                penalty_tokens_ptr = objv[i + 1];
+                break;
+            case OPT_CANDIDATES:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_candidates) || n_candidates < 0) {
+                    SetResult("candidates is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_SEED: {
+                Tcl_WideInt seed;
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &seed)) {
+                    SetResult("seed is not an integer");
+                    return TCL_ERROR;
+                }
+                tsd->rng_state = ml_SampleSeed((uint64_t) seed);
+                break;
+            }
+        }
+    }
+
+    int32_t *penalty_tokens = NULL;
+    if (penalty_tokens_ptr != NULL) {
+        Tcl_Obj **elems;
+        int n_elems;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, penalty_tokens_ptr, &n_elems, &elems)) {
+            SetResult("penalty_tokens is not a list");
+            return TCL_ERROR;
+        }
+        penalty_tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * (n_elems > 0 ? n_elems : 1));
+        for (int i = 0; i < n_elems; i++) {
+            int token;
+            if (TCL_OK != Tcl_GetIntFromObj(interp, elems[i], &token)) {
+                Tcl_Free((char *) penalty_tokens);
+                SetResult("penalty token is not an integer");
+                return TCL_ERROR;
+            }
+            penalty_tokens[i] = token;
+        }
+        params.penalty_tokens = penalty_tokens;
+        params.n_penalty_tokens = n_elems;
+    }
+
+    // the logits of a batch are rows, the last one belongs to the last token
+    int n_vocab = (int) logits->ne[0];
+    const float *row = (const float *) logits->data + (ggml_nrows(logits) - 1) * n_vocab;
+
+    if (tsd->capacity < n_vocab) {
+        if (tsd->candidates == NULL) {
+            Tcl_CreateThreadExitHandler(ml_SampleThreadExit, tsd);
+        }
+        tsd->candidates = (ml_sample_candidate_t *) Tcl_Realloc((char *) tsd->candidates, sizeof(ml_sample_candidate_t) * n_vocab);
+        tsd->capacity = n_vocab;
+    }
+
+    ml_sample_candidate_t *top = n_candidates > 0
+                                 ? (ml_sample_candidate_t *) Tcl_Alloc(sizeof(ml_sample_candidate_t) * n_candidates)
+                                 : NULL;
+    int n_top = 0;
+    int chosen = ml_Sample(row, n_vocab, &params, tsd->candidates, top, n_candidates, &n_top);
+
+    if (penalty_tokens != NULL) {
+        Tcl_Free((char *) penalty_tokens);
+    }
+
+    if (top == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(chosen));
+        return TCL_OK;
+    }
+
+    Tcl_Obj *candidates_ptr = Tcl_NewListObj(0, NULL);
+    for (int i = 0; i < n_top; i++) {
+        Tcl_Obj *pair[2] = {Tcl_NewIntObj(top[i].id), Tcl_NewDoubleObj(top[i].logit)};
+        Tcl_ListObjAppendElement(interp, candidates_ptr, Tcl_NewListObj(2, pair));
+    }
+    Tcl_Free((char *) top);
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("id", -1), Tcl_NewIntObj(chosen));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("candidates", -1), candidates_ptr);
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
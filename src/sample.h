@@ -0,0 +1,38 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_SAMPLE_H
+#define GGML_TCL_SAMPLE_H
+
+#include "common.h"
+
+typedef struct ml_sample_candidate_s {
+    int32_t id;
+    float logit;                    // the probability once returned by ml_Sample
+} ml_sample_candidate_t;
+
+typedef struct ml_sample_params_s {
+    float temperature;              // <= 0 picks the most likely token
+    int top_k;                      // 0 keeps all tokens
+    float top_p;                    // 1.0 disables nucleus filtering
+    float repeat_penalty;           // 1.0 disables it
+    float frequency_penalty;
+    float presence_penalty;
+    const int32_t *penalty_tokens;  // recent tokens the penalties apply to
+    int n_penalty_tokens;
+    uint64_t *rng_state;            // xorshift state, must not be 0
+} ml_sample_params_t;
+
+// Picks a token from n_vocab logits. The n_top most likely candidates of the final distribution,
+// with their probabilities, are written to top (when not NULL). candidates is scratch space
+// for n_vocab entries.
+int ml_Sample(const float *logits, int n_vocab, const ml_sample_params_t *params,
+              ml_sample_candidate_t *candidates, ml_sample_candidate_t *top, int n_top, int *n_top_written);
+
+uint64_t ml_SampleSeed(uint64_t seed);
+
+GGML_TCL_CMD(ml_SampleCmd);
+
+#endif //GGML_TCL_SAMPLE_H
@@ -0,0 +1,577 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <string.h>
+#include "scheduler.h"
+#include "tensor.h"
+
+static Tcl_HashTable ml_SchedulerToInternal_HT;
+static Tcl_Mutex ml_SchedulerToInternal_HT_Mutex;
+static Tcl_Mutex ml_SchedulerRefCount_Mutex;
+
+void ml_InitSchedulerHT() {
+    Tcl_MutexLock(&ml_SchedulerToInternal_HT_Mutex);
+    Tcl_InitHashTable(&ml_SchedulerToInternal_HT, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&ml_SchedulerToInternal_HT_Mutex);
+}
+
+void ml_DeleteSchedulerHT() {
+    Tcl_MutexLock(&ml_SchedulerToInternal_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_SchedulerToInternal_HT);
+    Tcl_MutexUnlock(&ml_SchedulerToInternal_HT_Mutex);
+}
+
+static int ml_RegisterScheduler(const char *name, ml_scheduler_t *internal) {
+    Tcl_HashEntry *entryPtr;
+    int newEntry;
+    Tcl_MutexLock(&ml_SchedulerToInternal_HT_Mutex);
+    entryPtr = Tcl_CreateHashEntry(&ml_SchedulerToInternal_HT, (char *) name, &newEntry);
+    if (newEntry) {
+        Tcl_SetHashValue(entryPtr, (ClientData) internal);
+    }
+    Tcl_MutexUnlock(&ml_SchedulerToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> RegisterScheduler: name=%s internal=%p %s\n", name, internal,
+                newEntry ? "entered into" : "already in"));
+
+    return newEntry;
+}
+
+static int ml_UnregisterScheduler(const char *name) {
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_SchedulerToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_SchedulerToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_SchedulerToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> UnregisterScheduler: name=%s entryPtr=%p\n", name, entryPtr));
+
+    return entryPtr != NULL;
+}
+
+static ml_scheduler_t *ml_GetInternalFromScheduler(const char *name) {
+    ml_scheduler_t *internal = NULL;
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_SchedulerToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_SchedulerToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        internal = (ml_scheduler_t *) Tcl_GetHashValue(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_SchedulerToInternal_HT_Mutex);
+
+    return internal;
+}
+
+static void ml_SchedulerRetain(ml_scheduler_t *sched) {
+    Tcl_MutexLock(&ml_SchedulerRefCount_Mutex);
+    sched->refcount++;
+    Tcl_MutexUnlock(&ml_SchedulerRefCount_Mutex);
+}
+
+// The scheduler outlives its handle until the owners of its generations have seen them done,
+// since their token events still use the scheduler's mutex.
+static void ml_SchedulerRelease(ml_scheduler_t *sched) {
+    Tcl_MutexLock(&ml_SchedulerRefCount_Mutex);
+    int refcount = --sched->refcount;
+    Tcl_MutexUnlock(&ml_SchedulerRefCount_Mutex);
+    if (refcount == 0) {
+        Tcl_ConditionFinalize(&sched->cond);
+        Tcl_MutexFinalize(&sched->mutex);
+        Tcl_Free((char *) sched->slots);
+        Tcl_Free((char *) sched);
+    }
+}
+
+static void ml_SchedulerGenerateDone(ml_generate_t *gen) {
+    ml_SchedulerRelease((ml_scheduler_t *) gen->producer);
+}
+
+// Called with the scheduler mutex held.
+static void ml_SchedulerFinish(ml_scheduler_t *sched, ml_generate_t *gen, const char *reason, const char *errmsg) {
+    if (gen->seq >= 0) {
+        sched->slots[gen->seq] = NULL;
+        sched->n_active--;
+        if (sched->llama->pages != NULL) {
+            ml_KvPagesRelease(sched->llama->pages, gen->seq);
+        }
+    }
+    ml_GenerateFinish(gen, reason, errmsg);
+}
+
+// Moves queued generations into free slots. A slot starts from an empty kv cache, or from the
+// cached pages of the longest prefix of the prompt when the prefix cache is on.
+static void ml_SchedulerAdmit(ml_scheduler_t *sched) {
+    ml_kv_pages_t *pages = sched->llama->pages;
+    for (int s = 0; s < sched->llama->n_seq && sched->first_queued_ptr != NULL; s++) {
+        if (sched->slots[s] != NULL) {
+            continue;
+        }
+        if (pages != NULL && pages->n_free + pages->n_evictable == 0) {
+            break;
+        }
+        ml_generate_t *gen = sched->first_queued_ptr;
+        sched->first_queued_ptr = gen->next_queued_ptr;
+        if (sched->first_queued_ptr == NULL) {
+            sched->last_queued_ptr = NULL;
+        }
+        gen->next_queued_ptr = NULL;
+        gen->seq = s;
+        gen->n_past = 0;
+        gen->n_evaluated = 0;
+        gen->prefix_hash = 0;
+        gen->n_prefix_pages = 0;
+        if (pages != NULL && pages->prefix_cache) {
+            int n_cached = ml_KvPagesMatchPrefix(pages, s, gen->tokens, gen->n_prompt, &gen->prefix_hash);
+            gen->n_past = n_cached;
+            gen->n_evaluated = n_cached;
+            gen->n_prefix_pages = n_cached / pages->page_size;
+            sched->n_prefix_tokens += n_cached;
+        }
+        sched->slots[s] = gen;
+        sched->n_queued--;
+        sched->n_active++;
+    }
+}
+
+static Tcl_ThreadCreateType ml_SchedulerThread(ClientData clientData) {
+    ml_scheduler_t *sched = (ml_scheduler_t *) clientData;
+    ml_llama_t *llama = sched->llama;
+    const int n_seq = llama->n_seq;
+    const int n_vocab = llama->hparams.n_vocab;
+
+    int32_t *batch_tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * llama->n_batch);
+    ml_llama_segment_t *segments = (ml_llama_segment_t *) Tcl_Alloc(sizeof(ml_llama_segment_t) * n_seq);
+    ml_generate_t **batch_gens = (ml_generate_t **) Tcl_Alloc(sizeof(ml_generate_t *) * n_seq);
+    const char **finish_reasons = (const char **) Tcl_Alloc(sizeof(const char *) * n_seq);
+    float *logits = (float *) Tcl_Alloc(sizeof(float) * n_seq * n_vocab);
+    ml_sample_candidate_t *candidates = (ml_sample_candidate_t *) Tcl_Alloc(sizeof(ml_sample_candidate_t) * n_vocab);
+    int first_seq = 0;
+
+    Tcl_MutexLock(&sched->mutex);
+    while (!sched->stop) {
+        ml_SchedulerAdmit(sched);
+
+        // every sequence contributes its unevaluated tokens, prompts are split to fit the batch
+        int n_segments = 0;
+        int n_tokens = 0;
+        int n_backpressured = 0;
+        ml_generate_t *page_starved = NULL;
+        for (int k = 0; k < n_seq && n_tokens < llama->n_batch; k++) {
+            int s = (first_seq + k) % n_seq;
+            ml_generate_t *gen = sched->slots[s];
+            if (gen == NULL) {
+                continue;
+            }
+            if (gen->cancel) {
+                ml_SchedulerFinish(sched, gen, "cancelled", NULL);
+                continue;
+            }
+            if (gen->pending >= gen->max_pending) {
+                n_backpressured++;
+                continue;
+            }
+            int n_todo = gen->n_prompt + gen->n_generated - gen->n_evaluated;
+            int n_take = n_todo < llama->n_batch - n_tokens ? n_todo : llama->n_batch - n_tokens;
+            if (gen->n_past + n_take > llama->n_ctx) {
+                ml_SchedulerFinish(sched, gen, "context_full", NULL);
+                continue;
+            }
+            if (llama->pages != NULL) {
+                // take only as many tokens as the free pages can hold
+                int capacity = ml_KvPagesCapacity(llama->pages, s) - gen->n_past;
+                if (n_take > capacity) {
+                    n_take = capacity;
+                }
+                if (n_take <= 0) {
+                    if (page_starved == NULL || llama->pages->n_seq_pages[s] > llama->pages->n_seq_pages[page_starved->seq]) {
+                        page_starved = gen;
+                    }
+                    continue;
+                }
+                ml_KvPagesReserve(llama->pages, s, gen->n_past + n_take);
+            }
+            memcpy(batch_tokens + n_tokens, gen->tokens + gen->n_evaluated, sizeof(int32_t) * n_take);
+            segments[n_segments].seq = s;
+            segments[n_segments].n_past = gen->n_past;
+            segments[n_segments].n_tokens = n_take;
+            batch_gens[n_segments] = gen;
+            n_segments++;
+            n_tokens += n_take;
+        }
+        if (n_segments == 0) {
+            if (page_starved != NULL && n_backpressured == 0) {
+                // no sequence can grow, give up the largest one so that the others can go on
+                ml_SchedulerFinish(sched, page_starved, "kv_full", NULL);
+                continue;
+            }
+            Tcl_ConditionWait(&sched->cond, &sched->mutex, NULL);
+            continue;
+        }
+        // rotate the sequence that is served first, so that long prompts cannot starve the others
+        first_seq = (first_seq + 1) % n_seq;
+        Tcl_MutexUnlock(&sched->mutex);
+
+        const char *eval_errmsg = NULL;
+        int rc = ml_LlamaEvalSegments(llama, batch_tokens, segments, n_segments, logits, &eval_errmsg);
+
+        int n_sampled = 0;
+        for (int i = 0; i < n_segments; i++) {
+            ml_generate_t *gen = batch_gens[i];
+            finish_reasons[i] = NULL;
+            if (rc != TCL_OK) {
+                finish_reasons[i] = sched->stop ? "cancelled" : "error";
+                continue;
+            }
+            gen->n_past += segments[i].n_tokens;
+            gen->n_evaluated += segments[i].n_tokens;
+            if (gen->n_evaluated < gen->n_prompt + gen->n_generated) {
+                continue;
+            }
+
+            int32_t token = ml_GenerateSample(gen, logits + (size_t) i * n_vocab, n_vocab, candidates);
+            ml_GenerateEmitToken(gen, token);
+            n_sampled++;
+            if (ml_GenerateIsStopToken(gen, token)) {
+                finish_reasons[i] = "stop";
+            } else if (gen->n_generated == gen->max_tokens) {
+                finish_reasons[i] = "max_tokens";
+            }
+        }
+
+        Tcl_MutexLock(&sched->mutex);
+        sched->n_steps++;
+        sched->n_batch_tokens += n_tokens;
+        sched->n_generated += n_sampled;
+        for (int i = 0; i < n_segments; i++) {
+            ml_generate_t *gen = batch_gens[i];
+            if (rc == TCL_OK && llama->pages != NULL && llama->pages->prefix_cache) {
+                // pages that filled up become reusable by later prompts with the same prefix
+                const int page_size = llama->pages->page_size;
+                while ((gen->n_prefix_pages + 1) * page_size <= gen->n_evaluated) {
+                    gen->prefix_hash = ml_KvPagesInsertPrefix(llama->pages, gen->seq, gen->n_prefix_pages, gen->prefix_hash,
+                                                              gen->tokens + (size_t) gen->n_prefix_pages * page_size);
+                    gen->n_prefix_pages++;
+                }
+            }
+            if (finish_reasons[i] != NULL) {
+                ml_SchedulerFinish(sched, batch_gens[i], finish_reasons[i], rc != TCL_OK && !sched->stop ? eval_errmsg : NULL);
+            }
+        }
+    }
+
+    for (int s = 0; s < n_seq; s++) {
+        if (sched->slots[s] != NULL) {
+            ml_SchedulerFinish(sched, sched->slots[s], "cancelled", NULL);
+        }
+    }
+    while (sched->first_queued_ptr != NULL) {
+        ml_generate_t *gen = sched->first_queued_ptr;
+        sched->first_queued_ptr = gen->next_queued_ptr;
+        sched->n_queued--;
+        ml_SchedulerFinish(sched, gen, "cancelled", NULL);
+    }
+    sched->last_queued_ptr = NULL;
+    Tcl_MutexUnlock(&sched->mutex);
+
+    Tcl_Free((char *) candidates);
+    Tcl_Free((char *) logits);
+    Tcl_Free((char *) finish_reasons);
+    Tcl_Free((char *) batch_gens);
+    Tcl_Free((char *) segments);
+    Tcl_Free((char *) batch_tokens);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+int ml_SchedulerCreateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SchedulerCreateCmd\n"));
+
+    static const char *options[] = {"-n_ctx", "-n_seq", "-n_batch", "-nthreads", "-kv_type", "-page_size", "-kv_size",
+                                    "-prefix_cache", "-spill_file", "-spill_pages", NULL};
+    enum options {
+        OPT_N_CTX, OPT_N_SEQ, OPT_N_BATCH, OPT_NTHREADS, OPT_KV_TYPE, OPT_PAGE_SIZE, OPT_KV_SIZE,
+        OPT_PREFIX_CACHE, OPT_SPILL_FILE, OPT_SPILL_PAGES
+    };
+
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle ?-n_ctx n? ?-n_seq n? ?-n_batch n? ?-nthreads n? ?-kv_type F16|F32? ?-page_size n? ?-kv_size n? ?-prefix_cache bool? ?-spill_file path? ?-spill_pages n?");
+        return TCL_ERROR;
+    }
+
+    const char *context_handle = Tcl_GetString(objv[1]);
+    ml_context_t *model_ctx = ml_GetInternalFromContext(context_handle);
+    if (!model_ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+
+    int n_ctx = 512;
+    int n_seq = 8;
+    int n_batch = 512;
+    int nthreads = 4;
+    enum ggml_type kv_type = GGML_TYPE_F16;
+    int page_size = 0;
+    int kv_size = 0;
+    int prefix_cache = 0;
+    const char *spill_file = NULL;
+    int spill_pages = 0;
+    for (int i = 2; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_N_CTX:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_ctx) || n_ctx <= 0) {
+                    SetResult("n_ctx is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_SEQ:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_seq) || n_seq <= 0) {
+                    SetResult("n_seq is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_N_BATCH:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &n_batch) || n_batch <= 0) {
+                    SetResult("n_batch is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_NTHREADS:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) || nthreads <= 0) {
+                    SetResult("nthreads is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_KV_TYPE:
+                if (TCL_OK != ml_GetTypeFromObj(interp, objv[i + 1], &kv_type)) {
+                    return TCL_ERROR;
+                }
+                if (kv_type != GGML_TYPE_F16 && kv_type != GGML_TYPE_F32) {
+                    SetResult("kv_type must be F16 or F32");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_PAGE_SIZE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &page_size) || page_size < 0) {
+                    SetResult("page_size is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_KV_SIZE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &kv_size) || kv_size <= 0) {
+                    SetResult("kv_size is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_PREFIX_CACHE:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &prefix_cache)) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_SPILL_FILE:
+                spill_file = Tcl_GetString(objv[i + 1]);
+                break;
+            case OPT_SPILL_PAGES:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &spill_pages) || spill_pages <= 0) {
+                    SetResult("spill_pages is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    // without paging every sequence has a slot of n_ctx positions
+    int n_pages = 0;
+    if (page_size > 0) {
+        if (kv_size == 0) {
+            kv_size = n_ctx * n_seq;
+        }
+        n_pages = (kv_size + page_size - 1) / page_size;
+    } else if (kv_size != 0) {
+        SetResult("kv_size requires a page_size");
+        return TCL_ERROR;
+    }
+    // prefixes are cached by whole pages
+    if (prefix_cache && page_size == 0) {
+        SetResult("prefix_cache requires a page_size");
+        return TCL_ERROR;
+    }
+    if ((spill_file != NULL || spill_pages != 0) && !prefix_cache) {
+        SetResult("spill_file and spill_pages require the prefix_cache");
+        return TCL_ERROR;
+    }
+    if (spill_file != NULL && spill_pages == 0) {
+        spill_pages = n_pages;
+    }
+
+    const char *errmsg = NULL;
+    ml_llama_t *llama = ml_LlamaNew(model_ctx, n_ctx, n_seq, n_batch, nthreads, kv_type, page_size, n_pages, &errmsg);
+    if (llama == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    if (prefix_cache && TCL_OK != ml_KvPagesEnablePrefixCache(llama->pages, spill_file, spill_pages, &errmsg)) {
+        ml_LlamaFree(interp, llama);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    ml_scheduler_t *sched = (ml_scheduler_t *) Tcl_Alloc(sizeof(ml_scheduler_t));
+    memset(sched, 0, sizeof(ml_scheduler_t));
+    sched->llama = llama;
+    sched->slots = (ml_generate_t **) Tcl_Alloc(sizeof(ml_generate_t *) * n_seq);
+    memset(sched->slots, 0, sizeof(ml_generate_t *) * n_seq);
+    sched->refcount = 1;
+    llama->abort_flag = &sched->stop;
+
+    if (TCL_OK != Tcl_CreateThread(&sched->thread, ml_SchedulerThread, sched,
+                                   TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE)) {
+        ml_LlamaFree(interp, llama);
+        ml_SchedulerRelease(sched);
+        SetResult("could not create scheduler thread");
+        return TCL_ERROR;
+    }
+
+    CMD_SCHEDULER_NAME(sched->handle, sched);
+    ml_RegisterScheduler(sched->handle, sched);
+
+    SetResult(sched->handle);
+    return TCL_OK;
+}
+
+int ml_SchedulerDestroyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SchedulerDestroyCmd\n"));
+    CheckArgs(2, 2, 1, "scheduler_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_scheduler_t *sched = ml_GetInternalFromScheduler(handle);
+    if (!sched) {
+        SetResult("scheduler handle not found");
+        return TCL_ERROR;
+    }
+    if (!ml_UnregisterScheduler(handle)) {
+        SetResult("unregister scheduler name failed");
+        return TCL_ERROR;
+    }
+
+    // outstanding generations are finished as cancelled
+    Tcl_MutexLock(&sched->mutex);
+    sched->stop = 1;
+    Tcl_ConditionNotify(&sched->cond);
+    Tcl_MutexUnlock(&sched->mutex);
+
+    int result;
+    Tcl_JoinThread(sched->thread, &result);
+
+    ml_llama_t *llama = sched->llama;
+    llama->abort_flag = NULL;
+    int rc = ml_LlamaFree(interp, llama);
+    ml_SchedulerRelease(sched);
+    return rc;
+}
+
+int ml_SchedulerSubmitCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SchedulerSubmitCmd\n"));
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "scheduler_handle " ML_GENERATE_USAGE);
+        return TCL_ERROR;
+    }
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_scheduler_t *sched = ml_GetInternalFromScheduler(handle);
+    if (!sched) {
+        SetResult("scheduler handle not found");
+        return TCL_ERROR;
+    }
+
+    ml_generate_t *gen = ml_GenerateFromArgs(interp, objc, objv, sched->llama->hparams.n_vocab);
+    if (gen == NULL) {
+        return TCL_ERROR;
+    }
+    if (gen->n_prompt > sched->llama->n_ctx) {
+        ml_GenerateDiscard(gen);
+        SetResult("prompt does not fit in the context of a sequence");
+        return TCL_ERROR;
+    }
+
+    // pending and cancel are guarded by the scheduler, whose thread waits for them to change
+    gen->producer = sched;
+    gen->on_done = ml_SchedulerGenerateDone;
+    gen->mutex_ptr = &sched->mutex;
+    gen->cond_ptr = &sched->cond;
+    ml_SchedulerRetain(sched);
+    ml_GenerateRegister(gen);
+
+    Tcl_MutexLock(&sched->mutex);
+    if (sched->last_queued_ptr == NULL) {
+        sched->first_queued_ptr = gen;
+    } else {
+        sched->last_queued_ptr->next_queued_ptr = gen;
+    }
+    sched->last_queued_ptr = gen;
+    sched->n_queued++;
+    Tcl_ConditionNotify(&sched->cond);
+    Tcl_MutexUnlock(&sched->mutex);
+
+    SetResult(gen->handle);
+    return TCL_OK;
+}
+
+int ml_SchedulerInfoCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "SchedulerInfoCmd\n"));
+    CheckArgs(2, 2, 1, "scheduler_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_scheduler_t *sched = ml_GetInternalFromScheduler(handle);
+    if (!sched) {
+        SetResult("scheduler handle not found");
+        return TCL_ERROR;
+    }
+
+    Tcl_MutexLock(&sched->mutex);
+    int n_active = sched->n_active;
+    int n_queued = sched->n_queued;
+    Tcl_WideInt n_steps = sched->n_steps;
+    Tcl_WideInt n_batch_tokens = sched->n_batch_tokens;
+    Tcl_WideInt n_generated = sched->n_generated;
+    ml_kv_pages_t *pages = sched->llama->pages;
+    int n_pages = pages != NULL ? pages->n_pages : 0;
+    int n_free_pages = pages != NULL ? pages->n_free : 0;
+    int n_cached_pages = pages != NULL && pages->prefix_cache ? pages->n_entries : 0;
+    Tcl_WideInt n_hit_pages = pages != NULL ? pages->n_hit_pages : 0;
+    Tcl_WideInt n_spill_hit_pages = pages != NULL ? pages->n_spill_hit_pages : 0;
+    Tcl_WideInt n_prefix_tokens = sched->n_prefix_tokens;
+    Tcl_MutexUnlock(&sched->mutex);
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_ctx", -1), Tcl_NewIntObj(sched->llama->n_ctx));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_seq", -1), Tcl_NewIntObj(sched->llama->n_seq));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("n_batch", -1), Tcl_NewIntObj(sched->llama->n_batch));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("active", -1), Tcl_NewIntObj(n_active));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("queued", -1), Tcl_NewIntObj(n_queued));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("steps", -1), Tcl_NewWideIntObj(n_steps));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("batch_tokens", -1), Tcl_NewWideIntObj(n_batch_tokens));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("generated_tokens", -1), Tcl_NewWideIntObj(n_generated));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("page_size", -1), Tcl_NewIntObj(pages != NULL ? pages->page_size : 0));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("pages", -1), Tcl_NewIntObj(n_pages));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("free_pages", -1), Tcl_NewIntObj(n_free_pages));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("cached_pages", -1), Tcl_NewIntObj(n_cached_pages));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("prefix_hit_pages", -1), Tcl_NewWideIntObj(n_hit_pages));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("spill_hit_pages", -1), Tcl_NewWideIntObj(n_spill_hit_pages));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("prefix_tokens", -1), Tcl_NewWideIntObj(n_prefix_tokens));
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
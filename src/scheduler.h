@@ -0,0 +1,42 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_SCHEDULER_H
+#define GGML_TCL_SCHEDULER_H
+
+#include "common.h"
+#include "llama.h"
+#include "generate.h"
+
+#define CMD_SCHEDULER_NAME(s, internal) sprintf((s), "_GGML_SCHED_%p", (internal))
+
+typedef struct ml_scheduler_s {
+    ml_llama_t *llama;                  // one kv cache slot per sequence
+    Tcl_ThreadId thread;
+    Tcl_Mutex mutex;                    // guards everything below, and pending/cancel of the generations
+    Tcl_Condition cond;
+    ml_generate_t **slots;              // n_seq entries, NULL when free
+    ml_generate_t *first_queued_ptr;    // waiting for a free slot
+    ml_generate_t *last_queued_ptr;
+    int n_active;
+    int n_queued;
+    volatile int stop;
+    int refcount;                       // the handle and every generation not yet done
+    Tcl_WideInt n_steps;
+    Tcl_WideInt n_batch_tokens;
+    Tcl_WideInt n_generated;
+    Tcl_WideInt n_prefix_tokens;        // prompt tokens served from the prefix cache
+    char handle[40];
+} ml_scheduler_t;
+
+void ml_InitSchedulerHT();
+void ml_DeleteSchedulerHT();
+
+GGML_TCL_CMD(ml_SchedulerCreateCmd);
+GGML_TCL_CMD(ml_SchedulerDestroyCmd);
+GGML_TCL_CMD(ml_SchedulerSubmitCmd);
+GGML_TCL_CMD(ml_SchedulerInfoCmd);
+
+#endif //GGML_TCL_SCHEDULER_H
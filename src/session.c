@@ -0,0 +1,344 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <string.h>
+#include "session.h"
+#include "tensor.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Converts n elements of a row of the given type to float.
+static void ml_SessionRowToFloat(enum ggml_type type, const void *src, float *dst, int n) {
+    switch (type) {
+        case GGML_TYPE_F32:
+            memcpy(dst, src, n * sizeof(float));
+            break;
+        case GGML_TYPE_F16:
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, n);
+            break;
+        default:
+            ggml_internal_get_type_traits(type).to_float(src, dst, n);
+    }
+}
+
+static void ml_SessionRowFromFloat(enum ggml_type type, const float *src, void *dst, int n) {
+    switch (type) {
+        case GGML_TYPE_F32:
+            memcpy(dst, src, n * sizeof(float));
+            break;
+        case GGML_TYPE_F16:
+            ggml_fp32_to_fp16_row(src, (ggml_fp16_t *) dst, n);
+            break;
+        default: {
+            int64_t hist[16] = {0};
+            ggml_quantize_chunk(type, src, dst, 0, n, hist);
+        }
+    }
+}
+
+// Reads the row of position pos of layer il into row, values are gathered from their transposed layout.
+static void ml_SessionGetRow(const ml_llama_t *llama, int il, int pos, int v, float *row) {
+    const int n_embd_gqa = llama->hparams.n_embd / llama->hparams.n_head * llama->hparams.n_head_kv;
+    const int n_cache = llama->n_ctx;
+    const struct ggml_tensor *cache = v ? llama->v_cache : llama->k_cache;
+    const size_t esize = ggml_element_size(cache);
+    const char *data = (const char *) cache->data;
+    if (!v) {
+        ml_SessionRowToFloat(cache->type, data + esize * n_embd_gqa * ((size_t) il * n_cache + pos), row, n_embd_gqa);
+        return;
+    }
+    const char *base = data + esize * ((size_t) il * n_cache * n_embd_gqa + pos);
+    for (int d = 0; d < n_embd_gqa; d++) {
+        const char *src = base + esize * (size_t) d * n_cache;
+        row[d] = cache->type == GGML_TYPE_F16 ? ggml_fp16_to_fp32(*(const ggml_fp16_t *) src) : *(const float *) src;
+    }
+}
+
+static void ml_SessionSetRow(ml_llama_t *llama, int il, int pos, int v, const float *row) {
+    const int n_embd_gqa = llama->hparams.n_embd / llama->hparams.n_head * llama->hparams.n_head_kv;
+    const int n_cache = llama->n_ctx;
+    struct ggml_tensor *cache = v ? llama->v_cache : llama->k_cache;
+    const size_t esize = ggml_element_size(cache);
+    char *data = (char *) cache->data;
+    if (!v) {
+        ml_SessionRowFromFloat(cache->type, row, data + esize * n_embd_gqa * ((size_t) il * n_cache + pos), n_embd_gqa);
+        return;
+    }
+    char *base = data + esize * ((size_t) il * n_cache * n_embd_gqa + pos);
+    for (int d = 0; d < n_embd_gqa; d++) {
+        char *dst = base + esize * (size_t) d * n_cache;
+        if (cache->type == GGML_TYPE_F16) {
+            *(ggml_fp16_t *) dst = ggml_fp32_to_fp16(row[d]);
+        } else {
+            *(float *) dst = row[d];
+        }
+    }
+}
+
+int ml_SessionSave(ml_llama_t *llama, const char *path, enum ggml_type type, size_t *size, const char **errmsg) {
+    const ml_llama_hparams_t *hparams = &llama->hparams;
+    const int n_embd_gqa = hparams->n_embd / hparams->n_head * hparams->n_head_kv;
+    if (n_embd_gqa % ggml_blck_size(type) != 0) {
+        *errmsg = "the kv rows are not a multiple of the block size of the session type";
+        return TCL_ERROR;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        *errmsg = "could not open the session file for writing";
+        return TCL_ERROR;
+    }
+
+    ml_session_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ML_SESSION_MAGIC;
+    header.version = ML_SESSION_VERSION;
+    header.type = type;
+    header.n_layer = hparams->n_layer;
+    header.n_embd_gqa = n_embd_gqa;
+    header.n_vocab = hparams->n_vocab;
+    header.n_past = llama->n_past;
+
+    // a layer's keys or values are written with a single call
+    const size_t row_size = ggml_type_size(type) * n_embd_gqa / ggml_blck_size(type);
+    const size_t block_size = row_size * llama->n_past;
+    char *block = (char *) Tcl_Alloc(block_size > 0 ? block_size : 1);
+    float *row = (float *) Tcl_Alloc(sizeof(float) * n_embd_gqa);
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+             && fwrite(llama->logits_ptr->ggml_tensor->data, sizeof(float), hparams->n_vocab, fp) == (size_t) hparams->n_vocab;
+    for (int il = 0; ok && il < hparams->n_layer; il++) {
+        for (int v = 0; ok && v < 2; v++) {
+            const struct ggml_tensor *cache = v ? llama->v_cache : llama->k_cache;
+            if (!v && cache->type == type) {
+                // the keys of a layer are already laid out like the file
+                memcpy(block, (const char *) cache->data + row_size * (size_t) il * llama->n_ctx, block_size);
+            } else {
+                for (int pos = 0; pos < llama->n_past; pos++) {
+                    ml_SessionGetRow(llama, il, pos, v, row);
+                    ml_SessionRowFromFloat(type, row, block + row_size * pos, n_embd_gqa);
+                }
+            }
+            ok = block_size == 0 || fwrite(block, block_size, 1, fp) == 1;
+        }
+    }
+
+    Tcl_Free((char *) row);
+    Tcl_Free(block);
+    if (fclose(fp) != 0 || !ok) {
+        *errmsg = "could not write the session file";
+        return TCL_ERROR;
+    }
+    *size = sizeof(header) + sizeof(float) * hparams->n_vocab + 2 * block_size * hparams->n_layer;
+    return TCL_OK;
+}
+
+// Maps the session file read only, or reads it into memory where mapping is not available.
+static char *ml_SessionMapFile(const char *path, size_t *size, const char **errmsg) {
+#ifdef __linux__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = "could not open the session file";
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        *errmsg = "could not stat the session file";
+        return NULL;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *errmsg = "could not map the session file";
+        return NULL;
+    }
+    // the file is read once from start to end
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return data;
+#else
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *errmsg = "could not open the session file";
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (length <= 0) {
+        fclose(fp);
+        *errmsg = "could not read the session file";
+        return NULL;
+    }
+    char *data = Tcl_Alloc(length);
+    if (fread(data, length, 1, fp) != 1) {
+        fclose(fp);
+        Tcl_Free(data);
+        *errmsg = "could not read the session file";
+        return NULL;
+    }
+    fclose(fp);
+    *size = length;
+    return data;
+#endif
+}
+
+static void ml_SessionUnmapFile(char *data, size_t size) {
+#ifdef __linux__
+    munmap(data, size);
+#else
+    Tcl_Free(data);
+#endif
+}
+
+int ml_SessionLoad(ml_llama_t *llama, const char *path, const char **errmsg) {
+    size_t size;
+    char *data = ml_SessionMapFile(path, &size, errmsg);
+    if (data == NULL) {
+        return TCL_ERROR;
+    }
+
+    const ml_llama_hparams_t *hparams = &llama->hparams;
+    const int n_embd_gqa = hparams->n_embd / hparams->n_head * hparams->n_head_kv;
+    ml_session_header_t header;
+    if (size < sizeof(header)) {
+        ml_SessionUnmapFile(data, size);
+        *errmsg = "not a session file";
+        return TCL_ERROR;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != ML_SESSION_MAGIC || header.version != ML_SESSION_VERSION
+        || header.type < 0 || header.type >= GGML_TYPE_COUNT || ggml_blck_size(header.type) <= 0) {
+        ml_SessionUnmapFile(data, size);
+        *errmsg = "not a session file";
+        return TCL_ERROR;
+    }
+    if (header.n_layer != hparams->n_layer || header.n_embd_gqa != n_embd_gqa || header.n_vocab != hparams->n_vocab) {
+        ml_SessionUnmapFile(data, size);
+        *errmsg = "session was saved from a different model";
+        return TCL_ERROR;
+    }
+    if (header.n_past < 0 || header.n_past > llama->n_ctx) {
+        ml_SessionUnmapFile(data, size);
+        *errmsg = "session does not fit in the context";
+        return TCL_ERROR;
+    }
+
+    const enum ggml_type type = (enum ggml_type) header.type;
+    const size_t row_size = ggml_type_size(type) * n_embd_gqa / ggml_blck_size(type);
+    const size_t block_size = row_size * header.n_past;
+    const size_t logits_size = sizeof(float) * hparams->n_vocab;
+    if (n_embd_gqa % ggml_blck_size(type) != 0 || size != sizeof(header) + logits_size + 2 * block_size * hparams->n_layer) {
+        ml_SessionUnmapFile(data, size);
+        *errmsg = "session file is truncated or corrupt";
+        return TCL_ERROR;
+    }
+
+    const char *src = data + sizeof(header);
+    memcpy(llama->logits_ptr->ggml_tensor->data, src, logits_size);
+    src += logits_size;
+
+    float *row = (float *) Tcl_Alloc(sizeof(float) * n_embd_gqa);
+    for (int il = 0; il < hparams->n_layer; il++) {
+        for (int v = 0; v < 2; v++) {
+            struct ggml_tensor *cache = v ? llama->v_cache : llama->k_cache;
+            if (!v && cache->type == type) {
+                memcpy((char *) cache->data + row_size * (size_t) il * llama->n_ctx, src, block_size);
+            } else {
+                for (int pos = 0; pos < header.n_past; pos++) {
+                    ml_SessionRowToFloat(type, src + row_size * pos, row, n_embd_gqa);
+                    ml_SessionSetRow(llama, il, pos, v, row);
+                }
+            }
+            src += block_size;
+        }
+    }
+    Tcl_Free((char *) row);
+    ml_SessionUnmapFile(data, size);
+
+    llama->n_past = header.n_past;
+    return TCL_OK;
+}
+
+int ml_LlamaSaveSessionCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaSaveSessionCmd\n"));
+
+    if (objc != 3 && objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "llama_handle path ?-type F16|F32|Q8_0?");
+        return TCL_ERROR;
+    }
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+    if (llama->busy) {
+        SetResult("llama is busy generating");
+        return TCL_ERROR;
+    }
+
+    // by default the rows are written in the type of the cache
+    enum ggml_type type = llama->k_cache->type;
+    if (objc == 5) {
+        if (strcmp(Tcl_GetString(objv[3]), "-type") != 0) {
+            SetResult("unknown option, expected -type");
+            return TCL_ERROR;
+        }
+        if (TCL_OK != ml_GetTypeFromObj(interp, objv[4], &type)) {
+            return TCL_ERROR;
+        }
+        if (type != GGML_TYPE_F16 && type != GGML_TYPE_F32 && type != GGML_TYPE_Q8_0) {
+            SetResult("type must be F16, F32 or Q8_0");
+            return TCL_ERROR;
+        }
+    }
+
+    size_t size;
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_SessionSave(llama, Tcl_GetString(objv[2]), type, &size, &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) size));
+    return TCL_OK;
+}
+
+int ml_LlamaLoadSessionCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LlamaLoadSessionCmd\n"));
+    CheckArgs(3, 3, 1, "llama_handle path");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_llama_t *llama = ml_GetInternalFromLlama(handle);
+    if (!llama) {
+        SetResult("llama handle not found");
+        return TCL_ERROR;
+    }
+    if (llama->busy) {
+        SetResult("llama is busy generating");
+        return TCL_ERROR;
+    }
+
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_SessionLoad(llama, Tcl_GetString(objv[2]), &errmsg)) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(llama->n_past));
+    return TCL_OK;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_SESSION_H
+#define GGML_TCL_SESSION_H
+
+#include "common.h"
+#include "llama.h"
+
+#define ML_SESSION_MAGIC 0x4e535447     // "GTSN"
+#define ML_SESSION_VERSION 1
+
+// A session file is this header, n_vocab F32 logits and then, for every layer, the keys and
+// the values of the first n_past positions as rows of n_embd_gqa elements of the given type.
+typedef struct ml_session_header_s {
+    uint32_t magic;
+    uint32_t version;
+    int32_t type;
+    int32_t n_layer;
+    int32_t n_embd_gqa;
+    int32_t n_vocab;
+    int32_t n_past;
+    int32_t reserved;
+} ml_session_header_t;
+
+int ml_SessionSave(ml_llama_t *llama, const char *path, enum ggml_type type, size_t *size, const char **errmsg);
+int ml_SessionLoad(ml_llama_t *llama, const char *path, const char **errmsg);
+
+GGML_TCL_CMD(ml_LlamaSaveSessionCmd);
+GGML_TCL_CMD(ml_LlamaLoadSessionCmd);
+
+#endif //GGML_TCL_SESSION_H
@@ -7,6 +7,7 @@
 #include <tcl.h>
 #include <ggml.h>
 #include "tensor.h"
+#include "context.h"
 
 
 static const char *types[] = {
@@ -42,6 +43,19 @@ enum ggml_type ml_GetType(Tcl_Interp *interp, Tcl_Obj *objPtr) {
     return GGML_TYPE_F32;
 }
 
+int ml_GetTypeFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, enum ggml_type *typePtr) {
+    int typeIndex;
+    if (TCL_OK != Tcl_GetIndexFromObj(interp, objPtr, types, "ggml_type", 0, &typeIndex)) {
+        return TCL_ERROR;
+    }
+    if (typeIndex >= GGML_TYPE_COUNT || ggml_blck_size((enum ggml_type) typeIndex) == 0) {
+        SetResult("unsupported ggml_type");
+        return TCL_ERROR;
+    }
+    *typePtr = (enum ggml_type) typeIndex;
+    return TCL_OK;
+}
+
 int ml_InsertTensorToList(ml_context_t *ctx, ml_tensor_t *internal) {
     if (ctx->first_tensor_ptr == NULL) {
         ctx->first_tensor_ptr = internal;
@@ -51,6 +65,47 @@ int ml_InsertTensorToList(ml_context_t *ctx, ml_tensor_t *internal) {
         internal->prev = ctx->last_tensor_ptr;
         ctx->last_tensor_ptr = internal;
     }
+    // every command that creates tensors ends up here, growable contexts place their data now
+    ml_ContextAllocTensors(ctx);
+    return TCL_OK;
+}
+
+// Growable contexts only place the data of a tensor once it has a handle, so commands that fill a new tensor
+// create its handle first and write tensor->data after.
+ml_tensor_t *ml_CreateTensorHandle(ml_context_t *ctx, struct ggml_tensor *tensor) {
+    ml_tensor_t *tensor_ptr = (ml_tensor_t *) Tcl_Alloc(sizeof(ml_tensor_t));
+    tensor_ptr->ggml_tensor = tensor;
+    tensor_ptr->ctx = ctx;
+    tensor_ptr->next = NULL;
+    tensor_ptr->prev = NULL;
+    ml_InsertTensorToList(ctx, tensor_ptr);
+    CMD_TENSOR_NAME(tensor_ptr->handle, tensor_ptr);
+    ml_RegisterTensor(tensor_ptr->handle, tensor_ptr);
+    return tensor_ptr;
+}
+
+// Drops a handle created by a command that failed partway, the ggml tensor stays in the context
+void ml_DestroyTensorHandle(ml_tensor_t *tensor_ptr) {
+    ml_context_t *ctx = tensor_ptr->ctx;
+    if (tensor_ptr->prev != NULL) {
+        tensor_ptr->prev->next = tensor_ptr->next;
+    } else {
+        ctx->first_tensor_ptr = tensor_ptr->next;
+    }
+    if (tensor_ptr->next != NULL) {
+        tensor_ptr->next->prev = tensor_ptr->prev;
+    } else {
+        ctx->last_tensor_ptr = tensor_ptr->prev;
+    }
+    ml_UnregisterTensor(tensor_ptr->handle);
+    Tcl_Free((char *) tensor_ptr);
+}
+
+static int ml_CheckTensorData(Tcl_Interp *interp, ml_tensor_t *tensor_ptr) {
+    if (tensor_ptr->ggml_tensor->data == NULL) {
+        SetResult("tensor has no data (no_alloc context)");
+        return TCL_ERROR;
+    }
     return TCL_OK;
 }
 
@@ -73,9 +128,11 @@ int ml_GetGradCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *
 
     ml_tensor_t *grad_ptr = (ml_tensor_t *) Tcl_Alloc(sizeof(ml_tensor_t));
     grad_ptr->ggml_tensor = grad;
+    grad_ptr->ctx = tensor_ptr->ctx;
     grad_ptr->next = NULL;
     grad_ptr->prev = NULL;
     ml_InsertTensorToList(tensor_ptr->ctx, grad_ptr);
+    CMD_TENSOR_NAME(grad_ptr->handle, grad_ptr);
     ml_RegisterTensor(grad_ptr->handle, grad_ptr);
 
     SetResult(grad_ptr->handle);
@@ -101,6 +158,7 @@ int ml_SetParamCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
     }
 
     ggml_set_param(ctx->ggml_ctx, tensor_ptr->ggml_tensor);
+    ml_ContextAllocTensors(ctx);
     return TCL_OK;
 }
 
@@ -359,7 +417,10 @@ int ml_NewI32Cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
         return TCL_ERROR;
     }
 
-    struct ggml_tensor *tensor = ggml_new_i32(ctx->ggml_ctx, value);
+    // ggml_new_i32 writes the value, so in no_alloc (measure or growable) contexts it is set once there is data
+    struct ggml_tensor *tensor = ggml_get_no_alloc(ctx->ggml_ctx)
+            ? ggml_new_tensor_1d(ctx->ggml_ctx, GGML_TYPE_I32, 1)
+            : ggml_new_i32(ctx->ggml_ctx, value);
     if (!tensor) {
         SetResult("tensor allocation failed");
         return TCL_ERROR;
@@ -375,6 +436,10 @@ int ml_NewI32Cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
     CMD_TENSOR_NAME(tensor_ptr->handle, tensor_ptr);
     ml_RegisterTensor(tensor_ptr->handle, tensor_ptr);
 
+    if (tensor->data != NULL && ggml_get_no_alloc(ctx->ggml_ctx)) {
+        ggml_set_i32(tensor, value);
+    }
+
     SetResult(tensor_ptr->handle);
     return TCL_OK;
 }
@@ -393,7 +458,10 @@ int ml_NewF32Cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
         return TCL_ERROR;
     }
 
-    struct ggml_tensor *tensor = ggml_new_f32(ctx->ggml_ctx, value);
+    // ggml_new_f32 writes the value, so in no_alloc (measure or growable) contexts it is set once there is data
+    struct ggml_tensor *tensor = ggml_get_no_alloc(ctx->ggml_ctx)
+            ? ggml_new_tensor_1d(ctx->ggml_ctx, GGML_TYPE_F32, 1)
+            : ggml_new_f32(ctx->ggml_ctx, value);
     if (!tensor) {
         SetResult("tensor allocation failed");
         return TCL_ERROR;
@@ -409,6 +477,10 @@ int ml_NewF32Cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
     CMD_TENSOR_NAME(tensor_ptr->handle, tensor_ptr);
     ml_RegisterTensor(tensor_ptr->handle, tensor_ptr);
 
+    if (tensor->data != NULL && ggml_get_no_alloc(ctx->ggml_ctx)) {
+        ggml_set_f32(tensor, value);
+    }
+
     SetResult(tensor_ptr->handle);
     return TCL_OK;
 }
@@ -488,18 +560,22 @@ int ml_ViewTensorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
 int ml_SetZeroCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     DBG(fprintf(stderr, "SetZeroCmd\n"));
     CheckArgs(2, 2, 1, "tensor_handle");
-    const char *tensor_handle = Tcl_GetString(objv[2]);
+    const char *tensor_handle = Tcl_GetString(objv[1]);
     ml_tensor_t *input_tensor_ptr = ml_GetInternalFromTensor(tensor_handle);
     if (!input_tensor_ptr) {
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, input_tensor_ptr)) {
+        return TCL_ERROR;
+    }
 
     struct ggml_tensor *tensor = ggml_set_zero(input_tensor_ptr->ggml_tensor);
     if (!tensor) {
         SetResult("tensor allocation failed");
         return TCL_ERROR;
     }
+    ml_ContextMarkModified(&tensor, 1);
     return TCL_OK;
 }
 
@@ -513,12 +589,16 @@ int ml_SetI32Cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, tensor_ptr)) {
+        return TCL_ERROR;
+    }
     int value;
     if (Tcl_GetIntFromObj(interp, objv[2], &value) != TCL_OK) {
         return TCL_ERROR;
     }
 
     ggml_set_i32(tensor_ptr->ggml_tensor, value);
+    ml_ContextMarkModified(&tensor_ptr->ggml_tensor, 1);
     return TCL_OK;
 }
 
@@ -532,12 +612,16 @@ int ml_SetF32Cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, tensor_ptr)) {
+        return TCL_ERROR;
+    }
     double value;
     if (Tcl_GetDoubleFromObj(interp, objv[2], &value) != TCL_OK) {
         return TCL_ERROR;
     }
 
     ggml_set_f32(tensor_ptr->ggml_tensor, value);
+    ml_ContextMarkModified(&tensor_ptr->ggml_tensor, 1);
     return TCL_OK;
 }
 
@@ -550,6 +634,9 @@ int ml_GetI321DCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, tensor_ptr)) {
+        return TCL_ERROR;
+    }
     int i;
     if (Tcl_GetIntFromObj(interp, objv[2], &i) != TCL_OK || i < 0) {
         SetResult("i is not an integer >= 0");
@@ -572,6 +659,9 @@ int ml_SetI321DCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, tensor_ptr)) {
+        return TCL_ERROR;
+    }
     int i;
     if (Tcl_GetIntFromObj(interp, objv[2], &i) != TCL_OK || i < 0) {
         SetResult("i is not an integer >= 0");
@@ -583,6 +673,7 @@ int ml_SetI321DCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
     }
 
     ggml_set_i32_1d(tensor_ptr->ggml_tensor, i, value);
+    ml_ContextMarkModified(&tensor_ptr->ggml_tensor, 1);
     return TCL_OK;
 }
 
@@ -595,6 +686,9 @@ int ml_GetF321DCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, tensor_ptr)) {
+        return TCL_ERROR;
+    }
     int i;
     if (Tcl_GetIntFromObj(interp, objv[2], &i) != TCL_OK || i < 0) {
         SetResult("i is not an integer >= 0");
@@ -617,6 +711,9 @@ int ml_SetF321DCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         SetResult("tensor handle not found");
         return TCL_ERROR;
     }
+    if (TCL_OK != ml_CheckTensorData(interp, tensor_ptr)) {
+        return TCL_ERROR;
+    }
     int i;
     if (Tcl_GetIntFromObj(interp, objv[2], &i) != TCL_OK || i < 0) {
         SetResult("i is not an integer >= 0");
@@ -628,6 +725,46 @@ int ml_SetF321DCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
     }
 
     ggml_set_f32_1d(tensor_ptr->ggml_tensor, i, value);
+    ml_ContextMarkModified(&tensor_ptr->ggml_tensor, 1);
+    return TCL_OK;
+}
+
+int ml_GetTensorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "GetTensorCmd\n"));
+    CheckArgs(3, 3, 1, "context_handle name");
+
+    const char *context_handle = Tcl_GetString(objv[1]);
+    ml_context_t *ctx = ml_GetInternalFromContext(context_handle);
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    const char *name = Tcl_GetString(objv[2]);
+
+    // growable contexts keep their tensors in every meta chunk
+    struct ggml_tensor *tensor = NULL;
+    if (ctx->chunk_size == 0) {
+        tensor = ggml_get_tensor(ctx->ggml_ctx, name);
+    } else {
+        for (ml_chunk_t *chunk = ctx->first_meta_chunk_ptr; chunk != NULL && tensor == NULL; chunk = chunk->next) {
+            tensor = ggml_get_tensor(chunk->ggml_ctx, name);
+        }
+    }
+    if (tensor == NULL) {
+        SetResult("tensor not found");
+        return TCL_ERROR;
+    }
+
+    // a tensor keeps the handle it already has
+    for (ml_tensor_t *tensor_ptr = ctx->first_tensor_ptr; tensor_ptr != NULL; tensor_ptr = tensor_ptr->next) {
+        if (tensor_ptr->ggml_tensor == tensor) {
+            SetResult(tensor_ptr->handle);
+            return TCL_OK;
+        }
+    }
+    ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+
+    SetResult(tensor_ptr->handle);
     return TCL_OK;
 }
 
@@ -8,6 +8,10 @@
 
 #include "common.h"
 
+ml_tensor_t *ml_CreateTensorHandle(ml_context_t *ctx, struct ggml_tensor *tensor);
+void ml_DestroyTensorHandle(ml_tensor_t *tensor_ptr);
+int ml_GetTypeFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, enum ggml_type *typePtr);
+
 GGML_TCL_CMD(ml_GetGradCmd);
 GGML_TCL_CMD(ml_SetParamCmd);
 GGML_TCL_CMD(ml_NumElementsCmd);
@@ -29,7 +33,7 @@ GGML_TCL_CMD(ml_SetI321DCmd);
 GGML_TCL_CMD(ml_GetF321DCmd);
 GGML_TCL_CMD(ml_SetF321DCmd);
 
-//GGML_TCL_CMD(ml_GetTensorCmd);
+GGML_TCL_CMD(ml_GetTensorCmd);
 //GGML_TCL_CMD(ml_GetNameCmd);
 //GGML_TCL_CMD(ml_SetNameCmd);
 //GGML_TCL_CMD(ml_FormatNameCmd);
@@ -0,0 +1,916 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tokenizer.h"
+#include "tensor.h"
+
+// U+2581 (lower one eighth block), sentencepiece's replacement for spaces
+#define ML_SPM_SPACE "\xe2\x96\x81"
+#define ML_SPM_SPACE_LEN 3
+
+static Tcl_HashTable ml_TokenizerToInternal_HT;
+static Tcl_Mutex ml_TokenizerToInternal_HT_Mutex;
+
+void ml_InitTokenizerHT() {
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    Tcl_InitHashTable(&ml_TokenizerToInternal_HT, TCL_STRING_KEYS);
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+}
+
+void ml_DeleteTokenizerHT() {
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    Tcl_DeleteHashTable(&ml_TokenizerToInternal_HT);
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+}
+
+static int ml_RegisterTokenizer(const char *name, ml_tokenizer_t *internal) {
+    Tcl_HashEntry *entryPtr;
+    int newEntry;
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    entryPtr = Tcl_CreateHashEntry(&ml_TokenizerToInternal_HT, (char *) name, &newEntry);
+    if (newEntry) {
+        Tcl_SetHashValue(entryPtr, (ClientData) internal);
+    }
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+
+    DBG(fprintf(stderr, "--> RegisterTokenizer: name=%s internal=%p %s\n", name, internal,
+                newEntry ? "entered into" : "already in"));
+
+    return newEntry;
+}
+
+// Generations retain the tokenizer from their own thread or interp, so the count shares the table mutex.
+void ml_TokenizerRetain(ml_tokenizer_t *tokenizer) {
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    tokenizer->refcount++;
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+}
+
+void ml_TokenizerRelease(ml_tokenizer_t *tokenizer) {
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    tokenizer->refcount--;
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+}
+
+ml_tokenizer_t *ml_GetInternalFromTokenizer(const char *name) {
+    ml_tokenizer_t *internal = NULL;
+    Tcl_HashEntry *entryPtr;
+
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    entryPtr = Tcl_FindHashEntry(&ml_TokenizerToInternal_HT, (char *) name);
+    if (entryPtr != NULL) {
+        internal = (ml_tokenizer_t *) Tcl_GetHashValue(entryPtr);
+    }
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+
+    return internal;
+}
+
+static void ml_TokenBufferPush(ml_token_buffer_t *buffer, int32_t token) {
+    if (buffer->size == buffer->capacity) {
+        buffer->capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 64;
+        buffer->data = (int32_t *) Tcl_Realloc((char *) buffer->data, sizeof(int32_t) * buffer->capacity);
+    }
+    buffer->data[buffer->size++] = token;
+}
+
+void ml_TokenBufferFree(ml_token_buffer_t *buffer) {
+    if (buffer->data != NULL) {
+        Tcl_Free((char *) buffer->data);
+    }
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+static int ml_Utf8Len(unsigned char c) {
+    if (c < 0x80) return 1;
+    if ((c & 0xE0) == 0xC0) return 2;
+    if ((c & 0xF0) == 0xE0) return 3;
+    if ((c & 0xF8) == 0xF0) return 4;
+    return 1;
+}
+
+// Looks up a token by a (not necessarily terminated) piece of text, -1 if it is not in the vocabulary.
+static int ml_TokenizerFind(ml_tokenizer_t *tokenizer, const char *text, int length) {
+    char stack_key[256];
+    char *key = length < (int) sizeof(stack_key) ? stack_key : Tcl_Alloc(length + 1);
+    memcpy(key, text, length);
+    key[length] = '\0';
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&tokenizer->token_to_id, key);
+    if (key != stack_key) {
+        Tcl_Free(key);
+    }
+    return entryPtr != NULL ? (int) (intptr_t) Tcl_GetHashValue(entryPtr) : -1;
+}
+
+static void ml_TokenizerPushBytes(ml_tokenizer_t *tokenizer, const char *text, int length, ml_token_buffer_t *out) {
+    for (int i = 0; i < length; i++) {
+        char byte_token[8];
+        snprintf(byte_token, sizeof(byte_token), "<0x%02X>", (unsigned char) text[i]);
+        int id = ml_TokenizerFind(tokenizer, byte_token, (int) strlen(byte_token));
+        ml_TokenBufferPush(out, id >= 0 ? id : tokenizer->unk_id);
+    }
+}
+
+// sentencepiece
+
+typedef struct ml_spm_symbol_s {
+    const char *text;
+    int n;
+    int prev;
+    int next;
+} ml_spm_symbol_t;
+
+typedef struct ml_spm_bigram_s {
+    int left;
+    int right;
+    float score;
+    int size;
+} ml_spm_bigram_t;
+
+typedef struct ml_spm_heap_s {
+    ml_spm_bigram_t *data;
+    int size;
+    int capacity;
+} ml_spm_heap_t;
+
+static int ml_SpmBigramLess(const ml_spm_bigram_t *a, const ml_spm_bigram_t *b) {
+    // best score first, leftmost first on ties
+    return a->score < b->score || (a->score == b->score && a->left > b->left);
+}
+
+static void ml_SpmHeapPush(ml_spm_heap_t *heap, ml_spm_bigram_t bigram) {
+    if (heap->size == heap->capacity) {
+        heap->capacity = heap->capacity > 0 ? heap->capacity * 2 : 64;
+        heap->data = (ml_spm_bigram_t *) Tcl_Realloc((char *) heap->data, sizeof(ml_spm_bigram_t) * heap->capacity);
+    }
+    int i = heap->size++;
+    heap->data[i] = bigram;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ml_SpmBigramLess(&heap->data[parent], &heap->data[i])) {
+            break;
+        }
+        ml_spm_bigram_t tmp = heap->data[parent];
+        heap->data[parent] = heap->data[i];
+        heap->data[i] = tmp;
+        i = parent;
+    }
+}
+
+static ml_spm_bigram_t ml_SpmHeapPop(ml_spm_heap_t *heap) {
+    ml_spm_bigram_t top = heap->data[0];
+    heap->data[0] = heap->data[--heap->size];
+    int i = 0;
+    for (;;) {
+        int largest = i;
+        int l = 2 * i + 1;
+        int r = 2 * i + 2;
+        if (l < heap->size && ml_SpmBigramLess(&heap->data[largest], &heap->data[l])) largest = l;
+        if (r < heap->size && ml_SpmBigramLess(&heap->data[largest], &heap->data[r])) largest = r;
+        if (largest == i) {
+            break;
+        }
+        ml_spm_bigram_t tmp = heap->data[largest];
+        heap->data[largest] = heap->data[i];
+        heap->data[i] = tmp;
+        i = largest;
+    }
+    return top;
+}
+
+static void ml_SpmTryAddBigram(ml_tokenizer_t *tokenizer, ml_spm_symbol_t *symbols, ml_spm_heap_t *heap, int left, int right) {
+    if (left < 0 || right < 0) {
+        return;
+    }
+    int size = symbols[left].n + symbols[right].n;
+    int id = ml_TokenizerFind(tokenizer, symbols[left].text, size);
+    if (id < 0) {
+        return;
+    }
+    ml_spm_bigram_t bigram = {.left = left, .right = right, .score = tokenizer->scores[id], .size = size};
+    ml_SpmHeapPush(heap, bigram);
+}
+
+static void ml_SpmEncode(ml_tokenizer_t *tokenizer, const char *text, int length, ml_token_buffer_t *out) {
+    // a leading space is added and every space becomes U+2581
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, ML_SPM_SPACE, ML_SPM_SPACE_LEN);
+    for (int i = 0; i < length; i++) {
+        if (text[i] == ' ') {
+            Tcl_DStringAppend(&ds, ML_SPM_SPACE, ML_SPM_SPACE_LEN);
+        } else {
+            Tcl_DStringAppend(&ds, &text[i], 1);
+        }
+    }
+    const char *normalized = Tcl_DStringValue(&ds);
+    int n = Tcl_DStringLength(&ds);
+
+    ml_spm_symbol_t *symbols = (ml_spm_symbol_t *) Tcl_Alloc(sizeof(ml_spm_symbol_t) * (n + 1));
+    int n_symbols = 0;
+    for (int offs = 0; offs < n;) {
+        int len = ml_Utf8Len((unsigned char) normalized[offs]);
+        if (offs + len > n) {
+            len = n - offs;
+        }
+        symbols[n_symbols].text = normalized + offs;
+        symbols[n_symbols].n = len;
+        symbols[n_symbols].prev = n_symbols - 1;
+        symbols[n_symbols].next = offs + len < n ? n_symbols + 1 : -1;
+        n_symbols++;
+        offs += len;
+    }
+
+    ml_spm_heap_t heap = {NULL, 0, 0};
+    for (int i = 1; i < n_symbols; i++) {
+        ml_SpmTryAddBigram(tokenizer, symbols, &heap, i - 1, i);
+    }
+
+    while (heap.size > 0) {
+        ml_spm_bigram_t bigram = ml_SpmHeapPop(&heap);
+        ml_spm_symbol_t *left = &symbols[bigram.left];
+        ml_spm_symbol_t *right = &symbols[bigram.right];
+
+        // skip bigrams made stale by an earlier merge
+        if (left->n == 0 || right->n == 0 || left->n + right->n != bigram.size) {
+            continue;
+        }
+
+        left->n += right->n;
+        right->n = 0;
+        left->next = right->next;
+        if (right->next >= 0) {
+            symbols[right->next].prev = bigram.left;
+        }
+
+        ml_SpmTryAddBigram(tokenizer, symbols, &heap, left->prev, bigram.left);
+        ml_SpmTryAddBigram(tokenizer, symbols, &heap, bigram.left, left->next);
+    }
+
+    for (int i = 0; i != -1 && n_symbols > 0; i = symbols[i].next) {
+        int id = ml_TokenizerFind(tokenizer, symbols[i].text, symbols[i].n);
+        if (id >= 0) {
+            ml_TokenBufferPush(out, id);
+        } else {
+            ml_TokenizerPushBytes(tokenizer, symbols[i].text, symbols[i].n, out);
+        }
+    }
+
+    if (heap.data != NULL) {
+        Tcl_Free((char *) heap.data);
+    }
+    Tcl_Free((char *) symbols);
+    Tcl_DStringFree(&ds);
+}
+
+// byte level bpe
+
+static int ml_BpeByteToUnicode[256];
+static int ml_BpeUnicodeToByte[512];
+static int ml_BpeTablesInitialized = 0;
+static Tcl_Mutex ml_BpeTables_Mutex;
+
+// gpt2's bytes_to_unicode: printable bytes map to themselves, the rest to 256 and up
+static void ml_BpeInitTables() {
+    Tcl_MutexLock(&ml_BpeTables_Mutex);
+    if (!ml_BpeTablesInitialized) {
+        int n = 0;
+        for (int b = 0; b < 256; b++) {
+            if ((b >= 33 && b <= 126) || (b >= 161 && b <= 172) || (b >= 174 && b <= 255)) {
+                ml_BpeByteToUnicode[b] = b;
+            } else {
+                ml_BpeByteToUnicode[b] = 256 + n++;
+            }
+        }
+        for (int i = 0; i < 512; i++) {
+            ml_BpeUnicodeToByte[i] = -1;
+        }
+        for (int b = 0; b < 256; b++) {
+            ml_BpeUnicodeToByte[ml_BpeByteToUnicode[b]] = b;
+        }
+        ml_BpeTablesInitialized = 1;
+    }
+    Tcl_MutexUnlock(&ml_BpeTables_Mutex);
+}
+
+static int ml_EncodeUtf8(int cp, char *buf) {
+    if (cp < 0x80) {
+        buf[0] = (char) cp;
+        return 1;
+    }
+    buf[0] = (char) (0xC0 | (cp >> 6));
+    buf[1] = (char) (0x80 | (cp & 0x3F));
+    return 2;
+}
+
+static int ml_DecodeUtf8(const char *s, int *len) {
+    unsigned char c = (unsigned char) s[0];
+    *len = ml_Utf8Len(c);
+    switch (*len) {
+        case 2:
+            return ((c & 0x1F) << 6) | (s[1] & 0x3F);
+        case 3:
+            return ((c & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        case 4:
+            return ((c & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        default:
+            return c;
+    }
+}
+
+typedef enum {
+    ML_CHAR_SPACE, ML_CHAR_LETTER, ML_CHAR_DIGIT, ML_CHAR_OTHER
+} ml_char_class_t;
+
+// Non-ascii code points are treated as letters, which matches \p{L} for the scripts gpt2 style vocabularies cover.
+static ml_char_class_t ml_CharClass(const char *s) {
+    unsigned char c = (unsigned char) s[0];
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f') return ML_CHAR_SPACE;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80) return ML_CHAR_LETTER;
+    if (c >= '0' && c <= '9') return ML_CHAR_DIGIT;
+    return ML_CHAR_OTHER;
+}
+
+// Length of the next pre-token at text[p], following gpt2's split pattern
+// 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+static int ml_BpeNextWord(const char *text, int length, int p) {
+    if (text[p] == '\'') {
+        static const char *contractions[] = {"s", "t", "re", "ve", "m", "ll", "d", NULL};
+        for (int i = 0; contractions[i] != NULL; i++) {
+            int n = (int) strlen(contractions[i]);
+            if (p + 1 + n <= length && strncmp(text + p + 1, contractions[i], n) == 0) {
+                return 1 + n;
+            }
+        }
+    }
+
+    int q = p;
+    if (text[p] == ' ' && p + 1 < length && ml_CharClass(text + p + 1) != ML_CHAR_SPACE) {
+        q = p + 1;
+    }
+    ml_char_class_t cls = ml_CharClass(text + q);
+    if (cls != ML_CHAR_SPACE) {
+        int end = q;
+        while (end < length && ml_CharClass(text + end) == cls) {
+            end += ml_Utf8Len((unsigned char) text[end]);
+        }
+        return (end > length ? length : end) - p;
+    }
+
+    int end = p;
+    while (end < length && ml_CharClass(text + end) == ML_CHAR_SPACE) {
+        end++;
+    }
+    // leave the last space to prefix the following word
+    if (end < length && end - p > 1) {
+        return end - p - 1;
+    }
+    return end - p;
+}
+
+static int ml_BpeMergeRank(ml_tokenizer_t *tokenizer, const char *left, int left_len, const char *right, int right_len) {
+    char stack_key[256];
+    int length = left_len + 1 + right_len;
+    char *key = length < (int) sizeof(stack_key) ? stack_key : Tcl_Alloc(length + 1);
+    memcpy(key, left, left_len);
+    key[left_len] = ' ';
+    memcpy(key + left_len + 1, right, right_len);
+    key[length] = '\0';
+    Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&tokenizer->merge_ranks, key);
+    if (key != stack_key) {
+        Tcl_Free(key);
+    }
+    return entryPtr != NULL ? (int) (intptr_t) Tcl_GetHashValue(entryPtr) : -1;
+}
+
+static void ml_BpeEncodeWord(ml_tokenizer_t *tokenizer, const char *word, int length, ml_token_buffer_t *out) {
+    // map the raw bytes to their printable code points
+    char *mapped = Tcl_Alloc(length * 2 + 1);
+    int *starts = (int *) Tcl_Alloc(sizeof(int) * (length + 1));
+    int mapped_len = 0;
+    int n_parts = 0;
+    for (int i = 0; i < length; i++) {
+        starts[n_parts++] = mapped_len;
+        mapped_len += ml_EncodeUtf8(ml_BpeByteToUnicode[(unsigned char) word[i]], mapped + mapped_len);
+    }
+    starts[n_parts] = mapped_len;
+
+    // merge the adjacent pair with the lowest rank until none is left
+    for (;;) {
+        int best_rank = -1;
+        int best = -1;
+        for (int i = 0; i + 1 < n_parts; i++) {
+            int rank = ml_BpeMergeRank(tokenizer,
+                                       mapped + starts[i], starts[i + 1] - starts[i],
+                                       mapped + starts[i + 1], starts[i + 2] - starts[i + 1]);
+            if (rank >= 0 && (best_rank < 0 || rank < best_rank)) {
+                best_rank = rank;
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        memmove(&starts[best + 1], &starts[best + 2], sizeof(int) * (n_parts - best - 1));
+        n_parts--;
+    }
+
+    for (int i = 0; i < n_parts; i++) {
+        int id = ml_TokenizerFind(tokenizer, mapped + starts[i], starts[i + 1] - starts[i]);
+        ml_TokenBufferPush(out, id >= 0 ? id : tokenizer->unk_id);
+    }
+
+    Tcl_Free((char *) starts);
+    Tcl_Free(mapped);
+}
+
+static void ml_BpeEncode(ml_tokenizer_t *tokenizer, const char *text, int length, ml_token_buffer_t *out) {
+    for (int p = 0; p < length;) {
+        int n = ml_BpeNextWord(text, length, p);
+        if (n <= 0) {
+            n = 1;
+        }
+        ml_BpeEncodeWord(tokenizer, text + p, n, out);
+        p += n;
+    }
+}
+
+void ml_TokenizerEncode(ml_tokenizer_t *tokenizer, const char *text, int length, int add_bos, ml_token_buffer_t *out) {
+    if (add_bos && tokenizer->bos_id >= 0) {
+        ml_TokenBufferPush(out, tokenizer->bos_id);
+    }
+    if (length == 0) {
+        return;
+    }
+    if (tokenizer->type == ML_TOKENIZER_SPM) {
+        ml_SpmEncode(tokenizer, text, length, out);
+    } else {
+        ml_BpeEncode(tokenizer, text, length, out);
+    }
+}
+
+void ml_TokenizerTokenToPiece(ml_tokenizer_t *tokenizer, int32_t id, Tcl_DString *out) {
+    if (id < 0 || id >= tokenizer->n_vocab) {
+        return;
+    }
+    int token_type = tokenizer->token_types != NULL ? tokenizer->token_types[id] : ML_TOKEN_TYPE_NORMAL;
+    if (token_type == ML_TOKEN_TYPE_CONTROL) {
+        return;
+    }
+    const char *text = tokenizer->tokens[id];
+
+    if (tokenizer->type == ML_TOKENIZER_SPM) {
+        unsigned int byte;
+        if (token_type == ML_TOKEN_TYPE_BYTE && sscanf(text, "<0x%02X>", &byte) == 1) {
+            char c = (char) byte;
+            Tcl_DStringAppend(out, &c, 1);
+            return;
+        }
+        for (const char *s = text; *s;) {
+            if (strncmp(s, ML_SPM_SPACE, ML_SPM_SPACE_LEN) == 0) {
+                Tcl_DStringAppend(out, " ", 1);
+                s += ML_SPM_SPACE_LEN;
+            } else {
+                Tcl_DStringAppend(out, s, 1);
+                s++;
+            }
+        }
+    } else {
+        for (const char *s = text; *s;) {
+            int len;
+            int cp = ml_DecodeUtf8(s, &len);
+            if (cp < 512 && ml_BpeUnicodeToByte[cp] >= 0) {
+                char c = (char) ml_BpeUnicodeToByte[cp];
+                Tcl_DStringAppend(out, &c, 1);
+            } else {
+                Tcl_DStringAppend(out, s, len);
+            }
+            s += len;
+        }
+    }
+}
+
+void ml_TokenizerDecode(ml_tokenizer_t *tokenizer, const int32_t *tokens, int n_tokens, Tcl_DString *out) {
+    int start = Tcl_DStringLength(out);
+    for (int i = 0; i < n_tokens; i++) {
+        ml_TokenizerTokenToPiece(tokenizer, tokens[i], out);
+    }
+
+    // drop the space sentencepiece added in front of the text
+    if (tokenizer->type == ML_TOKENIZER_SPM && Tcl_DStringLength(out) > start && Tcl_DStringValue(out)[start] == ' ') {
+        int length = Tcl_DStringLength(out);
+        char *value = Tcl_DStringValue(out);
+        memmove(value + start, value + start + 1, length - start - 1);
+        Tcl_DStringSetLength(out, length - 1);
+    }
+}
+
+static void ml_FreeTokenizer(ml_tokenizer_t *tokenizer) {
+    if (tokenizer->tokens != NULL) {
+        for (int i = 0; i < tokenizer->n_vocab; i++) {
+            if (tokenizer->tokens[i] != NULL) {
+                Tcl_Free(tokenizer->tokens[i]);
+            }
+        }
+        Tcl_Free((char *) tokenizer->tokens);
+    }
+    if (tokenizer->scores != NULL) {
+        Tcl_Free((char *) tokenizer->scores);
+    }
+    if (tokenizer->token_types != NULL) {
+        Tcl_Free((char *) tokenizer->token_types);
+    }
+    Tcl_DeleteHashTable(&tokenizer->token_to_id);
+    Tcl_DeleteHashTable(&tokenizer->merge_ranks);
+    Tcl_Free((char *) tokenizer);
+}
+
+static int ml_GgufGetTokenId(struct gguf_context *gguf_ctx, const char *key, int default_id) {
+    int key_id = gguf_find_key(gguf_ctx, key);
+    if (key_id < 0) {
+        return default_id;
+    }
+    enum gguf_type type = gguf_get_kv_type(gguf_ctx, key_id);
+    if (type == GGUF_TYPE_UINT32) {
+        return (int) gguf_get_val_u32(gguf_ctx, key_id);
+    } else if (type == GGUF_TYPE_INT32) {
+        return gguf_get_val_i32(gguf_ctx, key_id);
+    }
+    return default_id;
+}
+
+static int ml_LoadTokenizer(ml_tokenizer_t *tokenizer, struct gguf_context *gguf_ctx, const char **errmsg) {
+    int model_id = gguf_find_key(gguf_ctx, "tokenizer.ggml.model");
+    const char *model = model_id >= 0 ? gguf_get_val_str(gguf_ctx, model_id) : "llama";
+    if (strcmp(model, "llama") == 0) {
+        tokenizer->type = ML_TOKENIZER_SPM;
+    } else if (strcmp(model, "gpt2") == 0) {
+        tokenizer->type = ML_TOKENIZER_BPE;
+        ml_BpeInitTables();
+    } else {
+        *errmsg = "unsupported tokenizer model";
+        return TCL_ERROR;
+    }
+
+    int tokens_id = gguf_find_key(gguf_ctx, "tokenizer.ggml.tokens");
+    if (tokens_id < 0 || gguf_get_kv_type(gguf_ctx, tokens_id) != GGUF_TYPE_ARRAY) {
+        *errmsg = "gguf has no tokenizer.ggml.tokens";
+        return TCL_ERROR;
+    }
+    tokenizer->n_vocab = gguf_get_arr_n(gguf_ctx, tokens_id);
+    tokenizer->tokens = (char **) Tcl_Alloc(sizeof(char *) * tokenizer->n_vocab);
+    for (int i = 0; i < tokenizer->n_vocab; i++) {
+        const char *text = gguf_get_arr_str(gguf_ctx, tokens_id, i);
+        size_t len = strlen(text);
+        tokenizer->tokens[i] = Tcl_Alloc(len + 1);
+        memcpy(tokenizer->tokens[i], text, len + 1);
+
+        int newEntry;
+        Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&tokenizer->token_to_id, tokenizer->tokens[i], &newEntry);
+        if (newEntry) {
+            Tcl_SetHashValue(entryPtr, (ClientData) (intptr_t) i);
+        }
+    }
+
+    tokenizer->scores = (float *) Tcl_Alloc(sizeof(float) * tokenizer->n_vocab);
+    int scores_id = gguf_find_key(gguf_ctx, "tokenizer.ggml.scores");
+    if (scores_id >= 0 && gguf_get_arr_type(gguf_ctx, scores_id) == GGUF_TYPE_FLOAT32
+        && gguf_get_arr_n(gguf_ctx, scores_id) == tokenizer->n_vocab) {
+        memcpy(tokenizer->scores, gguf_get_arr_data(gguf_ctx, scores_id), sizeof(float) * tokenizer->n_vocab);
+    } else {
+        memset(tokenizer->scores, 0, sizeof(float) * tokenizer->n_vocab);
+    }
+
+    int types_id = gguf_find_key(gguf_ctx, "tokenizer.ggml.token_type");
+    if (types_id >= 0 && gguf_get_arr_type(gguf_ctx, types_id) == GGUF_TYPE_INT32
+        && gguf_get_arr_n(gguf_ctx, types_id) == tokenizer->n_vocab) {
+        tokenizer->token_types = (int32_t *) Tcl_Alloc(sizeof(int32_t) * tokenizer->n_vocab);
+        memcpy(tokenizer->token_types, gguf_get_arr_data(gguf_ctx, types_id), sizeof(int32_t) * tokenizer->n_vocab);
+    }
+
+    if (tokenizer->type == ML_TOKENIZER_BPE) {
+        int merges_id = gguf_find_key(gguf_ctx, "tokenizer.ggml.merges");
+        if (merges_id < 0) {
+            *errmsg = "gguf has no tokenizer.ggml.merges";
+            return TCL_ERROR;
+        }
+        int n_merges = gguf_get_arr_n(gguf_ctx, merges_id);
+        for (int i = 0; i < n_merges; i++) {
+            int newEntry;
+            Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&tokenizer->merge_ranks, gguf_get_arr_str(gguf_ctx, merges_id, i), &newEntry);
+            if (newEntry) {
+                Tcl_SetHashValue(entryPtr, (ClientData) (intptr_t) i);
+            }
+        }
+    }
+
+    tokenizer->bos_id = ml_GgufGetTokenId(gguf_ctx, "tokenizer.ggml.bos_token_id", tokenizer->type == ML_TOKENIZER_SPM ? 1 : -1);
+    tokenizer->eos_id = ml_GgufGetTokenId(gguf_ctx, "tokenizer.ggml.eos_token_id", tokenizer->type == ML_TOKENIZER_SPM ? 2 : -1);
+    tokenizer->unk_id = ml_GgufGetTokenId(gguf_ctx, "tokenizer.ggml.unknown_token_id", tokenizer->type == ML_TOKENIZER_SPM ? 0 : -1);
+    tokenizer->add_bos = tokenizer->type == ML_TOKENIZER_SPM;
+    int add_bos_id = gguf_find_key(gguf_ctx, "tokenizer.ggml.add_bos_token");
+    if (add_bos_id >= 0 && gguf_get_kv_type(gguf_ctx, add_bos_id) == GGUF_TYPE_BOOL) {
+        tokenizer->add_bos = gguf_get_val_bool(gguf_ctx, add_bos_id);
+    }
+    return TCL_OK;
+}
+
+int ml_TokenizerCreateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "TokenizerCreateCmd\n"));
+    CheckArgs(2, 2, 1, "context_handle");
+
+    const char *context_handle = Tcl_GetString(objv[1]);
+    ml_context_t *ctx = ml_GetInternalFromContext(context_handle);
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->gguf_ctx == NULL) {
+        SetResult("context was not loaded from a gguf file");
+        return TCL_ERROR;
+    }
+
+    ml_tokenizer_t *tokenizer = (ml_tokenizer_t *) Tcl_Alloc(sizeof(ml_tokenizer_t));
+    memset(tokenizer, 0, sizeof(ml_tokenizer_t));
+    Tcl_InitHashTable(&tokenizer->token_to_id, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&tokenizer->merge_ranks, TCL_STRING_KEYS);
+
+    const char *errmsg = NULL;
+    if (TCL_OK != ml_LoadTokenizer(tokenizer, ctx->gguf_ctx, &errmsg)) {
+        ml_FreeTokenizer(tokenizer);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    CMD_TOKENIZER_NAME(tokenizer->handle, tokenizer);
+    ml_RegisterTokenizer(tokenizer->handle, tokenizer);
+
+    SetResult(tokenizer->handle);
+    return TCL_OK;
+}
+
+int ml_TokenizerDestroyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "TokenizerDestroyCmd\n"));
+    CheckArgs(2, 2, 1, "tokenizer_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_tokenizer_t *tokenizer = ml_GetInternalFromTokenizer(handle);
+    if (!tokenizer) {
+        SetResult("tokenizer handle not found");
+        return TCL_ERROR;
+    }
+
+    // checked and unregistered under the table mutex, so that no generation retains it in between
+    Tcl_MutexLock(&ml_TokenizerToInternal_HT_Mutex);
+    int in_use = tokenizer->refcount > 0;
+    Tcl_HashEntry *entryPtr = NULL;
+    if (!in_use) {
+        entryPtr = Tcl_FindHashEntry(&ml_TokenizerToInternal_HT, (char *) handle);
+        if (entryPtr != NULL) {
+            Tcl_DeleteHashEntry(entryPtr);
+        }
+    }
+    Tcl_MutexUnlock(&ml_TokenizerToInternal_HT_Mutex);
+
+    if (in_use) {
+        SetResult("tokenizer is in use");
+        return TCL_ERROR;
+    }
+    if (entryPtr == NULL) {
+        SetResult("unregister tokenizer name failed");
+        return TCL_ERROR;
+    }
+    ml_FreeTokenizer(tokenizer);
+    return TCL_OK;
+}
+
+static ml_tensor_t *ml_NewTokenTensor(Tcl_Interp *interp, const char *context_handle, int64_t ne0, int64_t ne1) {
+    ml_context_t *ctx = ml_GetInternalFromContext(context_handle);
+    if (!ctx) {
+        SetResult("context handle not found");
+        return NULL;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return NULL;
+    }
+    struct ggml_tensor *tensor = ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_I32, ne0, ne1);
+    return ml_CreateTensorHandle(ctx, tensor);
+}
+
+int ml_TokenizeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "TokenizeCmd\n"));
+
+    static const char *options[] = {"-add_bos", "-context", NULL};
+    enum options {
+        OPT_ADD_BOS, OPT_CONTEXT
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "tokenizer_handle text ?-add_bos boolean? ?-context context_handle?");
+        return TCL_ERROR;
+    }
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_tokenizer_t *tokenizer = ml_GetInternalFromTokenizer(handle);
+    if (!tokenizer) {
+        SetResult("tokenizer handle not found");
+        return TCL_ERROR;
+    }
+
+    int add_bos = tokenizer->add_bos;
+    const char *context_handle = NULL;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_ADD_BOS:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &add_bos)) {
+                    SetResult("add_bos is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_CONTEXT:
+                context_handle = Tcl_GetString(objv[i + 1]);
+                break;
+        }
+    }
+
+    int length;
+    const char *text = Tcl_GetStringFromObj(objv[2], &length);
+
+    ml_token_buffer_t tokens = {NULL, 0, 0};
+    ml_TokenizerEncode(tokenizer, text, length, add_bos, &tokens);
+
+    if (context_handle != NULL) {
+        ml_tensor_t *tensor_ptr = ml_NewTokenTensor(interp, context_handle, tokens.size > 0 ? tokens.size : 1, 1);
+        if (tensor_ptr == NULL) {
+            ml_TokenBufferFree(&tokens);
+            return TCL_ERROR;
+        }
+        memset(tensor_ptr->ggml_tensor->data, 0, ggml_nbytes(tensor_ptr->ggml_tensor));
+        memcpy(tensor_ptr->ggml_tensor->data, tokens.data, sizeof(int32_t) * tokens.size);
+        ml_TokenBufferFree(&tokens);
+        SetResult(tensor_ptr->handle);
+        return TCL_OK;
+    }
+
+    Tcl_Obj *list_ptr = Tcl_NewListObj(0, NULL);
+    for (int i = 0; i < tokens.size; i++) {
+        Tcl_ListObjAppendElement(interp, list_ptr, Tcl_NewIntObj(tokens.data[i]));
+    }
+    ml_TokenBufferFree(&tokens);
+    Tcl_SetObjResult(interp, list_ptr);
+    return TCL_OK;
+}
+
+int ml_TokenizeBatchCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "TokenizeBatchCmd\n"));
+
+    static const char *options[] = {"-add_bos", "-pad_id", NULL};
+    enum options {
+        OPT_ADD_BOS, OPT_PAD_ID
+    };
+
+    if (objc < 4 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, "tokenizer_handle context_handle texts ?-add_bos boolean? ?-pad_id id?");
+        return TCL_ERROR;
+    }
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_tokenizer_t *tokenizer = ml_GetInternalFromTokenizer(handle);
+    if (!tokenizer) {
+        SetResult("tokenizer handle not found");
+        return TCL_ERROR;
+    }
+
+    int add_bos = tokenizer->add_bos;
+    int pad_id = tokenizer->eos_id >= 0 ? tokenizer->eos_id : 0;
+    for (int i = 4; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_ADD_BOS:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &add_bos)) {
+                    SetResult("add_bos is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_PAD_ID:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &pad_id)) {
+                    SetResult("pad_id is not an integer");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    Tcl_Obj **texts;
+    int n_texts;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objv[3], &n_texts, &texts) || n_texts == 0) {
+        SetResult("texts is not a non-empty list");
+        return TCL_ERROR;
+    }
+
+    ml_token_buffer_t *encoded = (ml_token_buffer_t *) Tcl_Alloc(sizeof(ml_token_buffer_t) * n_texts);
+    int max_len = 1;
+    for (int i = 0; i < n_texts; i++) {
+        int length;
+        const char *text = Tcl_GetStringFromObj(texts[i], &length);
+        encoded[i].data = NULL;
+        encoded[i].size = 0;
+        encoded[i].capacity = 0;
+        ml_TokenizerEncode(tokenizer, text, length, add_bos, &encoded[i]);
+        if (encoded[i].size > max_len) {
+            max_len = encoded[i].size;
+        }
+    }
+
+    // one row per text, padded to the longest one
+    ml_tensor_t *tensor_ptr = ml_NewTokenTensor(interp, Tcl_GetString(objv[2]), max_len, n_texts);
+    Tcl_Obj *lengths_ptr = Tcl_NewListObj(0, NULL);
+    for (int i = 0; i < n_texts; i++) {
+        if (tensor_ptr != NULL) {
+            int32_t *row = (int32_t *) tensor_ptr->ggml_tensor->data + (size_t) i * max_len;
+            memcpy(row, encoded[i].data, sizeof(int32_t) * encoded[i].size);
+            for (int j = encoded[i].size; j < max_len; j++) {
+                row[j] = pad_id;
+            }
+        }
+        Tcl_ListObjAppendElement(interp, lengths_ptr, Tcl_NewIntObj(encoded[i].size));
+        ml_TokenBufferFree(&encoded[i]);
+    }
+    Tcl_Free((char *) encoded);
+
+    if (tensor_ptr == NULL) {
+        Tcl_DecrRefCount(lengths_ptr);
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("tensor", -1), Tcl_NewStringObj(tensor_ptr->handle, -1));
+    Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj("lengths", -1), lengths_ptr);
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
+
+int ml_DetokenizeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "DetokenizeCmd\n"));
+    CheckArgs(3, 3, 1, "tokenizer_handle tokens_or_tensor_handle");
+
+    const char *handle = Tcl_GetString(objv[1]);
+    ml_tokenizer_t *tokenizer = ml_GetInternalFromTokenizer(handle);
+    if (!tokenizer) {
+        SetResult("tokenizer handle not found");
+        return TCL_ERROR;
+    }
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+
+    ml_tensor_t *tensor_ptr = ml_GetInternalFromTensor(Tcl_GetString(objv[2]));
+    if (tensor_ptr != NULL) {
+        struct ggml_tensor *tensor = tensor_ptr->ggml_tensor;
+        if (tensor->type != GGML_TYPE_I32 || tensor->data == NULL || !ggml_is_contiguous(tensor)) {
+            SetResult("tokens tensor must be a contiguous I32 tensor with data");
+            return TCL_ERROR;
+        }
+        ml_TokenizerDecode(tokenizer, (const int32_t *) tensor->data, (int) ggml_nelements(tensor), &ds);
+    } else {
+        Tcl_Obj **elems;
+        int n_elems;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, objv[2], &n_elems, &elems)) {
+            SetResult("tokens is not a list");
+            return TCL_ERROR;
+        }
+        int32_t *tokens = (int32_t *) Tcl_Alloc(sizeof(int32_t) * (n_elems > 0 ? n_elems : 1));
+        for (int i = 0; i < n_elems; i++) {
+            int token;
+            if (TCL_OK != Tcl_GetIntFromObj(interp, elems[i], &token)) {
+                Tcl_Free((char *) tokens);
+                SetResult("token is not an integer");
+                return TCL_ERROR;
+            }
+            tokens[i] = token;
+        }
+        ml_TokenizerDecode(tokenizer, tokens, n_elems, &ds);
+        Tcl_Free((char *) tokens);
+    }
+
+    Tcl_DStringResult(interp, &ds);
+    return TCL_OK;
+}
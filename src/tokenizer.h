@@ -0,0 +1,64 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_TOKENIZER_H
+#define GGML_TCL_TOKENIZER_H
+
+#include "common.h"
+
+#define CMD_TOKENIZER_NAME(s, internal) sprintf((s), "_GGML_TOK_%p", (internal))
+
+typedef enum {
+    ML_TOKENIZER_SPM,           // sentencepiece, tokenizer.ggml.model = llama
+    ML_TOKENIZER_BPE            // byte level bpe, tokenizer.ggml.model = gpt2
+} ml_tokenizer_type_t;
+
+// token types of tokenizer.ggml.token_type
+#define ML_TOKEN_TYPE_NORMAL 1
+#define ML_TOKEN_TYPE_UNKNOWN 2
+#define ML_TOKEN_TYPE_CONTROL 3
+#define ML_TOKEN_TYPE_BYTE 6
+
+typedef struct ml_tokenizer_s {
+    ml_tokenizer_type_t type;
+    int n_vocab;
+    char **tokens;
+    float *scores;
+    int32_t *token_types;
+    Tcl_HashTable token_to_id;  // token text -> id
+    Tcl_HashTable merge_ranks;  // "left right" -> rank, bpe only
+    int bos_id;
+    int eos_id;
+    int unk_id;
+    int add_bos;
+    int refcount;               // generations decoding with this tokenizer
+    char handle[40];
+} ml_tokenizer_t;
+
+typedef struct ml_token_buffer_s {
+    int32_t *data;
+    int size;
+    int capacity;
+} ml_token_buffer_t;
+
+void ml_InitTokenizerHT();
+void ml_DeleteTokenizerHT();
+ml_tokenizer_t *ml_GetInternalFromTokenizer(const char *name);
+void ml_TokenizerRetain(ml_tokenizer_t *tokenizer);
+void ml_TokenizerRelease(ml_tokenizer_t *tokenizer);
+
+void ml_TokenizerEncode(ml_tokenizer_t *tokenizer, const char *text, int length, int add_bos, ml_token_buffer_t *out);
+// Appends the text of a single token, without the leading space handling of ml_TokenizerDecode.
+void ml_TokenizerTokenToPiece(ml_tokenizer_t *tokenizer, int32_t id, Tcl_DString *out);
+void ml_TokenizerDecode(ml_tokenizer_t *tokenizer, const int32_t *tokens, int n_tokens, Tcl_DString *out);
+void ml_TokenBufferFree(ml_token_buffer_t *buffer);
+
+GGML_TCL_CMD(ml_TokenizerCreateCmd);
+GGML_TCL_CMD(ml_TokenizerDestroyCmd);
+GGML_TCL_CMD(ml_TokenizeCmd);
+GGML_TCL_CMD(ml_TokenizeBatchCmd);
+GGML_TCL_CMD(ml_DetokenizeCmd);
+
+#endif //GGML_TCL_TOKENIZER_H
@@ -0,0 +1,419 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include <tcl.h>
+#include <ggml.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "wav.h"
+#include "membuf.h"
+#include "tensor.h"
+
+#define ML_WAV_FORMAT_PCM 1
+#define ML_WAV_FORMAT_FLOAT 3
+#define ML_WAV_FORMAT_EXTENSIBLE 0xFFFE
+// zero crossings of the resampling kernel on each side
+#define ML_WAV_SINC_ZEROS 16
+// most phases of the resampling kernel that are tabulated, rarer rate ratios evaluate the kernel per tap
+#define ML_WAV_MAX_PHASES 4096
+
+typedef struct ml_wav_s {
+    int format;                         // ML_WAV_FORMAT_PCM or ML_WAV_FORMAT_FLOAT
+    int channels;
+    int rate;
+    int bits;
+    const unsigned char *data;
+    int64_t n_samples;                  // per channel
+} ml_wav_t;
+
+static uint32_t ml_WavLe32(const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t ml_WavLe16(const unsigned char *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static int ml_WavParse(const unsigned char *p, size_t size, ml_wav_t *wav, const char **errmsg) {
+    if (size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+        *errmsg = "not a RIFF/WAVE file";
+        return 0;
+    }
+    int have_fmt = 0;
+    size_t pos = 12;
+    while (pos + 8 <= size) {
+        const unsigned char *chunk = p + pos;
+        size_t chunk_size = ml_WavLe32(chunk + 4);
+        size_t available = size - pos - 8;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunk_size < 16 || chunk_size > available) {
+                *errmsg = "invalid fmt chunk";
+                return 0;
+            }
+            wav->format = ml_WavLe16(chunk + 8);
+            wav->channels = ml_WavLe16(chunk + 10);
+            wav->rate = (int) ml_WavLe32(chunk + 12);
+            wav->bits = ml_WavLe16(chunk + 22);
+            // the sub format of an extensible header starts with the format tag
+            if (wav->format == ML_WAV_FORMAT_EXTENSIBLE && chunk_size >= 26) {
+                wav->format = ml_WavLe16(chunk + 32);
+            }
+            have_fmt = 1;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                *errmsg = "data chunk before fmt chunk";
+                return 0;
+            }
+            // recorders that are cut off leave a data chunk that is larger than the file
+            if (chunk_size > available) {
+                chunk_size = available;
+            }
+            int supported = (wav->format == ML_WAV_FORMAT_PCM
+                             && (wav->bits == 8 || wav->bits == 16 || wav->bits == 24 || wav->bits == 32))
+                            || (wav->format == ML_WAV_FORMAT_FLOAT && (wav->bits == 32 || wav->bits == 64));
+            if (!supported) {
+                *errmsg = "only 8, 16, 24 and 32 bit PCM and 32 and 64 bit float wav files are supported";
+                return 0;
+            }
+            if (wav->channels <= 0 || wav->rate <= 0) {
+                *errmsg = "invalid fmt chunk";
+                return 0;
+            }
+            wav->data = chunk + 8;
+            wav->n_samples = (int64_t) (chunk_size / ((size_t) wav->channels * (wav->bits / 8)));
+            return 1;
+        }
+        // chunks are padded to an even size
+        if (chunk_size > available) {
+            break;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    *errmsg = "no data chunk";
+    return 0;
+}
+
+// Returns a sample as a float in [-1, 1], or 0 outside of the recording.
+static float ml_WavSample(const ml_wav_t *wav, int64_t i, int c) {
+    if (i < 0 || i >= wav->n_samples) {
+        return 0.0f;
+    }
+    int size = wav->bits / 8;
+    const unsigned char *p = wav->data + ((size_t) i * wav->channels + c) * size;
+    if (wav->format == ML_WAV_FORMAT_FLOAT) {
+        if (wav->bits == 32) {
+            float value;
+            memcpy(&value, p, sizeof(float));
+            return value;
+        }
+        double value;
+        memcpy(&value, p, sizeof(double));
+        return (float) value;
+    }
+    switch (wav->bits) {
+        case 8:
+            return ((float) p[0] - 128.0f) * (1.0f / 128.0f);
+        case 16:
+            return (float) (int16_t) ml_WavLe16(p) * (1.0f / 32768.0f);
+        case 24:
+            return (float) ((int32_t) (((uint32_t) p[0] << 8) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 24)) >> 8)
+                   * (1.0f / 8388608.0f);
+        default:
+            return (float) (int32_t) ml_WavLe32(p) * (1.0f / 2147483648.0f);
+    }
+}
+
+// Decodes samples first .. first + count - 1 into planar channels, averaged to one channel for mono.
+static void ml_WavDecode(const ml_wav_t *wav, int64_t first, int64_t count, int mono, float *out) {
+    if (mono) {
+        float scale = 1.0f / (float) wav->channels;
+        for (int64_t i = 0; i < count; i++) {
+            float sum = 0.0f;
+            for (int c = 0; c < wav->channels; c++) {
+                sum += ml_WavSample(wav, first + i, c);
+            }
+            out[i] = sum * scale;
+        }
+        return;
+    }
+    for (int c = 0; c < wav->channels; c++) {
+        for (int64_t i = 0; i < count; i++) {
+            out[c * count + i] = ml_WavSample(wav, first + i, c);
+        }
+    }
+}
+
+// Hann windowed sinc at distance x from the output sample, zero beyond the radius.
+static double ml_WavKernel(double x, double radius, double cutoff) {
+    if (fabs(x) > radius) {
+        return 0.0;
+    }
+    double window = 0.5 + 0.5 * cos(M_PI * x / radius);
+    double arg = M_PI * cutoff * x;
+    double sinc = fabs(arg) < 1e-9 ? 1.0 : sin(arg) / arg;
+    return cutoff * sinc * window;
+}
+
+static int64_t ml_WavGcd(int64_t a, int64_t b) {
+    while (b != 0) {
+        int64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Band limited resampling with a Hann windowed sinc. The input holds margin samples before and
+// after the resampled range of every channel, so that consecutive chunks of a recording join without clicks.
+// With in_rate / out_rate = M / L in lowest terms output i lies at phase (i * M) % L between two input
+// samples, the kernel of each of the L phases is computed once and shared by all channels.
+static void ml_WavResample(const float *in, int64_t n_in, int64_t margin, int in_rate, float *out, int64_t n_out,
+                           int out_rate, int channels) {
+    int64_t n_decoded = n_in + 2 * margin;
+    int64_t g = ml_WavGcd(in_rate, out_rate);
+    int64_t L = out_rate / g;
+    int64_t M = in_rate / g;
+    double cutoff = out_rate < in_rate ? (double) out_rate / (double) in_rate : 1.0;
+    double radius = ML_WAV_SINC_ZEROS / cutoff;
+
+    // tap m of a phase weighs input sample base + lo + m
+    int64_t lo = -(int64_t) floor(radius);
+    int64_t n_taps = 2 * (int64_t) floor(radius) + 2;
+    float *table = NULL;
+    if (L <= ML_WAV_MAX_PHASES) {
+        table = (float *) Tcl_Alloc(sizeof(float) * L * n_taps);
+        for (int64_t phase = 0; phase < L; phase++) {
+            double frac = (double) phase / (double) L;
+            for (int64_t m = 0; m < n_taps; m++) {
+                table[phase * n_taps + m] = (float) ml_WavKernel((double) (lo + m) - frac, radius, cutoff);
+            }
+        }
+    }
+
+    for (int c = 0; c < channels; c++) {
+        const float *src = in + c * n_decoded;
+        float *dst = out + c * n_out;
+        for (int64_t i = 0; i < n_out; i++) {
+            int64_t base = margin + i * M / L;
+            int64_t phase = i * M % L;
+            int64_t j0 = base + lo;
+            int64_t m0 = j0 < 0 ? -j0 : 0;
+            int64_t m1 = j0 + n_taps > n_decoded ? n_decoded - j0 : n_taps;
+            double sum = 0.0;
+            if (table != NULL) {
+                const float *weights = table + phase * n_taps;
+                for (int64_t m = m0; m < m1; m++) {
+                    sum += src[j0 + m] * weights[m];
+                }
+            } else {
+                // ratios with too many phases for a table evaluate the kernel directly
+                double frac = (double) phase / (double) L;
+                for (int64_t m = m0; m < m1; m++) {
+                    sum += src[j0 + m] * ml_WavKernel((double) (lo + m) - frac, radius, cutoff);
+                }
+            }
+            dst[i] = (float) sum;
+        }
+    }
+    if (table != NULL) {
+        Tcl_Free((char *) table);
+    }
+}
+
+static const char *ml_WavFormatName(const ml_wav_t *wav) {
+    return wav->format == ML_WAV_FORMAT_FLOAT ? "float" : "pcm";
+}
+
+int ml_WavInfoCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "WavInfoCmd\n"));
+    CheckArgs(2, 2, 1, "path");
+
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(Tcl_GetString(objv[1]), &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    ml_wav_t wav;
+    if (!ml_WavParse((const unsigned char *) buffer, size, &wav, &errmsg)) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    ml_FreeBuffer(buffer, mapped_size);
+
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("format", -1), Tcl_NewStringObj(ml_WavFormatName(&wav), -1));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("bits", -1), Tcl_NewIntObj(wav.bits));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("channels", -1), Tcl_NewIntObj(wav.channels));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("rate", -1), Tcl_NewIntObj(wav.rate));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("samples", -1), Tcl_NewWideIntObj(wav.n_samples));
+    Tcl_DictObjPut(NULL, dict_ptr, Tcl_NewStringObj("duration", -1),
+                   Tcl_NewDoubleObj((double) wav.n_samples / (double) wav.rate));
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
+
+int ml_LoadWavCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    DBG(fprintf(stderr, "LoadWavCmd\n"));
+
+    static const char *options[] = {"-rate", "-mono", "-offset", "-length", "-frame", "-hop", NULL};
+    enum options {
+        OPT_RATE, OPT_MONO, OPT_OFFSET, OPT_LENGTH, OPT_FRAME, OPT_HOP
+    };
+
+    if (objc < 3 || objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "context_handle path ?-rate hz? ?-mono boolean? ?-offset samples? ?-length samples? ?-frame samples? ?-hop samples?");
+        return TCL_ERROR;
+    }
+
+    ml_context_t *ctx = ml_GetInternalFromContext(Tcl_GetString(objv[1]));
+    if (!ctx) {
+        SetResult("context handle not found");
+        return TCL_ERROR;
+    }
+    if (ctx->no_alloc) {
+        SetResult("context has no data (no_alloc)");
+        return TCL_ERROR;
+    }
+
+    int rate = 0;
+    int mono = 1;
+    Tcl_WideInt offset = 0;
+    Tcl_WideInt length = -1;
+    int frame = 0;
+    int hop = 0;
+    for (int i = 3; i < objc; i += 2) {
+        int optionIndex;
+        if (TCL_OK != Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &optionIndex)) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) optionIndex) {
+            case OPT_RATE:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &rate) || rate <= 0) {
+                    SetResult("rate is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_MONO:
+                if (TCL_OK != Tcl_GetBooleanFromObj(interp, objv[i + 1], &mono)) {
+                    SetResult("mono is not a boolean");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_OFFSET:
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &offset) || offset < 0) {
+                    SetResult("offset is not an integer >= 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_LENGTH:
+                if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[i + 1], &length) || length <= 0) {
+                    SetResult("length is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_FRAME:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &frame) || frame <= 0) {
+                    SetResult("frame is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_HOP:
+                if (TCL_OK != Tcl_GetIntFromObj(interp, objv[i + 1], &hop) || hop <= 0) {
+                    SetResult("hop is not an integer > 0");
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+    if (hop != 0 && frame == 0) {
+        SetResult("hop needs a frame size");
+        return TCL_ERROR;
+    }
+    if (hop == 0) {
+        hop = frame;
+    }
+
+    size_t size;
+    size_t mapped_size;
+    const char *errmsg = NULL;
+    char *buffer = ml_MapFile(Tcl_GetString(objv[2]), &size, &mapped_size, &errmsg);
+    if (buffer == NULL) {
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+    ml_wav_t wav;
+    if (!ml_WavParse((const unsigned char *) buffer, size, &wav, &errmsg)) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(errmsg);
+        return TCL_ERROR;
+    }
+
+    // offset and length count samples at the rate of the file
+    if (rate == 0) {
+        rate = wav.rate;
+    }
+    int64_t n_in = offset < wav.n_samples ? wav.n_samples - offset : 0;
+    if (length > 0 && length < n_in) {
+        n_in = length;
+    }
+    int64_t n_out = rate == wav.rate ? n_in : n_in * rate / wav.rate;
+    int64_t n_frames = 0;
+    if (frame > 0 && n_out >= frame) {
+        n_frames = 1 + (n_out - frame) / hop;
+    }
+    if (n_out == 0 || (frame > 0 && n_frames == 0)) {
+        ml_FreeBuffer(buffer, mapped_size);
+        SetResult(frame > 0 ? "recording is shorter than a frame" : "no samples to read");
+        return TCL_ERROR;
+    }
+    int channels = mono ? 1 : wav.channels;
+
+    // samples are planar, [samples, channels] or framed as [frame, frames, channels]
+    struct ggml_tensor *tensor;
+    if (frame > 0) {
+        tensor = channels == 1
+                 ? ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_F32, frame, n_frames)
+                 : ggml_new_tensor_3d(ctx->ggml_ctx, GGML_TYPE_F32, frame, n_frames, channels);
+    } else {
+        tensor = channels == 1
+                 ? ggml_new_tensor_1d(ctx->ggml_ctx, GGML_TYPE_F32, n_out)
+                 : ggml_new_tensor_2d(ctx->ggml_ctx, GGML_TYPE_F32, n_out, channels);
+    }
+    ml_tensor_t *tensor_ptr = ml_CreateTensorHandle(ctx, tensor);
+
+    // the resampled signal goes straight into the tensor unless it is framed
+    float *signal = frame > 0 ? (float *) Tcl_Alloc(sizeof(float) * n_out * channels) : (float *) tensor->data;
+    if (rate == wav.rate) {
+        ml_WavDecode(&wav, offset, n_in, mono, signal);
+    } else {
+        int64_t margin = (int64_t) ceil(ML_WAV_SINC_ZEROS * (rate < wav.rate ? (double) wav.rate / rate : 1.0)) + 1;
+        int64_t n_decoded = n_in + 2 * margin;
+        float *decoded = (float *) Tcl_Alloc(sizeof(float) * n_decoded * channels);
+        ml_WavDecode(&wav, offset - margin, n_decoded, mono, decoded);
+        ml_WavResample(decoded, n_in, margin, wav.rate, signal, n_out, rate, channels);
+        Tcl_Free((char *) decoded);
+    }
+    ml_FreeBuffer(buffer, mapped_size);
+
+    if (frame > 0) {
+        float *out = (float *) tensor->data;
+        for (int c = 0; c < channels; c++) {
+            for (int64_t f = 0; f < n_frames; f++) {
+                memcpy(out + ((size_t) c * n_frames + f) * frame, signal + c * n_out + f * hop,
+                       sizeof(float) * frame);
+            }
+        }
+        Tcl_Free((char *) signal);
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(tensor_ptr->handle, -1));
+    return TCL_OK;
+}
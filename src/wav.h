@@ -0,0 +1,14 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2023 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef GGML_TCL_WAV_H
+#define GGML_TCL_WAV_H
+
+#include "common.h"
+
+GGML_TCL_CMD(ml_LoadWavCmd);
+GGML_TCL_CMD(ml_WavInfoCmd);
+
+#endif //GGML_TCL_WAV_H